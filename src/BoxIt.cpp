@@ -21,9 +21,9 @@ int main(int argc, char* argv[])
 //---------------------------------------------------------------------
 {
     Dummy( argc, argv );
-    std::vector<vecN> v = ReadGeneralFile( std::cin );
+    PointMatrix v = ReadPointMatrix( std::cin );
     BoxIt( v );
-    WriteVectorFile( v );
+    WritePointMatrix( v );
 	return 0;
 }
 
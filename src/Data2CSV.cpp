@@ -8,11 +8,50 @@
 #include "Data2CSV.h"
 
 #include <sstream>
+#include <fstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#if defined( __has_include )
+#if __has_include( <charconv> ) && ( __cplusplus >= 201703L || ( defined( _MSVC_LANG ) && _MSVC_LANG >= 201703L ) )
+#include <charconv>
+#endif
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "rhrand.h"
 
 static RHrand rhr;
 
+// the format of the last point set read, which the writers follow
+static PointSetFormat g_inputFormat = PointSetCSV;
+
+static void ToVector_3( const std::vector<vecN>& vin, std::vector<Vector_3>& vout );
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ExitIfNotWritten
+//
+// Ends the program with status 1 if the output could not all be written.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static void ExitIfNotWritten( const bool written )
+//---------------------------------------------------------------------
+{
+    if ( written ) return;
+    fprintf( stderr, "output could not be written\n" );
+    exit( 1 );
+}
+
 /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
 std::vector<std::string> GetNextLine( std::string& line )
 //---------------------------------------------------------------------
@@ -35,16 +74,24 @@ std::vector<Vector_3> ReadVector_3File( std::istream& str )
 {
     std::vector<Vector_3> v;
 
-    while ( ! str.fail() && ! str.eof( ) )
+    std::vector<vecN> points, probes, targets;
+    if ( ReadPointSetFile( str, points, probes, targets ) )
     {
-        std::string line;
-        getline( str, line, '\n' );
-        if ( ! str.fail( ) && ! str.eof( ) )
-        {
-            std::vector<std::string> vs = GetNextLine( line );
-            const Vector_3 v1( atof(vs[0].c_str()), atof(vs[1].c_str()), atof(vs[2].c_str()) );
-            v.push_back( v1 );
-        }
+        points.insert( points.end( ), probes.begin( ), probes.end( ) );
+        points.insert( points.end( ), targets.begin( ), targets.end( ) );
+        ToVector_3( points, v );
+        return( v );
+    }
+
+    std::vector<double> values;
+    std::vector<unsigned int> dims;
+    ReadCSVPoints( str, values, dims );
+
+    v.reserve( dims.size( ) );
+    const double* p = values.empty( ) ? 0 : &values[0];
+    for ( size_t i=0; i<dims.size( ); p+=dims[i], ++i )
+    {
+        v.push_back( Vector_3( dims[i] > 0 ? p[0] : 0.0, dims[i] > 1 ? p[1] : 0.0, dims[i] > 2 ? p[2] : 0.0 ) );
     }
     return( v );
 }
@@ -85,28 +132,23 @@ std::vector<vecN> ReadGeneralFile( std::istream& str )
 {
     std::vector<vecN > v;
 
-
-    while ( ! str.fail() && ! str.eof( ) )
+    std::vector<vecN> probes, targets;
+    if ( ReadPointSetFile( str, v, probes, targets ) )
     {
-        std::string line;
-        getline( str, line, '\n' );
-        if ( ! str.fail( ) && ! str.eof( ) )
-        {
-            if ( ! line.empty( ) )
-            {
-                const std::vector<std::string> vs = GetNextLine( line );
-                std::vector<double> vd(vs.size( ));
-
-                for ( unsigned int i=0; i<vs.size( ); ++i )
-                {
-                    vd[i] = atof(vs[i].c_str( ));
-                }
+        v.insert( v.end( ), probes.begin( ), probes.end( ) );
+        v.insert( v.end( ), targets.begin( ), targets.end( ) );
+        return( v );
+    }
 
-                const vecN v1( vd );
+    std::vector<double> values;
+    std::vector<unsigned int> dims;
+    ReadCSVPoints( str, values, dims );
 
-                v.push_back( v1 );
-            }
-        }
+    v.reserve( dims.size( ) );
+    const double* p = values.empty( ) ? 0 : &values[0];
+    for ( size_t i=0; i<dims.size( ); p+=dims[i], ++i )
+    {
+        v.push_back( vecN( p, (int)dims[i] ) );
     }
     return( v );
 }
@@ -119,117 +161,1258 @@ std::vector<vecN> ReadGeneralFile( std::istream& str )
 void WriteVector_3File( const std::vector<Vector_3>& v )
 //---------------------------------------------------------------------
 {
+    const PointSetFormat format = GetOutputFormat( );
+    if ( format != PointSetCSV )
+    {
+        std::vector<vecN> vn;
+        vn.reserve( v.size( ) );
+        std::vector<double> vd( 3 );
+        for ( unsigned int i=0; i<v.size( ); ++i )
+        {
+            vd[0] = v[i][0];
+            vd[1] = v[i][1];
+            vd[2] = v[i][2];
+            vn.push_back( vecN( vd ) );
+        }
+        ExitIfNotWritten( WritePointSetFile( stdout, format, vn, std::vector<vecN>( ), std::vector<vecN>( ) ) );
+        return;
+    }
+
+    CSVWriter out( stdout );
+    double p[3];
     for ( unsigned int i=0; i<v.size( ); ++i )
     {
-        const Vector_3& p = v[i];
-        fprintf( stdout, "%f,%f,%f\n", p[0],p[1],p[2] );
+        p[0] = v[i][0];
+        p[1] = v[i][1];
+        p[2] = v[i][2];
+        out.WriteRow( p, 3 );
     }
+    out.Flush( );
+    ExitIfNotWritten( fflush( stdout ) == 0 && ! out.Failed( ) );
 }
 
 /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
 void WriteVectorFile( const std::vector<vecN>& vin )
 //---------------------------------------------------------------------
 {
-    unsigned int dim = (unsigned int)vin[0].size( );
-    for ( unsigned int i=0; i<vin.size( ); ++i )
+    const PointSetFormat format = GetOutputFormat( );
+    if ( format != PointSetCSV )
     {
-        const vecN& v = vin[i];
-        for ( unsigned int k=0; k<dim; ++k )
+        ExitIfNotWritten( WritePointSetFile( stdout, format, vin, std::vector<vecN>( ), std::vector<vecN>( ) ) );
+        return;
+    }
+
+    if ( vin.empty( ) ) return;
+
+    // gathered a block of rows at a time, so that WriteRows can split the formatting
+    static const size_t BlockRows = 1 << 18;
+    const unsigned int dim = (unsigned int)vin[0].size( );
+    CSVWriter out( stdout );
+    std::vector<double> block( MIN( vin.size( ), BlockRows ) * dim );
+    for ( size_t first=0; first<vin.size( ); first+=BlockRows )
+    {
+        const size_t nRows = MIN( vin.size( ) - first, BlockRows );
+        for ( size_t i=0; i<nRows; ++i )
         {
-            if ( k == dim-1 )
+            const vecN& v = vin[first+i];
+            for ( unsigned int k=0; k<dim; ++k )
             {
-                fprintf( stdout, "%f", v[k] );
+                block[i*dim+k] = v[k];
             }
-            else
+        }
+        out.WriteRows( &block[0], nRows, dim );
+    }
+    out.Flush( );
+    ExitIfNotWritten( fflush( stdout ) == 0 && ! out.Failed( ) );
+}
+
+/*=======================================================================*/
+/* binary point sets, see Data2CSV.h                                     */
+/*=======================================================================*/
+
+const char PointSetMagic[8] = { '\x89', 'N', 'T', 'P', 'S', '\r', '\n', '\x1a' };
+
+static const size_t PointSetHeaderBytes  = 24;   // magic and the four uint32 fields
+static const size_t PointSetSectionBytes = 16;   // one entry of the section table
+
+struct PointSetLayout
+{
+    unsigned int                 dim;
+    unsigned int                 elementBytes;
+    std::vector<unsigned int>    kinds;
+    std::vector<unsigned long long> counts;
+};
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ParsePointSetHeader
+//
+// Reads the fixed part of the header. Returns the number of sections, or
+// -1 if p is not the start of a point set that these tools can read.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static long ParsePointSetHeader( const char* p, PointSetLayout& layout )
+//---------------------------------------------------------------------
+{
+    if ( memcmp( p, PointSetMagic, sizeof( PointSetMagic ) ) != 0 ) return( -1 );
+    unsigned int h[4];
+    memcpy( h, p+8, sizeof( h ) );
+    if ( h[0] != 1 || h[1] == 0 || ( h[2] != 4 && h[2] != 8 ) ) return( -1 );
+    layout.dim          = h[1];
+    layout.elementBytes = h[2];
+    return( (long)h[3] );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ParsePointSetSections
+//
+// Reads the section table. Returns false if the sections' points would
+// take more than available bytes, which also keeps every byte count
+// computed from them from overflowing.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static bool ParsePointSetSections( const char* p, const long nSections, const unsigned long long available, PointSetLayout& layout )
+//---------------------------------------------------------------------
+{
+    const unsigned long long rowBytes = (unsigned long long)layout.dim * layout.elementBytes;
+    unsigned long long payload = 0;
+    for ( long i=0; i<nSections; ++i )
+    {
+        unsigned int kind;
+        unsigned long long count;
+        memcpy( &kind,  p + (size_t)i*PointSetSectionBytes,     sizeof( kind ) );
+        memcpy( &count, p + (size_t)i*PointSetSectionBytes + 8, sizeof( count ) );
+        if ( count > ( available - payload )/rowBytes ) return( false );
+        layout.kinds .push_back( kind );
+        layout.counts.push_back( count );
+        payload += count * rowBytes;
+    }
+    return( true );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// DecodePoints
+//
+// Appends count points of dim elements each, stored contiguously at p,
+// to v.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static void DecodePoints( const char* p, const unsigned long long count, const PointSetLayout& layout, std::vector<vecN>& v )
+//---------------------------------------------------------------------
+{
+    if ( count == 0 ) return;
+    std::vector<double> vd( layout.dim );
+    v.reserve( v.size( ) + (size_t)count );
+    for ( unsigned long long i=0; i<count; ++i )
+    {
+        if ( layout.elementBytes == 4 )
+        {
+            for ( unsigned int k=0; k<layout.dim; ++k, p+=4 )
             {
-                fprintf( stdout, "%f,", v[k] );
+                float f;
+                memcpy( &f, p, 4 );
+                vd[k] = f;
             }
         }
-        fprintf( stdout, "\n" );
+        else
+        {
+            memcpy( &vd[0], p, layout.dim*8 );
+            p += layout.dim*8;
+        }
+        v.push_back( vecN( vd ) );
     }
 }
 
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-// FindBox
+// DecodePoints
 //
-// Determines the boundary extents of the vecN object along each of
-// the n axes. The maximums and the minimums are returned.
+// The same, appending to a matrix, which takes the point set's
+// dimension if it is empty.
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-std::pair<vecN,vecN> FindBox( const std::vector<vecN>& v )
+static void DecodePoints( const char* p, const unsigned long long count, const PointSetLayout& layout, PointMatrix& m )
 //---------------------------------------------------------------------
 {
-    const long dim = (long)v[0].size( );
-    vecN mins( dim, DBL_MAX);
-    vecN maxs( dim, -DBL_MAX);
-
-    for ( unsigned int i=0; i<v.size(); ++i )
+    if ( m.empty( ) ) m = PointMatrix( 0, (int)layout.dim );
+    const size_t first = m.size( );
+    m.resize( first + (size_t)count );
+    double* const out = m.data( ) + first*layout.dim;
+    if ( layout.elementBytes == 4 )
     {
-        const vecN& vn = v[i];
-        for ( unsigned int k=0; k<vn.size( ); ++k )
+        for ( size_t k=0; k<(size_t)count*layout.dim; ++k, p+=4 )
         {
-            const double d = vn[k];
-            if ( d > maxs[k] ) maxs[k] = d;
-            if ( d < mins[k] ) mins[k] = d;
+            float f;
+            memcpy( &f, p, 4 );
+            out[k] = f;
         }
+    }
+    else if ( count > 0 )
+    {
+        memcpy( out, p, (size_t)count*layout.dim*8 );
+    }
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// SectionFor
+//
+// The list that the points of a section of the given kind go to.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+template <typename PointList>
+static PointList& SectionFor( const unsigned int kind,
+   PointList& points, PointList& probes, PointList& targets )
+//---------------------------------------------------------------------
+{
+    if ( kind == PointSetProbes )  return( probes );
+    if ( kind == PointSetTargets ) return( targets );
+    return( points );
+}
 
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// DecodePointSet
+//
+// Decodes a whole point set that is in memory (a mapped file). Returns
+// false, with nothing changed, if it is not a complete point set.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+template <typename PointList>
+static bool DecodePointSet( const char* p, const size_t size,
+   PointList& points, PointList& probes, PointList& targets )
+//---------------------------------------------------------------------
+{
+    PointSetLayout layout;
+    if ( size < PointSetHeaderBytes ) return( false );
+    const long nSections = ParsePointSetHeader( p, layout );
+    if ( nSections < 0 || ( size - PointSetHeaderBytes )/PointSetSectionBytes < (size_t)nSections ) return( false );
+    size_t offset = PointSetHeaderBytes + (size_t)nSections*PointSetSectionBytes;
+    if ( ! ParsePointSetSections( p + PointSetHeaderBytes, nSections, size - offset, layout ) ) return( false );
+
+    for ( long i=0; i<nSections; ++i )
+    {
+        DecodePoints( p + offset, layout.counts[i], layout, SectionFor( layout.kinds[i], points, probes, targets ) );
+        offset += (size_t)( layout.counts[i] * layout.dim * layout.elementBytes );
     }
-    return( std::make_pair( mins, maxs ) );
+    g_inputFormat = (PointSetFormat)layout.elementBytes;
+    return( true );
 }
 
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-// BoxIt
+// MapFile
 //
-// Converts a set of vecN points so that they fit into the range
-// -1 to +1 along the largest axial extent of the set of points
+// Maps the whole of the open file fd, if it is a non-empty regular file
+// and the platform can, setting size. Returns 0 otherwise.
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-void BoxIt( std::vector<vecN>& v )
+static const char* MapFile( const int fd, size_t& size )
 //---------------------------------------------------------------------
 {
-    const std::pair<vecN,vecN> box = FindBox( v );
+    size = 0;
+#ifdef _WIN32
+    (void)fd;
+    return( 0 );
+#else
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || ! S_ISREG( st.st_mode ) || st.st_size <= 0 ) return( 0 );
+    void* const map = mmap( 0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( map == MAP_FAILED ) return( 0 );
+    size = (size_t)st.st_size;
+    return( (const char*)map );
+#endif
+}
 
-    const vecN limits = box.second - box.first;
-    const vecN middle = 0.5 * ( box.second + box.first );
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// UnmapFile
+//
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static void UnmapFile( const char* const p, const size_t size )
+//---------------------------------------------------------------------
+{
+#ifdef _WIN32
+    (void)p; (void)size;
+#else
+    if ( p ) munmap( (void*)p, size );
+#endif
+}
 
-    // determine the largest extent along any axis and
-    // use that for scaling
-    double scale = -DBL_MAX;
-    for ( unsigned int i=0; i<v.size( ); ++i )
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// DecodeMappedFile
+//
+// Maps the open file fd, if it is a regular file and the platform can,
+// and decodes it as a point set. Returns false, having read nothing, if
+// it cannot be mapped or is not a point set.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+template <typename PointList>
+static bool DecodeMappedFile( const int fd,
+   PointList& points, PointList& probes, PointList& targets )
+//---------------------------------------------------------------------
+{
+    size_t size;
+    const char* const map = MapFile( fd, size );
+    if ( map == 0 ) return( false );
+    const bool ok = size >= PointSetHeaderBytes && DecodePointSet( map, size, points, probes, targets );
+    UnmapFile( map, size );
+    return( ok );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ReadStreamBytes
+//
+// Reads bytes bytes of str into out a chunk at a time, so that out grows
+// only as far as str really goes, and a count made up by a damaged header
+// asks for no more memory than the stream holds. Returns false if str
+// ends first.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static bool ReadStreamBytes( std::istream& str, const unsigned long long bytes, std::vector<char>& out )
+//---------------------------------------------------------------------
+{
+    static const size_t ChunkBytes = 1 << 20;
+    out.clear( );
+    while ( out.size( ) < bytes )
     {
-        for ( unsigned int k=0; k<limits.size(); ++k )
+        const size_t first = out.size( );
+        const size_t chunk = ( bytes - first < ChunkBytes ) ? (size_t)( bytes - first ) : ChunkBytes;
+        out.resize( first + chunk );
+        str.read( &out[first], (std::streamsize)chunk );
+        if ( (size_t)str.gcount( ) != chunk ) return( false );
+    }
+    return( true );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ReadPointSetStream
+//
+// Reads a binary point set from str into points, probes and targets
+// (according to the kinds of its sections). Returns PointSetAbsent,
+// having read nothing, if str does not start with PointSetMagic, so that
+// the caller can read it as CSV instead, and PointSetBroken, with the
+// reason on stderr and nothing kept, if it does but the header is not
+// one these tools can read or the points are cut short. std::cin
+// redirected from a file is mapped rather than read.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+enum PointSetStatus { PointSetAbsent, PointSetRead, PointSetBroken };
+
+template <typename PointList>
+static PointSetStatus ReadPointSetStream(
+   std::istream& str,
+   PointList& points,
+   PointList& probes,
+   PointList& targets )
+//---------------------------------------------------------------------
+{
+    if ( &str == &std::cin )
+    {
+#ifdef _WIN32
+        _setmode( _fileno( stdin ), _O_BINARY );
+#else
+        if ( lseek( 0, 0, SEEK_CUR ) == 0 && DecodeMappedFile( 0, points, probes, targets ) )
         {
-            if ( scale < limits[k] ) scale = limits[k];
+            return( PointSetRead );
         }
+#endif
     }
 
-    if ( scale == -DBL_MAX  || scale == 0.0)
+    if ( str.peek( ) != (unsigned char)PointSetMagic[0] ) return( PointSetAbsent );
+
+    char header[PointSetHeaderBytes];
+    PointSetLayout layout;
+    str.read( header, PointSetHeaderBytes );
+    const long nSections = str ? ParsePointSetHeader( header, layout ) : -1;
+    if ( nSections < 0 )
     {
-        scale = 1.0;
+        fprintf( stderr, "not a point set that can be read\n" );
+        return( PointSetBroken );
+    }
+    std::vector<char> table;
+    if ( ! ReadStreamBytes( str, (unsigned long long)nSections*PointSetSectionBytes, table )
+         || ! ParsePointSetSections( table.data( ), nSections, SIZE_MAX, layout ) )
+    {
+        fprintf( stderr, "point set is truncated or too large\n" );
+        return( PointSetBroken );
     }
 
-    // factor of two because -1 to +1 is length 2
-    scale = 2.0 / scale;
+    std::vector<std::vector<char> > payload( nSections );
+    for ( long i=0; i<nSections; ++i )
+    {
+        if ( ! ReadStreamBytes( str, layout.counts[i] * layout.dim * layout.elementBytes, payload[i] ) )
+        {
+            fprintf( stderr, "point set is truncated\n" );
+            return( PointSetBroken );
+        }
+    }
+    for ( long i=0; i<nSections; ++i )
+    {
+        DecodePoints( payload[i].data( ), layout.counts[i], layout, SectionFor( layout.kinds[i], points, probes, targets ) );
+    }
+    g_inputFormat = (PointSetFormat)layout.elementBytes;
+    return( PointSetRead );
+}
 
-    for ( unsigned int i=0; i<v.size( ); ++i )
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ReadPointSetFile
+//
+// A point set that cannot be read ends the program with status 1, as
+// there is nothing sensible for the readers to return instead.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+template <typename PointList>
+static bool ReadPointSetOrExit(
+   std::istream& str,
+   PointList& points,
+   PointList& probes,
+   PointList& targets )
+//---------------------------------------------------------------------
+{
+    const PointSetStatus status = ReadPointSetStream( str, points, probes, targets );
+    if ( status == PointSetBroken ) exit( 1 );
+    return( status == PointSetRead );
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+bool ReadPointSetFile(
+   std::istream& str,
+   std::vector<vecN>& points,
+   std::vector<vecN>& probes,
+   std::vector<vecN>& targets )
+//---------------------------------------------------------------------
+{
+    return( ReadPointSetOrExit( str, points, probes, targets ) );
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+bool ReadPointSetFile(
+   std::istream& str,
+   PointMatrix& points,
+   PointMatrix& probes,
+   PointMatrix& targets )
+//---------------------------------------------------------------------
+{
+    return( ReadPointSetOrExit( str, points, probes, targets ) );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ReadPointSetFile
+//
+// The same, for a named file, which is mapped where the platform allows.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+bool ReadPointSetFile(
+   const char* path,
+   std::vector<vecN>& points,
+   std::vector<vecN>& probes,
+   std::vector<vecN>& targets )
+//---------------------------------------------------------------------
+{
+#ifndef _WIN32
+    const int fd = open( path, O_RDONLY );
+    if ( fd >= 0 )
     {
-        vecN& w = v[i];
-        w = scale * ( w - middle );
+        const bool ok = DecodeMappedFile( fd, points, probes, targets );
+        close( fd );
+        if ( ok ) return( true );
+    }
+#endif
+    std::ifstream file( path, std::ios::in | std::ios::binary );
+    return( file && ReadPointSetFile( file, points, probes, targets ) );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// WritePointSetFile
+//
+// Writes points, probes and targets as a binary point set with float
+// (PointSetFloat) or double (PointSetDouble) elements. Empty sections
+// are left out, except that there is always at least one. All of the
+// points must have the dimension of the first. Returns false if out
+// did not take all of it.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static inline unsigned int PointsDim( const std::vector<vecN>& v ) { return( (unsigned int)v[0].size( ) ); }
+static inline unsigned int PointsDim( const PointMatrix& m )       { return( (unsigned int)m.dim( ) ); }
+static inline double PointValue( const std::vector<vecN>& v, const size_t j, const unsigned int k ) { return( v[j][(int)k] ); }
+static inline double PointValue( const PointMatrix& m, const size_t j, const unsigned int k )       { return( m[j][k] ); }
+
+template <typename PointList>
+static bool WritePointSetSections(
+   FILE* out,
+   const PointSetFormat format,
+   const PointList& points,
+   const PointList& probes,
+   const PointList& targets )
+//---------------------------------------------------------------------
+{
+#ifdef _WIN32
+    _setmode( _fileno( out ), _O_BINARY );
+#endif
+    const PointList* sections[3] = { &points, &probes, &targets };
+    const unsigned int kinds[3] = { PointSetPoints, PointSetProbes, PointSetTargets };
+    unsigned int dim = 0;
+    unsigned int nSections = 0;
+    for ( int i=0; i<3; ++i )
+    {
+        if ( ! sections[i]->empty( ) )
+        {
+            if ( dim == 0 ) dim = PointsDim( *sections[i] );
+            ++nSections;
+        }
+    }
+    if ( nSections == 0 ) nSections = 1;
+    if ( dim == 0 ) dim = 1;
+
+    const unsigned int h[4] = { 1, dim, (unsigned int)format, nSections };
+    bool written = fwrite( PointSetMagic, 1, sizeof( PointSetMagic ), out ) == sizeof( PointSetMagic );
+    written = written && fwrite( h, sizeof( h[0] ), 4, out ) == 4;
+    for ( int i=0; i<3; ++i )
+    {
+        if ( ! sections[i]->empty( ) || ( i == 0 && points.empty( ) && probes.empty( ) && targets.empty( ) ) )
+        {
+            const unsigned int kind[2] = { kinds[i], 0 };
+            const unsigned long long count = sections[i]->size( );
+            written = written && fwrite( kind, sizeof( kind[0] ), 2, out ) == 2;
+            written = written && fwrite( &count, sizeof( count ), 1, out ) == 1;
+        }
+    }
+
+    std::vector<char> row( dim*(size_t)format );
+    for ( int i=0; i<3 && written; ++i )
+    {
+        const PointList& v = *sections[i];
+        for ( size_t j=0; j<v.size( ) && written; ++j )
+        {
+            for ( unsigned int k=0; k<dim; ++k )
+            {
+                if ( format == PointSetFloat )
+                {
+                    const float f = (float)PointValue( v, j, k );
+                    memcpy( &row[k*4], &f, 4 );
+                }
+                else
+                {
+                    const double d = PointValue( v, j, k );
+                    memcpy( &row[k*8], &d, 8 );
+                }
+            }
+            written = fwrite( &row[0], 1, row.size( ), out ) == row.size( );
+        }
     }
+    return( fflush( out ) == 0 && written && ! ferror( out ) );
 }
 
 /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
-vecN operator* ( const double& a, const vecN& v )
-//-------------------------------------------------------------------------------------
+bool WritePointSetFile(
+   FILE* out,
+   const PointSetFormat format,
+   const std::vector<vecN>& points,
+   const std::vector<vecN>& probes,
+   const std::vector<vecN>& targets )
+//---------------------------------------------------------------------
 {
-    const long siz = (long)v.pd.size( );
-    vecN vout( siz );
+    return( WritePointSetSections( out, format, points, probes, targets ) );
+}
 
-    for ( int i=0; i<siz; ++i )
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+bool WritePointSetFile(
+   FILE* out,
+   const PointSetFormat format,
+   const PointMatrix& points,
+   const PointMatrix& probes,
+   const PointMatrix& targets )
+//---------------------------------------------------------------------
+{
+    return( WritePointSetSections( out, format, points, probes, targets ) );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// GetOutputFormat
+//
+// The format for the writers: POINTSET_FORMAT if it is set to csv, f32
+// or f64, otherwise the format of the last point set read.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+PointSetFormat GetOutputFormat( void )
+//---------------------------------------------------------------------
+{
+    const char* const env = getenv( "POINTSET_FORMAT" );
+    if ( env != 0 )
     {
-        vout.pd[i] = a * v.pd[i];
+        if ( strcmp( env, "csv" ) == 0 ) return( PointSetCSV );
+        if ( strcmp( env, "f32" ) == 0 ) return( PointSetFloat );
+        if ( strcmp( env, "f64" ) == 0 ) return( PointSetDouble );
     }
-    return ( vout );
+    return( g_inputFormat );
+}
+
+// below this much text per thread, ParseCSVPoints does not split its input
+static const size_t CSVChunkBytes = 4 << 20;
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ParseCSVField
+//
+// Converts the number starting at p (after any blanks or a '+', which
+// from_chars does not take) into d, or sets d to 0 if there is none.
+// Returns the end of the number.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static inline const char* ParseCSVField( const char* p, const char* const end, double& d )
+//---------------------------------------------------------------------
+{
+    while ( p < end && ( *p == ' ' || *p == '\t' ) ) ++p;
+    if ( p < end && *p == '+' ) ++p;
+#ifdef __cpp_lib_to_chars
+    const std::from_chars_result r = std::from_chars( p, end, d );
+    if ( r.ec != std::errc( ) ) d = 0.0;
+    return( r.ptr );
+#else
+    // the text may not be terminated, so strtod gets a terminated copy of the
+    // field, on the stack unless it is too long for that
+    const char* const comma = (const char*)memchr( p, ',', end - p );
+    const size_t n = (size_t)( ( comma != 0 ? comma : end ) - p );
+    char shortField[64];
+    std::string longField;
+    char* field = shortField;
+    if ( n < sizeof( shortField ) )
+    {
+        memcpy( shortField, p, n );
+        shortField[n] = '\0';
+    }
+    else
+    {
+        longField.assign( p, n );
+        field = &longField[0];
+    }
+    char* fieldEnd;
+    d = strtod( field, &fieldEnd );
+    return( p + ( fieldEnd - field ) );
+#endif
 }
 
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ParseCSVLines
+//
+// ParseCSVPoints for one chunk of whole lines. Fields are split at
+// commas as GetNextLine splits them (an empty field after a final comma
+// is not one), and a '\r' ending the line is ignored.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static void ParseCSVLines( const char* p, const char* const end,
+   std::vector<double>& values, std::vector<unsigned int>& dims )
+//---------------------------------------------------------------------
+{
+    values.reserve( values.size( ) + ( end - p ) / 8 );
+    while ( p < end )
+    {
+        const char* eol = (const char*)memchr( p, '\n', end - p );
+        if ( eol == 0 ) eol = end;
+        const char* const last = ( eol > p && eol[-1] == '\r' ) ? eol - 1 : eol;
+
+        if ( p < last )
+        {
+            unsigned int n = 0;
+            for ( ; ; )
+            {
+                double d;
+                const char* const q = ParseCSVField( p, last, d );
+                values.push_back( d );
+                ++n;
+                const char* const comma = (const char*)memchr( q, ',', last - q );
+                if ( comma == 0 || comma + 1 == last ) break;
+                p = comma + 1;
+            }
+            dims.push_back( n );
+        }
+        p = eol + 1;
+    }
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ParseCSVPoints
+//
+// Parses the CSV text [begin,end) into values and dims, in chunks of
+// whole lines on separate threads when the text is large enough.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void ParseCSVPoints(
+   const char* begin,
+   const char* end,
+   std::vector<double>& values,
+   std::vector<unsigned int>& dims,
+   const unsigned int threads )
+//---------------------------------------------------------------------
+{
+    const size_t size = end - begin;
+    size_t nChunks = threads;
+    if ( nChunks == 0 )
+    {
+        nChunks = MIN( (size_t)MAX( std::thread::hardware_concurrency( ), 1U ), size / CSVChunkBytes );
+    }
+    if ( nChunks <= 1 )
+    {
+        ParseCSVLines( begin, end, values, dims );
+        return;
+    }
+
+    // cut after the first newline at or beyond each even split
+    std::vector<const char*> cuts( nChunks + 1, end );
+    cuts[0] = begin;
+    for ( size_t i=1; i<nChunks; ++i )
+    {
+        const char* const c = MAX( begin + size / nChunks * i, cuts[i-1] );
+        const char* const eol = (const char*)memchr( c, '\n', end - c );
+        cuts[i] = ( eol == 0 ) ? end : eol + 1;
+    }
+
+    std::vector<std::vector<double> > chunkValues( nChunks );
+    std::vector<std::vector<unsigned int> > chunkDims( nChunks );
+    std::vector<std::thread> pool;
+    for ( size_t i=1; i<nChunks; ++i )
+    {
+        pool.push_back( std::thread( ParseCSVLines, cuts[i], cuts[i+1], std::ref( chunkValues[i] ), std::ref( chunkDims[i] ) ) );
+    }
+    ParseCSVLines( cuts[0], cuts[1], values, dims );
+    for ( size_t i=0; i<pool.size( ); ++i )
+    {
+        pool[i].join( );
+    }
+
+    for ( size_t i=1; i<nChunks; ++i )
+    {
+        values.insert( values.end( ), chunkValues[i].begin( ), chunkValues[i].end( ) );
+        dims.insert( dims.end( ), chunkDims[i].begin( ), chunkDims[i].end( ) );
+    }
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ReadCSVPoints
+//
+// Parses the rest of str as CSV. std::cin redirected from a file that
+// has not been read from is mapped; anything else is read into memory
+// in large blocks first.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void ReadCSVPoints(
+   std::istream& str,
+   std::vector<double>& values,
+   std::vector<unsigned int>& dims,
+   const unsigned int threads )
+//---------------------------------------------------------------------
+{
+#ifndef _WIN32
+    // ftell rather than lseek: a peek at std::cin reads ahead into stdin's buffer
+    if ( &str == &std::cin && ftell( stdin ) == 0 )
+    {
+        size_t size;
+        const char* const map = MapFile( 0, size );
+        if ( map != 0 )
+        {
+            ParseCSVPoints( map, map + size, values, dims, threads );
+            UnmapFile( map, size );
+            fseek( stdin, 0, SEEK_END );
+            str.setstate( std::ios::eofbit );
+            return;
+        }
+    }
+#endif
+
+    static const size_t BlockBytes = 1 << 22;
+    std::vector<char> text;
+    while ( str )
+    {
+        const size_t used = text.size( );
+        text.resize( used + BlockBytes );
+        str.read( &text[used], BlockBytes );
+        text.resize( used + (size_t)str.gcount( ) );
+    }
+    if ( ! text.empty( ) )
+    {
+        ParseCSVPoints( &text[0], &text[0] + text.size( ), values, dims, threads );
+    }
+}
+
+// the most a number can take: DBL_MAX has 309 digits before the point
+static const size_t CSVNumberBytes = 320 + 40;
+static const int    CSVMaxPrecision = 40;
+
+// fewer rows than this per thread are not worth splitting
+static const size_t CSVRowsPerThread = 1 << 15;
+
+static const size_t CSVBufferBytes = 1 << 20;
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// GetCSVPrecision
+//
+// The precision for CSVWriter when none is given: CSV_PRECISION if it
+// is "shortest" or a number of decimals, otherwise 6.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+int GetCSVPrecision( void )
+//---------------------------------------------------------------------
+{
+    const char* const env = getenv( "CSV_PRECISION" );
+    if ( env != 0 )
+    {
+        if ( strcmp( env, "shortest" ) == 0 ) return( CSVShortest );
+        if ( env[0] >= '0' && env[0] <= '9' ) return( MIN( atoi( env ), CSVMaxPrecision ) );
+    }
+    return( 6 );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// FormatCSVNumber
+//
+// Writes d at p, which must have CSVNumberBytes of room, and returns
+// the end of it.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static inline char* FormatCSVNumber( char* const p, const double d, const int precision )
+//---------------------------------------------------------------------
+{
+#ifdef __cpp_lib_to_chars
+    const std::to_chars_result r = ( precision == CSVShortest )
+        ? std::to_chars( p, p + CSVNumberBytes, d )
+        : std::to_chars( p, p + CSVNumberBytes, d, std::chars_format::fixed, precision );
+    return( r.ptr );
+#else
+    const int n = ( precision == CSVShortest )
+        ? snprintf( p, CSVNumberBytes, "%.17g", d )
+        : snprintf( p, CSVNumberBytes, "%.*f", precision, d );
+    return( p + n );
+#endif
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// FormatCSVRows
+//
+// Appends nRows rows of dim numbers each, stored contiguously at p, to
+// text as CSV lines.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static void FormatCSVRows( const double* p, const size_t nRows, const size_t dim,
+   const int precision, std::vector<char>& text )
+//---------------------------------------------------------------------
+{
+    size_t used = text.size( );
+    text.resize( used + nRows * dim * 12 + CSVNumberBytes );
+    for ( size_t i=0; i<nRows; ++i )
+    {
+        for ( size_t k=0; k<dim; ++k, ++p )
+        {
+            if ( text.size( ) - used < CSVNumberBytes + 1 )
+            {
+                text.resize( 2 * text.size( ) );
+            }
+            char* const end = FormatCSVNumber( &text[used], *p, precision );
+            used = end - &text[0];
+            text[used++] = ( k+1 == dim ) ? '\n' : ',';
+        }
+        if ( dim == 0 )
+        {
+            text[used++] = '\n';
+        }
+    }
+    text.resize( used );
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+CSVWriter::CSVWriter( FILE* out, const int precision )
+//---------------------------------------------------------------------
+    : m_out( out )
+    , m_precision( ( precision < 0 ) ? (int)CSVShortest : MIN( precision, CSVMaxPrecision ) )
+    , m_buffer( CSVBufferBytes )
+    , m_used( 0 )
+    , m_inRow( false )
+    , m_failed( false )
+{
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+CSVWriter::~CSVWriter( void )
+//---------------------------------------------------------------------
+{
+    if ( m_inRow ) EndRow( );
+    Flush( );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// Write
+//
+// Adds d to the current row, after a comma unless it is the first.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void CSVWriter::Write( const double d )
+//---------------------------------------------------------------------
+{
+    if ( m_buffer.size( ) - m_used < CSVNumberBytes + 2 ) Flush( );
+    if ( m_inRow ) m_buffer[m_used++] = ',';
+    m_used = FormatCSVNumber( &m_buffer[m_used], d, m_precision ) - &m_buffer[0];
+    m_inRow = true;
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+void CSVWriter::EndRow( void )
+//---------------------------------------------------------------------
+{
+    if ( m_used == m_buffer.size( ) ) Flush( );
+    m_buffer[m_used++] = '\n';
+    m_inRow = false;
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+void CSVWriter::WriteRow( const double* const p, const size_t n )
+//---------------------------------------------------------------------
+{
+    for ( size_t k=0; k<n; ++k )
+    {
+        Write( p[k] );
+    }
+    EndRow( );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// WriteRows
+//
+// Writes nRows rows of dim numbers each, stored contiguously at p.
+// Enough rows are split into chunks formatted on separate threads and
+// written in order.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void CSVWriter::WriteRows( const double* const p, const size_t nRows, const size_t dim, const unsigned int threads )
+//---------------------------------------------------------------------
+{
+    if ( m_inRow ) EndRow( );
+
+    size_t nChunks = threads;
+    if ( nChunks == 0 )
+    {
+        nChunks = MIN( (size_t)MAX( std::thread::hardware_concurrency( ), 1U ), nRows / CSVRowsPerThread );
+    }
+    if ( nChunks <= 1 )
+    {
+        for ( size_t i=0; i<nRows; ++i )
+        {
+            WriteRow( p + i*dim, dim );
+        }
+        return;
+    }
+
+    std::vector<std::vector<char> > text( nChunks );
+    std::vector<std::thread> pool;
+    for ( size_t i=1; i<nChunks; ++i )
+    {
+        const size_t first = nRows * i / nChunks;
+        const size_t last  = nRows * (i+1) / nChunks;
+        pool.push_back( std::thread( FormatCSVRows, p + first*dim, last - first, dim, m_precision, std::ref( text[i] ) ) );
+    }
+    FormatCSVRows( p, nRows / nChunks, dim, m_precision, text[0] );
+    for ( size_t i=0; i<pool.size( ); ++i )
+    {
+        pool[i].join( );
+    }
+
+    Flush( );
+    for ( size_t i=0; i<nChunks; ++i )
+    {
+        if ( ! text[i].empty( ) && fwrite( &text[i][0], 1, text[i].size( ), m_out ) != text[i].size( ) ) m_failed = true;
+    }
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+void CSVWriter::Flush( void )
+//---------------------------------------------------------------------
+{
+    if ( m_used > 0 && fwrite( &m_buffer[0], 1, m_used, m_out ) != m_used ) m_failed = true;
+    m_used = 0;
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+bool CSVWriter::Failed( void ) const
+//---------------------------------------------------------------------
+{
+    return( m_failed || ferror( m_out ) != 0 );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ToVector_3
+//
+// The first three components of each point (zero for any it lacks).
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+static void ToVector_3( const std::vector<vecN>& vin, std::vector<Vector_3>& vout )
+//---------------------------------------------------------------------
+{
+    vout.reserve( vin.size( ) );
+    for ( size_t i=0; i<vin.size( ); ++i )
+    {
+        const vecN& v = vin[i];
+        vout.push_back( Vector_3( v.size( ) > 0 ? v[0] : 0.0,
+                                  v.size( ) > 1 ? v[1] : 0.0,
+                                  v.size( ) > 2 ? v[2] : 0.0 ) );
+    }
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// FindBox
+//
+// Determines the boundary extents of the vecN object along each of
+// the n axes. The maximums and the minimums are returned.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+std::pair<vecN,vecN> FindBox( const std::vector<vecN>& v )
+//---------------------------------------------------------------------
+{
+    const long dim = (long)v[0].size( );
+    vecN mins( dim, DBL_MAX);
+    vecN maxs( dim, -DBL_MAX);
+
+    for ( unsigned int i=0; i<v.size(); ++i )
+    {
+        const vecN& vn = v[i];
+        for ( unsigned int k=0; k<vn.size( ); ++k )
+        {
+            const double d = vn[k];
+            if ( d > maxs[k] ) maxs[k] = d;
+            if ( d < mins[k] ) mins[k] = d;
+        }
+
+    }
+    return( std::make_pair( mins, maxs ) );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// BoxIt
+//
+// Converts a set of vecN points so that they fit into the range
+// -1 to +1 along the largest axial extent of the set of points
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void BoxIt( std::vector<vecN>& v )
+//---------------------------------------------------------------------
+{
+    const std::pair<vecN,vecN> box = FindBox( v );
+
+    const vecN limits = box.second - box.first;
+    const vecN middle = 0.5 * ( box.second + box.first );
+
+    // determine the largest extent along any axis and
+    // use that for scaling
+    double scale = -DBL_MAX;
+    for ( unsigned int i=0; i<v.size( ); ++i )
+    {
+        for ( unsigned int k=0; k<limits.size(); ++k )
+        {
+            if ( scale < limits[k] ) scale = limits[k];
+        }
+    }
+
+    if ( scale == -DBL_MAX  || scale == 0.0)
+    {
+        scale = 1.0;
+    }
+
+    // factor of two because -1 to +1 is length 2
+    scale = 2.0 / scale;
+
+    for ( unsigned int i=0; i<v.size( ); ++i )
+    {
+        vecN& w = v[i];
+        w = scale * ( w - middle );
+    }
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// FindBox
+//
+// The same, for a matrix of points.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+std::pair<vecN,vecN> FindBox( const PointMatrix& m )
+//---------------------------------------------------------------------
+{
+    const int dim = m.dim( );
+    vecN mins( (long)dim, DBL_MAX);
+    vecN maxs( (long)dim, -DBL_MAX);
+
+    for ( size_t i=0; i<m.size( ); ++i )
+    {
+        const double* const p = m[i];
+        for ( int k=0; k<dim; ++k )
+        {
+            const double d = p[k];
+            if ( d > maxs[k] ) maxs[k] = d;
+            if ( d < mins[k] ) mins[k] = d;
+        }
+    }
+    return( std::make_pair( mins, maxs ) );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// BoxIt
+//
+// The same, for a matrix of points, which is changed in place.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void BoxIt( PointMatrix& m )
+//---------------------------------------------------------------------
+{
+    const std::pair<vecN,vecN> box = FindBox( m );
+    const int dim = m.dim( );
+
+    std::vector<double> middle( dim );
+    double scale = -DBL_MAX;
+    for ( int k=0; k<dim; ++k )
+    {
+        middle[k] = 0.5 * ( box.second[k] + box.first[k] );
+        scale = MAX( scale, box.second[k] - box.first[k] );
+    }
+
+    if ( scale == -DBL_MAX  || scale == 0.0 || m.empty( ) )
+    {
+        scale = 1.0;
+    }
+
+    // factor of two because -1 to +1 is length 2
+    scale = 2.0 / scale;
+
+    for ( size_t i=0; i<m.size( ); ++i )
+    {
+        double* const p = m[i];
+        for ( int k=0; k<dim; ++k )
+        {
+            p[k] = scale * ( p[k] - middle[k] );
+        }
+    }
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ReadPointMatrix
+//
+// Reads a CSV file or binary point set (all of its sections) from str.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+PointMatrix ReadPointMatrix( std::istream& str )
+//---------------------------------------------------------------------
+{
+    PointMatrix m;
+    PointMatrix probes, targets;
+    if ( ReadPointSetFile( str, m, probes, targets ) )
+    {
+        const PointMatrix* const more[2] = { &probes, &targets };
+        for ( int i=0; i<2; ++i )
+        {
+            if ( m.empty( ) ) m = PointMatrix( 0, more[i]->dim( ) );
+            m.reserve( m.size( ) + more[i]->size( ) );
+            for ( size_t j=0; j<more[i]->size( ); ++j )
+            {
+                m.push_back( (*more[i])[j] );
+            }
+        }
+        return( m );
+    }
+
+    std::vector<double> values;
+    std::vector<unsigned int> dims;
+    ReadCSVPoints( str, values, dims );
+    if ( dims.empty( ) ) return( m );
+
+    const unsigned int dim = dims[0];
+    m = PointMatrix( dims.size( ), (int)dim );
+    const double* p = &values[0];
+    double* out = m.data( );
+    for ( size_t i=0; i<dims.size( ); p+=dims[i], out+=dim, ++i )
+    {
+        memcpy( out, p, MIN( dims[i], dim ) * sizeof( double ) );
+    }
+    return( m );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// WritePointMatrix
+//
+// Writes m to stdout, as CSV or as a binary point set according to
+// GetOutputFormat.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void WritePointMatrix( const PointMatrix& m )
+//---------------------------------------------------------------------
+{
+    const PointSetFormat format = GetOutputFormat( );
+    if ( format != PointSetCSV )
+    {
+        ExitIfNotWritten( WritePointSetFile( stdout, format, m, PointMatrix( ), PointMatrix( ) ) );
+        return;
+    }
+
+    if ( m.empty( ) ) return;
+    CSVWriter out( stdout );
+    out.WriteRows( m.data( ), m.size( ), (size_t)m.dim( ) );
+    out.Flush( );
+    ExitIfNotWritten( fflush( stdout ) == 0 && ! out.Failed( ) );
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+PointMatrix::PointMatrix( const std::vector<vecN>& v )
+//---------------------------------------------------------------------
+    : m_values( )
+    , m_rows( 0 )
+    , m_dim( v.empty( ) ? 0 : v[0].dim )
+{
+    reserve( v.size( ) );
+    for ( size_t i=0; i<v.size( ); ++i )
+    {
+        push_back( v[i].data( ) );
+    }
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+void PointMatrix::reserve( const size_t rows )
+//---------------------------------------------------------------------
+{
+    m_values.reserve( rows*m_dim );
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+void PointMatrix::resize( const size_t rows )
+//---------------------------------------------------------------------
+{
+    m_values.resize( rows*m_dim );
+    m_rows = rows;
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// push_back
+//
+// Appends a row, copying dim( ) values from p.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void PointMatrix::push_back( const double* const p )
+//---------------------------------------------------------------------
+{
+    m_values.insert( m_values.end( ), p, p+m_dim );
+    ++m_rows;
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+void PointMatrix::clear( void )
+//---------------------------------------------------------------------
+{
+    m_values.clear( );
+    m_rows = 0;
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// ToVecN
+//
+// A copy of the points as vecN, for code that still wants them.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+std::vector<vecN> PointMatrix::ToVecN( void ) const
+//---------------------------------------------------------------------
+{
+    std::vector<vecN> v;
+    v.reserve( m_rows );
+    for ( size_t i=0; i<m_rows; ++i )
+    {
+        v.push_back( vecN( (*this)[i], m_dim ) );
+    }
+    return( v );
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+vecN operator* ( const double& a, const vecN& v )
+//-------------------------------------------------------------------------------------
+{
+    const long siz = (long)v.pd.size( );
+    vecN vout( siz );
+
+    for ( int i=0; i<siz; ++i )
+    {
+        vout.pd[i] = a * v.pd[i];
+    }
+    return ( vout );
+}
+
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// FillRandom
+//
+// Sets p[0..n) from the same generator, in the same order, as the
+// random vecN constructors, so that VecD<n>::Random( ) matches vecN( n ).
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+void FillRandom( double* const p, const int n )
+//---------------------------------------------------------------------
+{
+    for( int i=0; i<n; ++i )
+    {
+        p[i] = rhr.urand( );
+    }
+}
 
 /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
 vecN::vecN( const long n ) :
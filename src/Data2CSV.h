@@ -9,11 +9,14 @@
 #ifndef DATA2CSV_H
 #define DATA2CSV_H
 
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <iostream>
+#include <type_traits>
 
 #include "vector_3d.h"
+#include "L2Kernels.h"
 
 template <typename T>
 T MAX( const T& t1, const T& t2 )
@@ -70,6 +73,140 @@ void BoxIt( std::vector<vecN>& v );
 class vecN;
 std::vector<vecN> ReadGeneralFile( std::istream& str );
 
+/*=======================================================================*/
+/* Fast CSV parsing
+
+   The CSV readers above take the whole input as one block of text (std::cin
+   redirected from a file is memory-mapped, anything else is read in large
+   blocks), split it into lines and fields in place and convert the fields
+   with std::from_chars where the library has it (strtod otherwise), without
+   building a string per line or per field.
+
+   ParseCSVPoints appends the components of every non-blank line of
+   [begin,end) to values, one point after another, and the number of
+   components of each to dims. A field that is not a number counts as 0,
+   as atof would make it. With threads == 0 large inputs are split at
+   line boundaries into one chunk per hardware thread; the result is the
+   same for any number of threads.
+
+   ReadCSVPoints does the same for the rest of a stream. */
+/*=======================================================================*/
+void ParseCSVPoints(
+   const char* begin,
+   const char* end,
+   std::vector<double>& values,
+   std::vector<unsigned int>& dims,
+   const unsigned int threads = 0 );
+
+void ReadCSVPoints(
+   std::istream& str,
+   std::vector<double>& values,
+   std::vector<unsigned int>& dims,
+   const unsigned int threads = 0 );
+
+/*=======================================================================*/
+/* Fast CSV writing
+
+   CSVWriter formats numbers with std::to_chars (snprintf where the library
+   does not have it) into a large buffer of its own and writes that out in
+   big blocks, instead of calling fprintf for every number. The precision
+   is a number of decimals, as for "%.*f", or CSVShortest for the shortest
+   text that reads back as the same double. If none is given it comes from
+   the environment variable CSV_PRECISION (a number or "shortest"), and is
+   6, as "%f" gives, if that is not set.
+
+   WriteRows formats large blocks of rows on separate threads, one chunk
+   of rows per hardware thread when threads == 0; the output does not
+   depend on the number of threads. Failed tells whether any of the text
+   could not be written; Flush first, so that it covers the last rows. */
+/*=======================================================================*/
+enum { CSVShortest = -1 };
+
+int GetCSVPrecision( void );
+
+class CSVWriter
+{
+public:
+    explicit CSVWriter( FILE* out = stdout, const int precision = GetCSVPrecision( ) );
+    ~CSVWriter( void );
+
+    void Write( const double d );    // the next number of the current row
+    void EndRow( void );
+    void WriteRow( const double* const p, const size_t n );
+    void WriteRows( const double* const p, const size_t nRows, const size_t dim, const unsigned int threads = 0 );
+    void Flush( void );
+    bool Failed( void ) const;       // true if out did not take all that was written
+
+private:
+    CSVWriter( const CSVWriter& );
+    CSVWriter& operator=( const CSVWriter& );
+
+    FILE*             m_out;
+    int               m_precision;
+    std::vector<char> m_buffer;
+    size_t            m_used;
+    bool              m_inRow;
+    bool              m_failed;
+};
+
+/*=======================================================================*/
+/* Binary point sets
+
+   A compact alternative to the CSV files, for large data sets. All of the
+   readers above accept either form, telling them apart by the magic number,
+   and the writers write whichever form was last read (CSV if nothing was),
+   unless the environment variable POINTSET_FORMAT is csv, f32 or f64.
+
+   Layout (native byte order, which is little-endian on every platform
+   these tools are built for):
+
+      char     magic[8]          PointSetMagic
+      uint32   version           1
+      uint32   dim               components per point
+      uint32   elementBytes      4 (float) or 8 (double)
+      uint32   sectionCount
+      sectionCount times:
+         uint32   kind           PointSetPoints, PointSetProbes or PointSetTargets
+         uint32   reserved       0
+         uint64   count          number of points in the section
+      the sections' points, in the same order, each dim contiguous elements
+
+   The probe and target sections are for FixedTestSet and FixedTestStat;
+   readers that want a single list of points get all the sections together.
+   Input that starts with the magic number but has a header these tools
+   cannot read, or fewer points than its sections say, is an error: the
+   reason goes to stderr and the program exits with status 1. So does
+   output that cannot all be written; WritePointSetFile itself returns
+   false then.
+   When the input is a file (including stdin redirected from one) it is
+   memory-mapped where the platform allows, instead of being read. */
+/*=======================================================================*/
+extern const char PointSetMagic[8];
+
+enum PointSetSection { PointSetPoints = 0, PointSetProbes = 1, PointSetTargets = 2 };
+enum PointSetFormat  { PointSetCSV = 0, PointSetFloat = 4, PointSetDouble = 8 };
+
+bool ReadPointSetFile(
+   std::istream& str,
+   std::vector<vecN>& points,
+   std::vector<vecN>& probes,
+   std::vector<vecN>& targets );
+
+bool ReadPointSetFile(
+   const char* path,
+   std::vector<vecN>& points,
+   std::vector<vecN>& probes,
+   std::vector<vecN>& targets );
+
+bool WritePointSetFile(
+   FILE* out,
+   const PointSetFormat format,
+   const std::vector<vecN>& points,
+   const std::vector<vecN>& probes,
+   const std::vector<vecN>& targets );
+
+PointSetFormat GetOutputFormat( void );
+
 
 /*=======================================================================*/
 /* make an N-dimension vector class for testing */
@@ -115,6 +252,15 @@ public:
         length = Norm( );
     }
 
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    vecN( const double* const p, const int n )
+    //-------------------------------------------------------------------------------------
+    : pd( p, p+n )
+    , dim( n )
+    {
+        length = Norm( );
+    }
+
     /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
     ~vecN( void )
     //-------------------------------------------------------------------------------------
@@ -197,6 +343,42 @@ public:
         return( pd.size( ) );
     }
 
+    //-----------------------------------------------------------------------------
+    // Name: data()
+    // Description: pointer to the contiguous components of the vector (0 if empty)
+    //
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    inline const double* data( void ) const
+    //-------------------------------------------------------------------------------------
+    {
+        return( pd.empty( ) ? 0 : &pd[0] );
+    }
+
+    //-----------------------------------------------------------------------------
+    // Name: Distance()
+    // Description: L2 distance between two arrays of n components. No temporary
+    //              vector is made, so this is the path used by CNearTree.
+    //
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    static inline double Distance( const double* p1, const double* p2, const int n )
+    //-------------------------------------------------------------------------------------
+    {
+        double dtemp = 0.0;
+        for( int i=0; i<n; ++i )
+        {
+            const double d = p1[i] - p2[i];
+            dtemp += d*d;  //  L2 measure here
+        }
+        return( sqrt( dtemp ) );
+    }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    inline double DistanceTo( const vecN& v ) const
+    //-------------------------------------------------------------------------------------
+    {
+        return( Distance( data( ), v.data( ), dim ) );
+    }
+
 ////-----------------------------------------------------------------------------
 //// Name: operator+=()
 //// Description: add two vectors
@@ -216,6 +398,409 @@ public:
 
 };  // end vecN
 
+/*=======================================================================*/
+/* CNearTree distance for vecN, computed in place instead of through
+   operator-, which would copy (and free) a std::vector for every call */
+template <typename DistanceType>
+struct CNearTreeDistance<vecN, DistanceType>
+{
+    static inline DistanceType Between( const vecN& t1, const vecN& t2 )
+    {
+        return( DistanceType( t1.DistanceTo( t2 ) ) );
+    }
+};
+
+/* and its coordinates, for the space-filling-curve insertion orders */
+template <>
+struct CNearTreeCoordinates<vecN>
+{
+    enum { Available = 1 };
+    static inline int    Dim       ( const vecN& t ) { return( t.dim ); }
+    static inline double Coordinate( const vecN& t, const int k ) { return( t[k] ); }
+};
+
+
+/*=======================================================================*/
+/* VecD: a point of N components of type Scalar (double or float), with N
+   fixed at compile time. The loops over the components have a constant
+   trip count, so the compiler unrolls them, and the components are held
+   in the object, so a std::vector<VecD<N> > is one block of N*size
+   Scalars. For double, the distance is summed in the same order as vecN
+   sums it, so searches give the same results with either type.
+
+   DispatchDim calls job( std::integral_constant<int,N>( ) ) for N equal
+   to a dimension known only at run time, for 1 to VecDMaxDim, and
+   returns false for any other dimension (for which vecN is left). */
+/*=======================================================================*/
+void FillRandom( double* const p, const int n );  // the values vecN( n ) would have
+
+template <int N, typename Scalar = double>
+class VecD
+{
+public:
+    enum { dim = N };
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    VecD( void )
+    //-------------------------------------------------------------------------------------
+    {
+        for( int i=0; i<N; ++i )
+        {
+            m_v[i] = Scalar( 0 );
+        }
+    }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    explicit VecD( const double* const p )
+    //-------------------------------------------------------------------------------------
+    {
+        for( int i=0; i<N; ++i )
+        {
+            m_v[i] = Scalar( p[i] );
+        }
+    }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    explicit VecD( const vecN& v )
+    //-------------------------------------------------------------------------------------
+    {
+        const double* const p = v.data( );
+        for( int i=0; i<N; ++i )
+        {
+            m_v[i] = Scalar( p[i] );
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    // Name: Random()
+    // Description: a point with the random components vecN( N ) would have
+    //
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    static VecD Random( void )
+    //-------------------------------------------------------------------------------------
+    {
+        double d[N];
+        FillRandom( d, N );
+        return( VecD( d ) );
+    }
+
+    inline Scalar operator[] ( const int i ) const { return( m_v[i] ); }
+    inline Scalar& operator[] ( const int i ) { return( m_v[i] ); }
+    inline size_t size( void ) const { return( (size_t)N ); }
+    inline const Scalar* data( void ) const { return( m_v ); }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    VecD operator-( const VecD& v ) const
+    //-------------------------------------------------------------------------------------
+    {
+        VecD vtemp;
+        for( int i=0; i<N; ++i )
+        {
+            vtemp.m_v[i] = m_v[i] - v.m_v[i];
+        }
+        return( vtemp );
+    }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    VecD operator+( const VecD& v ) const
+    //-------------------------------------------------------------------------------------
+    {
+        VecD vtemp;
+        for( int i=0; i<N; ++i )
+        {
+            vtemp.m_v[i] = m_v[i] + v.m_v[i];
+        }
+        return( vtemp );
+    }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    double Norm( void ) const
+    //-------------------------------------------------------------------------------------
+    {
+        Scalar dtemp = Scalar( 0 );
+        for( int i=0; i<N; ++i )
+        {
+            dtemp += m_v[i]*m_v[i];
+        }
+        return( sqrt( double( dtemp ) ) );
+    }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    inline double DistanceTo( const VecD& v ) const
+    //-------------------------------------------------------------------------------------
+    {
+        Scalar dtemp = Scalar( 0 );
+        for( int i=0; i<N; ++i )
+        {
+            const Scalar d = m_v[i] - v.m_v[i];
+            dtemp += d*d;  //  L2 measure here
+        }
+        return( sqrt( double( dtemp ) ) );
+    }
+
+private:
+    Scalar m_v[N];
+};  // end VecD
+
+/*=======================================================================*/
+/* CNearTree distance for VecD, without the temporary of operator- */
+template <int N, typename Scalar, typename DistanceType>
+struct CNearTreeDistance<VecD<N, Scalar>, DistanceType>
+{
+    static inline DistanceType Between( const VecD<N, Scalar>& t1, const VecD<N, Scalar>& t2 )
+    {
+        return( DistanceType( t1.DistanceTo( t2 ) ) );
+    }
+};
+
+/* and for a block of VecD<N,double>, which are packed N doubles apart,
+   with the SIMD kernels of L2Kernels.h */
+template <int N>
+struct CNearTreeBlockDistance<VecD<N, double>, double>
+{
+    enum { Available = 1 };
+    static inline void Between( const VecD<N, double>& probe, const VecD<N, double>* const objects,
+                                const size_t n, double* const out )
+    {
+        if ( n > 0 ) L2DistanceBlock( probe.data( ), objects[0].data( ), n, N, N, out );
+    }
+    static inline void BetweenSquared( const VecD<N, double>& probe, const VecD<N, double>* const objects,
+                                       const size_t n, double* const out )
+    {
+        if ( n > 0 ) L2SquaredDistanceBlock( probe.data( ), objects[0].data( ), n, N, N, out );
+    }
+};
+
+template <int N, typename Scalar>
+struct CNearTreeCoordinates<VecD<N, Scalar> >
+{
+    enum { Available = 1 };
+    static inline int    Dim       ( const VecD<N, Scalar>& ) { return( N ); }
+    static inline double Coordinate( const VecD<N, Scalar>& t, const int k ) { return( double( t[k] ) ); }
+};
+
+// a VecD holds its coordinates itself, so CNearTree::Save may write it
+template <int N, typename Scalar>
+struct CNearTreeSnapshot<VecD<N, Scalar> >
+{
+    enum { Available = 1 };
+};
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+template <int N, typename Scalar>
+std::vector<VecD<N, Scalar> > ToVecD( const std::vector<vecN>& v )
+//-------------------------------------------------------------------------------------
+{
+    std::vector<VecD<N, Scalar> > vout;
+    vout.reserve( v.size( ) );
+    for ( size_t i=0; i<v.size( ); ++i )
+    {
+        vout.push_back( VecD<N, Scalar>( v[i] ) );
+    }
+    return( vout );
+}
+
+static const int VecDMaxDim = 8;
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+template <typename Job>
+bool DispatchDim( const int dim, Job job )
+//-------------------------------------------------------------------------------------
+{
+    switch ( dim )
+    {
+    case 1: job( std::integral_constant<int, 1>( ) ); return( true );
+    case 2: job( std::integral_constant<int, 2>( ) ); return( true );
+    case 3: job( std::integral_constant<int, 3>( ) ); return( true );
+    case 4: job( std::integral_constant<int, 4>( ) ); return( true );
+    case 5: job( std::integral_constant<int, 5>( ) ); return( true );
+    case 6: job( std::integral_constant<int, 6>( ) ); return( true );
+    case 7: job( std::integral_constant<int, 7>( ) ); return( true );
+    case 8: job( std::integral_constant<int, 8>( ) ); return( true );
+    default: return( false );
+    }
+}
+
+/*=======================================================================*/
+/* AlignedAllocator: a std::allocator replacement for blocks that must
+   start on an Align-byte boundary (a cache line by default) */
+/*=======================================================================*/
+template <typename T, size_t Align = 64>
+class AlignedAllocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator( void ) { }
+    template <typename U> AlignedAllocator( const AlignedAllocator<U, Align>& ) { }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    T* allocate( const size_t n )
+    //-------------------------------------------------------------------------------------
+    {
+        // over-allocate, and keep the block as new returned it just below the aligned start
+        char* const raw = static_cast<char*>( ::operator new( n*sizeof( T ) + Align + sizeof( void* ) ) );
+        char* const aligned = raw + sizeof( void* ) + ( Align - ( (size_t)( raw + sizeof( void* ) ) % Align ) ) % Align;
+        reinterpret_cast<void**>( aligned )[-1] = raw;
+        return( reinterpret_cast<T*>( aligned ) );
+    }
+
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    void deallocate( T* const p, const size_t )
+    //-------------------------------------------------------------------------------------
+    {
+        if ( p != 0 ) ::operator delete( reinterpret_cast<void**>( p )[-1] );
+    }
+
+    template <typename U> bool operator==( const AlignedAllocator<U, Align>& ) const { return( true ); }
+    template <typename U> bool operator!=( const AlignedAllocator<U, Align>& ) const { return( false ); }
+};
+
+/*=======================================================================*/
+/* PointMatrix: a set of points of one dimension, stored row-major in a
+   single aligned block, instead of as a std::vector<vecN> with a block of
+   its own (and a dim and a length) for every point.
+
+   PointMatrix::Row is a view of one point: a pointer to its coordinates
+   and the dimension. A CNearTree<PointMatrix::Row> built from a matrix,
+   e.g. CNearTree<PointMatrix::Row> tree( matrix ), holds views rather
+   than copies of the coordinates, so the matrix must outlive the tree and
+   must not be added to while the tree is in use. A Row can also view a
+   probe held anywhere else, e.g. Row( &probe[0], dim ). */
+/*=======================================================================*/
+class PointMatrix
+{
+public:
+    typedef std::vector<double, AlignedAllocator<double> > Storage;
+
+    /*=======================================================================*/
+    class Row
+    {
+    public:
+        Row( void ) : m_p( 0 ), m_dim( 0 ) { }
+        Row( const double* const p, const int dim ) : m_p( p ), m_dim( dim ) { }
+
+        inline double operator[] ( const int i ) const { return( m_p[i] ); }
+        inline size_t size( void ) const { return( (size_t)m_dim ); }
+        inline const double* data( void ) const { return( m_p ); }
+
+        inline double Norm( void ) const
+        {
+            double dtemp = 0.0;
+            for( int i=0; i<m_dim; ++i )
+            {
+                dtemp += m_p[i]*m_p[i];
+            }
+            return( sqrt( dtemp ) );
+        }
+
+        inline double DistanceTo( const Row& r ) const
+        {
+            return( vecN::Distance( m_p, r.m_p, m_dim ) );
+        }
+
+    private:
+        const double* m_p;
+        int           m_dim;
+    };
+
+    /*=======================================================================*/
+    // the rows, as views, for the container constructors of CNearTree
+    class const_iterator
+    {
+    public:
+        const_iterator( void ) : m_matrix( 0 ), m_index( 0 ) { }
+        const_iterator( const PointMatrix* const m, const size_t i ) : m_matrix( m ), m_index( i ) { }
+
+        inline Row operator* ( void ) const { return( m_matrix->row( m_index ) ); }
+        inline const_iterator& operator++ ( void ) { ++m_index; return( *this ); }
+        inline const_iterator operator++ ( int ) { const_iterator it( *this ); ++m_index; return( it ); }
+        inline bool operator== ( const const_iterator& it ) const { return( m_index == it.m_index ); }
+        inline bool operator!= ( const const_iterator& it ) const { return( m_index != it.m_index ); }
+
+    private:
+        const PointMatrix* m_matrix;
+        size_t             m_index;
+    };
+
+    typedef Row value_type;
+
+    PointMatrix( void ) : m_values( ), m_rows( 0 ), m_dim( 0 ) { }
+    PointMatrix( const size_t rows, const int dim ) : m_values( rows*dim ), m_rows( rows ), m_dim( dim ) { }
+    explicit PointMatrix( const std::vector<vecN>& v );
+
+    inline size_t size( void ) const { return( m_rows ); }
+    inline bool empty( void ) const { return( m_rows == 0 ); }
+    inline int dim( void ) const { return( m_dim ); }
+
+    inline double* operator[] ( const size_t i ) { return( &m_values[i*m_dim] ); }
+    inline const double* operator[] ( const size_t i ) const { return( &m_values[i*m_dim] ); }
+    inline Row row( const size_t i ) const { return( Row( &m_values[i*m_dim], m_dim ) ); }
+
+    inline double* data( void ) { return( m_values.empty( ) ? 0 : &m_values[0] ); }
+    inline const double* data( void ) const { return( m_values.empty( ) ? 0 : &m_values[0] ); }
+
+    inline const_iterator begin( void ) const { return( const_iterator( this, 0 ) ); }
+    inline const_iterator end( void ) const { return( const_iterator( this, m_rows ) ); }
+
+    void reserve( const size_t rows );
+    void resize( const size_t rows );
+    void push_back( const double* const p );
+    void clear( void );
+
+    std::vector<vecN> ToVecN( void ) const;
+
+private:
+    Storage m_values;
+    size_t  m_rows;
+    int     m_dim;
+};
+
+/*=======================================================================*/
+/* CNearTree distance for rows of a PointMatrix */
+template <typename DistanceType>
+struct CNearTreeDistance<PointMatrix::Row, DistanceType>
+{
+    static inline DistanceType Between( const PointMatrix::Row& t1, const PointMatrix::Row& t2 )
+    {
+        return( DistanceType( t1.DistanceTo( t2 ) ) );
+    }
+};
+
+template <>
+struct CNearTreeCoordinates<PointMatrix::Row>
+{
+    enum { Available = 1 };
+    static inline int    Dim       ( const PointMatrix::Row& t ) { return( int( t.size( ) ) ); }
+    static inline double Coordinate( const PointMatrix::Row& t, const int k ) { return( t[k] ); }
+};
+
+/*=======================================================================*/
+/* PointMatrix versions of the readers and writers above. A CSV file whose
+   rows differ in length gives a matrix of the first row's dimension, the
+   other rows cut short or padded with zeros. */
+/*=======================================================================*/
+PointMatrix ReadPointMatrix( std::istream& str );
+
+void WritePointMatrix( const PointMatrix& m );
+
+bool ReadPointSetFile(
+   std::istream& str,
+   PointMatrix& points,
+   PointMatrix& probes,
+   PointMatrix& targets );
+
+bool WritePointSetFile(
+   FILE* out,
+   const PointSetFormat format,
+   const PointMatrix& points,
+   const PointMatrix& probes,
+   const PointMatrix& targets );
+
+std::pair<vecN,vecN> FindBox( const PointMatrix& m );
+void BoxIt( PointMatrix& m );
 
 
 #endif  // DATA2CSV_H
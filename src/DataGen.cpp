@@ -370,14 +370,15 @@ std::vector<Vector_3> RAN_Dumbell(
 //
 // Creates a 4-D lattice of points
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-std::vector<vecN> LAT4_Gen( const int elemCount )
+PointMatrix LAT4_Gen( const int elemCount )
 //---------------------------------------------------------------------
 {
-    std::vector<vecN> v;
+    PointMatrix v( 0, 4 );
+    v.reserve( (size_t)elemCount*elemCount*elemCount*elemCount );
 
     for ( int m=0; m<elemCount; ++m )
     {
-        std::vector<double> vTemp(4);
+        double vTemp[4];
         vTemp[0] = double(m);
         for ( int n=0; n<elemCount; ++n )
         {
@@ -388,7 +389,7 @@ std::vector<vecN> LAT4_Gen( const int elemCount )
                 for ( int p=0; p<elemCount; ++p )
                 {
                     vTemp[3] = double(p);
-                    v.push_back( vecN( vTemp ) );
+                    v.push_back( vTemp );
                 }
 
             }
@@ -404,19 +405,20 @@ std::vector<vecN> LAT4_Gen( const int elemCount )
 //
 // Creates a 2-D lattice of points
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-std::vector<vecN> LAT2_Gen( const int elemCount )
+PointMatrix LAT2_Gen( const int elemCount )
 //---------------------------------------------------------------------
 {
-    std::vector<vecN> v;
+    PointMatrix v( 0, 2 );
+    v.reserve( (size_t)elemCount*elemCount );
 
     for ( int i=0; i<elemCount; ++i )
     {
-        std::vector<double> vTemp(2);
+        double vTemp[2];
         vTemp[0] = double(i);
         for ( int k=0; k<elemCount; ++k )
         {
             vTemp[1] = double(k);
-            v.push_back( vecN( vTemp ) );
+            v.push_back( vTemp );
         }
     }
 
@@ -532,30 +534,29 @@ bool ParseArgs( const int argc, char* argv[], std::string& sRet, std::vector<dou
     return( true );
 }
 
-std::vector<vecN> BOX_Gen( const int dim, const int nPoints )
+PointMatrix BOX_Gen( const int dim, const int nPoints )
 {
-    vecN v(dim);
-    std::vector<vecN> vout;
+    PointMatrix vout( (size_t)MAX( nPoints, 0 ), dim );
     RHrand rhr;
 
     for ( int ipt=0; ipt<nPoints; ++ipt )
     {
+        double* const v = vout[ipt];
         for ( int i=0; i<dim; ++i )
         {
             // put it into -1 to +1
             v[i] = 2.0*rhr.urand( ) - 1.0;
         }
-        vout.push_back( v );
     }
 
     return( vout );
 }
 
-std::vector<vecN> CIRCLE_Gen(const int nDivisions)
+PointMatrix CIRCLE_Gen(const int nDivisions)
 {
-   vecN v(3);
+   double v[3];
    v[2] = 0.0;
-   std::vector<vecN> vout;
+   PointMatrix vout( 0, 3 );
    const double incrementalAngle = 8.0*atan(1.0) / nDivisions;
    for (int ipt = 0; ipt < nDivisions + 1; ++ipt)
    {
@@ -566,11 +567,11 @@ std::vector<vecN> CIRCLE_Gen(const int nDivisions)
    return vout;
 }
 
-std::vector<vecN> LINE_Gen(const int nPoints)
+PointMatrix LINE_Gen(const int nPoints)
 {
-   vecN v(3);
+   double v[3];
    v[2] = 0.0;
-   std::vector<vecN> vout;
+   PointMatrix vout( 0, 3 );
    const double delta = 1.0 / double(nPoints - 1);
    for (int ipt = 0; ipt < nPoints; ++ipt)
    {
@@ -715,10 +716,10 @@ int main(int argc, char* argv[])
     }
     else if ( cmd == "LAT2" )
     {
-        const std::vector<vecN> vLAT = LAT2_Gen( int(vArgs[0]) );
+        const PointMatrix vLAT = LAT2_Gen( int(vArgs[0]) );
         if ( bPrint )
         {
-            WriteVectorFile( vLAT );
+            WritePointMatrix( vLAT );
         }
         else
         {
@@ -727,10 +728,10 @@ int main(int argc, char* argv[])
     }
     else if ( cmd == "LAT4" )
     {
-        const std::vector<vecN> vLAT = LAT4_Gen( int(vArgs[0]) );
+        const PointMatrix vLAT = LAT4_Gen( int(vArgs[0]) );
         if ( bPrint )
         {
-            WriteVectorFile( vLAT );
+            WritePointMatrix( vLAT );
         }
         else
         {
@@ -755,22 +756,14 @@ int main(int argc, char* argv[])
         std::vector<Vector_3> pork;
         const unsigned int vArgs0 = (unsigned int)(int(vArgs[0]));
 
-        for ( unsigned int i=0; i<vHAM.size( ); i+=unsigned int(vArgs[0]) )
+        if ( vArgs0 > 0 && ! vHAM.empty( ) )
         {
-            for ( unsigned int k=0; k<unsigned int(vArgs[0]); ++k )
-            {
-                if ( k == int(vArgs[0])-1 )
-                {
-                    fprintf( stdout, "%f", vHAM[i+k] );
-                }
-                else
-                {
-                    fprintf( stdout, "%f,", vHAM[i+k] );
-                }
-            }
-            fprintf( stdout, "\n" );
-            //pork.push_back( Vector_3( vHAM[i], vHAM[i+1], vHAM[i+2] ) );
+            PointMatrix mHAM( vHAM.size( ) / vArgs0, (int)vArgs0 );
+            std::copy( vHAM.begin( ), vHAM.begin( ) + mHAM.size( )*vArgs0, mHAM.data( ) );
+            WritePointMatrix( mHAM );
         }
+        //for ( unsigned int i=0; i<vHAM.size( ); i+=vArgs0 )
+        //    pork.push_back( Vector_3( vHAM[i], vHAM[i+1], vHAM[i+2] ) );
 
         if ( bPrint )
         {
@@ -796,12 +789,16 @@ int main(int argc, char* argv[])
             vq.push_back( Vector_3( nt[i][0], nt[i][1], nt[i][2] ) );
         }
 
-        for ( unsigned int i=0; i<nt.size( ); ++i )
+        if ( bPrint )
         {
-            if ( bPrint )
+            PointMatrix mq( 0, 4 );
+            mq.reserve( nt.size( ) );
+            for ( unsigned int i=0; i<nt.size( ); ++i )
             {
-                fprintf( stdout, "%f,%f,%f,%f\n", nt[i][0], nt[i][1], nt[i][2], nt[i][3] );
+                const double q[4] = { nt[i][0], nt[i][1], nt[i][2], nt[i][3] };
+                mq.push_back( q );
             }
+            WritePointMatrix( mq );
         }
 
         if ( bPrint )
@@ -815,15 +812,17 @@ int main(int argc, char* argv[])
     }
     else if ( cmd == "RANBOX" )
     {  // random set of points in an n-dimensional box
-        const std::vector<vecN> vBOX = BOX_Gen( int(vArgs[0]), int(vArgs[1]) );
-        WriteVectorFile( vBOX );
+        const PointMatrix vBOX = BOX_Gen( int(vArgs[0]), int(vArgs[1]) );
+        WritePointMatrix( vBOX );
     }
     else if ( cmd == "FRAC" )
     {
-        for ( unsigned int i=0; i<(unsigned int)int(vArgs[0]); ++i )
+        PointMatrix mFRAC( (size_t)MAX( int(vArgs[0]), 0 ), 1 );
+        for ( size_t i=0; i<mFRAC.size( ); ++i )
         {
-            fprintf( stdout, "%f\n", 2.0 / double(i+1) - 1.0 );
+            mFRAC[i][0] = 2.0 / double(i+1) - 1.0;
         }
+        WritePointMatrix( mFRAC );
     }
     else if ( cmd == "COMB" )
     {
@@ -834,11 +833,11 @@ int main(int argc, char* argv[])
     }
     else if (cmd == "CIRCLE")
     { // points to divide a unit circle in xy plane into n divisions
-    WriteVectorFile(CIRCLE_Gen(int(vArgs[0])));
+    WritePointMatrix(CIRCLE_Gen(int(vArgs[0])));
     }
     else if (cmd == "LINE")
     { // points to create n equally spaced points in 0-1
-       WriteVectorFile(LINE_Gen(int(vArgs[0])));
+       WritePointMatrix(LINE_Gen(int(vArgs[0])));
     }
     else
     {
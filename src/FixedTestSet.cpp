@@ -19,6 +19,8 @@
 #include <climits>
 
 #include <ctime>
+#include <chrono>
+#include <thread>
 
 #include "vector_3d.h"
 #include <utility>
@@ -36,17 +38,20 @@ int g_errorCount;
 
 
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-void testProbes( const bool Do_Random_Insertion, const double initialSearchRadius, const std::pair<std::vector<vecN>, std::vector<vecN> >& v )
+// testProbes
+//
+// P is vecN, or VecD for the dimensions DispatchDim covers.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+template <typename P>
+void testProbes( const bool Do_Random_Insertion, const double initialSearchRadius, const std::vector<P>& vProbe, const std::vector<P>& vTarget )
 //---------------------------------------------------------------------
 {
     const long requiredTests = 1;
     long totalTests = 0;
-    const std::vector<vecN>& vProbe = v.first;
-    const std::vector<vecN>& vTarget = v.second;
 
     const clock_t tc0 = std::clock();
 
-    CNearTree<vecN> nt( vTarget );
+    CNearTree<P> nt( vTarget );
 
     if ( Do_Random_Insertion )
     {
@@ -65,12 +70,12 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
 
     /*----------------------------begin balanced tree test--------------------------------------------*/
 
-    nt.SetFlags( CNearTree<vecN>::NTF_NoPrePrune );
+    nt.SetFlags( CNearTree<P>::NTF_NoPrePrune );
 
     long nodevisits1 = (long)nt.GetNodeVisits( );
     const clock_t tc1 = std::clock();
     fprintf( stdout, "Build tree,%f,%d\n", double(tc1-tc0)/ (double)CLOCKS_PER_SEC, (int)vProbe.size( ) );
-    vecN newPoint(vTarget[0]);
+    P newPoint(vTarget[0]);
 
     totalTests = 0;
     while ( totalTests < requiredTests )
@@ -78,14 +83,14 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
         totalTests += (long)vProbe.size( );
         for ( unsigned int i=0; i<vProbe.size( ); ++i )
         {
-            const vecN& probe = vProbe[i];
+            const P& probe = vProbe[i];
             nt.NearestNeighbor( initialSearchRadius, newPoint, probe );
         }
     }
 
     {
 
-        nt.SetFlags( CNearTree<vecN>::NTF_ForcePrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_ForcePrePrune );
         const clock_t tc2 = std::clock();
         long nodevisits2 = (long)nt.GetNodeVisits( );
 
@@ -95,7 +100,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                const vecN& probe = vProbe[i];
+                const P& probe = vProbe[i];
                 nt.NearestNeighbor( initialSearchRadius, newPoint, probe );
             }
         }
@@ -110,7 +115,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                const vecN& probe = vProbe[i];
+                const P& probe = vProbe[i];
                 nt.NearestNeighbor( initialSearchRadius, newPoint, probe );
             }
         }
@@ -143,7 +148,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
     /*----------------------------end balanced tree test--------------------------------------------*/
     /*----------------------------end left branch first test--------------------------------------------*/
     {
-        nt.SetFlags( CNearTree<vecN>::NTF_NoPrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_NoPrePrune );
 
 
         const long nodevisits1 = (long)nt.GetNodeVisits( );
@@ -154,12 +159,12 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                vecN newPoint(vTarget[0]);
+                P newPoint(vTarget[0]);
                 nt.LeftNearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
             }
         }
 
-        nt.SetFlags( CNearTree<vecN>::NTF_ForcePrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_ForcePrePrune );
         const long nodevisits2 = (long)nt.GetNodeVisits( );
         const clock_t tc2 = std::clock();
 
@@ -169,7 +174,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                vecN newPoint(vTarget[0]);
+                P newPoint(vTarget[0]);
                 nt.LeftNearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
             }
         }
@@ -184,7 +189,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                vecN newPoint(vTarget[0]);
+                P newPoint(vTarget[0]);
                 nt.LeftNearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
             }
         }
@@ -217,7 +222,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
     /*----------------------------end left branch first test--------------------------------------------*/
     /*----------------------------start short radius test--------------------------------------------*/
     {
-        nt.SetFlags( CNearTree<vecN>::NTF_NoPrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_NoPrePrune );
 
         const clock_t tc1 = std::clock();
         const long nodevisits1 = (long)nt.GetNodeVisits( );
@@ -227,13 +232,13 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                vecN newPoint(vTarget[0]);
+                P newPoint(vTarget[0]);
                 nt.ShortNearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
             }
         }
 
 
-        nt.SetFlags( CNearTree<vecN>::NTF_ForcePrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_ForcePrePrune );
         const long nodevisits2 = (long)nt.GetNodeVisits( );
         const clock_t tc2 = std::clock();
 
@@ -243,7 +248,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                vecN newPoint(vTarget[0]);
+                P newPoint(vTarget[0]);
                 nt.ShortNearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
             }
         }
@@ -258,7 +263,7 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             totalTests += (long)vProbe.size( );
             for ( unsigned int i=0; i<vProbe.size( ); ++i )
             {
-                vecN newPoint(vTarget[0]);
+                P newPoint(vTarget[0]);
                 nt.ShortNearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
             }
         }
@@ -288,6 +293,178 @@ void testProbes( const bool Do_Random_Insertion, const double initialSearchRadiu
             (double)nt.GetVarSpacing());
     }
     /*----------------------------end short radius test--------------------------------------------*/
+    /*----------------------------start batch test--------------------------------------------*/
+    {
+        // the balanced search once more, for all the probes at once on all the hardware
+        // threads; the time is wall-clock time, since clock( ) adds up the threads' CPU time
+        std::vector<size_t> vIndices;
+        std::vector<double> vDistances;
+        const unsigned int nThreads = std::max( 1u, std::thread::hardware_concurrency( ) );
+
+        nt.SetFlags( 0 );
+        const long nodevisits1 = (long)nt.GetNodeVisits( );
+        const std::chrono::steady_clock::time_point tw1 = std::chrono::steady_clock::now( );
+        const size_t nFound = nt.NearestNeighborBatch( vProbe, initialSearchRadius, vIndices, vDistances, nThreads );
+        const std::chrono::steady_clock::time_point tw2 = std::chrono::steady_clock::now( );
+        const long nodevisits2 = (long)nt.GetNodeVisits( );
+
+        fprintf( stdout, "CSV-BATCH,%ld,%ld,%.3f,%.3f,%d,%ld\n",
+            (long)nt.size( ),
+            (long)vProbe.size( ),
+            std::chrono::duration<double>( tw2-tw1 ).count( ),
+            (double)(nodevisits2-nodevisits1)/(double)std::max( (size_t)1, vProbe.size( ) ),
+            (int)nThreads,
+            (long)nFound );
+    }
+    /*----------------------------end batch test--------------------------------------------*/
+    /*----------------------------start brute force test--------------------------------------------*/
+    {
+        // the nearest target to each probe by measuring every target, once a pair at a
+        // time through CNearTreeDistance and once a block at a time through
+        // BlockDistanceBetween (the SIMD kernels, for types that have them), checked
+        // against the tree's answers
+        const size_t nBlock = 256;
+        std::vector<double> vBlock( nBlock );
+        std::vector<double> vPairMin( vProbe.size( ), DBL_MAX );
+        std::vector<double> vBlockMin( vProbe.size( ), DBL_MAX );
+
+        const std::chrono::steady_clock::time_point tw1 = std::chrono::steady_clock::now( );
+        for ( size_t i=0; i<vProbe.size( ); ++i )
+        {
+            for ( size_t j=0; j<vTarget.size( ); ++j )
+            {
+                vPairMin[i] = std::min( vPairMin[i], CNearTreeDistance<P, double>::Between( vTarget[j], vProbe[i] ) );
+            }
+        }
+        const std::chrono::steady_clock::time_point tw2 = std::chrono::steady_clock::now( );
+        for ( size_t i=0; i<vProbe.size( ); ++i )
+        {
+            for ( size_t j=0; j<vTarget.size( ); j+=nBlock )
+            {
+                const size_t n = std::min( nBlock, vTarget.size( )-j );
+                CNearTree<P>::BlockDistanceBetween( vProbe[i], &vTarget[j], n, &vBlock[0] );
+                for ( size_t k=0; k<n; ++k )
+                {
+                    vBlockMin[i] = std::min( vBlockMin[i], vBlock[k] );
+                }
+            }
+        }
+        const std::chrono::steady_clock::time_point tw3 = std::chrono::steady_clock::now( );
+
+        std::vector<size_t> vIndices;
+        std::vector<double> vDistances;
+        nt.NearestNeighborBatch( vProbe, initialSearchRadius, vIndices, vDistances, 1 );
+        long nMismatch = 0;
+        for ( size_t i=0; i<vProbe.size( ); ++i )
+        {
+            const bool bTreeFound = vIndices[i] != ULONG_MAX;
+            if ( vBlockMin[i] != vPairMin[i] ||
+                 bTreeFound != ( vBlockMin[i] <= initialSearchRadius ) ||
+                 ( bTreeFound && vDistances[i] != vBlockMin[i] ) )
+            {
+                ++nMismatch;
+            }
+        }
+        g_errorCount += (int)nMismatch;
+
+        fprintf( stdout, "CSV-BRUTE,%ld,%ld,%.3f,%.3f,%s,%ld\n",
+            (long)vTarget.size( ),
+            (long)vProbe.size( ),
+            std::chrono::duration<double>( tw2-tw1 ).count( ),
+            std::chrono::duration<double>( tw3-tw2 ).count( ),
+            L2KernelName( L2KernelSelected( ) ),
+            nMismatch );
+    }
+    /*----------------------------end brute force test--------------------------------------------*/
+    /*----------------------------start leaf bucket test--------------------------------------------*/
+    {
+        // the balanced search on frozen copies with leaf buckets of several sizes (0 for
+        // none); a bucket counts a visit for each object in it, so the visits rise with
+        // the bucket size while fewer nodes are walked. The last column is the time with
+        // NTF_SquaredDistances, which finds the same neighbors
+        static const size_t bucketSizes[] = { 0, 8, 16, 32, 64 };
+
+        nt.SetFlags( 0 );
+        for ( size_t b=0; b<sizeof( bucketSizes )/sizeof( bucketSizes[0] ); ++b )
+        {
+            if ( ! nt.Freeze( bucketSizes[b] ) ) break;
+            P newPoint( vTarget[0] );
+
+            const long nodevisits1 = (long)nt.GetNodeVisits( );
+            const clock_t tc1 = std::clock();
+            for ( unsigned int i=0; i<vProbe.size( ); ++i )
+            {
+                nt.NearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
+            }
+            const clock_t tc2 = std::clock();
+            const long nodevisits2 = (long)nt.GetNodeVisits( );
+
+            // the same with the squared distances of NTF_SquaredDistances
+            nt.SetFlags( CNearTree<P>::NTF_SquaredDistances );
+            for ( unsigned int i=0; i<vProbe.size( ); ++i )
+            {
+                nt.NearestNeighbor( initialSearchRadius, newPoint, vProbe[i] );
+            }
+            const clock_t tc3 = std::clock();
+            nt.SetFlags( 0 );
+
+            fprintf( stdout, "CSV-BUCKET,%ld,%ld,%d,%.3f,%.3f,%ld,%.3f\n",
+                (long)nt.size( ),
+                (long)vProbe.size( ),
+                (int)bucketSizes[b],
+                ((double)(tc2-tc1))/CLOCKS_PER_SEC,
+                (double)(nodevisits2-nodevisits1)/(double)std::max( (size_t)1, vProbe.size( ) ),
+                (long)nt.GetNodeBytes( ),
+                ((double)(tc3-tc2))/CLOCKS_PER_SEC );
+        }
+        nt.Thaw( );
+    }
+    /*----------------------------end leaf bucket test--------------------------------------------*/
+    /*----------------------------start parallel build test--------------------------------------------*/
+    {
+        // the same tree built by CompleteDelayedInsert and by CompleteDelayedInsertParallel
+        // on all the hardware threads, in wall-clock time
+        const unsigned int nThreads = std::max( 1u, std::thread::hardware_concurrency( ) );
+        CNearTree<P> ntSerial( vTarget );
+        CNearTree<P> ntParallel( vTarget );
+
+        const std::chrono::steady_clock::time_point tw1 = std::chrono::steady_clock::now( );
+        ntSerial.CompleteDelayedInsert( );
+        const std::chrono::steady_clock::time_point tw2 = std::chrono::steady_clock::now( );
+        ntParallel.CompleteDelayedInsertParallel( nThreads );
+        const std::chrono::steady_clock::time_point tw3 = std::chrono::steady_clock::now( );
+
+        if ( ntSerial.GetDepth( ) != ntParallel.GetDepth( ) || ntSerial.GetNodeCount( ) != ntParallel.GetNodeCount( ) )
+        {
+            ++g_errorCount;
+            fprintf( stdout, "parallel build differs from CompleteDelayedInsert\n" );
+        }
+        fprintf( stdout, "CSV-PARBUILD,%ld,%.3f,%.3f,%d,%ld,%ld\n",
+            (long)vTarget.size( ),
+            std::chrono::duration<double>( tw2-tw1 ).count( ),
+            std::chrono::duration<double>( tw3-tw2 ).count( ),
+            (int)nThreads,
+            (long)ntParallel.GetDepth( ),
+            (long)ntParallel.GetNodeCount( ) );
+    }
+    /*----------------------------end parallel build test--------------------------------------------*/
+    /*----------------------------start dimension estimate test--------------------------------------------*/
+    {
+        // what the dimension estimate that the short searches use costs, on a fresh tree
+        CNearTree<P> ntDim( vTarget );
+        ntDim.CompleteDelayedInsert( );
+        const std::chrono::steady_clock::time_point tw1 = std::chrono::steady_clock::now( );
+        const double dimEstimate = ntDim.GetDimEstimate( );
+        const std::chrono::steady_clock::time_point tw2 = std::chrono::steady_clock::now( );
+
+        fprintf( stdout, "CSV-DIMEST,%ld,%.4f,%.4f,%ld,%ld\n",
+            (long)vTarget.size( ),
+            dimEstimate,
+            std::chrono::duration<double>( tw2-tw1 ).count( ),
+            (long)ntDim.GetDimEstimateTrials( ),
+            (long)ntDim.GetDimEstimateVisits( ) );
+    }
+    /*----------------------------end dimension estimate test--------------------------------------------*/
 
 }
 
@@ -309,6 +486,12 @@ std::pair<std::vector<vecN>,std::vector<vecN> > ReadProbeTarget( std::istream& s
     bool isProbe = false;
     bool isTarget = false;
 
+    std::vector<vecN> vPoints;
+    if ( ReadPointSetFile( str, vPoints, vProbe, vTarget ) )
+    {
+        return( std::make_pair( vProbe, vTarget ) );
+    }
+
     while ( ! str.fail() && ! str.eof( ) )
     {
         fprintf( stdout, "a" );
@@ -401,9 +584,18 @@ int main( int argc, char* argv[] )
 
     const std::pair<std::vector<vecN>,std::vector<vecN> > v = ReadProbeTarget( std::cin );
 
-    testProbes( Do_Random_Insertion, initialSearchRadius, v );
+    // VecD only when every point has the same dimension; vecN copes with the rest
+    const bool sameDim = testInputVector( v.first ) && testInputVector( v.second ) && v.first[0].dim == v.second[0].dim;
+    const int dim = sameDim ? v.second[0].dim : 0;
+    if ( ! DispatchDim( dim, [&]( auto n ) {
+            testProbes( Do_Random_Insertion, initialSearchRadius, ToVecD<decltype( n )::value, double>( v.first ), ToVecD<decltype( n )::value, double>( v.second ) ); } ) )
+    {
+        testProbes( Do_Random_Insertion, initialSearchRadius, v.first, v.second );
+    }
 
-    return 0;
+    // the neighbors of the brute-force and parallel-build checks that did not match
+    fprintf( stdout, "CSV-ERRORS,%d\n", g_errorCount );
+    return ( g_errorCount > 0 ) ? 1 : 0;
 }
 
 
@@ -314,6 +314,12 @@ std::pair<std::vector<vecN>,std::vector<vecN> > ReadProbeTarget( std::istream& s
     bool isProbe = false;
     bool isTarget = false;
 
+    std::vector<vecN> vPoints;
+    if ( ReadPointSetFile( str, vPoints, vProbe, vTarget ) )
+    {
+        return( std::make_pair( vProbe, vTarget ) );
+    }
+
     while ( ! str.fail() && ! str.eof( ) )
     {
         std::string line;
@@ -0,0 +1,265 @@
+//*
+//*  L2Kernels.h
+//*
+//*  Distances from one probe to a block of points, with SIMD kernels chosen
+//*  at run time.
+//*
+//*  The block is n points of dim doubles each, the first at points and each
+//*  following one stride doubles after the one before (stride == dim for
+//*  points that are packed together). The kernels measure several points at
+//*  once, one point to a SIMD lane: SSE2 does 2, AVX2 4 and AVX-512 8 (the
+//*  lanes are filled by plain loads, which are faster here than gathers). The
+//*  components of each point are summed in order, with no fused multiply-
+//*  add, so every kernel gives exactly the result of the scalar loop
+//*
+//*     for ( k=0; k<dim; ++k ) { d = p[k]-probe[k]; sum += d*d; }
+//*
+//*  and the tree's searches give the same answers whichever is chosen.
+//*
+//*  The best kernel that the processor and compiler support is chosen the
+//*  first time one is used. The environment variable L2_KERNEL (scalar, sse2,
+//*  avx2 or avx512) can ask for a lesser one, for comparisons.
+//*
+//*    void L2DistanceBlock        ( probe, points, n, dim, stride, out )
+//*    void L2SquaredDistanceBlock ( probe, points, n, dim, stride, out )
+//*       out[i] is the distance (squared distance) from probe to point i
+//*
+//*    L2KernelISA L2KernelSelected( void )
+//*    const char* L2KernelName( const L2KernelISA isa )
+//*       which kernel is in use, for reporting
+//*
+
+#if !defined(L2KERNELS_H_INCLUDED)
+#define L2KERNELS_H_INCLUDED
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define L2KERNELS_X86
+#define L2KERNELS_TARGET( isa ) __attribute__(( target( isa ) ))
+// AVX-512 brings FMA with it, and GCC would fuse the multiply and add
+#define L2KERNELS_NO_FMA __attribute__(( optimize( "fp-contract=off" ) ))
+#include <immintrin.h>
+#elif defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+#define L2KERNELS_X86
+#define L2KERNELS_TARGET( isa )
+#define L2KERNELS_NO_FMA
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+enum L2KernelISA { L2KernelScalar = 0, L2KernelSSE2 = 1, L2KernelAVX2 = 2, L2KernelAVX512 = 3 };
+
+typedef void ( *L2BlockKernel )( const double* probe, const double* points, const size_t n,
+                                 const int dim, const size_t stride, double* out );
+
+//=======================================================================
+// L2BlockScalar
+//
+// The reference kernel, and the tail of the others.
+//=======================================================================
+template <bool Root>
+inline void L2BlockScalar( const double* const probe, const double* p, const size_t n,
+                           const int dim, const size_t stride, double* const out )
+{
+    for ( size_t i=0; i<n; ++i, p+=stride )
+    {
+        double sum = 0.0;
+        for ( int k=0; k<dim; ++k )
+        {
+            const double d = p[k] - probe[k];
+            sum += d*d;
+        }
+        out[i] = Root ? sqrt( sum ) : sum;
+    }
+}
+
+#ifdef L2KERNELS_X86
+
+//=======================================================================
+// L2BlockSSE2
+//=======================================================================
+template <bool Root>
+L2KERNELS_TARGET( "sse2" )
+void L2BlockSSE2( const double* const probe, const double* p, const size_t n,
+                  const int dim, const size_t stride, double* const out )
+{
+    size_t i = 0;
+    for ( ; i+2<=n; i+=2, p+=2*stride )
+    {
+        __m128d sum = _mm_setzero_pd( );
+        for ( int k=0; k<dim; ++k )
+        {
+            const __m128d x = _mm_loadh_pd( _mm_load_sd( p+k ), p+stride+k );
+            const __m128d d = _mm_sub_pd( x, _mm_set1_pd( probe[k] ) );
+            sum = _mm_add_pd( sum, _mm_mul_pd( d, d ) );
+        }
+        _mm_storeu_pd( out+i, Root ? _mm_sqrt_pd( sum ) : sum );
+    }
+    L2BlockScalar<Root>( probe, p, n-i, dim, stride, out+i );
+}
+
+//=======================================================================
+// L2BlockAVX2
+//=======================================================================
+template <bool Root>
+L2KERNELS_TARGET( "avx2" )
+void L2BlockAVX2( const double* const probe, const double* p, const size_t n,
+                  const int dim, const size_t stride, double* const out )
+{
+    size_t i = 0;
+    for ( ; i+4<=n; i+=4, p+=4*stride )
+    {
+        __m256d sum = _mm256_setzero_pd( );
+        for ( int k=0; k<dim; ++k )
+        {
+            const __m256d x = _mm256_set_pd( p[3*stride+k], p[2*stride+k], p[stride+k], p[k] );
+            const __m256d d = _mm256_sub_pd( x, _mm256_set1_pd( probe[k] ) );
+            sum = _mm256_add_pd( sum, _mm256_mul_pd( d, d ) );
+        }
+        _mm256_storeu_pd( out+i, Root ? _mm256_sqrt_pd( sum ) : sum );
+    }
+    L2BlockScalar<Root>( probe, p, n-i, dim, stride, out+i );
+}
+
+//=======================================================================
+// L2BlockAVX512
+//=======================================================================
+#if defined( __GNUC__ ) && !defined( __clang__ )
+#pragma GCC diagnostic push
+// a false alarm from _mm512_undefined_pd inside the intrinsics
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+template <bool Root>
+L2KERNELS_TARGET( "avx512f" ) L2KERNELS_NO_FMA
+void L2BlockAVX512( const double* const probe, const double* p, const size_t n,
+                    const int dim, const size_t stride, double* const out )
+{
+    size_t i = 0;
+    for ( ; i+8<=n; i+=8, p+=8*stride )
+    {
+        __m512d sum = _mm512_setzero_pd( );
+        for ( int k=0; k<dim; ++k )
+        {
+            const __m512d x = _mm512_set_pd( p[7*stride+k], p[6*stride+k], p[5*stride+k], p[4*stride+k],
+                                             p[3*stride+k], p[2*stride+k], p[stride+k],   p[k] );
+            const __m512d d = _mm512_sub_pd( x, _mm512_set1_pd( probe[k] ) );
+            sum = _mm512_add_pd( sum, _mm512_mul_pd( d, d ) );
+        }
+        _mm512_storeu_pd( out+i, Root ? _mm512_sqrt_pd( sum ) : sum );
+    }
+    L2BlockScalar<Root>( probe, p, n-i, dim, stride, out+i );
+}
+#if defined( __GNUC__ ) && !defined( __clang__ )
+#pragma GCC diagnostic pop
+#endif
+
+#endif  // L2KERNELS_X86
+
+//=======================================================================
+// L2KernelSupported
+//
+// The best kernel the processor (and operating system) can run.
+//=======================================================================
+inline L2KernelISA L2KernelSupported( void )
+{
+#if defined( L2KERNELS_X86 ) && defined( __GNUC__ )
+    __builtin_cpu_init( );
+    if ( __builtin_cpu_supports( "avx512f" ) ) return( L2KernelAVX512 );
+    if ( __builtin_cpu_supports( "avx2" ) )    return( L2KernelAVX2 );
+    if ( __builtin_cpu_supports( "sse2" ) )    return( L2KernelSSE2 );
+    return( L2KernelScalar );
+#elif defined( L2KERNELS_X86 )
+    int regs[4];
+    __cpuid( regs, 1 );
+    const bool sse2    = ( regs[3] & ( 1 << 26 ) ) != 0;
+    const bool osxsave = ( regs[2] & ( 1 << 27 ) ) != 0;
+    const unsigned long long xcr0 = osxsave ? _xgetbv( 0 ) : 0;
+    __cpuidex( regs, 7, 0 );
+    if ( ( regs[1] & ( 1 << 16 ) ) && ( xcr0 & 0xe6 ) == 0xe6 ) return( L2KernelAVX512 );
+    if ( ( regs[1] & ( 1 << 5 ) )  && ( xcr0 & 0x06 ) == 0x06 ) return( L2KernelAVX2 );
+    return( sse2 ? L2KernelSSE2 : L2KernelScalar );
+#else
+    return( L2KernelScalar );
+#endif
+}
+
+//=======================================================================
+inline const char* L2KernelName( const L2KernelISA isa )
+{
+    static const char* const names[4] = { "scalar", "sse2", "avx2", "avx512" };
+    return( names[isa] );
+}
+
+//=======================================================================
+// L2Kernels
+//
+// The pair of kernels in use, chosen on first use.
+//=======================================================================
+struct L2Kernels
+{
+    L2KernelISA   isa;
+    L2BlockKernel distance;
+    L2BlockKernel squared;
+
+    static const L2Kernels& Selected( void )
+    {
+        static const L2Kernels kernels( Choose( ) );
+        return( kernels );
+    }
+
+private:
+    explicit L2Kernels( const L2KernelISA i )
+        : isa( i ), distance( &L2BlockScalar<true> ), squared( &L2BlockScalar<false> )
+    {
+#ifdef L2KERNELS_X86
+        switch ( isa )
+        {
+        case L2KernelAVX512: distance = &L2BlockAVX512<true>; squared = &L2BlockAVX512<false>; break;
+        case L2KernelAVX2:   distance = &L2BlockAVX2<true>;   squared = &L2BlockAVX2<false>;   break;
+        case L2KernelSSE2:   distance = &L2BlockSSE2<true>;   squared = &L2BlockSSE2<false>;   break;
+        default: break;
+        }
+#endif
+    }
+
+    // the best supported, or less if L2_KERNEL asks for less
+    static L2KernelISA Choose( void )
+    {
+        L2KernelISA isa = L2KernelSupported( );
+        const char* const env = getenv( "L2_KERNEL" );
+        if ( env != 0 )
+        {
+            for ( int i=L2KernelScalar; i<isa; ++i )
+            {
+                if ( strcmp( env, L2KernelName( (L2KernelISA)i ) ) == 0 ) isa = (L2KernelISA)i;
+            }
+        }
+        return( isa );
+    }
+};
+
+//=======================================================================
+inline L2KernelISA L2KernelSelected( void )
+{
+    return( L2Kernels::Selected( ).isa );
+}
+
+//=======================================================================
+inline void L2DistanceBlock( const double* const probe, const double* const points, const size_t n,
+                             const int dim, const size_t stride, double* const out )
+{
+    L2Kernels::Selected( ).distance( probe, points, n, dim, stride, out );
+}
+
+//=======================================================================
+inline void L2SquaredDistanceBlock( const double* const probe, const double* const points, const size_t n,
+                                    const int dim, const size_t stride, double* const out )
+{
+    L2Kernels::Selected( ).squared( probe, points, n, dim, stride, out );
+}
+
+#endif  // L2KERNELS_H_INCLUDED
@@ -18,7 +18,7 @@ void Dummy( int, char*[] )
 {
 }
 
-    CNearTree<vecN> nt;
+    CNearTree<PointMatrix::Row> nt;
 
 
 /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
@@ -26,7 +26,7 @@ int main(int argc, char* argv[])
 //---------------------------------------------------------------------
 {
     Dummy( argc, argv );
-    std::vector<vecN> v = ReadGeneralFile( std::cin );
+    const PointMatrix v = ReadPointMatrix( std::cin );
 
     const clock_t tc0 = std::clock();
     nt.insert( v );
@@ -45,33 +45,32 @@ int main(int argc, char* argv[])
         return( 1 );
     }
 
-    std::vector<vecN> knear( v[0].dim );
-    vecN far(nt[0]);
+    std::vector<PointMatrix::Row> knear;
+    PointMatrix::Row far(nt[0]);
     for ( size_t i=0; i<n; ++i )
     {
-        vecN probe( v[0].dim );
         knear.clear( );
-        // one of the knear is the probe and the other (larger Norm) is the nearest
-        probe = v[i];
+        // one of the knear is the probe and the other (larger distance) is the nearest
+        const PointMatrix::Row probe = v.row( i );
         nt.FindK_NearestNeighbors( 2, DBL_MAX, knear, probe );
-        const double small = MAX( (probe-knear[0]).Norm( ), (probe-knear[1]).Norm( ) );
+        const double small = MAX( probe.DistanceTo( knear[0] ), probe.DistanceTo( knear[1] ) );
         smallestNear = MIN( smallestNear, small );
         largestNear  = MAX( largestNear,  small );
         avgNearest += small;
 
         nt.FarthestNeighbor( far, probe );
-        largest = MAX( largest, (probe-far).Norm( ) );
+        largest = MAX( largest, probe.DistanceTo( far ) );
     }
 
     avgNearest /= double( n-1 );
 
     fprintf( stdout, " v.size %ld\n dimension %d\n smallestNear-near %g\n largest-near %g\n largest-far %g\n average nearest %g\n estimated-dimension %g\n", 
-       (long)nt.size( ), v[0].dim, smallestNear, largestNear, largest, avgNearest, hausdorff );
+       (long)nt.size( ), v.dim( ), smallestNear, largestNear, largest, avgNearest, hausdorff );
 
     bool bCopyInput = false;
     if ( bCopyInput )
     {
-        WriteVectorFile( v );
+        WritePointMatrix( v );
     }
 
 	return 0;
@@ -16,7 +16,7 @@
 int main(int argc, char* argv[])
 //---------------------------------------------------------------------
 {
-    std::vector<vecN> v = ReadGeneralFile( std::cin );
+    const PointMatrix v = ReadPointMatrix( std::cin );
     bool Do_Random_Insertion = true;
 
     if ( argc > 1 )
@@ -33,7 +33,7 @@ int main(int argc, char* argv[])
 
     }
 
-    CNearTree<vecN> nt( v );
+    CNearTree<PointMatrix::Row> nt( v );
 
     if ( Do_Random_Insertion )
     {
@@ -51,12 +51,12 @@ int main(int argc, char* argv[])
     const long depth = (long)nt.GetDepth( );
 
     fprintf( stdout, " v.size %ld\n  depth %ld\n dimension %d\n estimated-dimension %g\n",
-        (long)nt.size( ), depth, v[0].dim, hausdorff );
+        (long)nt.size( ), depth, v.dim( ), hausdorff );
 
     bool bCopyInput = false;
     if ( bCopyInput )
     {
-        WriteVectorFile( v );
+        WritePointMatrix( v );
     }
 
 	return 0;
@@ -69,6 +69,10 @@
 //    a copy constructor would be nice
 //    a constructor would be nice
 //    a destructor would be nice
+//
+// Norm and operator- are not needed if CNearTreeDistance<T,DistanceType> is
+// specialized for the type (see below); that is also the way to avoid
+// building a temporary difference object for every distance evaluation.
 
 // The provided interface is:
 //
@@ -92,6 +96,55 @@
 //    void insert( ContainerType ) // for containers, std::vector, ..., or CNearTree
 //       all inserts are delayed until a search is performed or until an explicit call to CompleteDelayedInsertions
 //
+//    bool erase( const size_t n )
+//    bool erase( const iterator& it )
+//       erases the object with index n (as at( n ) and the searches' tIndices number them), or the
+//       one at it. The object is only marked as erased, which takes constant time: it stays in
+//       its node to steer the searches past it, and the m_dMax bounds above it are left as they
+//       were, but no search, iterator or size( ) counts it again. When the erased objects
+//       make up more than the compaction threshold of all those held, or all of them, the tree
+//       is compacted. Returns false if n is out of range or already erased.
+//
+//    void Compact( void ) Drops the erased objects and rebuilds the tree from the rest, as
+//       CompleteDelayedInsert does, so that the m_dMax bounds are tight again; a frozen tree is
+//       frozen again. The objects keep their order, but are renumbered, so indices and
+//       iterators from before are no longer valid.
+//
+//    void SetCompactionThreshold( const double fraction ), double GetCompactionThreshold( void )
+//       Set and get the fraction of erased objects at which erase compacts the tree; 0.2 unless
+//       set. At 1 or more, only erasing every object compacts.
+//
+//    size_t GetErasedCount( void ) Returns the number of erased objects not yet compacted away.
+//
+//    bool Contains( const T& t ) const
+//    bool Contains( const T& t, const DistanceType tolerance ) const
+//       returns true if the tree holds an object that matches t, one no farther from it than
+//       tolerance, or than the match tolerance; a nearest neighbor search that starts at
+//       that radius, so it looks at only the objects close to t
+//
+//    void SetMatchTolerance( const DistanceType tolerance ), DistanceType GetMatchTolerance( void )
+//       Set and get the match tolerance of Contains and the set operations; 0 unless set, which
+//       matches only objects at no distance from each other
+//
+//    void SetApproximation( const DistanceType epsilon ), DistanceType GetApproximation( void )
+//       Set and get the epsilon of the approximate searches: NearestNeighbor, FindK_NearestNeighbors,
+//       their Left versions and their batches then prune each branch that cannot hold anything
+//       nearer than the current radius divided by (1+epsilon), so every object they return is at
+//       most (1+epsilon) times as far from the probe as the true neighbor it stands for, and
+//       they visit fewer nodes. 0, the default, keeps them exact. The Short searches, Contains and
+//       the sphere and annulus searches are always exact.
+//
+//    CNearTree& operator+=( const ContainerType& o )
+//    CNearTree& operator-=( const ContainerType& o )
+//    CNearTree& set_symmetric_difference( const ContainerType& o )
+//       for containers, std::vector, ..., or CNearTree. += inserts the objects of o that match
+//       nothing in the tree, nor an object of o already inserted; -= erases (see erase) every
+//       object that matches one of o; set_symmetric_difference does both, erasing the
+//       objects that match one of o and inserting those of o that match none. Each object
+//       of o costs one search, so the time grows with the size of o, not of the tree. The
+//       objects already in the tree are not compared with each other: += no longer removes
+//       the duplicates among them, as it did when it rebuilt the tree from a std::set.
+//
 //    bool NearestNeighbor ( const DistanceType dRadius,  T& tClosest,   const T& t ) const
 //       dRadius is the largest radius within which to search; make it
 //          very large if you want to include every point that was loaded; dRadius
@@ -131,6 +184,12 @@
 //       t is the probe point, used to search in the group of points insert'ed
 //       return value is the number of objects found within the search radius
 //
+//    long ForEachInSphere ( const DistanceType dRadius, const T& t, Visitor fn ) const
+//    long CountInSphere ( const DistanceType dRadius, const T& t ) const
+//       the same search as FindInSphere, but nothing is copied: ForEachInSphere calls
+//          fn( index, distance ) for each object found, and CountInSphere only counts them
+//       return value is the number of objects found within the search radius
+//
 //    long FindOutSphere ( const DistanceType dRadius,  ContainerType& tClosest, const T& t ) const
 //    long FindOutSphere ( const DistanceType dRadius,  ContainerType& tClosest, std::vector<size_t>& tIndices, const T& t ) const
 //       dRadius is the radius outside which to search; make it very small if you want to
@@ -156,6 +215,21 @@
 //       tClosest is returned ContainerType of the objects found within the sphere
 //       if tIndices is used, it is a vector to which to add the indices of the points found
 //       t is the probe point, used to search in the group of points insert'ed
+//       the objects are returned nearest first; only their indices are kept during the search,
+//       in a heap of the k nearest so far, so each object is copied once, at the end
+//
+//    size_t NearestNeighborBatch ( const std::vector<T>& probes, const DistanceType radius,
+//             std::vector<size_t>& indices, std::vector<DistanceType>& distances, const unsigned int threads = 0 )
+//    size_t FindK_NearestNeighborsBatch ( const size_t k, const DistanceType radius, const std::vector<T>& probes,
+//             std::vector<std::vector<size_t> >& indices, std::vector<std::vector<DistanceType> >& distances,
+//             const unsigned int threads = 0 )
+//    size_t FindInSphereBatch ( const DistanceType radius, const std::vector<T>& probes,
+//             std::vector<std::vector<size_t> >& indices, const unsigned int threads = 0 )
+//       NearestNeighbor, FindK_NearestNeighbors and FindInSphere for a whole vector of probes,
+//       run on threads threads (0 for one per hardware thread). The results are the indices
+//       (see at( )) of the objects found for each probe, and their distances; a probe with no
+//       nearest neighbor within radius gets the index ULONG_MAX. The return value is the
+//       number of probes with a nearest neighbor, or the total number of objects found.
 //
 //    long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tClosest,   const T& t )
 //    long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tClosest, std::vector<size_t>& tIndices,  const T& t )
@@ -164,6 +238,12 @@
 //       if tIndices is used, it is a vector to which to add the indices of the points found
 //       t is the probe point, used to search in the group of points insert'ed
 //
+//    All of the searches are const. Any number of threads may search one tree at the same time,
+//    as long as no thread changes it (insert, clear, Freeze, ...) meanwhile. If objects are still
+//    waiting for a delayed insert, the first search to run inserts them while the others wait.
+//    GetNodeVisits( ) and SetNodeVisits( ) read and set the count of node visits made by the
+//    calling thread, so the threads never share a counter.
+//
 //    The variants LeftNearestNeighbor, LeftFarthestNeighbor, LeftFindInSphere, LeftFindOutSphere,
 //    LeftFindInAnnulus, LeftFindK_NearestNeighbors, and LeftFindK_FarthestNeighbors are the
 //    older, search-left-first versions, retained for exiting applications that may require support
@@ -208,6 +288,27 @@
 //       is invoked at the beginning of all searches, so the average user will never need
 //       to call it.
 //
+//    void CompleteDelayedInsert( const InsertionOrder order, const unsigned long seed ) The same,
+//       with the objects inserted in the given order: NTO_SqrtPrefix (as above), NTO_Shuffle
+//       (all at random), NTO_Morton or NTO_Hilbert (spread along a space-filling curve, see
+//       CNearTreeCoordinates), or NTO_FarthestFirst (sqrt(n) objects each farthest from those
+//       before it, then the rest at random). The random choices come from seed alone, so the
+//       same objects, order and seed always build the same tree. Searches call the plain
+//       CompleteDelayedInsert, so call this one first to choose the order.
+//
+//    void CompleteDelayedInsertParallel( const unsigned int threads = 0 ) Builds the same tree as
+//       CompleteDelayedInsert, but once the random objects have fixed the top levels of the tree,
+//       the subtrees below them are built concurrently on up to threads threads (0 means one per
+//       hardware thread). If the depth watchdog (see SetDepthLimitFactor) finds the result
+//       too deep, the whole tree is then rebuilt in random order.
+//
+//    void BulkBuild( const unsigned int threads = 0 ) Builds the tree again, top down, from all of
+//       the objects, delayed or not, on up to threads threads. Each node gets an approximate
+//       farthest pair of the objects that reach it, and the others are split in place by which of
+//       the two they are nearer, as an insert would send them. The tree is shallower, with
+//       smaller m_dMax bounds, so searches visit fewer nodes, above all on clustered data; the
+//       build takes about 2n distances a level. Later inserts go into it as usual.
+//
 //    size_t GetDeferredSize( void ) Returns the number of delayed objects that have not
 //       yet been insert'ed. This is mainly for information about details of the tree.
 //
@@ -219,6 +320,77 @@
 //    size_t GetDepth( void ) Returns the maximum tree layers from the root.  This is
 //       mainly for information about details of the tree.
 //
+//    void SetDepthLimitFactor( const double c ), double GetDepthLimitFactor( void ) Set and get
+//       the depth watchdog. When an insert lands deeper than c*log2(n) levels, n being the
+//       number of objects, the smallest subtree on its way down that is too deep for the
+//       objects it holds is rebuilt in random order, so sorted data can be inserted one by
+//       one without the tree turning into a list. c is 4 unless set; 0 turns the watchdog off.
+//       Where no rebuild can help, as with many coincident objects, the watchdog rests until
+//       the number of objects has doubled.
+//
+//    size_t GetRebuildCount( void ) Returns the number of subtrees the watchdog has rebuilt.
+//
+//    size_t GetNodeCount( void ) Returns the number of nodes in the tree.
+//
+//    double GetDimEstimate( const double DimEstimateEsd = 0.1, const unsigned int threads = 0 ) Returns
+//       an estimate of the dimension of the points, from the growth of the number of points in
+//       spheres around randomly chosen ones, or 0 if there is none. The trials run on up to
+//       threads threads, and the estimate is kept until the tree changes. It is what the
+//       Short searches use to prune.
+//
+//    size_t GetDimEstimateVisits( void ), size_t GetDimEstimateTrials( void ) Return the node
+//       visits and the number of sphere counts that the last dimension estimate took. Those
+//       visits are not included in GetNodeVisits.
+//
+//    size_t GetNodeBytes( void ) Returns the number of bytes held for the nodes of the tree.
+//       The nodes are taken from blocks owned by the tree, which are all released
+//       together by clear( ) or by the destructor.
+//
+//    bool Freeze( void ) Builds a read-only copy of the tree as one contiguous array, in the
+//       order the searches walk it, with 32-bit links. NearestNeighbor, FindInSphere,
+//       FindInAnnulus and FindK_NearestNeighbors then search the frozen copy. Any insert
+//       thaws the tree again. Returns false (and leaves the tree thawed) if the tree is
+//       too large for 32-bit links.
+//
+//    bool Freeze( const size_t bucketSize ) The same, except that every subtree holding at most
+//       bucketSize objects (up to MaxLeafBucket) becomes a leaf bucket: a contiguous copy of
+//       its objects that the searches measure all at once (see CNearTreeBlockDistance) instead
+//       of walking its nodes. The tree is then shallower, and the last levels of a search are
+//       one linear scan. A bucket counts one node visit per object in it.
+//
+//    size_t GetLeafBucketSize( void ) Returns the bucketSize of the last Freeze, or 0 if the
+//       tree is not frozen or has no buckets.
+//
+//    void Thaw( void ) Discards the frozen copy; searches go back to the linked nodes.
+//
+//    SetFlags( NTF_SquaredDistances, NTF_SquaredDistances ) For types with a block kernel (see
+//       CNearTreeBlockDistance), the leaf buckets, BelongsToPoints and SeparateByRadius then
+//       compare squared distances, and take a square root only for an object that is kept
+//       or that is too close to the limit to tell. The results are exactly the same.
+//
+//    bool IsFrozen( void ) Returns true if the searches are using the frozen copy.
+//
+//    bool Save( const std::string& path ) Writes the tree to the file path as one flat block:
+//       the objects, the nodes with 32-bit links (and the leaf buckets, if the tree is frozen
+//       with them), the depth, and the diameter, spacing and dimension estimates. Nothing in
+//       it depends on where it is loaded. T must be a plain value that holds all of its data
+//       and can be copied byte by byte (double, int, VecD, ...; see CNearTreeSnapshot),
+//       not one that holds pointers (vecN or PointMatrix::Row). Returns false if T is not
+//       such a type, if the tree is too large for 32-bit links, if it holds erased objects
+//       (see Compact), or if the file cannot be written.
+//
+//    bool Open( const std::string& path ) Replaces the contents of the tree with those of a
+//       file written by Save, which is mapped into memory read-only rather than read. The tree
+//       is then frozen, and NearestNeighbor, FindInSphere, FindInAnnulus, FindK_NearestNeighbors
+//       and ForEachInSphere search the mapped file itself, so opening reads only the nodes, to
+//       check them, and none of the objects. The other searches need the linked nodes, which
+//       the first of them builds from the file; any insert, Thaw or Freeze copies the file into
+//       the tree and releases it. Returns false, leaving the tree as it was, if the file cannot
+//       be mapped, was not written by Save for the same T and DistanceType on a machine of the
+//       same byte order, or has a node, branch or bucket that points outside the tree.
+//
+//    bool IsOpened( void ) Returns true if the tree is searching a file opened by Open.
+//
 //    bool empty( void )  returns true if the tree is empty, otherwise false
 //
 // =====================================================================================================
@@ -228,7 +400,8 @@
 //     return a CNearTree. However, they can be used with any CNearTree.
 //     They should function in a fashion essentially the same as STL iterators. There is no assurance
 //     that data will be returned in the order it was loaded, just that it is accessible. The same set is
-//     provided for const_iterator.
+//     provided for const_iterator. ++ and -- step over erased objects (see erase); +, -, += and -=
+//     move by index, as at( ) counts.
 // =====================================================================================================
 //      iterator( void ) { }; // constructor
 //
@@ -287,8 +460,30 @@
 #endif
 
 #include <vector>
-#include <set>
 #include <iterator>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <type_traits>
+#include <limits>
+#include <random>
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+#if defined( _WIN32 )
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #ifdef CNEARTREE_SAFE_TRIANG
 #define TRIANG(a,b,c) (  (((b)+(c))-(a) >= 0) \
@@ -300,6 +495,103 @@
 #define CNEARTREE_INSTRUMENTED
 
 
+//=======================================================================
+// CNearTreeDistance is the traits hook behind CNearTree::DistanceBetween
+// for user types. The default computes ( t1-t2 ).Norm( ). A type whose
+// operator- is expensive (for example, one that allocates storage for the
+// difference) can specialize this template to compute the distance
+// directly from its own data, e.g.
+//
+//    template <typename DistanceType>
+//    struct CNearTreeDistance<MyType, DistanceType>
+//    {
+//        static inline DistanceType Between( const MyType& t1, const MyType& t2 )
+//        { ... }
+//    };
+//
+// The specialization must be visible before the CNearTree<MyType> is used.
+//=======================================================================
+template <typename TT, typename DistanceType>
+struct CNearTreeDistance
+{
+    static inline DistanceType Between( const TT& t1, const TT& t2 )
+    {
+        DistanceType d = ( t1-t2 ).Norm( );
+        return( d>0?d:-d );  // apparent compiler error makes this necessary
+    }
+};
+
+//=======================================================================
+// CNearTreeBlockDistance is the traits hook behind CNearTree::
+// BlockDistanceBetween, which measures a probe against several stored
+// objects at once. By default there is none, and the objects are measured
+// one at a time by DistanceBetween. A type that keeps its coordinates as
+// packed doubles can specialize it to use the SIMD kernels of L2Kernels.h,
+// e.g.
+//
+//    template <>
+//    struct CNearTreeBlockDistance<MyType, double>
+//    {
+//        enum { Available = 1 };
+//        static inline void Between( const MyType& probe, const MyType* const objects,
+//                                    const size_t n, double* const out )
+//        { L2DistanceBlock( probe.data( ), objects[0].data( ), n, dim, stride, out ); }
+//        static inline void BetweenSquared( ...the same... )
+//        { L2SquaredDistanceBlock( probe.data( ), objects[0].data( ), n, dim, stride, out ); }
+//    };
+//
+// out[i] must be exactly what DistanceBetween gives for objects[i], so
+// that the results do not depend on which is used, and BetweenSquared must
+// give the number whose square root that is.
+//=======================================================================
+template <typename TT, typename DistanceType>
+struct CNearTreeBlockDistance
+{
+    enum { Available = 0 };
+};
+
+//=======================================================================
+// CNearTreeCoordinates is the traits hook behind the space-filling-curve
+// insertion orders (see CNearTree::CompleteDelayedInsert), which sort the
+// objects by their coordinates. By default there are none, and the curve
+// is laid instead through the objects' distances from a few far-apart
+// ones. A type with coordinates can specialize it, e.g.
+//
+//    template <>
+//    struct CNearTreeCoordinates<MyType>
+//    {
+//        enum { Available = 1 };
+//        static inline int    Dim       ( const MyType& t ) { return( t.dim ); }
+//        static inline double Coordinate( const MyType& t, const int k ) { return( t[k] ); }
+//    };
+//=======================================================================
+template <typename TT>
+struct CNearTreeCoordinates
+{
+    enum { Available = 0 };
+};
+
+//=======================================================================
+// CNearTreeSnapshot is the traits hook behind CNearTree::Save and Open,
+// which write the objects byte by byte and map them back. That is right
+// only for a type that holds all of its data itself: a pointer, or a view
+// such as PointMatrix::Row, would come back pointing into the memory of
+// the process that wrote it. By default only the arithmetic types do. A
+// trivially copyable type with no pointers in it can say so, e.g.
+//
+//    template <>
+//    struct CNearTreeSnapshot<MyType>
+//    {
+//        enum { Available = 1 };
+//    };
+//=======================================================================
+template <typename TT>
+struct CNearTreeSnapshot
+{
+    enum { Available = std::is_arithmetic<TT>::value ? 1 : 0 };
+};
+
+
 //=======================================================================
 // CNearTree is the root class for the neartree. The actual data of the
 // tree is stored in NearTreeNode objects descending from a CNearTree.
@@ -359,12 +651,12 @@ public:
 // DistanceBetween
 // template function for calculating the "distance" between two objects.
 // The specific functions for the built-in types must be here also. For
-// the common types (int, float, ...) they are provided.
+// the common types (int, float, ...) they are provided. Other types go
+// through CNearTreeDistance (above), which they may specialize.
 template <typename TT>
 static inline DistanceType DistanceBetween( const TT& t1, const TT& t2 )
 {
-DistanceType d = ( t1-t2 ).Norm( );
-return( d>0?d:-d );  // apparent compiler error makes this necessary
+return( CNearTreeDistance<TT, DistanceType>::Between( t1, t2 ) );
 }
 
 static inline DistanceType DistanceBetween( const double t1, const double t2 )
@@ -402,6 +694,55 @@ static inline DistanceType DistanceBetween( const short t1, const short t2 )
     return( (DistanceType)abs(t1-t2) ); // encourage the compiler to get the correct abs
 }
 
+// BlockDistanceBetween
+// out[i] = DistanceBetween( objects[i], probe ) for i from 0 to n-1, all at
+// once if CNearTreeBlockDistance (above) is specialized for T
+static inline void BlockDistanceBetween( const T& probe, const T* const objects, const size_t n, DistanceType* const out )
+{
+    BlockDistanceBetween( probe, objects, n, out,
+        std::integral_constant<bool, CNearTreeBlockDistance<T, DistanceType>::Available != 0>( ) );
+}
+
+static inline void BlockDistanceBetween( const T& probe, const T* const objects, const size_t n, DistanceType* const out,
+                                         std::true_type )
+{
+    CNearTreeBlockDistance<T, DistanceType>::Between( probe, objects, n, out );
+}
+
+static inline void BlockDistanceBetween( const T& probe, const T* const objects, const size_t n, DistanceType* const out,
+                                         std::false_type )
+{
+    for ( size_t i=0; i<n; ++i )
+    {
+        out[i] = DistanceBetween( objects[i], probe );
+    }
+}
+
+// BlockSquaredDistanceBetween
+// the squares of what BlockDistanceBetween gives, without the square roots
+// if CNearTreeBlockDistance is specialized for T
+static inline void BlockSquaredDistanceBetween( const T& probe, const T* const objects, const size_t n, DistanceType* const out )
+{
+    BlockSquaredDistanceBetween( probe, objects, n, out,
+        std::integral_constant<bool, CNearTreeBlockDistance<T, DistanceType>::Available != 0>( ) );
+}
+
+static inline void BlockSquaredDistanceBetween( const T& probe, const T* const objects, const size_t n, DistanceType* const out,
+                                                std::true_type )
+{
+    CNearTreeBlockDistance<T, DistanceType>::BetweenSquared( probe, objects, n, out );
+}
+
+static inline void BlockSquaredDistanceBetween( const T& probe, const T* const objects, const size_t n, DistanceType* const out,
+                                                std::false_type )
+{
+    BlockDistanceBetween( probe, objects, n, out, std::false_type( ) );
+    for ( size_t i=0; i<n; ++i )
+    {
+        out[i] *= out[i];
+    }
+}
+
 
 private:
 
@@ -410,6 +751,17 @@ RHrand rhr;
 // forward declaration of nested class NearTreeNode
 template <typename TNode, typename DistanceTypeNode, int distMinValueNode >
 class NearTreeNode;
+// forward declaration of nested class NodeArena, the storage for the nodes
+class NodeArena;
+// forward declaration of nested struct FrozenNode, one node of the frozen layout
+struct FrozenNode;
+// forward declaration of nested class SearchScratch, a reusable work vector for one search
+template <typename Elem> class SearchScratch;
+// forward declaration of nested class Snapshot, a tree file mapped into memory
+class Snapshot;
+// the k nearest objects found so far by a K-nearest search: a max-heap of their
+// distances from the probe and their indices in m_ObjectStore, farthest on top
+typedef std::vector<std::pair<DistanceType, size_t> > K_Heap;
 public:
 // Forward declaration for the nested classes, iterator and const_iterator. Friend is necessary
 // for the access to the appropriate data elements
@@ -420,23 +772,51 @@ friend class const_iterator;
 
 static const long        NTF_NoPrePrune        = 1; //flag to supress all search prepruning
 static const long        NTF_ForcePrePrune     = 2; //flag to force search prepruning
+static const long        NTF_SquaredDistances  = 4; //flag to compare squared distances in block scans
+
+// the orders in which CompleteDelayedInsert( order, seed ) can insert the delayed objects
+enum InsertionOrder
+{
+    NTO_SqrtPrefix    = 0,  // sqrt(n) random objects first, then the rest as queued
+    NTO_Shuffle       = 1,  // all of the objects in random order
+    NTO_Morton        = 2,  // spread along a Morton (Z-order) curve
+    NTO_Hilbert       = 3,  // spread along a Hilbert curve
+    NTO_FarthestFirst = 4   // sqrt(n) objects each farthest from those before, then the rest at random
+};
 
 private: // start of real definition of CNearTree
 std::vector<long> m_DelayedIndices;    // objects queued for insertion, possibly in random order
 std::vector<T>    m_ObjectStore;       // all inserted objects go here
 size_t            m_DeepestDepth;      // maximum diameter of the tree
+double            m_DepthLimitFactor;  // the depth watchdog's c in c*log2(n), 0 for none
+size_t            m_RebuildCount;      // number of subtrees the depth watchdog has rebuilt
+size_t            m_WatchdogResume;    // the depth watchdog rests until the store holds this many objects
+std::vector<char> m_Erased;            // nonzero for each erased object, empty while none is, see erase
+size_t            m_ErasedCount;       // number of erased objects still in m_ObjectStore
+double            m_CompactionThreshold; // the erased fraction of m_ObjectStore that makes erase compact
+DistanceType      m_MatchTolerance;    // how close objects must be to match in Contains and the set operations
+DistanceType      m_Approximation;     // epsilon of the approximate nearest neighbor searches, 0 for exact ones
 
 
 NearTreeNode<T, DistanceType, distMinValue>      m_BaseNode; // the tree's data is stored down from here
+NodeArena         m_NodeArena;         // storage for all of the nodes below m_BaseNode
+std::vector<FrozenNode> m_FrozenNodes; // read-only copy of the nodes in search order, see Freeze
+std::vector<T>    m_BucketObjects;     // copies of the objects in the frozen leaf buckets, see Freeze
+std::vector<unsigned int> m_BucketIndices; // where each of m_BucketObjects is in m_ObjectStore
+size_t            m_LeafBucketSize;    // the largest leaf bucket allowed by Freeze, 0 for none
+std::shared_ptr<const Snapshot> m_Snapshot; // the file the tree was opened from, see Open
 long              m_Flags;             // flags for operational control (mainly for testing)
 DistanceType      m_DiamEstimate;      // estimated diameter
 DistanceType      m_SumSpacings;       // sum of spacings at time of insertion
 DistanceType      m_SumSpacingsSq;     // sum of squares of spacings at time of insertion
 double            m_DimEstimate;       // estimated dimension
 double            m_DimEstimateEsd;    // estimated dimension estimated standard deviation
-#ifdef CNEARTREE_INSTRUMENTED
-size_t            m_NodeVisits;        // number of node visits
-#endif
+size_t            m_DimEstimateVisits; // node visits spent on the last dimension estimate
+size_t            m_DimEstimateTrials; // sample spheres counted for the last dimension estimate
+std::atomic<bool> m_DelayedPending;    // true while m_DelayedIndices holds anything
+mutable std::atomic<bool> m_DimEstimateReady; // true once the short searches have a dimension estimate
+std::atomic<bool> m_LinkPending;       // true while an opened tree has no linked nodes, see LinkSnapshot
+mutable std::mutex m_SearchMutex;      // taken by a search that has to bring the tree up to date
 
 public:
 
@@ -454,16 +834,33 @@ CNearTree ( void )  // constructor
 : m_DelayedIndices (   )
 , m_ObjectStore    (   )
 , m_DeepestDepth   ( 0 )
+, m_DepthLimitFactor ( 4.0 )
+, m_RebuildCount   ( 0 )
+, m_WatchdogResume ( 0 )
+, m_Erased         (   )
+, m_ErasedCount    ( 0 )
+, m_CompactionThreshold ( 0.2 )
+, m_MatchTolerance ( DistanceType( 0 ) )
+, m_Approximation  ( DistanceType( 0 ) )
 , m_BaseNode       (   )
+, m_NodeArena      (   )
+, m_FrozenNodes    (   )
+, m_BucketObjects  (   )
+, m_BucketIndices  (   )
+, m_LeafBucketSize ( 0 )
+, m_Snapshot       (   )
 , m_Flags ( 0 )
 , m_DiamEstimate  ( DistanceType( 0 ) )
 , m_SumSpacings   ( DistanceType( 0 ) )
 , m_SumSpacingsSq ( DistanceType( 0 ) )
 , m_DimEstimate   ( 0 )
 , m_DimEstimateEsd( 0 )
-#ifdef CNEARTREE_INSTRUMENTED
-, m_NodeVisits( 0 )
-#endif
+, m_DimEstimateVisits( 0 )
+, m_DimEstimateTrials( 0 )
+, m_DelayedPending( false )
+, m_DimEstimateReady( false )
+, m_LinkPending   ( false )
+, m_SearchMutex    (   )
 {
     
 }  //  CNearTree constructor
@@ -480,16 +877,33 @@ CNearTree ( const InputContainer& o )  // constructor
 : m_DelayedIndices (   )
 , m_ObjectStore    (   )
 , m_DeepestDepth   ( 0 )
+, m_DepthLimitFactor ( 4.0 )
+, m_RebuildCount   ( 0 )
+, m_WatchdogResume ( 0 )
+, m_Erased         (   )
+, m_ErasedCount    ( 0 )
+, m_CompactionThreshold ( 0.2 )
+, m_MatchTolerance ( DistanceType( 0 ) )
+, m_Approximation  ( DistanceType( 0 ) )
 , m_BaseNode       (   )
+, m_NodeArena      (   )
+, m_FrozenNodes    (   )
+, m_BucketObjects  (   )
+, m_BucketIndices  (   )
+, m_LeafBucketSize ( 0 )
+, m_Snapshot       (   )
 , m_Flags ( 0 )
 , m_DiamEstimate  ( DistanceType( 0 ) )
 , m_SumSpacings   ( DistanceType( 0 ) )
 , m_SumSpacingsSq ( DistanceType( 0 ) )
 , m_DimEstimate   ( 0 )
 , m_DimEstimateEsd( 0 )
-#ifdef CNEARTREE_INSTRUMENTED
-, m_NodeVisits( 0 )
-#endif
+, m_DimEstimateVisits( 0 )
+, m_DimEstimateTrials( 0 )
+, m_DelayedPending( false )
+, m_DimEstimateReady( false )
+, m_LinkPending   ( false )
+, m_SearchMutex    (   )
 {
     typename InputContainer::const_iterator it;
     for( it=o.begin(); it!=o.end(); ++it )
@@ -511,16 +925,33 @@ CNearTree ( const InputContainer1& o1, const InputContainer2& o2 ) // constructo
 : m_DelayedIndices (   )
 , m_ObjectStore    (   )
 , m_DeepestDepth   ( 0 )
+, m_DepthLimitFactor ( 4.0 )
+, m_RebuildCount   ( 0 )
+, m_WatchdogResume ( 0 )
+, m_Erased         (   )
+, m_ErasedCount    ( 0 )
+, m_CompactionThreshold ( 0.2 )
+, m_MatchTolerance ( DistanceType( 0 ) )
+, m_Approximation  ( DistanceType( 0 ) )
 , m_BaseNode       (   )
+, m_NodeArena      (   )
+, m_FrozenNodes    (   )
+, m_BucketObjects  (   )
+, m_BucketIndices  (   )
+, m_LeafBucketSize ( 0 )
+, m_Snapshot       (   )
 , m_Flags ( 0 )
 , m_DiamEstimate  ( DistanceType( 0 ) )
 , m_SumSpacings   ( DistanceType( 0 ) )
 , m_SumSpacingsSq ( DistanceType( 0 ) )
 , m_DimEstimate   ( 0 )
 , m_DimEstimateEsd( 0 )
-#ifdef CNEARTREE_INSTRUMENTED
-, m_NodeVisits( 0 )
-#endif
+, m_DimEstimateVisits( 0 )
+, m_DimEstimateTrials( 0 )
+, m_DelayedPending( false )
+, m_DimEstimateReady( false )
+, m_LinkPending   ( false )
+, m_SearchMutex    (   )
 {
     typename InputContainer1::const_iterator it1;
     for( it1=o1.begin(); it1!=o1.end(); ++it1 )
@@ -547,6 +978,94 @@ CNearTree ( const InputContainer1& o1, const InputContainer2& o2 ) // constructo
     clear ( );
 }  //  ~CNearTree
 
+//=======================================================================
+//  CNearTree ( const CNearTree& o )
+//
+//  Copy constructor for class CNearTree. The nodes are duplicated into
+//  the new tree's own NodeArena, so the copy has exactly the same
+//  structure as the original and shares no storage with it.
+//
+//=======================================================================
+CNearTree ( const CNearTree& o )  // copy constructor
+: rhr              ( o.rhr )
+, m_DelayedIndices ( o.m_DelayedIndices )
+, m_ObjectStore    ( o.m_ObjectStore )
+, m_DeepestDepth   ( o.m_DeepestDepth )
+, m_DepthLimitFactor ( o.m_DepthLimitFactor )
+, m_RebuildCount   ( o.m_RebuildCount )
+, m_WatchdogResume ( o.m_WatchdogResume )
+, m_Erased         ( o.m_Erased )
+, m_ErasedCount    ( o.m_ErasedCount )
+, m_CompactionThreshold ( o.m_CompactionThreshold )
+, m_MatchTolerance ( o.m_MatchTolerance )
+, m_Approximation  ( o.m_Approximation )
+, m_BaseNode       (   )
+, m_NodeArena      (   )
+, m_FrozenNodes    ( o.m_FrozenNodes )
+, m_BucketObjects  ( o.m_BucketObjects )
+, m_BucketIndices  ( o.m_BucketIndices )
+, m_LeafBucketSize ( o.m_LeafBucketSize )
+, m_Snapshot       ( o.m_Snapshot )
+, m_Flags ( o.m_Flags )
+, m_DiamEstimate  ( o.m_DiamEstimate )
+, m_SumSpacings   ( o.m_SumSpacings )
+, m_SumSpacingsSq ( o.m_SumSpacingsSq )
+, m_DimEstimate   ( o.m_DimEstimate )
+, m_DimEstimateEsd( o.m_DimEstimateEsd )
+, m_DimEstimateVisits( o.m_DimEstimateVisits )
+, m_DimEstimateTrials( o.m_DimEstimateTrials )
+, m_DelayedPending( o.m_DelayedPending.load( ) )
+, m_DimEstimateReady( o.m_DimEstimateReady.load( ) )
+, m_LinkPending   ( o.m_LinkPending.load( ) )
+, m_SearchMutex    (   )
+{
+    m_BaseNode.CopyFrom( o.m_BaseNode, m_NodeArena );
+}  //  CNearTree copy constructor
+
+//=======================================================================
+//  CNearTree& operator= ( const CNearTree& o )
+//
+//  Assignment for class CNearTree, see the copy constructor
+//
+//=======================================================================
+CNearTree& operator= ( const CNearTree& o )
+{
+    if ( this != &o )
+    {
+        clear( );
+        rhr              = o.rhr;
+        m_DelayedIndices = o.m_DelayedIndices;
+        m_ObjectStore    = o.m_ObjectStore;
+        m_DeepestDepth   = o.m_DeepestDepth;
+        m_DepthLimitFactor = o.m_DepthLimitFactor;
+        m_RebuildCount   = o.m_RebuildCount;
+        m_WatchdogResume = o.m_WatchdogResume;
+        m_Erased         = o.m_Erased;
+        m_ErasedCount    = o.m_ErasedCount;
+        m_CompactionThreshold = o.m_CompactionThreshold;
+        m_MatchTolerance = o.m_MatchTolerance;
+        m_Approximation  = o.m_Approximation;
+        m_FrozenNodes    = o.m_FrozenNodes;
+        m_BucketObjects  = o.m_BucketObjects;
+        m_BucketIndices  = o.m_BucketIndices;
+        m_LeafBucketSize = o.m_LeafBucketSize;
+        m_Snapshot       = o.m_Snapshot;
+        m_Flags          = o.m_Flags;
+        m_DiamEstimate   = o.m_DiamEstimate;
+        m_SumSpacings    = o.m_SumSpacings;
+        m_SumSpacingsSq  = o.m_SumSpacingsSq;
+        m_DimEstimate    = o.m_DimEstimate;
+        m_DimEstimateEsd = o.m_DimEstimateEsd;
+        m_DimEstimateVisits = o.m_DimEstimateVisits;
+        m_DimEstimateTrials = o.m_DimEstimateTrials;
+        m_DelayedPending = o.m_DelayedPending.load( );
+        m_DimEstimateReady = o.m_DimEstimateReady.load( );
+        m_LinkPending    = o.m_LinkPending.load( );
+        m_BaseNode.CopyFrom( o.m_BaseNode, m_NodeArena );
+    }
+    return( *this );
+}  //  operator=
+
 
 
 //=======================================================================
@@ -574,37 +1093,104 @@ void SetFlags( const long flags, const long mask )
     m_Flags = (flags&mask)|(m_Flags&(~mask));
 }
 
+//=======================================================================
+// Name: Get and Set DepthLimitFactor
+// Description: get and set c of the depth watchdog, which rebuilds part
+// of the tree when an insert lands deeper than c*log2(n); 0 turns it off
+//
+//=======================================================================
+double GetDepthLimitFactor( void ) const
+{
+    return m_DepthLimitFactor;
+}
+
+void SetDepthLimitFactor( const double factor )
+{
+    m_DepthLimitFactor = factor;
+}
+
+//=======================================================================
+// Name: Get and Set MatchTolerance
+// Description: get and set how far apart two objects can be and still
+// match, for Contains and the set operations; 0 matches only objects at
+// no distance from each other
+//
+//=======================================================================
+DistanceType GetMatchTolerance( void ) const
+{
+    return m_MatchTolerance;
+}
+
+void SetMatchTolerance( const DistanceType tolerance )
+{
+    m_MatchTolerance = tolerance;
+}
+
+//=======================================================================
+// Name: Get and Set Approximation
+// Description: get and set the epsilon of the approximate nearest
+// neighbor searches, NearestNeighbor, FindK_NearestNeighbors, their
+// Left versions and their batches: each object they return is at most
+// (1+epsilon) times as far from the probe as the true one. 0 (the
+// default) keeps them exact; a negative epsilon is taken as 0
+//
+//=======================================================================
+DistanceType GetApproximation( void ) const
+{
+    return m_Approximation;
+}
+
+void SetApproximation( const DistanceType epsilon )
+{
+    m_Approximation = epsilon > DistanceType( 0 ) ? epsilon : DistanceType( 0 );
+}
+
+//=======================================================================
+// Name: Get and Set CompactionThreshold
+// Description: get and set the fraction of the stored objects that
+// erase lets be erased before it compacts the tree
+//
+//=======================================================================
+double GetCompactionThreshold( void ) const
+{
+    return m_CompactionThreshold;
+}
+
+void SetCompactionThreshold( const double fraction )
+{
+    m_CompactionThreshold = fraction;
+}
+
 
 //=======================================================================
 // Name: operator+=()
-// Description: add a container's contents to a NearTree
+// Description: add a container's contents to a NearTree, except for the
+//              objects that match (see Contains) one already in it or one
+//              inserted before them from the container. The objects already
+//              in the tree stay as they are, duplicates and all
 //
 //=======================================================================
 template<typename InputContainer>
 CNearTree& operator+= ( const InputContainer& o )
 {
 
-    if ( this->empty( ) )
-    {  // if "this" is empty, all that will remain is "o"
-        this->insert( o );
-    }
-    else if ( o.empty( ) )
+    if ( o.empty( ) )
     { // do nothing if there is nothing to be added to "this"
     }
     else
     {
-        std::set<T> s1, s2, s3;
-        s1.insert( this->begin( ), this->end( ) );
-
-        s2.insert( o.begin(), o.end( ) );
-
-        this->clear( );
-        std::set_union(
-            s1.begin( ), s1.end( ),
-            s2.begin( ), s2.end( ),
-            std::inserter( s3, s3.end( ) ) );
-
-        this->insert( s3 );
+        // only the objects that match nothing in the tree, nor one already taken from o,
+        // even when the tree is empty
+        CNearTree added;
+        typename InputContainer::const_iterator it;
+        for ( it=o.begin( ); it!=o.end( ); ++it )
+        {
+            if ( ! this->Contains( *it ) && ! added.Contains( *it, m_MatchTolerance ) )
+            {
+                added.ImmediateInsert( *it );
+            }
+        }
+        this->insert( added );
     }
 
     this->CompleteDelayedInsert( );
@@ -613,7 +1199,8 @@ CNearTree& operator+= ( const InputContainer& o )
 
 //=======================================================================
 // Name: operator-=()
-// Description: removes a container's contents from a NearTree
+// Description: removes a container's contents from a NearTree: erases
+//              every object that matches (see Contains) one in the container
 //
 //=======================================================================
 template<typename InputContainer>
@@ -628,18 +1215,14 @@ CNearTree& operator-= ( const InputContainer& o )
     }
     else
     {
-        std::set<T> s1, s2, s3;
-        s1.insert( this->begin( ), this->end( ) );
-
-        s2.insert( o.begin(), o.end( ) );
-
-        this->clear( );
-        std::set_difference(
-            s1.begin( ), s1.end( ),
-            s2.begin( ), s2.end( ),
-            std::inserter( s3, s3.end( ) ) );
-
-        this->insert( s3 );
+        // every object that matches one of o, all found before any is erased
+        std::vector<size_t> matches;
+        typename InputContainer::const_iterator it;
+        for ( it=o.begin( ); it!=o.end( ); ++it )
+        {
+            AppendMatches( *it, matches );
+        }
+        EraseAll( matches );
     }
 
     this->CompleteDelayedInsert( );
@@ -651,7 +1234,7 @@ CNearTree& operator-= ( const InputContainer& o )
 // Description: removes the portion container's contents from a NearTree
 //              that is already in the NearTree and add in the portion
 //              of the container's contents that is not already in the
-//              NearTree
+//              NearTree, matching objects as Contains does
 //   (= Sheffer stroke operation and NAND = exclusive or)
 //
 //=======================================================================
@@ -662,24 +1245,25 @@ CNearTree& set_symmetric_difference ( const InputContainer& o )
     if ( o.empty( ) )
     { // do nothing if "this" is already complete
     }
-    else if ( this->empty( ) )
-    { // all that will remain is the content of "o"
-        this->insert( o );
-    }
     else
     {
-        std::set<T> s1, s2, s3;
-        s1.insert( this->begin( ), this->end( ) );
-
-        s2.insert( o.begin(), o.end( ) );
-
-        this->clear( );
-        std::set_symmetric_difference(
-            s1.begin( ), s1.end( ),
-            s2.begin( ), s2.end( ),
-            std::inserter( s3, s3.end( ) ) );
-
-        this->insert( s3 );
+        // the objects of the tree that match one of o go, and the objects of o
+        // that match nothing in the tree, nor one already taken from o, come in,
+        // even when the tree is empty
+        std::vector<size_t> matches;
+        CNearTree added;
+        typename InputContainer::const_iterator it;
+        for ( it=o.begin( ); it!=o.end( ); ++it )
+        {
+            const size_t nMatched = matches.size( );
+            AppendMatches( *it, matches );
+            if ( matches.size( ) == nMatched && ! added.Contains( *it, m_MatchTolerance ) )
+            {
+                added.ImmediateInsert( *it );
+            }
+        }
+        EraseAll( matches );
+        this->insert( added );
     }
 
     this->CompleteDelayedInsert( );
@@ -695,17 +1279,92 @@ CNearTree& set_symmetric_difference ( const InputContainer& o )
 void clear ( void )
 {
     m_DeepestDepth = 0;
+    m_RebuildCount = 0;
+    m_WatchdogResume = 0;
 
     if ( ! m_DelayedIndices.empty( ) )
     {
         std::vector<long> vtempLong;
         m_DelayedIndices.swap( vtempLong );  // release any delayed indices list
     }
+    m_DelayedPending = false;
+    m_DimEstimate = 0;
+    m_DimEstimateReady = false;
+    m_DimEstimateEsd = 0;
+    m_DimEstimateVisits = 0;
+    m_DimEstimateTrials = 0;
 
     std::vector<T> vtempT;
     m_ObjectStore.swap( vtempT );  // release the object store
+    std::vector<char> vtempChar;
+    m_Erased.swap( vtempChar );    // and the marks of the erased objects
+    m_ErasedCount = 0;
 
     this->m_BaseNode .clear( ); // clear the nodes of the tree
+    this->m_NodeArena.clear( ); // and release their storage all at once
+    m_Snapshot.reset( );        // and let go of any file the tree was opened from
+    m_LinkPending = false;
+    Thaw( );
+}
+
+//=======================================================================
+//  bool erase ( const size_t n )
+//  bool erase ( const iterator& it )
+//
+//  Erases object n, or the one at it, by marking it. It stays in its node
+//  and steers the searches as before, but none of them finds it, and the
+//  iterators and size( ) pass it by. The m_dMax bounds above it are left
+//  as they were, so they may be larger than needed until the tree is
+//  compacted, which erase does once the erased objects are more than
+//  m_CompactionThreshold of the store. Returns false if n is out of range
+//  or already erased.
+//
+//=======================================================================
+bool erase ( const size_t n )
+{
+    if ( ! MarkErased( n ) )
+    {
+        return ( false );
+    }
+    CompactIfNeeded( );
+    return ( true );
+}
+
+bool erase ( const iterator& it )
+{
+    return ( erase( (size_t)it.get_position( ) ) );
+}
+
+//=======================================================================
+//  void Compact ( void )
+//
+//  Drops the erased objects from the store and builds the tree again
+//  from the others, in the order they were inserted, as
+//  CompleteDelayedInsert does. A frozen tree is frozen again with the
+//  same leaf buckets. The objects are renumbered.
+//
+//=======================================================================
+void Compact ( void )
+{
+    if ( m_ErasedCount == 0 ) return;
+
+    std::vector<T> live;
+    live.reserve( size( ) );
+    const T* const objects = ObjectData( );
+    for ( size_t i=0; i<StoreSize( ); ++i )
+    {
+        if ( m_Erased[i] == 0 ) live.push_back( objects[i] );
+    }
+    const bool frozen = IsFrozen( );
+    const size_t bucketSize = m_LeafBucketSize;
+
+    clear( );
+    // clear( ) keeps the spacing sums, which the new tree would add to
+    m_SumSpacings   = DistanceType( 0 );
+    m_SumSpacingsSq = DistanceType( 0 );
+    insert( live );
+    CompleteDelayedInsert( );
+    if ( frozen ) Freeze( bucketSize );
 }
 
 //=======================================================================
@@ -716,7 +1375,7 @@ void clear ( void )
 //=======================================================================
 bool empty ( void ) const
 {
-    return ( m_ObjectStore.empty( ) );
+    return ( size( ) == 0 );
 }
 
 //=======================================================================
@@ -739,8 +1398,11 @@ bool empty ( void ) const
 //=======================================================================
 void insert ( const T& t )
 {
+    UnmapSnapshot( );
     m_ObjectStore    .push_back( t );
     m_DelayedIndices .push_back( (long)m_ObjectStore.size( ) - 1 );
+    m_DelayedPending = true;
+    if ( ! m_Erased.empty( ) ) m_Erased.push_back( 0 );
 };
 
 //=======================================================================
@@ -773,13 +1435,17 @@ void insert ( const InputContainer& o )
     size_t localDepth = 0;
     typename InputContainer::const_iterator it;
 
+    UnmapSnapshot( );
     for( it=o.begin(); it!=o.end(); ++it )
     {
         m_ObjectStore    .push_back( *it );
         m_DelayedIndices .push_back( (long)m_ObjectStore.size( ) - 1 );
     }
+    if ( ! m_Erased.empty( ) ) m_Erased.resize( m_ObjectStore.size( ), 0 );
+    m_DelayedPending = !m_DelayedIndices.empty( );
     m_DeepestDepth = std::max( localDepth, m_DeepestDepth );
     m_DimEstimate = 0;
+    m_DimEstimateReady = false;
     m_DimEstimateEsd= 0;
 }
 
@@ -803,10 +1469,13 @@ void insert ( const InputContainer& o )
 void ImmediateInsert ( const T& t )
 {
     size_t localDepth = 0;
-    m_BaseNode.Inserter( t, localDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq );
-    m_DeepestDepth = std::max( localDepth, m_DeepestDepth );
+    Thaw( );
+    m_BaseNode.Inserter( t, localDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq, m_NodeArena );
+    if ( ! m_Erased.empty( ) ) m_Erased.push_back( 0 );
+    WatchDepth( (long)m_ObjectStore.size( )-1, localDepth );
     m_DiamEstimate = m_BaseNode.GetDiamEstimate();
     m_DimEstimate = 0;
+    m_DimEstimateReady = false;
     m_DimEstimateEsd= 0;
 }
 
@@ -819,16 +1488,19 @@ void ImmediateInsert ( const T& t )
 template< typename InputContainer >
 void ImmediateInsert ( const InputContainer& o )
 {
-    size_t localDepth = 0;
     typename InputContainer::const_iterator it;
 
+    Thaw( );
     for( it=o.begin(); it!=o.end(); ++it )
     {
-        m_BaseNode.Inserter( *it, localDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq  );
+        size_t localDepth = 0;
+        m_BaseNode.Inserter( *it, localDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq, m_NodeArena );
+        WatchDepth( (long)m_ObjectStore.size( )-1, localDepth );
     }
-    m_DeepestDepth = std::max( localDepth, m_DeepestDepth );
+    if ( ! m_Erased.empty( ) ) m_Erased.resize( m_ObjectStore.size( ), 0 );
     m_DiamEstimate = m_BaseNode.GetDiamEstimate();
     m_DimEstimate = 0;
+    m_DimEstimateReady = false;
     m_DimEstimateEsd= 0;
 }
 
@@ -850,24 +1522,21 @@ void ImmediateInsert ( const InputContainer& o )
 //  This version used the balanced search
 //=======================================================================
 inline iterator NearestNeighbor ( const DistanceType& radius, const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
-    T closest;
     size_t index = ULONG_MAX;
     DistanceType tempRadius = radius;
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
 
     if( this->empty( ) || radius < DistanceType( 0 ) )
     {
         return ( iterator(end( )) );
     }
-    else if ( m_BaseNode.Nearest( tempRadius, closest, t, index, m_ObjectStore
+    else if ( SearchNearest ( tempRadius, 0, t, index, m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-, m_NodeVisits
+                            , NodeVisitCounter( )
 #endif
-                                 ) )
+                            ) )
     {
         return ( iterator( (long)index, this ) );
     }
@@ -895,22 +1564,19 @@ const
 //  This version used the left-first search
 //=======================================================================
 inline iterator LeftNearestNeighbor ( const DistanceType& radius, const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
-    T closest;
     size_t index = ULONG_MAX;
     DistanceType tempRadius = radius;
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) || radius < DistanceType( 0 ) )
     {
         return ( iterator(end( )) );
     }
-    else if ( m_BaseNode.LeftNearest( tempRadius, closest, t, index, m_ObjectStore
+    else if ( m_BaseNode.LeftNearest( tempRadius, 0, t, index, m_ObjectStore, ErasedData( ), m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-                                 , m_NodeVisits
+                                 , NodeVisitCounter( )
 #endif
                                  ) )
     {
@@ -942,11 +1608,9 @@ const
 //  This version used the balanced search
 //=======================================================================
 inline bool NearestNeighbor ( const DistanceType& dRadius,  T& tClosest,   const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
     
     if ( dRadius < DistanceType(0) )
     {
@@ -960,11 +1624,11 @@ const
     {
         DistanceType dSearchRadius = dRadius;
         size_t index = ULONG_MAX;
-        return ( this->m_BaseNode.Nearest ( dSearchRadius, tClosest, t, index, m_ObjectStore
+        return ( SearchNearest ( dSearchRadius, &tClosest, t, index, m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-                                           , m_NodeVisits
+                               , NodeVisitCounter( )
 #endif
-                                           ) );
+                               ) );
     }
 }  //  NearestNeighbor
 
@@ -987,11 +1651,9 @@ const
 //  This version used the left-first search
 //=======================================================================
 inline bool LeftNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,   const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if ( dRadius < DistanceType(0) )
     {
@@ -1005,9 +1667,9 @@ const
     {
         DistanceType dSearchRadius = dRadius;
         size_t index = ULONG_MAX;
-        return ( this->m_BaseNode.LeftNearest ( dSearchRadius, tClosest, t, index, m_ObjectStore
+        return ( this->m_BaseNode.LeftNearest ( dSearchRadius, &tClosest, t, index, m_ObjectStore, ErasedData( ), m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-                                           , m_NodeVisits
+                                           , NodeVisitCounter( )
 #endif
                                            ) );
     }
@@ -1031,26 +1693,25 @@ const
 //
 //  This version uses the short-radius balanced search
 //=======================================================================
-inline iterator ShortNearestNeighbor ( const DistanceType& radius, const T& t )
+inline iterator ShortNearestNeighbor ( const DistanceType& radius, const T& t ) const
 {
-    T closest;
     size_t dimest;
     size_t index = ULONG_MAX;
     DistanceType tempRadius = radius;
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
     
     if( this->empty( ) || radius < DistanceType( 0 ) )
     {
         return ( iterator(end( )) );
     }
-    else if (!(m_Flags & NTF_NoPrePrune) && (dimest=(this)->GetDimEstimate())>0) {
-        DistanceType shortRadius = m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-        DistanceType limitRadius = 10*m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-        DistanceType meanSpacing = m_SumSpacings/DistanceType((1+m_ObjectStore.size()));
-        DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+m_ObjectStore.size()))-meanSpacing*meanSpacing;
+    else if (!(m_Flags & NTF_NoPrePrune) && (dimest=GetDimEstimateForSearch( ))>0) {
+        DistanceType shortRadius = m_DiamEstimate/DistanceType((1+size()));
+        DistanceType limitRadius = 10*m_DiamEstimate/DistanceType((1+size()));
+        DistanceType meanSpacing = m_SumSpacings/DistanceType((1+size()));
+        DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+size()))-meanSpacing*meanSpacing;
         if (limitRadius > radius/2.) limitRadius = radius/2.;
         if (limitRadius > meanSpacing/2.) limitRadius = meanSpacing/2.;
-        double lineardensity=pow((double)m_ObjectStore.size(),1./(dimest));
+        double lineardensity=pow((double)size(),1./(dimest));
         if (shortRadius > DistanceType( 0 ) &&
             ( (varSpacing < 0.25*meanSpacing*meanSpacing/(dimest)
                || (lineardensity*((double)meanSpacing) > 1.)          
@@ -1058,20 +1719,20 @@ inline iterator ShortNearestNeighbor ( const DistanceType& radius, const T& t )
             DistanceType testRadius;
             while (shortRadius <= limitRadius) {
                 testRadius = shortRadius;
-                if (m_BaseNode.Nearest ( testRadius, closest, t, index, m_ObjectStore
+                if (SearchNearest ( testRadius, 0, t, index, DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                        , m_NodeVisits
+                                  , NodeVisitCounter( )
 #endif
-                                        )) 
+                                  )) 
                     return iterator( (long)index, this );
                 shortRadius *= DistanceType(10);
             }
         }
-        if ( m_BaseNode.Nearest( tempRadius, closest, t, index, m_ObjectStore
+        if ( SearchNearest ( tempRadius, 0, t, index, DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                , m_NodeVisits
+                           , NodeVisitCounter( )
 #endif
-                                ) )
+                           ) )
         {
             return ( iterator( (long)index, this ) );
         }
@@ -1080,11 +1741,11 @@ inline iterator ShortNearestNeighbor ( const DistanceType& radius, const T& t )
             return ( iterator(end( )) );
         }        
     }
-    else if ( m_BaseNode.Nearest( tempRadius, closest, t, index, m_ObjectStore
+    else if ( SearchNearest ( tempRadius, 0, t, index, DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                 , m_NodeVisits
+                            , NodeVisitCounter( )
 #endif
-                                 ) )
+                            ) )
     {
         return ( iterator( (long)index, this ) );
     }
@@ -1115,11 +1776,11 @@ inline iterator ShortNearestNeighbor ( const DistanceType& radius, const T& t )
 //
 //  This version uses the short-radius balanced search
 //=======================================================================
-inline bool ShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,   const T& t )
+inline bool ShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,   const T& t ) const
 {
     size_t index = ULONG_MAX;
     double dimest;
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
     
     DistanceType dSearchRadius = dRadius;
 
@@ -1133,15 +1794,15 @@ inline bool ShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,
     }
     else
     {
-        if (!(m_Flags & NTF_NoPrePrune) && (dimest=(this)->GetDimEstimate())>0.) {
-          DistanceType shortRadius = m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-          DistanceType limitRadius = 10.0*m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-          DistanceType meanSpacing = m_SumSpacings/DistanceType((1+m_ObjectStore.size()));
-          DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+m_ObjectStore.size()))-meanSpacing*meanSpacing;
+        if (!(m_Flags & NTF_NoPrePrune) && (dimest=GetDimEstimateForSearch( ))>0.) {
+          DistanceType shortRadius = m_DiamEstimate/DistanceType((1+size()));
+          DistanceType limitRadius = 10.0*m_DiamEstimate/DistanceType((1+size()));
+          DistanceType meanSpacing = m_SumSpacings/DistanceType((1+size()));
+          DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+size()))-meanSpacing*meanSpacing;
           if (limitRadius > dRadius/2.) limitRadius = dRadius/2.;
           if (limitRadius > meanSpacing/2.) limitRadius = meanSpacing/2.;
           bool bReturn;
-          double lineardensity=pow((double)m_ObjectStore.size(),1./(dimest));
+          double lineardensity=pow((double)size(),1./(dimest));
           if (shortRadius > DistanceType( 0 ) &&
               ( (varSpacing < 0.25*meanSpacing*meanSpacing/(dimest)
                 || (lineardensity*((double)meanSpacing) > 1.)          
@@ -1149,20 +1810,20 @@ inline bool ShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,
             DistanceType testRadius;
             while (shortRadius <= limitRadius) {
                 testRadius = shortRadius;
-                if (bReturn = this->m_BaseNode.Nearest ( testRadius, tClosest, t, index, m_ObjectStore
+                if (bReturn = SearchNearest ( testRadius, &tClosest, t, index, DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                                        , m_NodeVisits
+                                            , NodeVisitCounter( )
 #endif
-                                                        ), bReturn) return bReturn;
+                                            ), bReturn) return bReturn;
                 shortRadius *= DistanceType(10);
             }
           }
         }
-        return ( this->m_BaseNode.Nearest ( dSearchRadius, tClosest, t, index, m_ObjectStore
+        return ( SearchNearest ( dSearchRadius, &tClosest, t, index, DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                           , m_NodeVisits
+                               , NodeVisitCounter( )
 #endif
-                                           ) );
+                               ) );
     }
 }  //  end ShortNearestNeighbor
 
@@ -1184,26 +1845,25 @@ inline bool ShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,
 //
 //  This version used the short-radius left-first search 
 //=======================================================================
-inline iterator LeftShortNearestNeighbor ( const DistanceType& radius, const T& t )
+inline iterator LeftShortNearestNeighbor ( const DistanceType& radius, const T& t ) const
 {
-    T closest;
     size_t dimest;
     size_t index = ULONG_MAX;
     DistanceType tempRadius = radius;
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) || radius < DistanceType( 0 ) )
     {
         return ( iterator(end( )) );
     }
-    else if (!(m_Flags & NTF_NoPrePrune) && (dimest=(this)->GetDimEstimate())>0) {
-        DistanceType shortRadius = m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-        DistanceType limitRadius = 10*m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-        DistanceType meanSpacing = m_SumSpacings/DistanceType((1+m_ObjectStore.size()));
-        DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+m_ObjectStore.size()))-meanSpacing*meanSpacing;
+    else if (!(m_Flags & NTF_NoPrePrune) && (dimest=GetDimEstimateForSearch( ))>0) {
+        DistanceType shortRadius = m_DiamEstimate/DistanceType((1+size()));
+        DistanceType limitRadius = 10*m_DiamEstimate/DistanceType((1+size()));
+        DistanceType meanSpacing = m_SumSpacings/DistanceType((1+size()));
+        DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+size()))-meanSpacing*meanSpacing;
         if (limitRadius > radius/2.) limitRadius = radius/2.;
         if (limitRadius > meanSpacing/2.) limitRadius = meanSpacing/2.;
-        double lineardensity=pow((double)m_ObjectStore.size(),1./(dimest));
+        double lineardensity=pow((double)size(),1./(dimest));
         if (shortRadius > DistanceType( 0 ) &&
             ( (varSpacing < 0.25*meanSpacing*meanSpacing/(dimest)
                || (lineardensity*((double)meanSpacing) > 1.)          
@@ -1211,18 +1871,18 @@ inline iterator LeftShortNearestNeighbor ( const DistanceType& radius, const T&
             DistanceType testRadius;
             while (shortRadius <= limitRadius) {
                 testRadius = shortRadius;
-                if (m_BaseNode.Nearest ( testRadius, closest, t, index, m_ObjectStore
+                if (SearchNearest ( testRadius, 0, t, index, DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                        , m_NodeVisits
+                                  , NodeVisitCounter( )
 #endif
-                                        )) 
+                                  )) 
                     return iterator( (long)index, this );
                 shortRadius *= DistanceType(10);
             }
         }
-        if ( m_BaseNode.LeftNearest( tempRadius, closest, t, index, m_ObjectStore
+        if ( m_BaseNode.LeftNearest( tempRadius, 0, t, index, m_ObjectStore, ErasedData( ), DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                , m_NodeVisits
+                                , NodeVisitCounter( )
 #endif
                                 ) )
         {
@@ -1233,9 +1893,9 @@ inline iterator LeftShortNearestNeighbor ( const DistanceType& radius, const T&
             return ( iterator(end( )) );
         }        
     }
-    else if ( m_BaseNode.LeftNearest( tempRadius, closest, t, index, m_ObjectStore
+    else if ( m_BaseNode.LeftNearest( tempRadius, 0, t, index, m_ObjectStore, ErasedData( ), DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                 , m_NodeVisits
+                                 , NodeVisitCounter( )
 #endif
                                  ) )
     {
@@ -1265,11 +1925,11 @@ inline iterator LeftShortNearestNeighbor ( const DistanceType& radius, const T&
 //
 //  This version uses the short-radius left-first search
 //=======================================================================
-inline bool LeftShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,   const T& t )
+inline bool LeftShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest,   const T& t ) const
 {
     size_t index = ULONG_MAX;
     double dimest;
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     DistanceType dSearchRadius = dRadius;
     
@@ -1283,15 +1943,15 @@ inline bool LeftShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest
     }
     else
     {
-        if (!(m_Flags & NTF_NoPrePrune) && (dimest=(this)->GetDimEstimate())>0.) {
-            DistanceType shortRadius = m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-            DistanceType limitRadius = 10.0*m_DiamEstimate/DistanceType((1+m_ObjectStore.size()));
-            DistanceType meanSpacing = m_SumSpacings/DistanceType((1+m_ObjectStore.size()));
-            DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+m_ObjectStore.size()))-meanSpacing*meanSpacing;
+        if (!(m_Flags & NTF_NoPrePrune) && (dimest=GetDimEstimateForSearch( ))>0.) {
+            DistanceType shortRadius = m_DiamEstimate/DistanceType((1+size()));
+            DistanceType limitRadius = 10.0*m_DiamEstimate/DistanceType((1+size()));
+            DistanceType meanSpacing = m_SumSpacings/DistanceType((1+size()));
+            DistanceType varSpacing = m_SumSpacingsSq/DistanceType((1+size()))-meanSpacing*meanSpacing;
             if (limitRadius > dRadius/2.) limitRadius = dRadius/2.;
             if (limitRadius > meanSpacing/2.) limitRadius = meanSpacing/2.;
             bool bReturn;
-            double lineardensity=pow((double)m_ObjectStore.size(),1./(dimest));
+            double lineardensity=pow((double)size(),1./(dimest));
             if (shortRadius > DistanceType( 0 ) &&
                 ( (varSpacing < 0.25*meanSpacing*meanSpacing/(dimest)
                    || (lineardensity*((double)meanSpacing) > 1.)          
@@ -1299,18 +1959,18 @@ inline bool LeftShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest
                 DistanceType testRadius;
                 while (shortRadius <= limitRadius) {
                     testRadius = shortRadius;
-                    if (bReturn = this->m_BaseNode.LeftNearest ( testRadius, tClosest, t, index, m_ObjectStore
+                    if (bReturn = this->m_BaseNode.LeftNearest ( testRadius, &tClosest, t, index, m_ObjectStore, ErasedData( ), DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                                            , m_NodeVisits
+                                                            , NodeVisitCounter( )
 #endif
                                                             )) return bReturn;
                     shortRadius *= DistanceType(10);
                 }
             }
         }
-        return ( this->m_BaseNode.LeftNearest ( dSearchRadius, tClosest, t, index, m_ObjectStore
+        return ( this->m_BaseNode.LeftNearest ( dSearchRadius, &tClosest, t, index, m_ObjectStore, ErasedData( ), DistanceType( 0 )
 #ifdef CNEARTREE_INSTRUMENTED
-                                           , m_NodeVisits
+                                           , NodeVisitCounter( )
 #endif
                                            ) );
     }
@@ -1333,22 +1993,20 @@ inline bool LeftShortNearestNeighbor ( const DistanceType& dRadius,  T& tClosest
 // This version uses the balanced search
 //=======================================================================
 iterator FarthestNeighbor ( const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     T farthest;
     size_t index = ULONG_MAX;
     DistanceType radius = DistanceType( distMinValue );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
 
     if( this->empty( ) )
     {
         return ( end( ) );
     }
-    else if ( m_BaseNode.Farthest( radius, farthest, t, index, m_ObjectStore
+    else if ( m_BaseNode.Farthest( radius, farthest, t, index, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                  , m_NodeVisits
+                                  , NodeVisitCounter( )
 #endif
                                   ) )
     {
@@ -1375,22 +2033,20 @@ const
 // This version uses the left-first search
 //=======================================================================
 iterator LeftFarthestNeighbor ( const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     T farthest;
     size_t index = ULONG_MAX;
     DistanceType radius = DistanceType( distMinValue );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
         return ( end( ) );
     }
-    else if ( m_BaseNode.LeftFarthest( radius, farthest, t, index, m_ObjectStore
+    else if ( m_BaseNode.LeftFarthest( radius, farthest, t, index, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                  , m_NodeVisits
+                                  , NodeVisitCounter( )
 #endif
                                   ) )
     {
@@ -1419,11 +2075,9 @@ const
 //
 //=======================================================================
 bool FarthestNeighbor ( T& tFarthest, const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
 
     if ( this->empty( ) )
     {
@@ -1433,9 +2087,9 @@ const
     {
         DistanceType dSearchRadius = DistanceType( distMinValue );
         size_t index = ULONG_MAX;
-        return ( this->m_BaseNode.Farthest ( dSearchRadius, tFarthest, t, index, m_ObjectStore
+        return ( this->m_BaseNode.Farthest ( dSearchRadius, tFarthest, t, index, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                            , m_NodeVisits
+                                            , NodeVisitCounter( )
 #endif
                                             ) );
     }
@@ -1459,11 +2113,9 @@ const
 //  This version uses the left-first search
 //=======================================================================
 bool LeftFarthestNeighbor ( T& tFarthest, const T& t )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if ( this->empty( ) )
     {
@@ -1473,32 +2125,63 @@ const
     {
         DistanceType dSearchRadius = DistanceType( distMinValue );
         size_t index = ULONG_MAX;
-        return ( this->m_BaseNode.LeftFarthest ( dSearchRadius, tFarthest, t, index, m_ObjectStore
+        return ( this->m_BaseNode.LeftFarthest ( dSearchRadius, tFarthest, t, index, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                            , m_NodeVisits
+                                            , NodeVisitCounter( )
 #endif
                                             ) );
     }
 }  //  LeftFarthestNeighbor
 
 
+//=======================================================================
+// The scans of the whole store below measure the objects a block at a time
+// (see BlockDistanceBetween), so that types with SIMD kernels can use them.
+// BlockDistances measures objects [first, first+n) from the probe, squared
+// if squared is true.
+//=======================================================================
+enum { ScanBlockSize = 256 };
+
+void BlockDistances( const T& probe, const size_t first, const size_t n, DistanceType* const out,
+                     const bool squared ) const
+{
+    if ( squared )
+    {
+        BlockSquaredDistanceBetween( probe, ObjectData( )+first, n, out );
+    }
+    else
+    {
+        BlockDistanceBetween( probe, ObjectData( )+first, n, out );
+    }
+}
+
 //=======================================================================
 template<typename ContainerType>
 void BelongsToPoints( const T& t1, const T& t2, ContainerType& group1, ContainerType& group2 )
 {
     group1.clear();
     group2.clear();
-    typename CNearTree<T>::iterator it;
+    DistanceType d1[ScanBlockSize];
+    DistanceType d2[ScanBlockSize];
+    const bool squared = UseSquaredDistances( );
+    const char* const erased = ErasedData( );
 
-    for ( it=this->begin( ); it!=this->end( ); ++it )
+    for ( size_t first=0; first<StoreSize( ); first+=ScanBlockSize )
     {
-        if( DistanceBetween( (*it), t1 ) < DistanceBetween( (*it), t2) )
+        const size_t n = (std::min)( size_t( ScanBlockSize ), StoreSize( )-first );
+        BlockDistances( t1, first, n, d1, squared );
+        BlockDistances( t2, first, n, d2, squared );
+        for ( size_t i=0; i<n; ++i )
         {
-            group1.insert( group1.end( ), (*it) );
-        }
-        else
-        {
-            group2.insert( group2.end(), (*it) );
+            if ( ! Live( erased, first+i ) ) continue;
+            if( squared ? RootLess( d1[i], d2[i] ) : d1[i] < d2[i] )
+            {
+                group1.insert( group1.end( ), ObjectData( )[first+i] );
+            }
+            else
+            {
+                group2.insert( group2.end(), ObjectData( )[first+i] );
+            }
         }
     }
 }  // end BelongsToPoints
@@ -1508,19 +2191,29 @@ void BelongsToPoints( const T& t1, const T& t2, ContainerType& group1, Container
 {
     group1.clear();
     group2.clear();
-    typename CNearTree<T>::iterator it;
+    DistanceType d1[ScanBlockSize];
+    DistanceType d2[ScanBlockSize];
+    const bool squared = UseSquaredDistances( );
+    const char* const erased = ErasedData( );
     
-    for ( it=this->begin( ); it!=this->end( ); ++it )
+    for ( size_t first=0; first<StoreSize( ); first+=ScanBlockSize )
     {
-        if( DistanceBetween( (*it), t1 ) < DistanceBetween( (*it), t2) )
+        const size_t n = (std::min)( size_t( ScanBlockSize ), StoreSize( )-first );
+        BlockDistances( t1, first, n, d1, squared );
+        BlockDistances( t2, first, n, d2, squared );
+        for ( size_t i=0; i<n; ++i )
         {
-            group1.insert( group1.end( ), (*it) );
-            group1_ordinals.insert( group1_ordinals.end( ), it.get_position( ) );
-        }
-        else
-        {
-            group2.insert( group2.end(), (*it) );
-            group2_ordinals.insert( group2_ordinals.end( ), it.get_position( ) );
+            if ( ! Live( erased, first+i ) ) continue;
+            if( squared ? RootLess( d1[i], d2[i] ) : d1[i] < d2[i] )
+            {
+                group1.insert( group1.end( ), ObjectData( )[first+i] );
+                group1_ordinals.insert( group1_ordinals.end( ), first+i );
+            }
+            else
+            {
+                group2.insert( group2.end(), ObjectData( )[first+i] );
+                group2_ordinals.insert( group2_ordinals.end( ), first+i );
+            }
         }
     }
 }  // end BelongsToPoints
@@ -1531,17 +2224,25 @@ void SeparateByRadius( const DistanceType radius, const T& probe, ContainerTypeI
 {
     inside.clear();
     outside.clear();
-    typename CNearTree<T>::iterator it;
+    DistanceType d[ScanBlockSize];
+    const bool squared = UseSquaredDistances( );
+    const char* const erased = ErasedData( );
 
-    for ( it=this->begin( ); it!=this->end( ); ++it )
+    for ( size_t first=0; first<StoreSize( ); first+=ScanBlockSize )
     {
-        if( DistanceBetween( (*it), probe ) < radius )
+        const size_t n = (std::min)( size_t( ScanBlockSize ), StoreSize( )-first );
+        BlockDistances( probe, first, n, d, squared );
+        for ( size_t i=0; i<n; ++i )
         {
-            inside.insert( inside.end( ), (*it) );
-        }
-        else
-        {
-            outside.insert( outside.end(), (*it) );
+            if ( ! Live( erased, first+i ) ) continue;
+            if( squared ? RootBelow( d[i], radius ) : d[i] < radius )
+            {
+                inside.insert( inside.end( ), ObjectData( )[first+i] );
+            }
+            else
+            {
+                outside.insert( outside.end(), ObjectData( )[first+i] );
+            }
         }
     }
 
@@ -1558,19 +2259,27 @@ void SeparateByRadius( const DistanceType radius, const T& probe,
 {
     inside.clear();
     outside.clear();
-    typename CNearTree<T>::iterator it;
+    DistanceType d[ScanBlockSize];
+    const bool squared = UseSquaredDistances( );
+    const char* const erased = ErasedData( );
     
-    for ( it=this->begin( ); it!=this->end( ); ++it )
+    for ( size_t first=0; first<StoreSize( ); first+=ScanBlockSize )
     {
-        if( DistanceBetween( (*it), probe ) < radius )
+        const size_t n = (std::min)( size_t( ScanBlockSize ), StoreSize( )-first );
+        BlockDistances( probe, first, n, d, squared );
+        for ( size_t i=0; i<n; ++i )
         {
-            inside.insert( inside.end( ), (*it) );
-            inside_ordinals.insert( inside_ordinals.end( ), it.get_position());
-        }
-        else
-        {
-            outside.insert( outside.end(), (*it) );
-            inside_ordinals.insert( outside_ordinals.end( ), it.get_position());
+            if ( ! Live( erased, first+i ) ) continue;
+            if( squared ? RootBelow( d[i], radius ) : d[i] < radius )
+            {
+                inside.insert( inside.end( ), ObjectData( )[first+i] );
+                inside_ordinals.insert( inside_ordinals.end( ), first+i );
+            }
+            else
+            {
+                outside.insert( outside.end(), ObjectData( )[first+i] );
+                outside_ordinals.insert( outside_ordinals.end( ), first+i );
+            }
         }
     }
     
@@ -1598,13 +2307,11 @@ void SeparateByRadius( const DistanceType radius, const T& probe,
 //=======================================================================
 template<typename OutputContainerType>
 inline long FindInSphere ( const DistanceType& dRadius,  OutputContainerType& tClosest,   const T& t ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
 
     if( this->empty( ) )
     {
@@ -1612,24 +2319,22 @@ const
     }
     else
     {
-        return ( m_BaseNode.InSphere( dRadius, tClosest, t, m_ObjectStore
+        return ( SearchInSphere ( dRadius, tClosest, t
 #ifdef CNEARTREE_INSTRUMENTED
-                                     , m_NodeVisits
+                                , NodeVisitCounter( )
 #endif
-                                     ) );
+                                ) );
     }
 }  //  FindInSphere
 template<typename OutputContainerType>
 inline long FindInSphere ( const DistanceType& dRadius,  OutputContainerType& tClosest, 
                           std::vector<size_t>& tIndices, const T& t ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
     
     if( this->empty( ) )
     {
@@ -1637,14 +2342,91 @@ const
     }
     else
     {
-        return ( m_BaseNode.InSphere( dRadius, tClosest, tIndices, t, m_ObjectStore
+        return ( SearchInSphere ( dRadius, tClosest, tIndices, t
 #ifdef CNEARTREE_INSTRUMENTED
-                                     , m_NodeVisits
+                                , NodeVisitCounter( )
 #endif
-                                     ) );
+                                ) );
     }
 }  //  FindInSphere
 
+//=======================================================================
+//  bool Contains ( const T& t ) const
+//  bool Contains ( const T& t, const DistanceType tolerance ) const
+//
+//  Function to test whether a NearTree holds an object that matches t:
+//  one no farther from it than tolerance, or than GetMatchTolerance( ).
+//  It is a nearest neighbor search that starts with that radius, so it
+//  looks at only the few objects close to t.
+//
+//=======================================================================
+bool Contains ( const T& t ) const
+{
+    return ( Contains( t, m_MatchTolerance ) );
+}
+
+bool Contains ( const T& t, const DistanceType tolerance ) const
+{
+    DistanceType dRadius = tolerance;
+    size_t index = ULONG_MAX;
+    CompleteDelayedInsertForSearch( );
+
+    if ( this->empty( ) || tolerance < DistanceType( 0 ) )
+    {
+        return ( false );
+    }
+    return ( SearchNearest( dRadius, 0, t, index, DistanceType( 0 )
+#ifdef CNEARTREE_INSTRUMENTED
+                          , NodeVisitCounter( )
+#endif
+                          ) );
+}
+
+//=======================================================================
+//  long ForEachInSphere ( const DistanceType& dRadius, const T& t, Visitor fn ) const
+//
+//  Function to search a NearTree for the objects closer to some probe point, t,
+//  than dRadius, without collecting them anywhere.
+//
+//    dRadius is the maximum search radius - any point farther than dRadius from the probe
+//             point will be ignored
+//    t  is the probe point
+//    fn is called as fn( index, distance ) for each object found, with the index of
+//             the object (see at( )) and its distance from t, in no particular order
+//
+// returns the number of objects found
+//
+//=======================================================================
+template<typename Visitor>
+long ForEachInSphere ( const DistanceType& dRadius, const T& t, Visitor fn ) const
+{
+    CompleteDelayedInsertForSearch( );
+
+    if( this->empty( ) )
+    {
+        return( 0L );
+    }
+    else
+    {
+        return ( SearchForEachInSphere ( dRadius, fn, t
+#ifdef CNEARTREE_INSTRUMENTED
+                                       , NodeVisitCounter( )
+#endif
+                                       ) );
+    }
+}  //  ForEachInSphere
+
+//=======================================================================
+//  long CountInSphere ( const DistanceType& dRadius, const T& t ) const
+//
+//  The number of objects that FindInSphere would find, without copying any of them.
+//
+//=======================================================================
+long CountInSphere ( const DistanceType& dRadius, const T& t ) const
+{
+    return ( ForEachInSphere( dRadius, t, IgnoreFound( ) ) );
+}  //  CountInSphere
+
 //=======================================================================
 //  long LeftFindInSphere ( const DistanceType& dRadius,  OutputContainerType& tClosest,   const T& t ) const
 //
@@ -1665,13 +2447,11 @@ const
 //=======================================================================
 template<typename OutputContainerType>
 inline long LeftFindInSphere ( const DistanceType& dRadius,  OutputContainerType& tClosest,   const T& t ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -1679,9 +2459,9 @@ const
     }
     else
     {
-        return ( m_BaseNode.LeftInSphere( dRadius, tClosest, t, m_ObjectStore
+        return ( m_BaseNode.LeftInSphere( dRadius, tClosest, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                     , m_NodeVisits
+                                     , NodeVisitCounter( )
 #endif
                                      ) );
     }
@@ -1690,14 +2470,12 @@ const
 template<typename OutputContainerType>
 inline long LeftFindInSphere ( const DistanceType& dRadius,  OutputContainerType& tClosest, 
                           std::vector<size_t>& tIndices, const T& t ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -1705,9 +2483,9 @@ const
     }
     else
     {
-        return ( m_BaseNode.LeftInSphere( dRadius, tClosest, tIndices, t, m_ObjectStore
+        return ( m_BaseNode.LeftInSphere( dRadius, tClosest, tIndices, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                     , m_NodeVisits
+                                     , NodeVisitCounter( )
 #endif
                                      ) );
     }
@@ -1737,13 +2515,11 @@ long FindOutSphere (
                     OutputContainerType& tFarthest,
                     const T& t
                     ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
 
     if( this->empty( ) )
     {
@@ -1751,9 +2527,9 @@ const
     }
     else
     {
-        return ( m_BaseNode.OutSphere( dRadius, tFarthest, t, m_ObjectStore
+        return ( m_BaseNode.OutSphere( dRadius, tFarthest, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                      , m_NodeVisits
+                                      , NodeVisitCounter( )
 #endif
                                       ) );
     }
@@ -1765,14 +2541,12 @@ long FindOutSphere (
                     std::vector<size_t>& tIndices,
                     const T& t
                     )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -1780,9 +2554,9 @@ const
     }
     else
     {
-        return ( m_BaseNode.OutSphere( dRadius, tFarthest, tIndices, t, m_ObjectStore
+        return ( m_BaseNode.OutSphere( dRadius, tFarthest, tIndices, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                      , m_NodeVisits
+                                      , NodeVisitCounter( )
 #endif
                                       ) );
     }
@@ -1812,13 +2586,11 @@ long LeftFindOutSphere (
                     OutputContainerType& tFarthest,
                     const T& t
                     ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -1826,9 +2598,9 @@ const
     }
     else
     {
-        return ( m_BaseNode.LeftOutSphere( dRadius, tFarthest, t, m_ObjectStore
+        return ( m_BaseNode.LeftOutSphere( dRadius, tFarthest, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                      , m_NodeVisits
+                                      , NodeVisitCounter( )
 #endif
                                       ) );
     }
@@ -1841,14 +2613,12 @@ long LeftFindOutSphere (
                     std::vector<size_t>& tIndices,
                     const T& t
                     )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -1856,9 +2626,9 @@ const
     }
     else
     {
-        return ( m_BaseNode.LeftOutSphere( dRadius, tFarthest, tIndices, t, m_ObjectStore
+        return ( m_BaseNode.LeftOutSphere( dRadius, tFarthest, tIndices, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                      , m_NodeVisits
+                                      , NodeVisitCounter( )
 #endif
                                       ) );
     }
@@ -1891,14 +2661,12 @@ long FindInAnnulus (
                     OutputContainerType& tAnnular,
                     const T& t
                     )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     long lReturn = 0;
     // clear the contents of the return vector so that things don't accidentally accumulate
     tAnnular.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
 
     if( this->empty( ) )
     {
@@ -1910,11 +2678,11 @@ const
     }
     else
     {
-        lReturn = this->m_BaseNode.InAnnulus( dRadius1, dRadius2, tAnnular, t, m_ObjectStore
+        lReturn = SearchInAnnulus ( dRadius1, dRadius2, tAnnular, t
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                  , NodeVisitCounter( )
 #endif
-                                             );
+                                  );
     }
 
     return ( lReturn );
@@ -1927,15 +2695,13 @@ long FindInAnnulus (
                     std::vector<size_t>& tIndices,
                     const T& t
                     ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     long lReturn = 0;
     // clear the contents of the return vector so that things don't accidentally accumulate
     tAnnular.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
     
     if( this->empty( ) )
     {
@@ -1947,11 +2713,11 @@ const
     }
     else
     {
-        lReturn = this->m_BaseNode.InAnnulus( dRadius1, dRadius2, tAnnular, tIndices, t, m_ObjectStore
+        lReturn = SearchInAnnulus ( dRadius1, dRadius2, tAnnular, tIndices, t
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                  , NodeVisitCounter( )
 #endif
-                                             );
+                                  );
     }
     
     return ( lReturn );
@@ -1983,14 +2749,12 @@ long LeftFindInAnnulus (
                     OutputContainerType& tAnnular,
                     const T& t
                     )
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     long lReturn = 0;
     // clear the contents of the return vector so that things don't accidentally accumulate
     tAnnular.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -2002,9 +2766,9 @@ const
     }
     else
     {
-        lReturn = this->m_BaseNode.LeftInAnnulus( dRadius1, dRadius2, tAnnular, t, m_ObjectStore
+        lReturn = this->m_BaseNode.LeftInAnnulus( dRadius1, dRadius2, tAnnular, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                             , NodeVisitCounter( )
 #endif
                                              );
     }
@@ -2019,15 +2783,13 @@ long LeftFindInAnnulus (
                     std::vector<size_t>& tIndices,
                     const T& t
                     ) 
-#ifndef CNEARTREE_INSTRUMENTED
 const
-#endif
 {
     long lReturn = 0;
     // clear the contents of the return vector so that things don't accidentally accumulate
     tAnnular.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -2039,9 +2801,9 @@ const
     }
     else
     {
-        lReturn = this->m_BaseNode.LeftInAnnulus( dRadius1, dRadius2, tAnnular, tIndices, t, m_ObjectStore
+        lReturn = this->m_BaseNode.LeftInAnnulus( dRadius1, dRadius2, tAnnular, tIndices, t, m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                             , NodeVisitCounter( )
 #endif
                                              );
     }
@@ -2071,11 +2833,11 @@ const
 //
 //=======================================================================
 template<typename OutputContainerType>
-long FindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  OutputContainerType& tClosest,   const T& t )
+long FindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  OutputContainerType& tClosest,   const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
 
     if( this->empty( ) )
     {
@@ -2083,16 +2845,16 @@ long FindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  Outpu
     }
     else
     {
-        std::vector<std::pair<DistanceType, T> > K_Storage;
+        SearchScratch<typename K_Heap::value_type> K_Storage;
         DistanceType dRadius = radius;
-        const long lFound = m_BaseNode.K_Near( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = SearchK_Near ( k, dRadius, K_Storage.Get( ), t, m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-                                              , m_NodeVisits
+                                         , NodeVisitCounter( )
 #endif
-                                              );
-        for( unsigned int i=0; i<K_Storage.size( ); ++i )
+                                         );
+        for( size_t i=0; i<K_Storage.size( ); ++i )
         {
-            tClosest.insert( tClosest.end( ), K_Storage[i].second );
+            tClosest.insert( tClosest.end( ), ObjectData( )[K_Storage[i].second] );
         }
         return( lFound );
     }
@@ -2100,12 +2862,12 @@ long FindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  Outpu
 template<typename OutputContainerType>
 long FindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  
                              OutputContainerType& tClosest,
-                             std::vector<size_t>& tIndices, const T& t )
+                             std::vector<size_t>& tIndices, const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    CompleteDelayedInsertForSearch( );
     
     if( this->empty( ) )
     {
@@ -2113,22 +2875,152 @@ long FindK_NearestNeighbors ( const size_t k, const DistanceType& radius,
     }
     else
     {
-        std::vector<triple<DistanceType, T, size_t> > K_Storage;
+        SearchScratch<typename K_Heap::value_type> K_Storage;
         DistanceType dRadius = radius;
-        const long lFound = m_BaseNode.K_Near( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = SearchK_Near ( k, dRadius, K_Storage.Get( ), t, m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-                                              , m_NodeVisits
+                                         , NodeVisitCounter( )
 #endif
-                                              );
-        for( unsigned int i=0; i<K_Storage.size( ); ++i )
+                                         );
+        for( size_t i=0; i<K_Storage.size( ); ++i )
         {
-            tClosest.insert( tClosest.end( ), K_Storage[i].GetSecond() );
-            tIndices.insert( tIndices.end( ), K_Storage[i].GetThird() );
+            tClosest.insert( tClosest.end( ), ObjectData( )[K_Storage[i].second] );
+            tIndices.insert( tIndices.end( ), K_Storage[i].second );
         }
         return( lFound );
     }
 }  //  FindK_NearestNeighbors
 
+//=======================================================================
+//  size_t NearestNeighborBatch ( const std::vector<T>& probes, const DistanceType& radius,
+//                                std::vector<size_t>& indices, std::vector<DistanceType>& distances,
+//                                const unsigned int threads = 0 )
+//
+//  The balanced NearestNeighbor search for every object in probes, spread
+//  over several threads.
+//
+//    probes are the probe points
+//    radius is the maximum search radius - any point farther than radius from a probe
+//             point will be ignored
+//    indices is returned holding, for each probe, the index of its nearest object
+//             (see at( )), or ULONG_MAX if nothing was found within radius
+//    distances is returned holding the distance of each probe from its nearest
+//             object, or radius if nothing was found
+//    threads is the number of threads to use; 0 means one per hardware thread
+//
+//  returns the number of probes for which a nearest object was found
+//
+//  The probes are handed out to the threads in small chunks, so that the
+//  work stays balanced when some probes cost more than others. The tree must
+//  not be changed by another thread while the search runs.
+//=======================================================================
+size_t NearestNeighborBatch ( const std::vector<T>& probes, const DistanceType& radius,
+                              std::vector<size_t>& indices, std::vector<DistanceType>& distances,
+                              const unsigned int threads = 0 )
+const
+{
+    CompleteDelayedInsertForSearch( );
+    indices  .assign( probes.size( ), (size_t)ULONG_MAX );
+    distances.assign( probes.size( ), radius );
+
+    if( this->empty( ) || radius < DistanceType( 0 ) || probes.empty( ) )
+    {
+        return( 0 );
+    }
+
+    NearestBatchWorker worker( this, probes, radius, &indices[0], &distances[0] );
+    RunBatch( probes.size( ), threads, worker );
+    return( probes.size( ) - (size_t)std::count( indices.begin( ), indices.end( ), (size_t)ULONG_MAX ) );
+}  //  NearestNeighborBatch
+
+//=======================================================================
+//  size_t FindK_NearestNeighborsBatch ( const size_t k, const DistanceType& radius,
+//                                       const std::vector<T>& probes,
+//                                       std::vector<std::vector<size_t> >& indices,
+//                                       std::vector<std::vector<DistanceType> >& distances,
+//                                       const unsigned int threads = 0 )
+//
+//  FindK_NearestNeighbors for every object in probes, spread over several threads
+//  as in NearestNeighborBatch.
+//
+//    k is the maximum number of points to return for each probe
+//    radius is the maximum search radius
+//    probes are the probe points
+//    indices is returned holding, for each probe, the indices of the objects found
+//    distances is returned holding the matching distances; for each probe
+//             both are sorted from the nearest object out
+//    threads is the number of threads to use; 0 means one per hardware thread
+//
+//  returns the total number of objects found for all of the probes
+//=======================================================================
+size_t FindK_NearestNeighborsBatch ( const size_t k, const DistanceType& radius,
+                                     const std::vector<T>& probes,
+                                     std::vector<std::vector<size_t> >& indices,
+                                     std::vector<std::vector<DistanceType> >& distances,
+                                     const unsigned int threads = 0 )
+const
+{
+    CompleteDelayedInsertForSearch( );
+    indices  .assign( probes.size( ), std::vector<size_t>( ) );
+    distances.assign( probes.size( ), std::vector<DistanceType>( ) );
+
+    if( this->empty( ) || k == 0 || probes.empty( ) )
+    {
+        return( 0 );
+    }
+
+    K_NearestBatchWorker worker( this, k, probes, radius, &indices[0], &distances[0] );
+    RunBatch( probes.size( ), threads, worker );
+
+    size_t nFound = 0;
+    for ( size_t i=0; i<indices.size( ); ++i )
+    {
+        nFound += indices[i].size( );
+    }
+    return( nFound );
+}  //  FindK_NearestNeighborsBatch
+
+//=======================================================================
+//  size_t FindInSphereBatch ( const DistanceType& dRadius, const std::vector<T>& probes,
+//                             std::vector<std::vector<size_t> >& indices,
+//                             const unsigned int threads = 0 )
+//
+//  FindInSphere for every object in probes, spread over several threads
+//  as in NearestNeighborBatch. Only the indices of the objects found are
+//  returned, so no objects are copied.
+//
+//    dRadius is the radius within which to search
+//    probes are the probe points
+//    indices is returned holding, for each probe, the indices of the objects
+//             found within dRadius of it
+//    threads is the number of threads to use; 0 means one per hardware thread
+//
+//  returns the total number of objects found for all of the probes
+//=======================================================================
+size_t FindInSphereBatch ( const DistanceType& dRadius, const std::vector<T>& probes,
+                           std::vector<std::vector<size_t> >& indices,
+                           const unsigned int threads = 0 )
+const
+{
+    CompleteDelayedInsertForSearch( );
+    indices.assign( probes.size( ), std::vector<size_t>( ) );
+
+    if( this->empty( ) || probes.empty( ) )
+    {
+        return( 0 );
+    }
+
+    InSphereBatchWorker worker( this, dRadius, probes, &indices[0] );
+    RunBatch( probes.size( ), threads, worker );
+
+    size_t nFound = 0;
+    for ( size_t i=0; i<indices.size( ); ++i )
+    {
+        nFound += indices[i].size( );
+    }
+    return( nFound );
+}  //  FindInSphereBatch
+
 //=======================================================================
 //  long FindK_NearestNeighbors(  const size_t k, const DistanceType& dRadius, OutputContainerType& tClosest, const T& t ) const
 //
@@ -2150,11 +3042,11 @@ long FindK_NearestNeighbors ( const size_t k, const DistanceType& radius,
 // This version uses the left-first search
 //=======================================================================
 template<typename OutputContainerType>
-long LeftFindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  OutputContainerType& tClosest,   const T& t )
+long LeftFindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  OutputContainerType& tClosest,   const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -2162,11 +3054,11 @@ long LeftFindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  O
     }
     else
     {
-        std::vector<std::pair<DistanceType, T> > K_Storage;
+        SearchScratch<std::pair<DistanceType, T> > K_Storage;
         DistanceType dRadius = radius;
-        const long lFound = m_BaseNode.LeftK_Near( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = m_BaseNode.LeftK_Near( k, dRadius, K_Storage.Get( ), t, this->m_ObjectStore, ErasedData( ), m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-                                              , m_NodeVisits
+                                              , NodeVisitCounter( )
 #endif
                                               );
         for( unsigned int i=0; i<K_Storage.size( ); ++i )
@@ -2179,12 +3071,12 @@ long LeftFindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  O
 template<typename OutputContainerType>
 long LeftFindK_NearestNeighbors ( const size_t k, const DistanceType& radius,  
                              OutputContainerType& tClosest,
-                             std::vector<size_t>& tIndices, const T& t )
+                             std::vector<size_t>& tIndices, const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tClosest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -2192,11 +3084,11 @@ long LeftFindK_NearestNeighbors ( const size_t k, const DistanceType& radius,
     }
     else
     {
-        std::vector<triple<DistanceType, T, size_t> > K_Storage;
+        SearchScratch<triple<DistanceType, T, size_t> > K_Storage;
         DistanceType dRadius = radius;
-        const long lFound = m_BaseNode.LeftK_Near( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = m_BaseNode.LeftK_Near( k, dRadius, K_Storage.Get( ), t, this->m_ObjectStore, ErasedData( ), m_Approximation
 #ifdef CNEARTREE_INSTRUMENTED
-                                              , m_NodeVisits
+                                              , NodeVisitCounter( )
 #endif
                                               );
         for( unsigned int i=0; i<K_Storage.size( ); ++i )
@@ -2227,11 +3119,11 @@ long LeftFindK_NearestNeighbors ( const size_t k, const DistanceType& radius,
 // This version uses the balanced search
 //=======================================================================
 template<typename OutputContainerType>
-long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest,   const T& t )
+long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest,   const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
 
     if( this->empty( ) )
     {
@@ -2239,11 +3131,11 @@ long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest,
     }
     else
     {
-        std::vector<std::pair<DistanceType, T> > K_Storage;
+        SearchScratch<std::pair<DistanceType, T> > K_Storage;
         DistanceType dRadius = 0;
-        const long lFound = m_BaseNode.K_Far( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = m_BaseNode.K_Far( k, dRadius, K_Storage.Get( ), t, this->m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                             , NodeVisitCounter( )
 #endif
                                              );
         for( unsigned int i=0; i<K_Storage.size( ); ++i )
@@ -2254,12 +3146,12 @@ long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest,
     }
 }  //  FindK_FarthestNeighbors
 template<typename OutputContainerType>
-long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest, std::vector<size_t>& tIndices, const T& t )
+long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest, std::vector<size_t>& tIndices, const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -2267,11 +3159,11 @@ long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest, s
     }
     else
     {
-        std::vector<triple<DistanceType, T, size_t> > K_Storage;
+        SearchScratch<triple<DistanceType, T, size_t> > K_Storage;
         DistanceType dRadius = 0;
-        const long lFound = m_BaseNode.K_Far( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = m_BaseNode.K_Far( k, dRadius, K_Storage.Get( ), t, this->m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                             , NodeVisitCounter( )
 #endif
                                              );
         for( unsigned int i=0; i<K_Storage.size( ); ++i )
@@ -2301,11 +3193,11 @@ long FindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest, s
 // This version uses the left-first search
 //=======================================================================
 template<typename OutputContainerType>
-long LeftFindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest,   const T& t )
+long LeftFindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest,   const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -2313,11 +3205,11 @@ long LeftFindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthes
     }
     else
     {
-        std::vector<std::pair<DistanceType, T> > K_Storage;
+        SearchScratch<std::pair<DistanceType, T> > K_Storage;
         DistanceType dRadius = 0;
-        const long lFound = m_BaseNode.LeftK_Far( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = m_BaseNode.LeftK_Far( k, dRadius, K_Storage.Get( ), t, this->m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                             , NodeVisitCounter( )
 #endif
                                              );
         for( unsigned int i=0; i<K_Storage.size( ); ++i )
@@ -2329,12 +3221,12 @@ long LeftFindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthes
 }  //  LeftFindK_FarthestNeighbors
 
 template<typename OutputContainerType>
-long LeftFindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest, std::vector<size_t>& tIndices, const T& t )
+long LeftFindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthest, std::vector<size_t>& tIndices, const T& t ) const
 {
     // clear the contents of the return vector so that things don't accidentally accumulate
     tFarthest.clear( );
     tIndices.clear( );
-    const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+    LinkSnapshotForSearch( );
     
     if( this->empty( ) )
     {
@@ -2342,11 +3234,11 @@ long LeftFindK_FarthestNeighbors ( const size_t k, OutputContainerType& tFarthes
     }
     else
     {
-        std::vector<triple<DistanceType, T, size_t> > K_Storage;
+        SearchScratch<triple<DistanceType, T, size_t> > K_Storage;
         DistanceType dRadius = 0;
-        const long lFound = m_BaseNode.LeftK_Far( k, dRadius, K_Storage, t, this->m_ObjectStore
+        const long lFound = m_BaseNode.LeftK_Far( k, dRadius, K_Storage.Get( ), t, this->m_ObjectStore, ErasedData( )
 #ifdef CNEARTREE_INSTRUMENTED
-                                             , m_NodeVisits
+                                             , NodeVisitCounter( )
 #endif
                                              );
         for( unsigned int i=0; i<K_Storage.size( ); ++i )
@@ -2376,27 +3268,11 @@ inline void CompleteDelayedInsert ( void )
     {
         return;
     }
+    Thaw( );
 
     // insert a random selection of the objects
+    InsertDelayedPrefix( );
     const size_t vectorSize = m_DelayedIndices.size( );
-    const size_t toRandomlyInsert = (size_t)::sqrt( (double)vectorSize );
-    for ( size_t i=0; i<toRandomlyInsert; ++i )
-    {
-
-        size_t n = (size_t)((double)(vectorSize-1u) * (DistanceType)(rhr.urand()));
-        rhr.urand( ); rhr.urand( );
-
-        // Find the next pointer that hasn't already had its object "insert"ed
-        // We can do this blindly since sqrt(n)<=n for all cases. n=1 would be the only
-        // bad case here, and that will not trigger the later loop.
-        while ( m_DelayedIndices[n] == -1 )
-        {
-            ++n;
-            n = n% vectorSize;
-        }
-        insertDelayed( (long)m_DelayedIndices[n] );
-        m_DelayedIndices[n] = -1;
-    }
 
     // finish by inserting all the remaining objects
     for ( size_t i=0; i<vectorSize; ++i )
@@ -2412,13 +3288,16 @@ inline void CompleteDelayedInsert ( void )
     std::vector<long> DelayedPointersTemp;
     DelayedPointersTemp  .swap( m_DelayedIndices );
     m_DiamEstimate = m_BaseNode.GetDiamEstimate();
+    m_DimEstimateReady = false;
+    m_DelayedPending.store( false, std::memory_order_release );
 };
 //=======================================================================
 //  void CompleteDelayedInsertRandom ( void )
 //
 //  When CompleteDelayedInsertRandom is invoked, if there are any objects in the
-//  delayed store they are then inserted into the neartree. CompleteDelayedInsertRandom
-//  randomly selects all objects and inserts them. m_DelayedIndices is empty after
+//  delayed store they are then inserted into the neartree, all of them in
+//  random order: CompleteDelayedInsert( NTO_Shuffle, seed ), with the seed
+//  drawn from the tree's own random numbers. m_DelayedIndices is empty after
 //  a call to CompleteDelayedInsertRandom.
 //
 //=======================================================================
@@ -2428,32 +3307,161 @@ inline void CompleteDelayedInsertRandom ( void )
     {
         return;
     }
+    CompleteDelayedInsert( NTO_Shuffle, (unsigned long)rhr.random( ) );
+};
 
-    // insert a random selection of the objects
-    const size_t vectorSize = m_DelayedIndices.size( );
-    for ( size_t i=0; i<m_DelayedIndices.size( ); ++i )
+//=======================================================================
+//  void CompleteDelayedInsert ( const InsertionOrder order, const unsigned long seed )
+//
+//  CompleteDelayedInsert, with the delayed objects inserted in the given
+//  order. The random choices are made by a generator started from seed,
+//  not by the tree's own random numbers, so the same objects, order and
+//  seed always build the same tree, and orders can be compared by the
+//  searches they give.
+//
+//    NTO_SqrtPrefix    sqrt(n) objects at random, then the rest in the order
+//                      they were queued, as CompleteDelayedInsert does
+//    NTO_Shuffle       all of the objects in random order (Fisher-Yates)
+//    NTO_Morton,       the objects are sorted along a Morton (Z-order) or a
+//    NTO_Hilbert       Hilbert curve, then taken in bit-reversed order of
+//                      their places on it: the middle one, the quarters, the
+//                      eighths, ... so that the first ones inserted cover the
+//                      whole set and the later ones fill in. Inserted straight
+//                      along the curve, neighbors would follow neighbors and
+//                      the tree would be as deep as for sorted input. The
+//                      seed is not used.
+//    NTO_FarthestFirst sqrt(n) objects, the first at random and each next the
+//                      farthest from those before it, then the rest at random
+//
+//=======================================================================
+inline void CompleteDelayedInsert ( const InsertionOrder order, const unsigned long seed )
+{
+    if ( m_DelayedIndices.empty( ) )
     {
+        return;
+    }
+    Thaw( );
 
-        size_t n = (size_t)((double)(vectorSize-1u) * (DistanceType)(rhr.urand()));
-        rhr.urand( ); rhr.urand( );
+    std::vector<long> sequence;
+    MakeInsertionOrder( order, seed, sequence );
+    for ( size_t i=0; i<sequence.size( ); ++i )
+    {
+        insertDelayed( sequence[i] );
+    }
 
-        // Find the next pointer that hasn't already had its object "insert"ed
-        // We can do this blindly since sqrt(n)<=n for all cases. n=1 would be the only
-        // bad case here, and that will not trigger the later loop.
-        while ( m_DelayedIndices[n] == -1 )
+    // now get rid of the temporary storage that was used for delayed
+    // insertions (fast way, faster than clear() )
+    std::vector<long> DelayedPointersTemp;
+    DelayedPointersTemp.swap( m_DelayedIndices );
+    m_DiamEstimate = m_BaseNode.GetDiamEstimate();
+    m_DimEstimateReady = false;
+    m_DelayedPending.store( false, std::memory_order_release );
+};
+
+//=======================================================================
+//  void CompleteDelayedInsertParallel ( const unsigned int threads = 0 )
+//
+//  CompleteDelayedInsert on up to threads threads (0 means one per hardware
+//  thread). The random sqrt(n) objects are inserted first, as usual, which
+//  fixes the top levels of the tree. Each remaining object is then routed
+//  down those levels to the subtree it belongs in, and the subtrees are
+//  built concurrently, each from its objects in their original order.
+//  The tree is the same as the one CompleteDelayedInsert would build from
+//  the same objects and the same random numbers, with the same depth and
+//  the same m_dMax bounds; only the sums behind GetMeanSpacing and
+//  GetVarSpacing may differ in their last bits, being added in another order.
+//  The exception is a tree that the depth watchdog has to fix: the serial
+//  build rebuilds subtrees as it goes (see WatchDepth), while this one is
+//  rebuilt whole at the end.
+//
+//=======================================================================
+inline void CompleteDelayedInsertParallel ( const unsigned int threads = 0 )
+{
+    if ( m_DelayedIndices.empty( ) )
+    {
+        return;
+    }
+    Thaw( );
+
+    // insert a random selection of the objects
+    InsertDelayedPrefix( );
+
+    // then route the remaining objects to the subtrees below it and build those
+    std::vector<long> remaining;
+    remaining.reserve( m_DelayedIndices.size( ) );
+    for ( size_t i=0; i<m_DelayedIndices.size( ); ++i )
+    {
+        if ( m_DelayedIndices[i] != -1 )
         {
-            ++n;
-            n = n% vectorSize;
+            remaining.push_back( m_DelayedIndices[i] );
         }
-        insertDelayed( (long)m_DelayedIndices[n] );
-        m_DelayedIndices[n] = -1;
     }
+    size_t deepestDepth = 0;
+    m_BaseNode.InserterParallel( remaining, deepestDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq, m_NodeArena,
+        threads == 0 ? std::max( std::thread::hardware_concurrency( ), 1u ) : threads );
+    if ( deepestDepth > m_DeepestDepth ) m_DeepestDepth = deepestDepth;
+
+    // the subtrees were built without the depth watchdog, so if one of
+    // them went too deep, the whole tree is rebuilt in random order
+    if ( m_DepthLimitFactor > 0.0 && (double)m_DeepestDepth > GetDepthLimit( ) )
+    {
+        m_DeepestDepth = m_BaseNode.Rebuild( 0, m_ObjectStore, m_NodeArena, rhr );
+        ++m_RebuildCount;
+    }
+
+    // now get rid of the temporary storage that was used for delayed
+    // insertions (fast way, faster than clear() )
+    std::vector<long> DelayedPointersTemp;
+    DelayedPointersTemp.swap( m_DelayedIndices );
+    m_DiamEstimate = m_BaseNode.GetDiamEstimate();
+    m_DimEstimateReady = false;
+    m_DelayedPending.store( false, std::memory_order_release );
+};
+
+//=======================================================================
+//  void BulkBuild ( const unsigned int threads = 0 )
+//
+//  Build the tree again, top down, from all of the objects held, the
+//  delayed ones included and the erased ones left out, on up to threads
+//  threads (0 means one per hardware thread). Where an insert puts an
+//  object in the first node with room for it, each node here gets a
+//  well-separated pair of the objects below it, an approximate farthest
+//  pair, and the others are split by which of the two they are nearer
+//  (see NearTreeNode::BulkBuild). The tree is an ordinary one, built to
+//  the same rule as an insert follows, so inserts, erase, Freeze and the
+//  searches go on as usual; it is just shallower, with smaller m_dMax
+//  bounds, than a tree built by inserting, above all on clustered data.
+//  Each level takes about 2n distances, so the build costs more than
+//  CompleteDelayedInsert. The depth watchdog is not needed, and the spacing
+//  sums are counted afresh.
+//
+//=======================================================================
+inline void BulkBuild ( const unsigned int threads = 0 )
+{
+    Thaw( );
+    std::vector<long> indices;
+    indices.reserve( size( ) );
+    const char* const erased = ErasedData( );
+    for ( size_t i=0; i<m_ObjectStore.size( ); ++i )
+    {
+        if ( Live( erased, i ) ) indices.push_back( (long)i );
+    }
+
+    m_BaseNode .clear( );
+    m_NodeArena.clear( );
+    m_SumSpacings   = DistanceType( 0 );
+    m_SumSpacingsSq = DistanceType( 0 );
+    m_DeepestDepth  = 0;
+    m_BaseNode.BulkBuild( indices, m_DeepestDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq, m_NodeArena,
+        threads == 0 ? std::max( std::thread::hardware_concurrency( ), 1u ) : threads );
 
     // now get rid of the temporary storage that was used for delayed
     // insertions (fast way, faster than clear() )
     std::vector<long> DelayedPointersTemp;
     DelayedPointersTemp.swap( m_DelayedIndices );
     m_DiamEstimate = m_BaseNode.GetDiamEstimate();
+    m_DimEstimateReady = false;
+    m_DelayedPending.store( false, std::memory_order_release );
 };
 
 //=======================================================================
@@ -2476,7 +3484,7 @@ size_t GetDeferredSize ( void ) const
 //=======================================================================
 DistanceType GetMeanSpacing (  void )
 {
-    return m_SumSpacings/DistanceType((1+m_ObjectStore.size()));
+    return m_SumSpacings/DistanceType((1+size()));
 }
 
 //=======================================================================
@@ -2488,8 +3496,8 @@ DistanceType GetMeanSpacing (  void )
 //=======================================================================
 DistanceType GetVarSpacing (  void )
 {
-    DistanceType meanSpacing = m_SumSpacings/DistanceType((1+m_ObjectStore.size()));
-    return m_SumSpacingsSq/DistanceType((1+m_ObjectStore.size()))-meanSpacing*meanSpacing;
+    DistanceType meanSpacing = m_SumSpacings/DistanceType((1+size()));
+    return m_SumSpacingsSq/DistanceType((1+size()))-meanSpacing*meanSpacing;
 }
 
 #ifndef CNEARTREE_INSTRUMENTED
@@ -2501,7 +3509,7 @@ DistanceType GetVarSpacing (  void )
 //  
 //
 //=======================================================================
-inline size_t GetNodeVisits (  void )
+inline size_t GetNodeVisits (  void ) const
 {
     return 0;
 }
@@ -2512,24 +3520,30 @@ inline size_t GetNodeVisits (  void )
 //=======================================================================
 //  size_t GetNodeVisits (  void )
 //
-//  Get the number of visits to nodes
+//  Get the number of visits to nodes made by the searches of the
+//  calling thread. The count is kept per thread rather than per tree,
+//  so that the searches can be const and any number of threads can
+//  search one tree without sharing a counter. (It covers all trees of
+//  this type searched by the thread, which makes no difference to the
+//  usual before-and-after use.) The batch searches add in the visits
+//  of their worker threads.
 //  
 //
 //=======================================================================
-inline size_t GetNodeVisits (  void )
+inline size_t GetNodeVisits (  void ) const
 {
-    return m_NodeVisits;
+    return NodeVisitCounter( );
 }
 //=======================================================================
 //  void SetNodeVisits (  const size_t visits )
 //
-//  Set the number of visits to nodes
+//  Set the calling thread's number of visits to nodes
 //  
 //
 //=======================================================================
-void SetNodeVisits (  const size_t visits )
+void SetNodeVisits (  const size_t visits ) const
 {
-    m_NodeVisits = visits;
+    NodeVisitCounter( ) = visits;
 }
 #endif    
 
@@ -2560,31 +3574,40 @@ double GetDimEstimate ( void )
 
 
 //=======================================================================
-//  size_t GetDimEstimate (  const double DimEstimateEsd )
+//  size_t GetDimEstimate (  const double DimEstimateEsd, const unsigned int threads = 0 )
 //
 //  Get an estimate of the dimension of the collection of points
 //  in the tree, to within the specified esd
-//  
+//
+//  Each trial counts the objects within two radii, r and r/1.1, of a
+//  randomly chosen object; the dimension is about the log of the ratio of
+//  the counts over log(1.1). The spheres are only counted (CountInSphere),
+//  never collected. The trials run a block at a time on up to threads
+//  threads (0 means one per hardware thread), each trial drawing its
+//  object from its own random stream, so the estimate is the same for any
+//  number of threads. They stop once the mean has the esd asked for. The
+//  estimate is kept until the tree changes; GetDimEstimateVisits and
+//  GetDimEstimateTrials give what it cost. These node visits are not
+//  added to GetNodeVisits.
 //
 //=======================================================================
-double GetDimEstimate ( const double DimEstimateEsd )
+double GetDimEstimate ( const double DimEstimateEsd, const unsigned int threads = 0 )
 {
     const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
     if ( m_DimEstimate == DBL_MAX ) return ( 0. );
     if ( m_DimEstimate > 0. 
         && (m_DimEstimateEsd <= DimEstimateEsd || DimEstimateEsd <= 0.) ) return (m_DimEstimate);
-    size_t estsize = m_ObjectStore.size();
-    std::vector<T> sampledisklarge;
-    std::vector<T> sampledisksmall;
+    m_DimEstimateVisits = 0;
+    m_DimEstimateTrials = 0;
+    size_t estsize = size();
     size_t trials;
     double estd;
     double estdim = 0.;
     double estdimsq = 0.;
     double testlim = (DimEstimateEsd<=0.)?0.01:(DimEstimateEsd*DimEstimateEsd);
-    DistanceType meanSpacing = m_SumSpacings/DistanceType((1+m_ObjectStore.size()));
+    DistanceType meanSpacing = m_SumSpacings/DistanceType((1+size()));
     size_t n;
-    long poplarge, popsmall, poptrial;
-    T probe = m_ObjectStore[0];
+    long poptrial;
     
     
     /*  Do not try to get a dimension extimate with fewer than
@@ -2612,10 +3635,18 @@ double GetDimEstimate ( const double DimEstimateEsd )
     shrinkfactor = 4.;
     do { 
         shrinkfactor = shrinkfactor/1.2;
-        n = (size_t)(((double)estsize-1u) * ((DistanceType)rhr.urand()));
+        // an erased object is no center for a sphere; size() >= 32 says a live one is there
+        do {
+            n = (size_t)(((double)StoreSize( )-1u) * ((DistanceType)rhr.urand()));
+        } while ( ! Live( ErasedData( ), n ) );
         rhr.urand( ); rhr.urand( );
-        probe = m_ObjectStore[n];
-        poptrial=FindInSphere((DistanceType)targetradius/shrinkfactor,sampledisklarge,probe);
+        IgnoreFound ignore;
+        poptrial = SearchForEachInSphere( (DistanceType)targetradius/shrinkfactor, ignore, ObjectData( )[n]
+#ifdef CNEARTREE_INSTRUMENTED
+                                        , m_DimEstimateVisits
+#endif
+                                        );
+        ++m_DimEstimateTrials;
     } while (poptrial < 256 && shrinkfactor > 1.);
     
     targetradius /= shrinkfactor;
@@ -2624,26 +3655,38 @@ double GetDimEstimate ( const double DimEstimateEsd )
     int goodtrials = 0;
     trials = (size_t)sqrt(0.5+(double)estsize);
     if (trials < 20) trials = 20;
-        
-    n = (size_t)(((double)estsize-1u) * ((DistanceType)rhr.urand()));
-    rhr.urand( ); rhr.urand( );
-    probe = m_ObjectStore[n];
-    
-     
-    for(size_t ii = 0; ii < trials; ii++) {
-        n = (size_t)(((double)estsize-1u) * ((DistanceType)rhr.urand()));
-        rhr.urand( ); rhr.urand( );
-        probe = m_ObjectStore[n];
-        
-        if ((poplarge=FindInSphere((DistanceType)targetradius,sampledisklarge,probe))>0
-            &&(popsmall=FindInSphere((DistanceType)(targetradius/1.1),sampledisksmall,probe))>0 )
+
+    // the trials, a block at a time; they are added up in order, so the
+    // last block may hold a few more than were needed
+    const unsigned long long seedBase = (unsigned long long)rhr.random( );
+    const unsigned int nThreads = ( threads == 0 ) ? std::max( std::thread::hardware_concurrency( ), 1u ) : threads;
+    const size_t blockSize = std::max( (size_t)MinDimTrials, (size_t)nThreads );
+    std::vector<long>   popLarge( blockSize );
+    std::vector<long>   popSmall( blockSize );
+    std::vector<size_t> visits( blockSize );
+    bool converged = false;
+    for ( size_t first=0; first<trials && !converged; first+=blockSize )
+    {
+        const size_t block = std::min( blockSize, trials-first );
+        const DimTrialWorker worker( this, seedBase, first, (DistanceType)targetradius,
+                                     &popLarge[0], &popSmall[0], &visits[0] );
+        RunBatch( block, nThreads, worker, 1 );
+        for ( size_t ii=0; ii<block && !converged; ++ii )
         {
-            rat = (double)poplarge/(double)popsmall;
-            estd = log(rat)/log(1.1);
-            estdim += estd;
-            estdimsq += estd*estd;
-            goodtrials++;
-            if (estdimsq/((double)goodtrials) - estdim*estdim/((double)(goodtrials*goodtrials)) <= testlim) break;
+            m_DimEstimateVisits += visits[ii];
+            m_DimEstimateTrials += ( popLarge[ii] > 0 ) ? 2 : 1;
+            if ( popLarge[ii] > 0 && popSmall[ii] > 0 )
+            {
+                rat = (double)popLarge[ii]/(double)popSmall[ii];
+                estd = log(rat)/log(1.1);
+                estdim += estd;
+                estdimsq += estd*estd;
+                goodtrials++;
+                // the variance of the mean of the trials so far
+                if ( goodtrials >= (int)MinDimTrials &&
+                     (estdimsq/((double)goodtrials) - estdim*estdim/((double)goodtrials*goodtrials))/((double)goodtrials) <= testlim )
+                    converged = true;
+            }
         }
     }
     if (goodtrials < 1) {
@@ -2651,11 +3694,30 @@ double GetDimEstimate ( const double DimEstimateEsd )
         return(0);
     }
     m_DimEstimate = estdim/((double)goodtrials);
-    m_DimEstimateEsd = sqrt(estdimsq/((double)goodtrials) -  m_DimEstimate*m_DimEstimate);
+    m_DimEstimateEsd = sqrt(std::max(0., estdimsq/((double)goodtrials) -  m_DimEstimate*m_DimEstimate)/((double)goodtrials));
     if (m_DimEstimate + 3.*m_DimEstimateEsd< 0.) {
         m_DimEstimate = m_DimEstimateEsd = DBL_MAX;
+        return(0);
     }
-    return(estdim);
+    return(m_DimEstimate);
+};
+
+//=======================================================================
+//  size_t GetDimEstimateVisits ( void ) const
+//  size_t GetDimEstimateTrials ( void ) const
+//
+//  What the last dimension estimate cost: the node visits of its searches,
+//  and the number of spheres it counted.
+//
+//=======================================================================
+size_t GetDimEstimateVisits ( void ) const
+{
+    return ( m_DimEstimateVisits );
+};
+
+size_t GetDimEstimateTrials ( void ) const
+{
+    return ( m_DimEstimateTrials );
 };
 
 
@@ -2663,19 +3725,19 @@ double GetDimEstimate ( const double DimEstimateEsd )
 //  size_t GetTotalSize (  void )
 //
 //  The total number of objects that have been inserted plus those
-//  queued for insertion.
+//  queued for insertion, less those erased.
 //
 //=======================================================================
 size_t GetTotalSize ( void ) const
 {
-    return ( m_ObjectStore.size( ) );
+    return ( StoreSize( ) - m_ErasedCount );
 };
 
 //=======================================================================
 //  size_t size ( void )
 //
 //  The total number of objects that have been inserted plus those
-//  queued for insertion.
+//  queued for insertion, less those erased.
 //
 //=======================================================================
 size_t size ( void ) const
@@ -2694,26 +3756,402 @@ size_t GetDepth ( void ) const
     return ( m_DeepestDepth );
 };
 
-
 //=======================================================================
-//  T Centroid ( void ) const
+//  size_t GetRebuildCount ( void ) const
 //
-//  compute the centroid of a neartree
+//  The number of subtrees the depth watchdog has rebuilt, see WatchDepth.
 //
 //=======================================================================
-T Centroid( void ) const
+size_t GetRebuildCount ( void ) const
 {
-    T t( T(0.0) );
-    const unsigned int count = m_ObjectStore.size( );
+    return ( m_RebuildCount );
+};
 
-    if ( count == 0 )
+//=======================================================================
+//  size_t GetErasedCount ( void ) const
+//
+//  The number of objects that have been erased but are still held,
+//  waiting for the tree to be compacted.
+//
+//=======================================================================
+size_t GetErasedCount ( void ) const
+{
+    return ( m_ErasedCount );
+};
+
+//=======================================================================
+//  size_t GetNodeCount ( void ) const
+//
+//  The number of nodes in the tree, including the base node.
+//
+//=======================================================================
+size_t GetNodeCount ( void ) const
+{
+    return ( m_Snapshot ? (size_t)m_Snapshot->GetHeader( ).m_NodeCount : m_NodeArena.GetNodeCount( ) + 1 );
+};
+
+//=======================================================================
+//  size_t GetNodeBytes ( void ) const
+//
+//  The number of bytes of storage held for the nodes of the tree,
+//  including space reserved in the NodeArena but not yet handed out.
+//
+//=======================================================================
+size_t GetNodeBytes ( void ) const
+{
+    return ( m_NodeArena.GetBytes( ) + sizeof( m_BaseNode ) + m_FrozenNodes.capacity( )*sizeof( FrozenNode )
+             + m_BucketObjects.capacity( )*sizeof( T ) + m_BucketIndices.capacity( )*sizeof( unsigned int ) );
+};
+
+//=======================================================================
+//  bool Freeze ( void )
+//
+//  Copy the finished tree into m_FrozenNodes, one FrozenNode per node in
+//  depth-first order, so that the left descendant of a node is the next
+//  element of the array and a search mostly walks forward through memory.
+//  The links and object indices are 32 bits, and each bound is stored next
+//  to the object it belongs to, so a node is half the size of a NearTreeNode
+//  on 64-bit systems. The linked nodes are kept, since the Left*, Farthest,
+//  OutSphere and K_Far searches still use them, and any later insert
+//  discards the frozen copy (see Thaw).
+//
+//  If bucketSize is 2 or more, the subtrees of at most bucketSize objects
+//  are then made into leaf buckets (see MakeLeafBuckets).
+//
+//  Returns true if the tree is now frozen.
+//
+//=======================================================================
+enum { MaxLeafBucket = 256 };  // the largest leaf bucket Freeze will make
+
+bool Freeze ( const size_t bucketSize = 0 )
+{
+    CompleteDelayedInsert( );
+    Thaw( );
+    if ( m_ObjectStore.size( ) >= (size_t)FrozenBucket || GetNodeCount( ) >= (size_t)FrozenBucket )
+    {
+        return ( false );
+    }
+    m_BaseNode.Flatten( m_FrozenNodes, GetNodeCount( ) );
+    if ( bucketSize >= 2 )
+    {
+        MakeLeafBuckets( (std::min)( bucketSize, size_t( MaxLeafBucket ) ) );
+    }
+    return ( true );
+}
+
+//=======================================================================
+//  void MakeLeafBuckets ( const size_t bucketSize )
+//
+//  Rebuild m_FrozenNodes, in the same order, with each largest subtree of
+//  at most bucketSize objects replaced by one bucket node. The objects of
+//  a bucket are copied, in the order Flatten left them, into a run of
+//  m_BucketObjects, with their positions in m_ObjectStore in the same run
+//  of m_BucketIndices. A bucket node has FrozenBucket as its left branch,
+//  the start of its run as its left object and the length of the run as
+//  its right object; its bounds are not used, since its parent's bounds
+//  already cover the whole subtree.
+//
+//=======================================================================
+void MakeLeafBuckets ( const size_t bucketSize )
+{
+    std::vector<FrozenNode> full;
+    full.swap( m_FrozenNodes );
+
+    // the number of objects below each node; a node's branches come after it
+    std::vector<size_t> count( full.size( ) );
+    for ( size_t i=full.size( ); i-- > 0; )
+    {
+        const FrozenNode& node = full[i];
+        count[i] = ( node.m_ptLeft  != FrozenNone ? 1 : 0 )
+                 + ( node.m_ptRight != FrozenNone ? 1 : 0 )
+                 + ( node.m_pLeftBranch  != FrozenNone ? count[node.m_pLeftBranch]  : 0 )
+                 + ( node.m_pRightBranch != FrozenNone ? count[node.m_pRightBranch] : 0 );
+    }
+
+    // each entry is a node of full still to be copied and the branch that is
+    // to point to it, as in Flatten
+    std::vector<std::pair<unsigned int, size_t> > sStack;
+    std::vector<unsigned int> sGather;
+    m_BucketIndices.reserve( m_ObjectStore.size( ) );
+    sStack.push_back( std::make_pair( 0u, (size_t)ULONG_MAX ) );
+    while ( !sStack.empty( ) )
+    {
+        const unsigned int from = sStack.back( ).first;
+        const size_t branch = sStack.back( ).second;
+        sStack.pop_back( );
+        const unsigned int position = (unsigned int)m_FrozenNodes.size( );
+        if ( branch != ULONG_MAX )
+        {
+            if ( branch%2 == 0 ) m_FrozenNodes[branch/2].m_pLeftBranch  = position;
+            else                 m_FrozenNodes[branch/2].m_pRightBranch = position;
+        }
+        FrozenNode node = full[from];
+        if ( count[from] <= bucketSize && node.m_ptLeft != FrozenNone )
+        {
+            node.m_ptLeft       = (unsigned int)m_BucketIndices.size( );
+            node.m_ptRight      = (unsigned int)count[from];
+            node.m_pLeftBranch  = FrozenBucket;
+            node.m_pRightBranch = FrozenNone;
+            sGather.push_back( from );
+            while ( !sGather.empty( ) )
+            {
+                const FrozenNode& g = full[sGather.back( )];
+                sGather.pop_back( );
+                if ( g.m_ptLeft  != FrozenNone ) m_BucketIndices.push_back( g.m_ptLeft );
+                if ( g.m_ptRight != FrozenNone ) m_BucketIndices.push_back( g.m_ptRight );
+                if ( g.m_pRightBranch != FrozenNone ) sGather.push_back( g.m_pRightBranch );
+                if ( g.m_pLeftBranch  != FrozenNone ) sGather.push_back( g.m_pLeftBranch );
+            }
+            m_FrozenNodes.push_back( node );
+            continue;
+        }
+        node.m_pLeftBranch  = FrozenNone;
+        node.m_pRightBranch = FrozenNone;
+        m_FrozenNodes.push_back( node );
+        if ( full[from].m_pRightBranch != FrozenNone )
+            sStack.push_back( std::make_pair( full[from].m_pRightBranch, 2*(size_t)position+1 ) );
+        if ( full[from].m_pLeftBranch != FrozenNone )
+            sStack.push_back( std::make_pair( full[from].m_pLeftBranch, 2*(size_t)position ) );
+    }
+
+    m_BucketObjects.reserve( m_BucketIndices.size( ) );
+    for ( size_t i=0; i<m_BucketIndices.size( ); ++i )
+    {
+        m_BucketObjects.push_back( m_ObjectStore[m_BucketIndices[i]] );
+    }
+    m_LeafBucketSize = bucketSize;
+}  //  end MakeLeafBuckets
+
+//=======================================================================
+//  size_t GetLeafBucketSize ( void ) const
+//
+//  the largest leaf bucket of the frozen copy, 0 if there are none
+//
+//=======================================================================
+size_t GetLeafBucketSize ( void ) const
+{
+    return ( m_LeafBucketSize );
+}
+
+//=======================================================================
+//  void Thaw ( void )
+//
+//  Discard the frozen copy of the tree, if there is one
+//
+//=======================================================================
+void Thaw ( void )
+{
+    UnmapSnapshot( );
+    if ( ! m_FrozenNodes.empty( ) )
+    {
+        std::vector<FrozenNode> vtemp;
+        m_FrozenNodes.swap( vtemp );
+        std::vector<T> vtempT;
+        m_BucketObjects.swap( vtempT );
+        std::vector<unsigned int> vtempIndices;
+        m_BucketIndices.swap( vtempIndices );
+        m_LeafBucketSize = 0;
+    }
+}
+
+//=======================================================================
+//  bool IsFrozen ( void ) const
+//
+//  true if the searches are using the frozen copy of the tree
+//
+//=======================================================================
+bool IsFrozen ( void ) const
+{
+    return ( m_Snapshot || ! m_FrozenNodes.empty( ) );
+}
+
+//=======================================================================
+//  bool IsOpened ( void ) const
+//
+//  true if the searches are reading a file mapped by Open
+//
+//=======================================================================
+bool IsOpened ( void ) const
+{
+    return ( m_Snapshot != 0 );
+}
+
+//=======================================================================
+//  bool Save ( const std::string& path )
+//
+//  Write the tree to path, in the layout of SnapshotHeader, for Open to
+//  map. The nodes are written as Flatten lays them out, for Open to link
+//  again when it has to, and if the tree is frozen with leaf buckets, the
+//  frozen copy is written as well, for the searches. Nothing in the file
+//  depends on where it is loaded, so the objects have to be plain values
+//  that hold all of their data (see CNearTreeSnapshot).
+//
+//  The file is written under a temporary name and then renamed, so a tree
+//  that has the old file open goes on reading it undisturbed.
+//
+//  Returns true if the file was written.
+//
+//=======================================================================
+bool Save ( const std::string& path )
+{
+    if ( ! CNearTreeSnapshot<T>::Available || ! std::is_trivially_copyable<T>::value || m_ErasedCount > 0 )
+    {
+        return ( false );
+    }
+    CompleteDelayedInsert( );
+    if ( size( ) >= (size_t)FrozenBucket || GetNodeCount( ) >= (size_t)FrozenBucket )
+    {
+        return ( false );
+    }
+
+    // the whole tree, and the frozen copy if that is not the same
+    std::vector<FrozenNode> flattened;
+    const FrozenNode* nodes = 0;
+    if ( m_Snapshot )
+    {
+        nodes = m_Snapshot->Nodes( );
+    }
+    else if ( IsFrozen( ) && m_LeafBucketSize == 0 )
+    {
+        nodes = &m_FrozenNodes[0];
+    }
+    else
+    {
+        m_BaseNode.Flatten( flattened, GetNodeCount( ) );
+        nodes = &flattened[0];
+    }
+    const bool buckets = IsFrozen( ) && m_LeafBucketSize > 0;
+    const size_t searchNodeCount = !buckets ? 0 :
+        m_Snapshot ? (size_t)m_Snapshot->GetHeader( ).m_SearchNodeCount : m_FrozenNodes.size( );
+    const size_t bucketCount = !buckets ? 0 :
+        m_Snapshot ? (size_t)m_Snapshot->GetHeader( ).m_BucketCount : m_BucketIndices.size( );
+
+    SnapshotHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.m_Magic, SnapshotHeader::Magic( ), sizeof( header.m_Magic ) );
+    header.m_ByteOrder          = SnapshotHeader::ByteOrder;
+    header.m_ObjectBytes        = (unsigned int)sizeof( T );
+    header.m_DistanceBytes      = (unsigned int)sizeof( DistanceType );
+    header.m_NodeBytes          = (unsigned int)sizeof( FrozenNode );
+    header.m_ObjectCount        = size( );
+    header.m_NodeCount          = GetNodeCount( );
+    header.m_SearchNodeCount    = buckets ? searchNodeCount : GetNodeCount( );
+    header.m_BucketCount        = bucketCount;
+    header.m_ObjectOffset       = SnapshotHeader::Align( sizeof( header ) );
+    header.m_NodeOffset         = SnapshotHeader::Align( header.m_ObjectOffset + header.m_ObjectCount*sizeof( T ) );
+    header.m_SearchNodeOffset   = !buckets ? header.m_NodeOffset :
+        SnapshotHeader::Align( header.m_NodeOffset + header.m_NodeCount*sizeof( FrozenNode ) );
+    header.m_BucketObjectOffset = SnapshotHeader::Align( header.m_SearchNodeOffset + header.m_SearchNodeCount*sizeof( FrozenNode ) );
+    header.m_BucketIndexOffset  = SnapshotHeader::Align( header.m_BucketObjectOffset + header.m_BucketCount*sizeof( T ) );
+    header.m_FileBytes          = header.m_BucketIndexOffset + header.m_BucketCount*sizeof( unsigned int );
+    header.m_DeepestDepth       = m_DeepestDepth;
+    header.m_LeafBucketSize     = buckets ? m_LeafBucketSize : 0;
+    header.m_DiamEstimate       = (double)m_DiamEstimate;
+    header.m_SumSpacings        = (double)m_SumSpacings;
+    header.m_SumSpacingsSq      = (double)m_SumSpacingsSq;
+    header.m_DimEstimate        = m_DimEstimate;
+    header.m_DimEstimateEsd     = m_DimEstimateEsd;
+    header.m_DimEstimateReady   = m_DimEstimateReady.load( ) ? 1 : 0;
+
+    const std::string temporary = path + ".tmp";
+    FILE* const file = fopen( temporary.c_str( ), "wb" );
+    if ( file == 0 )
+    {
+        return ( false );
+    }
+    unsigned long long position = 0;
+    bool written = WriteSnapshotPart( file, position, 0, &header, sizeof( header ) )
+        && WriteSnapshotPart( file, position, header.m_ObjectOffset, ObjectData( ), header.m_ObjectCount*sizeof( T ) )
+        && WriteSnapshotPart( file, position, header.m_NodeOffset, nodes, header.m_NodeCount*sizeof( FrozenNode ) );
+    if ( buckets )
+    {
+        written = written
+            && WriteSnapshotPart( file, position, header.m_SearchNodeOffset, FrozenNodeData( ), searchNodeCount*sizeof( FrozenNode ) )
+            && WriteSnapshotPart( file, position, header.m_BucketObjectOffset, BucketObjectData( ), bucketCount*sizeof( T ) )
+            && WriteSnapshotPart( file, position, header.m_BucketIndexOffset, BucketIndexData( ), bucketCount*sizeof( unsigned int ) );
+    }
+    written = written && WriteSnapshotPart( file, position, header.m_FileBytes, 0, 0 );
+    written = ( fclose( file ) == 0 ) && written;
+    if ( written )
+    {
+#if defined( _WIN32 )
+        remove( path.c_str( ) );  // rename will not replace a file there
+#endif
+        written = ( rename( temporary.c_str( ), path.c_str( ) ) == 0 );
+    }
+    if ( ! written )
+    {
+        remove( temporary.c_str( ) );
+    }
+    return ( written );
+}
+
+//=======================================================================
+//  bool Open ( const std::string& path )
+//
+//  Replace the contents of the tree with a file written by Save. The file
+//  is mapped into memory read-only and the tree searches it where it is:
+//  the frozen copy, objects and all, is read straight from the mapping, so
+//  the pages of the objects are read only as the searches touch them. The
+//  header is checked, and so is every node (see Snapshot::Check), so that
+//  a damaged file is refused rather than read out of bounds. The searches
+//  that need the linked nodes build them from the
+//  file the first time (see LinkSnapshotForSearch), and anything that
+//  changes the tree copies it out of the file and releases the mapping
+//  (see UnmapSnapshot). Copies of the tree share the mapping.
+//
+//  Returns true if the tree now holds the file; otherwise it is unchanged.
+//
+//=======================================================================
+bool Open ( const std::string& path )
+{
+    if ( ! CNearTreeSnapshot<T>::Available || ! std::is_trivially_copyable<T>::value )
+    {
+        return ( false );
+    }
+    std::shared_ptr<Snapshot> snapshot( new Snapshot );
+    if ( ! snapshot->Map( path ) )
+    {
+        return ( false );
+    }
+
+    clear( );
+    const SnapshotHeader& header = snapshot->GetHeader( );
+    // no path down the nodes is longer than there are nodes
+    m_DeepestDepth     = (size_t)std::min( header.m_DeepestDepth, header.m_NodeCount );
+    m_LeafBucketSize   = (size_t)header.m_LeafBucketSize;
+    m_DiamEstimate     = DistanceType( header.m_DiamEstimate );
+    m_SumSpacings      = DistanceType( header.m_SumSpacings );
+    m_SumSpacingsSq    = DistanceType( header.m_SumSpacingsSq );
+    m_DimEstimate      = header.m_DimEstimate;
+    m_DimEstimateEsd   = header.m_DimEstimateEsd;
+    m_DimEstimateReady = ( header.m_DimEstimateReady != 0 );
+    m_Snapshot         = snapshot;
+    m_LinkPending      = true;
+    return ( true );
+}
+
+
+//=======================================================================
+//  T Centroid ( void ) const
+//
+//  compute the centroid of a neartree
+//
+//=======================================================================
+T Centroid( void ) const
+{
+    T t( T(0.0) );
+    const unsigned int count = size( );
+    const char* const erased = ErasedData( );
+
+    if ( count == 0 )
     {
     }
     else
     {
-        for ( unsigned int i=0; i<count; ++i )
+        for ( size_t i=0; i<StoreSize( ); ++i )
         {
-            t += m_ObjectStore[i];
+            if ( Live( erased, i ) ) t += ObjectData( )[i];
         }
         t = T( DistanceType(t) / DistanceType(count) );
     }
@@ -2752,11 +4190,23 @@ static T Centroid(  CentroidContainerType& vt )
 //  std::vector<T> GetObjectStore ( void ) const
 //
 //  Utility function to copy the data object to a user's container object.
+//  Erased objects are left out, so the positions in it are the indices
+//  only if nothing has been erased since the last compaction.
 //
 //=======================================================================
 std::vector<T> GetObjectStore ( void ) const
 {
-    return ( m_ObjectStore );
+    if ( m_ErasedCount == 0 )
+    {
+        return ( std::vector<T>( ObjectData( ), ObjectData( )+StoreSize( ) ) );
+    }
+    std::vector<T> live;
+    live.reserve( size( ) );
+    for ( size_t i=0; i<StoreSize( ); ++i )
+    {
+        if ( m_Erased[i] == 0 ) live.push_back( ObjectData( )[i] );
+    }
+    return ( live );
 }
 
 
@@ -2769,19 +4219,19 @@ std::vector<T> GetObjectStore ( void ) const
 template<typename ContainerType>
 operator ContainerType ( void ) const
 {
-    return ( m_ObjectStore );
+    return ( GetObjectStore( ) );
 }
 
 public:
-iterator begin ( void ) { return ( iterator( 0, this ) ); };
-iterator end   ( void ) { return ( iterator( m_ObjectStore.empty( )? 1 :(long)m_ObjectStore.size( )  , this ) ); };
-iterator back  ( void ) { return ( iterator( m_ObjectStore.empty( )? 1 :(long)m_ObjectStore.size( )-1, this ) ); };
-const_iterator begin ( void ) const { return ( const_iterator( 0, this ) ); };
-const_iterator end   ( void ) const { return ( const_iterator( m_ObjectStore.empty( )? 1 :(long)m_ObjectStore.size( )  , this ) ); };
-const_iterator back  ( void ) const { return ( const_iterator( m_ObjectStore.empty( )? 1 :(long)m_ObjectStore.size( )-1, this ) ); };
+iterator begin ( void ) { return ( iterator( NextLive( 0 ), this ) ); };
+iterator end   ( void ) { return ( iterator( empty( )? 1 :(long)StoreSize( )  , this ) ); };
+iterator back  ( void ) { return ( iterator( empty( )? 1 :PreviousLive( (long)StoreSize( )-1 ), this ) ); };
+const_iterator begin ( void ) const { return ( const_iterator( NextLive( 0 ), this ) ); };
+const_iterator end   ( void ) const { return ( const_iterator( empty( )? 1 :(long)StoreSize( )  , this ) ); };
+const_iterator back  ( void ) const { return ( const_iterator( empty( )? 1 :PreviousLive( (long)StoreSize( )-1 ), this ) ); };
 
-T at( const size_t n ) const { return ( m_ObjectStore[n] ); };
-T operator[] ( const size_t position ) const { return ( m_ObjectStore[position] ); };
+T at( const size_t n ) const { return ( ObjectData( )[n] ); };
+T operator[] ( const size_t position ) const { return ( ObjectData( )[position] ); };
 
 
 private:
@@ -2790,68 +4240,1366 @@ private:
 void insertDelayed ( const long n )
 {
     size_t localDepth = 0;
-    m_BaseNode.InserterDelayed( n, localDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq );
-    if ( localDepth > m_DeepestDepth ) m_DeepestDepth = localDepth;
+    m_BaseNode.InserterDelayed( n, localDepth, m_ObjectStore, m_SumSpacings, m_SumSpacingsSq, m_NodeArena );
+    WatchDepth( n, localDepth );
 }
 
 //=======================================================================
+//  void WatchDepth ( const long n, const size_t localDepth )
+//
+//  The depth watchdog, called after object n has been inserted at level
+//  localDepth. If that is deeper than GetDepthLimit( ), the smallest
+//  subtree on the way down to n that is too deep for its size is found
+//  (see NearTreeNode::FindScapegoat) and rebuilt in random order. As in
+//  a scapegoat tree, a subtree is rebuilt only once enough inserts have
+//  deepened it, so objects arriving in sorted order cost about n*log(n)
+//  to insert instead of n*n.
+//
+//  No order can make coincident objects shallower: they all go the same
+//  way at every node. So a scapegoat whose objects all coincide is left
+//  as it is, and after that, or after a rebuild that leaves the tree still
+//  too deep, the watchdog rests until the number of objects has doubled.
+//  Duplicate objects then cost little more than with no watchdog at all,
+//  instead of a rebuild for every insert.
+//
+//  m_DeepestDepth is raised to the depth reached, but not lowered when a
+//  rebuild makes the tree shallower, so it remains an upper bound.
+//
 //=======================================================================
+void WatchDepth ( const long n, const size_t localDepth )
+{
+    if ( m_DepthLimitFactor <= 0.0 || (double)localDepth <= GetDepthLimit( )
+         || m_ObjectStore.size( ) < m_WatchdogResume )
+    {
+        if ( localDepth > m_DeepestDepth ) m_DeepestDepth = localDepth;
+        return;
+    }
+    size_t level = 0;
+    NearTreeNode<T, DistanceType, distMinValue>* const pScapegoat =
+        m_BaseNode.FindScapegoat( n, m_DepthLimitFactor, level, m_ObjectStore );
+    if ( pScapegoat->AllCoincide( m_ObjectStore ) )
+    {
+        if ( localDepth > m_DeepestDepth ) m_DeepestDepth = localDepth;
+        m_WatchdogResume = 2*m_ObjectStore.size( );
+        return;
+    }
+    const size_t rebuiltDepth = pScapegoat->Rebuild( level, m_ObjectStore, m_NodeArena, rhr );
+    if ( rebuiltDepth > m_DeepestDepth ) m_DeepestDepth = rebuiltDepth;
+    ++m_RebuildCount;
+    if ( (double)rebuiltDepth > GetDepthLimit( ) )
+    {
+        m_WatchdogResume = 2*m_ObjectStore.size( );
+    }
+}
+
 //=======================================================================
+//  double GetDepthLimit ( void ) const
+//
+//  c*log2(n), the depth beyond which WatchDepth rebuilds
+//
 //=======================================================================
+double GetDepthLimit ( void ) const
+{
+    const double n = (double)std::max( m_ObjectStore.size( ), (size_t)2 );
+    return ( m_DepthLimitFactor*::log( n )/::log( 2.0 ) );
+}
+
 //=======================================================================
+//  void InsertDelayedPrefix ( void )
+//
+//  Insert sqrt(n) randomly chosen delayed objects, marking each one -1 in
+//  m_DelayedIndices. This is the start of CompleteDelayedInsert and of
+//  CompleteDelayedInsertParallel, which then insert the rest in order.
+//
 //=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//  end of CNearTree
-//=======================================================================
-template<typename U> class KT : U
+void InsertDelayedPrefix ( void )
+{
+    const size_t vectorSize = m_DelayedIndices.size( );
+    const size_t toRandomlyInsert = (size_t)::sqrt( (double)vectorSize );
+    for ( size_t i=0; i<toRandomlyInsert; ++i )
     {
-    private:
-        DistanceType d;
-        KT( void ) : U() { };
-    };
 
+        size_t n = (size_t)((double)(vectorSize-1u) * (DistanceType)(rhr.urand()));
+        rhr.urand( ); rhr.urand( );
 
+        // Find the next pointer that hasn't already had its object "insert"ed
+        // We can do this blindly since sqrt(n)<=n for all cases. n=1 would be the only
+        // bad case here, and that will not trigger the later loop.
+        while ( m_DelayedIndices[n] == -1 )
+        {
+            ++n;
+            n = n% vectorSize;
+        }
+        insertDelayed( (long)m_DelayedIndices[n] );
+        m_DelayedIndices[n] = -1;
+    }
+}
 
-// start of nested class NearTreeNode
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
-//=======================================================================
 //=======================================================================
+//  void MakeInsertionOrder ( const InsertionOrder order, const unsigned long seed,
+//                            std::vector<long>& sequence ) const
+//
+//  The objects of m_DelayedIndices in the order in which
+//  CompleteDelayedInsert( order, seed ) inserts them.
+//
 //=======================================================================
+void MakeInsertionOrder ( const InsertionOrder order, const unsigned long seed,
+                          std::vector<long>& sequence ) const
+{
+    const size_t n = m_DelayedIndices.size( );
+    std::mt19937_64 rng( seed );
+    sequence.clear( );
+    sequence.reserve( n );
+
+    if ( order == NTO_Shuffle )
+    {
+        sequence = m_DelayedIndices;
+        Shuffle( sequence, 0, rng );
+    }
+    else if ( order == NTO_Morton || order == NTO_Hilbert )
+    {
+        std::vector<std::pair<unsigned long long, long> > keyed;
+        CurveKeys( order, keyed );
+        std::sort( keyed.begin( ), keyed.end( ) );
+        int bits = 0;
+        while ( ( (size_t)1 << bits ) < n ) ++bits;
+        for ( size_t i=0; i < ( (size_t)1 << bits ); ++i )
+        {
+            size_t r = 0;
+            for ( int b=0; b<bits; ++b )
+            {
+                if ( ( i >> b ) & 1 ) r |= (size_t)1 << ( bits-1-b );
+            }
+            if ( r < n ) sequence.push_back( keyed[r].second );
+        }
+    }
+    else if ( order == NTO_FarthestFirst )
+    {
+        // Gonzalez's farthest-first traversal, for the top of the tree only:
+        // it takes n distances for each object chosen
+        const size_t toChoose = (size_t)::sqrt( (double)n );
+        std::vector<DistanceType> dNearest( n, std::numeric_limits<DistanceType>::max( ) );
+        std::vector<char> chosen( n, 0 );
+        size_t next = (size_t)( rng( ) % n );
+        for ( size_t j=0; j<toChoose; ++j )
+        {
+            chosen[next] = 1;
+            sequence.push_back( m_DelayedIndices[next] );
+            const T& tChosen = m_ObjectStore[m_DelayedIndices[next]];
+            size_t farthest = next;
+            for ( size_t i=0; i<n; ++i )
+            {
+                if ( chosen[i] ) continue;
+                const DistanceType d = DistanceBetween( m_ObjectStore[m_DelayedIndices[i]], tChosen );
+                if ( d < dNearest[i] ) dNearest[i] = d;
+                if ( farthest == next || dNearest[i] > dNearest[farthest] ) farthest = i;
+            }
+            next = farthest;
+        }
+        for ( size_t i=0; i<n; ++i )
+        {
+            if ( !chosen[i] ) sequence.push_back( m_DelayedIndices[i] );
+        }
+        Shuffle( sequence, toChoose, rng );
+    }
+    else // NTO_SqrtPrefix
+    {
+        const size_t toChoose = (size_t)::sqrt( (double)n );
+        std::vector<size_t> positions( n );
+        for ( size_t i=0; i<n; ++i ) positions[i] = i;
+        std::vector<char> chosen( n, 0 );
+        for ( size_t j=0; j<toChoose; ++j )
+        {
+            std::swap( positions[j], positions[j + (size_t)( rng( ) % ( n-j ) )] );
+            chosen[positions[j]] = 1;
+            sequence.push_back( m_DelayedIndices[positions[j]] );
+        }
+        for ( size_t i=0; i<n; ++i )
+        {
+            if ( !chosen[i] ) sequence.push_back( m_DelayedIndices[i] );
+        }
+    }
+}
+
 //=======================================================================
+//  void Shuffle ( std::vector<long>& v, const size_t first, std::mt19937_64& rng )
+//
+//  Fisher-Yates shuffle of v from position first to the end
+//
 //=======================================================================
+static void Shuffle ( std::vector<long>& v, const size_t first, std::mt19937_64& rng )
+{
+    for ( size_t i=v.size( ); i>first+1; --i )
+    {
+        std::swap( v[i-1], v[first + (size_t)( rng( ) % ( i-first ) )] );
+    }
+}
 
 //=======================================================================
+//  void CurveKeys ( const InsertionOrder order,
+//                   std::vector<std::pair<unsigned long long, long> >& keyed ) const
 //
-// NEARTREENODE - nested class to hold the actual neartree and the indices to its data objects
+//  The place of each object of m_DelayedIndices on the Morton or Hilbert
+//  curve, paired with the object. The coordinates (see CurveCoordinates)
+//  are scaled to the box around the objects, and cut to as many bits as
+//  fit in 64 for all of them.
 //
-// For the description of the template parameters, see the text above in the description
-// of CNearTree.
 //=======================================================================
-template <typename TNode, typename DistanceTypeNode=DistanceType, int distMinValueNode=-1 >
-class NearTreeNode
+static const int MaxCurveDims = 16;
+
+void CurveKeys ( const InsertionOrder order, std::vector<std::pair<unsigned long long, long> >& keyed ) const
 {
-size_t            m_ptLeft;            // index of left object (of type TNode) stored in this node
-size_t            m_ptRight;           // index of right object (of type TNode) stored in this node
-DistanceTypeNode      m_dMaxLeft;      // longest distance from the left object to
-// anything below it in the tree
-DistanceTypeNode      m_dMaxRight;     // longest distance from the right object to
-// anything below it in the tree
-NearTreeNode *    m_pLeftBranch;       // tree descending from the left object
+    const size_t n = m_DelayedIndices.size( );
+    std::vector<double> coords;
+    const int dims = CurveCoordinates( coords,
+        std::integral_constant<bool, CNearTreeCoordinates<T>::Available != 0>( ) );
+    const int bits = std::min( 64/dims, 21 );
+    const double cells = (double)( ( 1u << bits ) - 1u );
+
+    std::vector<double> lo( dims, std::numeric_limits<double>::max( ) );
+    std::vector<double> hi( dims, -std::numeric_limits<double>::max( ) );
+    for ( size_t i=0; i<n; ++i )
+    {
+        for ( int k=0; k<dims; ++k )
+        {
+            lo[k] = std::min( lo[k], coords[i*dims+k] );
+            hi[k] = std::max( hi[k], coords[i*dims+k] );
+        }
+    }
+
+    keyed.resize( n );
+    unsigned int q[MaxCurveDims];
+    for ( size_t i=0; i<n; ++i )
+    {
+        for ( int k=0; k<dims; ++k )
+        {
+            const double scaled = ( hi[k] > lo[k] ) ? ( coords[i*dims+k]-lo[k] )/( hi[k]-lo[k] ) : 0.0;
+            q[k] = (unsigned int)( scaled*cells );
+        }
+        if ( order == NTO_Hilbert ) HilbertTranspose( q, dims, bits );
+        keyed[i] = std::make_pair( InterleaveBits( q, dims, bits ), m_DelayedIndices[i] );
+    }
+}
+
+//=======================================================================
+//  int CurveCoordinates ( std::vector<double>& coords, std::true_type ) const
+//  int CurveCoordinates ( std::vector<double>& coords, std::false_type ) const
+//
+//  The coordinates of the objects of m_DelayedIndices, dims of them for
+//  each object, one object after another; dims is returned. With
+//  CNearTreeCoordinates they are the first MaxCurveDims or fewer
+//  coordinates of each object. Without, they are its distances from three
+//  objects far apart: the farthest from the first object, the farthest
+//  from that one, and the one farthest from both.
+//
+//=======================================================================
+int CurveCoordinates ( std::vector<double>& coords, std::true_type ) const
+{
+    const size_t n = m_DelayedIndices.size( );
+    const int dims = std::max( 1, std::min(
+        CNearTreeCoordinates<T>::Dim( m_ObjectStore[m_DelayedIndices[0]] ), int( MaxCurveDims ) ) );
+    coords.resize( n*dims );
+    for ( size_t i=0; i<n; ++i )
+    {
+        const T& t = m_ObjectStore[m_DelayedIndices[i]];
+        for ( int k=0; k<dims; ++k )
+        {
+            coords[i*dims+k] = CNearTreeCoordinates<T>::Coordinate( t, k );
+        }
+    }
+    return ( dims );
+}
+
+int CurveCoordinates ( std::vector<double>& coords, std::false_type ) const
+{
+    static const int dims = 3;
+    const size_t n = m_DelayedIndices.size( );
+    coords.resize( n*dims );
+    std::vector<double> dNearest( n, std::numeric_limits<double>::max( ) );
+    size_t pivot = 0;
+    for ( int k=-1; k<dims; ++k )
+    {
+        const T& tPivot = m_ObjectStore[m_DelayedIndices[pivot]];
+        size_t farthest = pivot;
+        for ( size_t i=0; i<n; ++i )
+        {
+            const double d = (double)DistanceBetween( m_ObjectStore[m_DelayedIndices[i]], tPivot );
+            if ( k >= 0 ) coords[i*dims+k] = d;
+            if ( d < dNearest[i] ) dNearest[i] = d;
+            if ( dNearest[i] > dNearest[farthest] ) farthest = i;
+        }
+        // the first object only starts the search for the pivots
+        if ( k < 0 ) std::fill( dNearest.begin( ), dNearest.end( ), std::numeric_limits<double>::max( ) );
+        pivot = farthest;
+    }
+    return ( dims );
+}
+
+//=======================================================================
+//  unsigned long long InterleaveBits ( const unsigned int* q, const int dims, const int bits )
+//
+//  The Morton key of q: the top bit of each coordinate in turn, then the
+//  next bit of each, ... down to the lowest.
+//
+//=======================================================================
+static unsigned long long InterleaveBits ( const unsigned int* const q, const int dims, const int bits )
+{
+    unsigned long long key = 0;
+    for ( int b=bits-1; b>=0; --b )
+    {
+        for ( int k=0; k<dims; ++k )
+        {
+            key = ( key << 1 ) | ( ( q[k] >> b ) & 1u );
+        }
+    }
+    return ( key );
+}
+
+//=======================================================================
+//  void HilbertTranspose ( unsigned int* q, const int dims, const int bits )
+//
+//  Replaces the coordinates q by the "transposed" Hilbert index, whose
+//  interleaved bits (InterleaveBits) are the place of q on the Hilbert
+//  curve (J. Skilling, "Programming the Hilbert curve", AIP Conf. Proc.
+//  707, 381 (2004)).
+//
+//=======================================================================
+static void HilbertTranspose ( unsigned int* const q, const int dims, const int bits )
+{
+    const unsigned int top = 1u << ( bits-1 );
+
+    // inverse undo
+    for ( unsigned int Q=top; Q>1; Q>>=1 )
+    {
+        const unsigned int P = Q-1;
+        for ( int k=0; k<dims; ++k )
+        {
+            if ( q[k] & Q )
+            {
+                q[0] ^= P;
+            }
+            else
+            {
+                const unsigned int t = ( q[0] ^ q[k] ) & P;
+                q[0] ^= t;
+                q[k] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for ( int k=1; k<dims; ++k ) q[k] ^= q[k-1];
+    unsigned int t = 0;
+    for ( unsigned int Q=top; Q>1; Q>>=1 )
+    {
+        if ( q[dims-1] & Q ) t ^= Q-1;
+    }
+    for ( int k=0; k<dims; ++k ) q[k] ^= t;
+}
+
+//=======================================================================
+//  void CompleteDelayedInsertForSearch ( void ) const
+//
+//  The searches are const, but they still insert any delayed objects
+//  first, which is the one change a search can make to a tree. That is
+//  done at most once, by whichever search gets m_SearchMutex; the others
+//  wait for it. Once nothing is delayed the searches only read the tree,
+//  so any number of threads can search it at once.
+//
+//=======================================================================
+void CompleteDelayedInsertForSearch ( void ) const
+{
+    if ( m_DelayedPending.load( std::memory_order_acquire ) )
+    {
+        std::lock_guard<std::mutex> lock( m_SearchMutex );
+        if ( m_DelayedPending.load( std::memory_order_relaxed ) )
+        {
+            const_cast<CNearTree*>(this)->CompleteDelayedInsert( );
+        }
+    }
+}
+
+//=======================================================================
+//  void LinkSnapshotForSearch ( void ) const
+//
+//  CompleteDelayedInsertForSearch, for the searches that walk the linked
+//  nodes (the Left, Farthest, OutSphere and K_Far searches), and for an
+//  opened tree, which has no linked nodes to begin with, LinkSnapshot as
+//  well. That too is done once, under m_SearchMutex.
+//
+//=======================================================================
+void LinkSnapshotForSearch ( void ) const
+{
+    CompleteDelayedInsertForSearch( );
+    if ( m_LinkPending.load( std::memory_order_acquire ) )
+    {
+        std::lock_guard<std::mutex> lock( m_SearchMutex );
+        const_cast<CNearTree*>(this)->LinkSnapshot( );
+    }
+}
+
+//=======================================================================
+//  void LinkSnapshot ( void )
+//
+//  Give an opened tree its own copy of the objects, in m_ObjectStore, and
+//  the linked nodes, rebuilt from the whole tree as Save wrote it (see
+//  NearTreeNode::Unflatten). The file stays mapped, and the searches of
+//  the frozen copy go on reading it, so they can run while this does.
+//
+//=======================================================================
+void LinkSnapshot ( void )
+{
+    if ( m_LinkPending.load( std::memory_order_acquire ) )
+    {
+        const SnapshotHeader& header = m_Snapshot->GetHeader( );
+        m_ObjectStore.assign( m_Snapshot->Objects( ), m_Snapshot->Objects( )+(size_t)header.m_ObjectCount );
+        m_BaseNode.Unflatten( m_Snapshot->Nodes( ), (size_t)header.m_NodeCount, m_NodeArena );
+        m_LinkPending.store( false, std::memory_order_release );
+    }
+}
+
+//=======================================================================
+//  void UnmapSnapshot ( void )
+//
+//  Before an opened tree is changed: LinkSnapshot, and let go of the file,
+//  which leaves the tree thawed.
+//
+//=======================================================================
+void UnmapSnapshot ( void )
+{
+    if ( m_Snapshot )
+    {
+        LinkSnapshot( );
+        m_Snapshot.reset( );
+        m_LeafBucketSize = 0;
+    }
+}
+
+//=======================================================================
+//  static bool WriteSnapshotPart ( FILE* file, unsigned long long& position,
+//                                  const unsigned long long offset, const void* data,
+//                                  const size_t bytes )
+//
+//  For Save: write zeros from position up to offset, then bytes of data,
+//  and leave position after them.
+//
+//=======================================================================
+static bool WriteSnapshotPart ( FILE* const file, unsigned long long& position,
+                                const unsigned long long offset, const void* const data, const size_t bytes )
+{
+    static const char zeros[SnapshotHeader::Alignment] = { 0 };
+    while ( position < offset )
+    {
+        const size_t pad = (size_t)std::min( offset-position, (unsigned long long)sizeof( zeros ) );
+        if ( fwrite( zeros, 1, pad, file ) != pad ) return ( false );
+        position += pad;
+    }
+    if ( bytes > 0 && fwrite( data, 1, bytes, file ) != bytes ) return ( false );
+    position += bytes;
+    return ( true );
+}
+
+//=======================================================================
+//  const T* ObjectData ( void ) const
+//  const FrozenNode* FrozenNodeData ( void ) const
+//  const T* BucketObjectData ( void ) const
+//  const unsigned int* BucketIndexData ( void ) const
+//
+//  Where the objects and the frozen copy of the tree are: in the tree's
+//  own vectors, or in the file it was opened from (see Open). The searches
+//  of the frozen copy read them only through these.
+//
+//=======================================================================
+const T* ObjectData ( void ) const
+{
+    return ( m_Snapshot ? m_Snapshot->Objects( ) : m_ObjectStore.data( ) );
+}
+
+const FrozenNode* FrozenNodeData ( void ) const
+{
+    return ( m_Snapshot ? m_Snapshot->SearchNodes( ) : m_FrozenNodes.data( ) );
+}
+
+const T* BucketObjectData ( void ) const
+{
+    return ( m_Snapshot ? m_Snapshot->BucketObjects( ) : m_BucketObjects.data( ) );
+}
+
+const unsigned int* BucketIndexData ( void ) const
+{
+    return ( m_Snapshot ? m_Snapshot->BucketIndices( ) : m_BucketIndices.data( ) );
+}
+
+//=======================================================================
+//  size_t StoreSize ( void ) const
+//  const char* ErasedData ( void ) const
+//  static bool Live ( const char* const erased, const size_t n )
+//
+//  The number of objects in the store, erased or not, which is one more
+//  than the largest index; the marks of the erased objects (see erase),
+//  or 0 while none is erased; and whether object n is not erased.
+//
+//=======================================================================
+size_t StoreSize ( void ) const
+{
+    return ( m_Snapshot ? (size_t)m_Snapshot->GetHeader( ).m_ObjectCount : m_ObjectStore.size( ) );
+}
+
+const char* ErasedData ( void ) const
+{
+    return ( m_Erased.empty( ) ? 0 : &m_Erased[0] );
+}
+
+static bool Live ( const char* const erased, const size_t n )
+{
+    return ( erased == 0 || erased[n] == 0 );
+}
+
+//=======================================================================
+//  bool MarkErased ( const size_t n )
+//  void CompactIfNeeded ( void )
+//
+//  The two halves of erase: marking object n as erased, which is false if
+//  it is out of range or already marked, and compacting the tree once
+//  enough objects are marked. The set operations mark all of theirs before
+//  compacting, since Compact renumbers the objects.
+//
+//=======================================================================
+bool MarkErased ( const size_t n )
+{
+    if ( n >= StoreSize( ) || ! Live( ErasedData( ), n ) )
+    {
+        return ( false );
+    }
+    if ( m_Erased.empty( ) ) m_Erased.resize( StoreSize( ), 0 );
+    m_Erased[n] = 1;
+    ++m_ErasedCount;
+    m_DimEstimate = 0;
+    m_DimEstimateReady = false;
+    m_DimEstimateEsd= 0;
+    return ( true );
+}
+
+void CompactIfNeeded ( void )
+{
+    if ( m_ErasedCount > 0 &&
+         ( m_ErasedCount == StoreSize( ) ||
+           (double)m_ErasedCount > m_CompactionThreshold*(double)StoreSize( ) ) )
+    {
+        Compact( );
+    }
+}
+
+//=======================================================================
+//  void AppendMatches ( const T& t, std::vector<size_t>& matches ) const
+//  void EraseAll ( const std::vector<size_t>& indices )
+//
+//  For the set operations: add the indices of all of the objects that
+//  match t (see Contains) to matches, and erase the objects with the
+//  given indices, which may repeat.
+//
+//=======================================================================
+void AppendMatches ( const T& t, std::vector<size_t>& matches ) const
+{
+    CompleteDelayedInsertForSearch( );
+    if ( this->empty( ) || m_MatchTolerance < DistanceType( 0 ) ) return;
+    ObjectCounter found;
+    SearchInSphere( m_MatchTolerance, found, matches, t
+#ifdef CNEARTREE_INSTRUMENTED
+                  , NodeVisitCounter( )
+#endif
+                  );
+}
+
+void EraseAll ( const std::vector<size_t>& indices )
+{
+    for ( size_t i=0; i<indices.size( ); ++i )
+    {
+        MarkErased( indices[i] );
+    }
+    CompactIfNeeded( );
+}
+
+//=======================================================================
+//  long NextLive ( long position ) const
+//  long PreviousLive ( long position ) const
+//
+//  The first object at or after position, or at or before it, that is
+//  not erased, for the iterators; StoreSize( ) or -1 if there is none.
+//
+//=======================================================================
+long NextLive ( long position ) const
+{
+    while ( ! m_Erased.empty( ) && position < (long)m_Erased.size( ) && m_Erased[position] != 0 ) ++position;
+    return ( position );
+}
+
+long PreviousLive ( long position ) const
+{
+    while ( ! m_Erased.empty( ) && position >= 0 && m_Erased[position] != 0 ) --position;
+    return ( position );
+}
+
+//=======================================================================
+//  double GetDimEstimateForSearch ( void ) const
+//
+//  The dimension estimate used by the short-radius searches. It is worked
+//  out by the first search that needs it, under m_SearchMutex as in
+//  CompleteDelayedInsertForSearch, and kept until the tree is changed.
+//
+//=======================================================================
+double GetDimEstimateForSearch ( void ) const
+{
+    if ( ! m_DimEstimateReady.load( std::memory_order_acquire ) )
+    {
+        std::lock_guard<std::mutex> lock( m_SearchMutex );
+        if ( ! m_DimEstimateReady.load( std::memory_order_relaxed ) )
+        {
+            const_cast<CNearTree*>(this)->GetDimEstimate( );
+            m_DimEstimateReady.store( true, std::memory_order_release );
+        }
+    }
+    return ( ( m_DimEstimate == DBL_MAX ) ? 0. : m_DimEstimate );
+}
+
+#ifdef CNEARTREE_INSTRUMENTED
+//=======================================================================
+//  size_t& NodeVisitCounter ( void )
+//
+//  The calling thread's count of node visits, see GetNodeVisits
+//
+//=======================================================================
+static size_t& NodeVisitCounter ( void )
+{
+    static thread_local size_t visits = 0;
+    return ( visits );
+}
+#endif
+
+//=======================================================================
+//  bool SearchNearest ( DistanceType& dRadius, T* tClosest, const T& t, size_t& index,
+//                       const DistanceType epsilon )
+//  long SearchInSphere ( const DistanceType dRadius, OutputContainerType& tClosest, const T& t )
+//  long SearchInSphere ( const DistanceType dRadius, OutputContainerType& tClosest,
+//                        std::vector<size_t>& tIndices, const T& t )
+//  long SearchInAnnulus ( const DistanceType dRadius1, const DistanceType dRadius2,
+//                         OutputContainerType& tAnnular, const T& t )
+//  long SearchInAnnulus ( const DistanceType dRadius1, const DistanceType dRadius2,
+//                         OutputContainerType& tAnnular, std::vector<size_t>& tIndices, const T& t )
+//  long SearchK_Near ( const size_t k, DistanceType& dRadius, K_Heap& tClosest, const T& t,
+//                      const DistanceType epsilon )
+//  long SearchForEachInSphere ( const DistanceType dRadius, Visitor& fn, const T& t )
+//
+//  The balanced searches, on the frozen copy of the tree if there is one
+//  (see Freeze), otherwise on the linked nodes. The arguments and results
+//  are those of NearTreeNode::Nearest, InSphere, InAnnulus, K_Near and VisitInSphere,
+//  except that SearchK_Near leaves tClosest sorted, nearest first. epsilon
+//  is 0 for the exact search (see SetApproximation).
+//  They change nothing in the tree, and count the node visits in
+//  VisitCount, so that several threads can search at once.
+//
+//=======================================================================
+bool SearchNearest ( DistanceType& dRadius, T* const tClosest, const T& t, size_t& index,
+                     const DistanceType epsilon
+#ifdef CNEARTREE_INSTRUMENTED
+                    , size_t& VisitCount
+#endif
+                    ) const
+{
+    if ( ! IsFrozen( ) )
+    {
+        return ( m_BaseNode.Nearest( dRadius, tClosest, t, index, m_ObjectStore, ErasedData( ), epsilon
+#ifdef CNEARTREE_INSTRUMENTED
+                                    , VisitCount
+#endif
+                                    ) );
+    }
+    NearestSearch search( dRadius, index, epsilon );
+    FrozenSearch( search, t
+#ifdef CNEARTREE_INSTRUMENTED
+                 , VisitCount
+#endif
+                 );
+    if ( index != ULONG_MAX && tClosest != 0 )
+        *tClosest = ObjectData( )[index];
+    return ( index != ULONG_MAX );
+}
+
+template<typename OutputContainerType>
+long SearchInSphere ( const DistanceType dRadius, OutputContainerType& tClosest, const T& t
+#ifdef CNEARTREE_INSTRUMENTED
+                     , size_t& VisitCount
+#endif
+                     ) const
+{
+    if ( ! IsFrozen( ) )
+    {
+        return ( m_BaseNode.InSphere( dRadius, tClosest, t, m_ObjectStore, ErasedData( )
+#ifdef CNEARTREE_INSTRUMENTED
+                                     , VisitCount
+#endif
+                                     ) );
+    }
+    InSphereSearch<OutputContainerType> search( dRadius, tClosest, 0, ObjectData( ) );
+    FrozenSearch( search, t
+#ifdef CNEARTREE_INSTRUMENTED
+                 , VisitCount
+#endif
+                 );
+    return ( (long)tClosest.size( ) );
+}
+
+template<typename OutputContainerType>
+long SearchInSphere ( const DistanceType dRadius, OutputContainerType& tClosest,
+                      std::vector<size_t>& tIndices, const T& t
+#ifdef CNEARTREE_INSTRUMENTED
+                     , size_t& VisitCount
+#endif
+                     ) const
+{
+    if ( ! IsFrozen( ) )
+    {
+        return ( m_BaseNode.InSphere( dRadius, tClosest, tIndices, t, m_ObjectStore, ErasedData( )
+#ifdef CNEARTREE_INSTRUMENTED
+                                     , VisitCount
+#endif
+                                     ) );
+    }
+    InSphereSearch<OutputContainerType> search( dRadius, tClosest, &tIndices, ObjectData( ) );
+    FrozenSearch( search, t
+#ifdef CNEARTREE_INSTRUMENTED
+                 , VisitCount
+#endif
+                 );
+    return ( (long)tClosest.size( ) );
+}
+
+template<typename OutputContainerType>
+long SearchInAnnulus ( const DistanceType dRadius1, const DistanceType dRadius2,
+                       OutputContainerType& tAnnular, const T& t
+#ifdef CNEARTREE_INSTRUMENTED
+                     , size_t& VisitCount
+#endif
+                     ) const
+{
+    if ( ! IsFrozen( ) )
+    {
+        return ( m_BaseNode.InAnnulus( dRadius1, dRadius2, tAnnular, t, m_ObjectStore, ErasedData( )
+#ifdef CNEARTREE_INSTRUMENTED
+                                      , VisitCount
+#endif
+                                      ) );
+    }
+    InAnnulusSearch<OutputContainerType> search( dRadius1, dRadius2, tAnnular, 0, ObjectData( ) );
+    FrozenSearch( search, t
+#ifdef CNEARTREE_INSTRUMENTED
+                 , VisitCount
+#endif
+                 );
+    return ( (long)tAnnular.size( ) );
+}
+
+template<typename OutputContainerType>
+long SearchInAnnulus ( const DistanceType dRadius1, const DistanceType dRadius2,
+                       OutputContainerType& tAnnular, std::vector<size_t>& tIndices, const T& t
+#ifdef CNEARTREE_INSTRUMENTED
+                     , size_t& VisitCount
+#endif
+                     ) const
+{
+    if ( ! IsFrozen( ) )
+    {
+        return ( m_BaseNode.InAnnulus( dRadius1, dRadius2, tAnnular, tIndices, t, m_ObjectStore, ErasedData( )
+#ifdef CNEARTREE_INSTRUMENTED
+                                      , VisitCount
+#endif
+                                      ) );
+    }
+    InAnnulusSearch<OutputContainerType> search( dRadius1, dRadius2, tAnnular, &tIndices, ObjectData( ) );
+    FrozenSearch( search, t
+#ifdef CNEARTREE_INSTRUMENTED
+                 , VisitCount
+#endif
+                 );
+    return ( (long)tAnnular.size( ) );
+}
+
+long SearchK_Near ( const size_t k, DistanceType& dRadius, K_Heap& tClosest, const T& t,
+                    const DistanceType epsilon
+#ifdef CNEARTREE_INSTRUMENTED
+                     , size_t& VisitCount
+#endif
+                     ) const
+{
+    if ( ! IsFrozen( ) )
+    {
+        m_BaseNode.K_Near( k, dRadius, tClosest, t, m_ObjectStore, ErasedData( ), epsilon
+#ifdef CNEARTREE_INSTRUMENTED
+                          , VisitCount
+#endif
+                          );
+    }
+    else if ( k > 0 )
+    {
+        K_NearSearch search( k, dRadius, tClosest, epsilon );
+        FrozenSearch( search, t
+#ifdef CNEARTREE_INSTRUMENTED
+                     , VisitCount
+#endif
+                     );
+    }
+    std::sort_heap( tClosest.begin( ), tClosest.end( ) );
+    return ( (long)tClosest.size( ) );
+}
+
+template<typename Visitor>
+long SearchForEachInSphere ( const DistanceType dRadius, Visitor& fn, const T& t
+#ifdef CNEARTREE_INSTRUMENTED
+                     , size_t& VisitCount
+#endif
+                     ) const
+{
+    if ( ! IsFrozen( ) )
+    {
+        return ( m_BaseNode.VisitInSphere( dRadius, fn, t, m_ObjectStore, ErasedData( )
+#ifdef CNEARTREE_INSTRUMENTED
+                                          , VisitCount
+#endif
+                                          ) );
+    }
+    ForEachInSphereSearch<Visitor> search( dRadius, fn );
+    FrozenSearch( search, t
+#ifdef CNEARTREE_INSTRUMENTED
+                 , VisitCount
+#endif
+                 );
+    return ( search.lFound );
+}
+
+//=======================================================================
+//  void RunBatch ( const size_t nProbes, unsigned int threads, const BatchWorker& prototype,
+//                  const size_t chunk = BatchChunk )
+//
+//  Run a batch search over probes 0 to nProbes-1 on up to threads threads
+//  (0 means one per hardware thread). Each thread works with its own copy
+//  of prototype, which holds that thread's scratch space and node visit
+//  count, and takes chunk probes at a time until none are left. The
+//  calling thread does a share of the work too.
+//
+//=======================================================================
+static const size_t BatchChunk = 64;  // number of probes a batch thread takes at a time
+
+template<typename BatchWorker>
+void RunBatch ( const size_t nProbes, unsigned int threads, const BatchWorker& prototype,
+                const size_t chunk = BatchChunk )
+const
+{
+    if ( threads == 0 ) threads = std::thread::hardware_concurrency( );
+    const size_t nChunks = ( nProbes + chunk - 1 ) / chunk;
+    if ( (size_t)threads > nChunks ) threads = (unsigned int)nChunks;
+    if ( threads == 0 ) threads = 1;
+
+    std::vector<BatchWorker> workers( threads, prototype );
+    std::atomic<size_t> nextProbe( 0 );
+    std::vector<std::thread> pool;
+    for ( unsigned int i=1; i<threads; ++i )
+    {
+        pool.push_back( std::thread( &CNearTree::template BatchLoop<BatchWorker>,
+                                     std::ref( workers[i] ), std::ref( nextProbe ), nProbes, chunk ) );
+    }
+    BatchLoop( workers[0], nextProbe, nProbes, chunk );
+    for ( size_t i=0; i<pool.size( ); ++i )
+    {
+        pool[i].join( );
+    }
+#ifdef CNEARTREE_INSTRUMENTED
+    for ( size_t i=0; i<workers.size( ); ++i )
+    {
+        NodeVisitCounter( ) += workers[i].m_Visits;
+    }
+#endif
+}
+
+template<typename BatchWorker>
+static void BatchLoop ( BatchWorker& worker, std::atomic<size_t>& nextProbe, const size_t nProbes,
+                        const size_t chunk )
+{
+    for ( ; ; )
+    {
+        const size_t first = nextProbe.fetch_add( chunk );
+        if ( first >= nProbes ) break;
+        const size_t last = std::min( first + chunk, nProbes );
+        for ( size_t i=first; i<last; ++i )
+        {
+            worker( i );
+        }
+    }
+}
+
+//=======================================================================
+//  IgnoreFound
+//
+//  The visitor for ForEachInSphere when only the number found is wanted.
+//
+//=======================================================================
+struct IgnoreFound
+{
+    void operator() ( const size_t, const DistanceType ) const { }
+};
+
+//=======================================================================
+//  ObjectCounter
+//
+//  A stand-in for an output container, for searches that want only the
+//  indices of what they find: it counts the objects inserted into it
+//  instead of keeping copies of them.
+//
+//=======================================================================
+struct ObjectCounter
+{
+    size_t n;
+
+    ObjectCounter( void ) : n( 0 ) { }
+    int    end   ( void ) const { return ( 0 ); }
+    void   insert( const int, const T& ) { ++n; }
+    size_t size  ( void ) const { return ( n ); }
+    void   clear ( void ) { n = 0; }
+};
+
+//=======================================================================
+//  NearestBatchWorker, K_NearestBatchWorker, InSphereBatchWorker
+//
+//  The per-thread state of NearestNeighborBatch, FindK_NearestNeighborsBatch
+//  and FindInSphereBatch: where the results go, the scratch space that is
+//  reused from one probe to the next, and the thread's node visit count.
+//  Each result slot is written by exactly one thread.
+//
+//=======================================================================
+struct NearestBatchWorker
+{
+    const CNearTree*          tree;
+    const std::vector<T>*     probes;
+    DistanceType              radius;
+    size_t*                   indices;
+    DistanceType*             distances;
+    size_t                    m_Visits;
+
+    NearestBatchWorker( const CNearTree* nt, const std::vector<T>& p, const DistanceType r,
+                        size_t* pIndices, DistanceType* pDistances )
+        : tree( nt ), probes( &p ), radius( r ), indices( pIndices ), distances( pDistances ),
+          m_Visits( 0 ) { }
+    void operator() ( const size_t i )
+    {
+        DistanceType dRadius = radius;
+        size_t index;
+        if ( tree->SearchNearest( dRadius, 0, (*probes)[i], index, tree->m_Approximation
+#ifdef CNEARTREE_INSTRUMENTED
+                                 , m_Visits
+#endif
+                                 ) )
+        {
+            indices[i]   = index;
+            distances[i] = dRadius;
+        }
+    }
+};
+
+struct K_NearestBatchWorker
+{
+    const CNearTree*                        tree;
+    size_t                                  k;
+    const std::vector<T>*                   probes;
+    DistanceType                            radius;
+    std::vector<size_t>*                    indices;
+    std::vector<DistanceType>*              distances;
+    K_Heap                                  K_Storage;     // scratch
+    size_t                                  m_Visits;
+
+    K_NearestBatchWorker( const CNearTree* nt, const size_t kk, const std::vector<T>& p, const DistanceType r,
+                          std::vector<size_t>* pIndices, std::vector<DistanceType>* pDistances )
+        : tree( nt ), k( kk ), probes( &p ), radius( r ), indices( pIndices ), distances( pDistances ),
+          K_Storage( ), m_Visits( 0 ) { }
+    void operator() ( const size_t i )
+    {
+        DistanceType dRadius = radius;
+        K_Storage.clear( );
+        tree->SearchK_Near( k, dRadius, K_Storage, (*probes)[i], tree->m_Approximation
+#ifdef CNEARTREE_INSTRUMENTED
+                           , m_Visits
+#endif
+                           );
+        indices[i]  .resize( K_Storage.size( ) );
+        distances[i].resize( K_Storage.size( ) );
+        for ( size_t j=0; j<K_Storage.size( ); ++j )
+        {
+            distances[i][j] = K_Storage[j].first;
+            indices[i][j]   = K_Storage[j].second;
+        }
+    }
+};
+
+struct InSphereBatchWorker
+{
+    const CNearTree*          tree;
+    DistanceType              radius;
+    const std::vector<T>*     probes;
+    std::vector<size_t>*      indices;
+    ObjectCounter             found;         // stands in for the container of objects
+    size_t                    m_Visits;
+
+    InSphereBatchWorker( const CNearTree* nt, const DistanceType r, const std::vector<T>& p,
+                         std::vector<size_t>* pIndices )
+        : tree( nt ), radius( r ), probes( &p ), indices( pIndices ), found( ), m_Visits( 0 ) { }
+    void operator() ( const size_t i )
+    {
+        found.clear( );
+        tree->SearchInSphere( radius, found, indices[i], (*probes)[i]
+#ifdef CNEARTREE_INSTRUMENTED
+                             , m_Visits
+#endif
+                             );
+    }
+};
+
+//=======================================================================
+//  DimTrialWorker
+//
+//  One trial of GetDimEstimate: the objects within radius and radius/1.1
+//  of a live object chosen with the trial's own random stream. Trial first+i
+//  is written to popLarge[i], popSmall[i] and visits[i], so the node visits
+//  are kept apart from GetNodeVisits.
+//
+//=======================================================================
+static const size_t MinDimTrials = 8;  // trials that GetDimEstimate adds up before it may stop
+
+//=======================================================================
+//  static unsigned long long SplitMix ( const unsigned long long seed, const unsigned long long n )
+//
+//  The n-th output of the splitmix64 generator started at seed: a full
+//  64-bit mix, so that nearby seeds and nearby n give unrelated values.
+//
+//=======================================================================
+static unsigned long long SplitMix ( const unsigned long long seed, const unsigned long long n )
+{
+    unsigned long long z = seed + ( n+1ull )*0x9E3779B97F4A7C15ull;
+    z = ( z ^ ( z >> 30 ) )*0xBF58476D1CE4E5B9ull;
+    z = ( z ^ ( z >> 27 ) )*0x94D049BB133111EBull;
+    return ( z ^ ( z >> 31 ) );
+}
+
+struct DimTrialWorker
+{
+    const CNearTree*          tree;
+    unsigned long long        seedBase;
+    size_t                    first;
+    DistanceType              radius;
+    long*                     popLarge;
+    long*                     popSmall;
+    size_t*                   visits;
+    size_t                    m_Visits;      // always 0; the visits go to visits[i]
+
+    DimTrialWorker( const CNearTree* nt, const unsigned long long seed, const size_t f, const DistanceType r,
+                    long* pLarge, long* pSmall, size_t* pVisits )
+        : tree( nt ), seedBase( seed ), first( f ), radius( r ),
+          popLarge( pLarge ), popSmall( pSmall ), visits( pVisits ), m_Visits( 0 ) { }
+    void operator() ( const size_t i )
+    {
+        // each trial has a stream of its own, seeded from the whole of seedBase and
+        // the trial, since nearby seeds start nearby streams
+        std::mt19937_64 stream( SplitMix( seedBase, first+i ) );
+        const size_t stored = tree->StoreSize( );
+        size_t n;
+        do {
+            n = (size_t)( stream( ) % stored );
+        } while ( ! Live( tree->ErasedData( ), n ) );
+        const T& probe = tree->ObjectData( )[n];
+        IgnoreFound ignore;
+        visits[i] = 0;
+        popSmall[i] = 0;
+        popLarge[i] = tree->SearchForEachInSphere( radius, ignore, probe
+#ifdef CNEARTREE_INSTRUMENTED
+                                                  , visits[i]
+#endif
+                                                  );
+        if ( popLarge[i] > 0 )
+        {
+            popSmall[i] = tree->SearchForEachInSphere( radius/DistanceType(1.1), ignore, probe
+#ifdef CNEARTREE_INSTRUMENTED
+                                                      , visits[i]
+#endif
+                                                      );
+        }
+    }
+};
+
+//=======================================================================
+//  bool UseSquaredDistances ( void ) const
+//  static bool RootAbove ( const DistanceType s, const DistanceType r )
+//  static bool RootBelow ( const DistanceType s, const DistanceType r )
+//  static bool RootLess ( const DistanceType s1, const DistanceType s2 )
+//
+//  For NTF_SquaredDistances: whether the block scans are to compare squared
+//  distances, and, for squared distances s, s1 and s2, whether sqrt( s ) > r,
+//  sqrt( s ) < r and sqrt( s1 ) < sqrt( s2 ). The square roots are taken only
+//  when the squares are too close to tell, so the answers are those of the
+//  distances themselves.
+//
+//=======================================================================
+bool UseSquaredDistances ( void ) const
+{
+    return ( ( m_Flags & NTF_SquaredDistances ) != 0 && CNearTreeBlockDistance<T, DistanceType>::Available != 0 );
+}
+
+static inline DistanceType RootMargin ( void )
+{
+    return ( DistanceType( 4 )*std::numeric_limits<DistanceType>::epsilon( ) );
+}
+
+static inline bool RootAbove ( const DistanceType s, const DistanceType r )
+{
+    if ( r < DistanceType( 0 ) ) return ( true );
+    const DistanceType r2 = r*r;
+    if ( s > r2 + r2*RootMargin( ) ) return ( true );
+    if ( s < r2 - r2*RootMargin( ) ) return ( false );
+    return ( DistanceType( sqrt( s ) ) > r );
+}
+
+static inline bool RootBelow ( const DistanceType s, const DistanceType r )
+{
+    if ( r <= DistanceType( 0 ) ) return ( false );
+    const DistanceType r2 = r*r;
+    if ( s < r2 - r2*RootMargin( ) ) return ( true );
+    if ( s > r2 + r2*RootMargin( ) ) return ( false );
+    return ( DistanceType( sqrt( s ) ) < r );
+}
+
+static inline bool RootLess ( const DistanceType s1, const DistanceType s2 )
+{
+    if ( s1 >= s2 ) return ( false );
+    if ( s1 < s2 - s2*RootMargin( ) ) return ( true );
+    return ( DistanceType( sqrt( s1 ) ) < DistanceType( sqrt( s2 ) ) );
+}
+
+//=======================================================================
+//  void FrozenSearch ( SearchType& search, const T& t ) const
+//
+//  The balanced search of NearTreeNode::Nearest, InSphere, InAnnulus and
+//  K_Near, walking m_FrozenNodes instead of the linked nodes. What is kept
+//  is up to search: search.Found( d, n ) is called for every object looked
+//  at, with its distance d from the probe and its index n, and
+//  search.Useful( d, dMax ) says whether a branch whose object is at d from
+//  the probe and whose descendants are at most dMax from that object can
+//  still hold anything wanted. The branches are taken, and the visits
+//  counted, exactly as in the linked searches, except that the objects of
+//  a leaf bucket are all measured at once, one visit each. Erased objects
+//  (see erase) are measured, to steer the search, but never Found. search.Cutoff( )
+//  is the farthest an object can be and still be wanted, which lets the
+//  squared distances of a bucket be compared without square roots.
+//
+//=======================================================================
+template<typename SearchType>
+void FrozenSearch ( SearchType& search, const T& t
+#ifdef CNEARTREE_INSTRUMENTED
+                   , size_t& VisitCount
+#endif
+                   ) const
+{
+    SearchScratch<unsigned int> sStack( m_DeepestDepth+1 );
+    DistanceType dDL=0., dDR=0.;
+    const bool squared = UseSquaredDistances( );
+    const FrozenNode* const nodes = FrozenNodeData( );
+    const T* const objects = ObjectData( );
+    const T* const bucketObjects = BucketObjectData( );
+    const unsigned int* const bucketIndices = BucketIndexData( );
+    const char* const erased = ErasedData( );
+    const FrozenNode* pt = nodes;
+#ifdef CNEARTREE_INSTRUMENTED
+    ++VisitCount;
+#endif
+    if ( pt->m_ptLeft == FrozenNone ) return; // test for empty, only the base node can be
+    for ( ; ; )
+    {
+        if ( pt->m_pLeftBranch == FrozenBucket )
+        {
+            DistanceType dBucket[MaxLeafBucket];
+            const size_t first = pt->m_ptLeft;
+            const size_t n     = pt->m_ptRight;
+            if ( squared )
+            {
+                BlockSquaredDistanceBetween( t, bucketObjects+first, n, dBucket );
+                for ( size_t i=0; i<n; ++i )
+                {
+                    if ( ! RootAbove( dBucket[i], search.Cutoff( ) ) && Live( erased, bucketIndices[first+i] ) )
+                        search.Found( DistanceType( sqrt( dBucket[i] ) ), bucketIndices[first+i] );
+                }
+            }
+            else
+            {
+                BlockDistanceBetween( t, bucketObjects+first, n, dBucket );
+                for ( size_t i=0; i<n; ++i )
+                {
+                    if ( Live( erased, bucketIndices[first+i] ) )
+                        search.Found( dBucket[i], bucketIndices[first+i] );
+                }
+            }
+#ifdef CNEARTREE_INSTRUMENTED
+            VisitCount += n-1;
+#endif
+            if ( sStack.empty( ) ) break;
+            pt = nodes + sStack.back( );
+            sStack.pop_back( );
+#ifdef CNEARTREE_INSTRUMENTED
+            ++VisitCount;
+#endif
+            continue;
+        }
+
+        dDL = DistanceBetween( t, objects[pt->m_ptLeft] );
+        if ( Live( erased, pt->m_ptLeft ) ) search.Found( dDL, pt->m_ptLeft );
+        if ( pt->m_ptRight != FrozenNone ) {
+#ifdef CNEARTREE_INSTRUMENTED
+            ++VisitCount;
+#endif
+            dDR = DistanceBetween( t, objects[pt->m_ptRight] );
+            if ( Live( erased, pt->m_ptRight ) ) search.Found( dDR, pt->m_ptRight );
+        }
+
+        /*
+         See if both branches are populated.  In that case, save one branch
+         on the stack, and process the other one based on which one seems
+         smaller, but useful first
+         */
+        if ( pt->m_pLeftBranch != FrozenNone && pt->m_pRightBranch != FrozenNone ) {
+            if ( dDL+pt->m_dMaxLeft < dDR+pt->m_dMaxRight ) {
+                if ( search.Useful( dDL, pt->m_dMaxLeft ) ) {
+                    if ( search.Useful( dDR, pt->m_dMaxRight ) ) {
+                        sStack.push_back( pt->m_pRightBranch );
+                    }
+                    pt = nodes + pt->m_pLeftBranch;
+#ifdef CNEARTREE_INSTRUMENTED
+                    ++VisitCount;
+#endif
+                    continue;
+                }
+            }
+            if ( search.Useful( dDR, pt->m_dMaxRight ) ) {
+                if ( search.Useful( dDL, pt->m_dMaxLeft ) ) {
+                    sStack.push_back( pt->m_pLeftBranch );
+                }
+                pt = nodes + pt->m_pRightBranch;
+#ifdef CNEARTREE_INSTRUMENTED
+                ++VisitCount;
+#endif
+                continue;
+            }
+        }
+
+        /* Only one branch is viable, try them one at a time
+         */
+        if ( pt->m_pLeftBranch != FrozenNone && search.Useful( dDL, pt->m_dMaxLeft ) ) {
+            pt = nodes + pt->m_pLeftBranch;
+#ifdef CNEARTREE_INSTRUMENTED
+            ++VisitCount;
+#endif
+            continue;
+        }
+
+        if ( pt->m_pRightBranch != FrozenNone && search.Useful( dDR, pt->m_dMaxRight ) ) {
+            pt = nodes + pt->m_pRightBranch;
+#ifdef CNEARTREE_INSTRUMENTED
+            ++VisitCount;
+#endif
+            continue;
+        }
+
+        /* We have procesed both sides, we need to go to the stack */
+
+        if ( sStack.empty( ) ) break;
+        pt = nodes + sStack.back( );
+        sStack.pop_back( );
+#ifdef CNEARTREE_INSTRUMENTED
+        ++VisitCount;
+#endif
+    }
+}  //  end FrozenSearch
+
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//  end of CNearTree
+//=======================================================================
+template<typename U> class KT : U
+    {
+    private:
+        DistanceType d;
+        KT( void ) : U() { };
+    };
+
+
+
+// start of nested class NearTreeNode
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+//=======================================================================
+
+//=======================================================================
+//
+// NEARTREENODE - nested class to hold the actual neartree and the indices to its data objects
+//
+// For the description of the template parameters, see the text above in the description
+// of CNearTree.
+//=======================================================================
+template <typename TNode, typename DistanceTypeNode=DistanceType, int distMinValueNode=-1 >
+class NearTreeNode
+{
+size_t            m_ptLeft;            // index of left object (of type TNode) stored in this node
+size_t            m_ptRight;           // index of right object (of type TNode) stored in this node
+DistanceTypeNode      m_dMaxLeft;      // longest distance from the left object to
+// anything below it in the tree
+DistanceTypeNode      m_dMaxRight;     // longest distance from the right object to
+// anything below it in the tree
+NearTreeNode *    m_pLeftBranch;       // tree descending from the left object
 NearTreeNode *    m_pRightBranch;      // tree descending from the right object
 
 public:
 
+// the k nearest objects found so far by K_Near: a max-heap of their distances
+// from the probe and their indices in the object store, farthest on top
+typedef std::vector<std::pair<DistanceTypeNode, size_t> > K_Heap;
+
+// a run of the indices that BulkBuild partitions: the objects m_First to
+// m_Last-1 of it make up the subtree of m_pNode, which is at level m_Depth;
+// if m_FarFirst, the first of them is the farthest from the object above
+struct BulkRun
+{
+    NearTreeNode* m_pNode;
+    size_t        m_First;
+    size_t        m_Last;
+    size_t        m_Depth;
+    bool          m_FarFirst;
+};
+
+// below this many objects per thread, BulkBuild's threads cost more than they save
+static const size_t BulkMinPerThread = 4096;
+
 NearTreeNode( void ) :  //  NearTreeNode constructor
 m_ptLeft            ( ULONG_MAX ),
 m_ptRight           ( ULONG_MAX ),
@@ -2863,183 +5611,872 @@ m_pRightBranch      ( 0 )
 };  //  NearTreeNode constructor
 
 //=======================================================================
-~NearTreeNode( void )  //  NearTreeNode destructor
+// The descending nodes belong to the tree's NodeArena, so clear only
+// forgets them; the arena releases their storage. There is deliberately
+// no destructor, so that a whole block of nodes can be freed at once.
+void clear( void )
+{
+    m_pLeftBranch  = 0;
+    m_pRightBranch = 0;
+
+    m_ptLeft     = ULONG_MAX;
+    m_ptRight    = ULONG_MAX;
+    m_dMaxLeft   = DistanceTypeNode( distMinValueNode );
+    m_dMaxRight  = DistanceTypeNode( distMinValueNode );
+};  //  end clear
+
+//=======================================================================
+DistanceTypeNode GetDiamEstimate( void ) const
+{
+    DistanceTypeNode temp = m_dMaxLeft;
+    if ( m_dMaxRight > temp ) temp = m_dMaxRight;
+    if ( DistanceTypeNode(0) > temp ) temp = DistanceTypeNode(0);
+    return temp;
+}
+
+//=======================================================================
+//  void CopyFrom ( const NearTreeNode& o, NodeArena& arena )
+//
+//  Make this node a deep copy of the tree below o, taking the
+//  descending nodes from arena. Uses a stack rather than recursion.
+//
+//=======================================================================
+void CopyFrom ( const NearTreeNode& o, NodeArena& arena )
+{
+    std::vector<std::pair<NearTreeNode*, const NearTreeNode*> > sStack;
+    sStack.push_back( std::make_pair( this, &o ) );
+    while ( !sStack.empty( ) )
+    {
+        NearTreeNode* pt = sStack.back( ).first;
+        const NearTreeNode* po = sStack.back( ).second;
+        sStack.pop_back( );
+        *pt = *po;
+        if ( po->m_pLeftBranch != 0 )
+        {
+            pt->m_pLeftBranch = arena.Allocate( );
+            sStack.push_back( std::make_pair( pt->m_pLeftBranch, (const NearTreeNode*)po->m_pLeftBranch ) );
+        }
+        if ( po->m_pRightBranch != 0 )
+        {
+            pt->m_pRightBranch = arena.Allocate( );
+            sStack.push_back( std::make_pair( pt->m_pRightBranch, (const NearTreeNode*)po->m_pRightBranch ) );
+        }
+    }
+}  //  end CopyFrom
+
+//=======================================================================
+//  void Flatten ( std::vector<FrozenNode>& nodes, const size_t nodeCount ) const
+//
+//  Copy the tree below this node into nodes (see CNearTree::Freeze), in
+//  depth-first order with each left branch right after its parent.
+//  nodeCount is the number of nodes, so that nodes is allocated once.
+//
+//=======================================================================
+void Flatten ( std::vector<FrozenNode>& nodes, const size_t nodeCount ) const
+{
+    // each entry is a node still to be copied and the branch that is to point
+    // to it, as 2*(position of the parent)+1 for a right branch, ULONG_MAX for none
+    std::vector<std::pair<const NearTreeNode*, size_t> > sStack;
+    nodes.clear( );
+    nodes.reserve( nodeCount );
+    sStack.push_back( std::make_pair( this, (size_t)ULONG_MAX ) );
+    while ( !sStack.empty( ) )
+    {
+        const NearTreeNode* pt = sStack.back( ).first;
+        const size_t branch = sStack.back( ).second;
+        sStack.pop_back( );
+        const unsigned int position = (unsigned int)nodes.size( );
+        if ( branch != ULONG_MAX )
+        {
+            if ( branch%2 == 0 ) nodes[branch/2].m_pLeftBranch  = position;
+            else                 nodes[branch/2].m_pRightBranch = position;
+        }
+        FrozenNode node;
+        node.m_ptLeft       = ( pt->m_ptLeft  == ULONG_MAX ) ? FrozenNone : (unsigned int)pt->m_ptLeft;
+        node.m_ptRight      = ( pt->m_ptRight == ULONG_MAX ) ? FrozenNone : (unsigned int)pt->m_ptRight;
+        node.m_dMaxLeft     = pt->m_dMaxLeft;
+        node.m_dMaxRight    = pt->m_dMaxRight;
+        node.m_pLeftBranch  = FrozenNone;
+        node.m_pRightBranch = FrozenNone;
+        nodes.push_back( node );
+        // the right branch is stacked first, so that the left one is copied next
+        if ( pt->m_pRightBranch != 0 )
+            sStack.push_back( std::make_pair( (const NearTreeNode*)pt->m_pRightBranch, 2*(size_t)position+1 ) );
+        if ( pt->m_pLeftBranch != 0 )
+            sStack.push_back( std::make_pair( (const NearTreeNode*)pt->m_pLeftBranch, 2*(size_t)position ) );
+    }
+}  //  end Flatten
+
+//=======================================================================
+//  void Unflatten ( const FrozenNode* nodes, const size_t nodeCount, NodeArena& arena )
+//
+//  The reverse of Flatten: rebuild the tree below this node, which must be
+//  empty, from the nodeCount nodes that Flatten left in nodes, taking the
+//  descending nodes from arena. Flatten puts every node after its parent,
+//  so each node has been made by the time it is reached.
+//
+//=======================================================================
+void Unflatten ( const FrozenNode* const nodes, const size_t nodeCount, NodeArena& arena )
+{
+    std::vector<NearTreeNode*> linked( nodeCount, 0 );
+    linked[0] = this;
+    for ( size_t i=0; i<nodeCount; ++i )
+    {
+        NearTreeNode* const pt = linked[i];
+        const FrozenNode& node = nodes[i];
+        pt->m_ptLeft    = ( node.m_ptLeft  == FrozenNone ) ? ULONG_MAX : (size_t)node.m_ptLeft;
+        pt->m_ptRight   = ( node.m_ptRight == FrozenNone ) ? ULONG_MAX : (size_t)node.m_ptRight;
+        pt->m_dMaxLeft  = node.m_dMaxLeft;
+        pt->m_dMaxRight = node.m_dMaxRight;
+        if ( node.m_pLeftBranch != FrozenNone )
+        {
+            pt->m_pLeftBranch = arena.Allocate( );
+            linked[node.m_pLeftBranch] = pt->m_pLeftBranch;
+        }
+        if ( node.m_pRightBranch != FrozenNone )
+        {
+            pt->m_pRightBranch = arena.Allocate( );
+            linked[node.m_pRightBranch] = pt->m_pRightBranch;
+        }
+    }
+}  //  end Unflatten
+
+//=======================================================================
+//  void Inserter ( const TNode& t, size_t& localDepth, std::vector<TNode>& objectStore,
+//                  DistanceTypeNode& SumSpacings,  DistanceTypeNode& SumSpacingsSq,
+//                  NodeArena& arena )
+//
+//  Function to insert some "point" as an object into a CNearTree for
+//  later searching
+//
+//     t is an object of the templated type which is to be inserted into a
+//     NearTree
+//
+//     localDepth is the returned deepest tree level reached for the current insert
+//
+//     arena supplies any new node that has to be created
+//
+//  Three possibilities exist: put the datum into the left
+//  position (first test),into the right position, or else
+//  into a node descending from the nearer of those positions
+//  when they are both already used. The descent is a loop rather
+//  than recursion, so a deep tree cannot overflow the stack.
+//
+//=======================================================================
+void Inserter ( const TNode& t, size_t& localDepth, std::vector<TNode>& objectStore,
+               DistanceTypeNode& SumSpacings,  DistanceTypeNode& SumSpacingsSq, NodeArena& arena )
+{
+    NearTreeNode* pt = this;
+    for ( ;; )
+    {
+        // do a bit of precomputing if it is possible so that we can
+        // reduce the number of calls to operator 'DistanceTypeNode' as much as possible;
+        // 'DistanceTypeNode' might use square roots in some cases
+        DistanceTypeNode dTempRight =  DistanceTypeNode(0);
+        DistanceTypeNode dTempLeft  =  DistanceTypeNode(0);
+        ++localDepth;
+
+        if ( pt->m_ptRight  != ULONG_MAX )
+        {
+            dTempRight  = DistanceBetween( t, objectStore[pt->m_ptRight] );
+            dTempLeft   = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
+        }
+
+        if ( pt->m_ptLeft == ULONG_MAX )
+        {
+            pt->m_ptLeft = objectStore.size( );
+            objectStore.push_back( t );
+            return;
+        }
+        else if ( pt->m_ptRight == ULONG_MAX )
+        {
+            pt->m_ptRight = objectStore.size( );
+            objectStore.push_back( t );
+            return;
+        }
+        else if ( dTempLeft > dTempRight )
+        {
+            if ( pt->m_pRightBranch == 0 ) pt->m_pRightBranch = arena.Allocate( );
+            // note that the next line assumes that m_dMaxRight is negative for a new node
+            if ( pt->m_dMaxRight < dTempRight ) pt->m_dMaxRight = dTempRight;
+            if ( pt->m_pRightBranch->m_ptLeft == ULONG_MAX || pt->m_pRightBranch->m_ptLeft == ULONG_MAX)
+            {
+                SumSpacings += dTempRight;
+                SumSpacingsSq += dTempRight*dTempRight;
+            }
+            pt = pt->m_pRightBranch;
+        }
+        else  // ((DistanceTypeNode)(t - *m_tLeft) <= (DistanceTypeNode)(t - *m_tRight) )
+        {
+            if ( pt->m_pLeftBranch  == 0 ) pt->m_pLeftBranch  = arena.Allocate( );
+            // note that the next line assumes that m_dMaxLeft is negative for a new node
+            if ( pt->m_dMaxLeft < dTempLeft ) pt->m_dMaxLeft  = dTempLeft;
+            if ( pt->m_pLeftBranch->m_ptLeft == ULONG_MAX || pt->m_pLeftBranch->m_ptLeft == ULONG_MAX)
+            {
+                SumSpacings += dTempLeft;
+                SumSpacingsSq += dTempLeft*dTempLeft;
+            }
+            pt = pt->m_pLeftBranch;
+        }
+    }
+}  //  end Inserter
+
+//=======================================================================
+void InserterDelayed ( const long n, size_t& localDepth, std::vector<TNode>& objectStore,
+                       DistanceTypeNode& SumSpacings,  DistanceTypeNode& SumSpacingsSq, NodeArena& arena )
+{
+    NearTreeNode* pt = this;
+    for ( ;; )
+    {
+        // do a bit of precomputing if it is possible so that we can
+        // reduce the number of calls to operator 'DistanceTypeNode' as much as possible;
+        // 'DistanceTypeNode' might use square roots in some cases
+        DistanceTypeNode dTempRight =  DistanceTypeNode(0);
+        DistanceTypeNode dTempLeft  =  DistanceTypeNode(0);
+        ++localDepth;
+
+        if ( pt->m_ptRight  != ULONG_MAX )
+        {
+            dTempRight  = DistanceBetween( objectStore[n], objectStore[pt->m_ptRight] );
+            dTempLeft   = DistanceBetween( objectStore[n], objectStore[pt->m_ptLeft]  );
+        }
+
+        if ( pt->m_ptLeft == ULONG_MAX )
+        {
+            pt->m_ptLeft = n;
+            return;
+        }
+        else if ( pt->m_ptRight == ULONG_MAX )
+        {
+            pt->m_ptRight = n;
+            return;
+        }
+        else if ( dTempLeft > dTempRight )
+        {
+            if ( pt->m_pRightBranch == 0 ) pt->m_pRightBranch = arena.Allocate( );
+            // note that the next line assumes that m_dMaxRight is negative for a new node
+            if ( pt->m_dMaxRight < dTempRight ) pt->m_dMaxRight = dTempRight;
+            if ( pt->m_pRightBranch->m_ptLeft == ULONG_MAX || pt->m_pRightBranch->m_ptLeft == ULONG_MAX)
+            {
+                SumSpacings += dTempRight;
+                SumSpacingsSq += dTempRight*dTempRight;
+            }
+            pt = pt->m_pRightBranch;
+        }
+        else  // ((DistanceTypeNode)(t - *m_tLeft) <= (DistanceTypeNode)(t - *m_tRight) )
+        {
+            if ( pt->m_pLeftBranch  == 0 ) pt->m_pLeftBranch  = arena.Allocate( );
+            // note that the next line assumes that m_dMaxLeft is negative for a new node
+            if ( pt->m_dMaxLeft < dTempLeft ) pt->m_dMaxLeft  = dTempLeft;
+            if ( pt->m_pLeftBranch->m_ptLeft == ULONG_MAX || pt->m_pLeftBranch->m_ptLeft == ULONG_MAX)
+            {
+                SumSpacings += dTempLeft;
+                SumSpacingsSq += dTempLeft*dTempLeft;
+            }
+            pt = pt->m_pLeftBranch;
+        }
+    }
+}  //   end InserterDelayed
+
+//=======================================================================
+//  size_t CountObjects ( void ) const
+//
+//  The number of objects in this node and all of the nodes below it.
+//
+//=======================================================================
+size_t CountObjects ( void ) const
+{
+    size_t count = 0;
+    SearchScratch<const NearTreeNode*> sStack;
+    sStack.push_back( this );
+    while ( !sStack.empty( ) )
+    {
+        const NearTreeNode* const pt = sStack.back( );
+        sStack.pop_back( );
+        if ( pt->m_ptLeft  != ULONG_MAX ) ++count;
+        if ( pt->m_ptRight != ULONG_MAX ) ++count;
+        if ( pt->m_pLeftBranch  != 0 ) sStack.push_back( pt->m_pLeftBranch );
+        if ( pt->m_pRightBranch != 0 ) sStack.push_back( pt->m_pRightBranch );
+    }
+    return ( count );
+}  //  end CountObjects
+
+//=======================================================================
+//  bool AllCoincide ( const std::vector<TNode>& objectStore ) const
+//
+//  true if every object of this node and of the nodes below it is at no
+//  distance from this node's left object
+//
+//=======================================================================
+bool AllCoincide ( const std::vector<TNode>& objectStore ) const
+{
+    if ( m_ptLeft == ULONG_MAX ) return ( true );
+    SearchScratch<const NearTreeNode*> sStack;
+    sStack.push_back( this );
+    while ( !sStack.empty( ) )
+    {
+        const NearTreeNode* const pt = sStack.back( );
+        sStack.pop_back( );
+        if ( pt->m_ptLeft != ULONG_MAX
+             && DistanceBetween( objectStore[m_ptLeft], objectStore[pt->m_ptLeft] ) > DistanceTypeNode( 0 ) )
+            return ( false );
+        if ( pt->m_ptRight != ULONG_MAX
+             && DistanceBetween( objectStore[m_ptLeft], objectStore[pt->m_ptRight] ) > DistanceTypeNode( 0 ) )
+            return ( false );
+        if ( pt->m_pLeftBranch  != 0 ) sStack.push_back( pt->m_pLeftBranch );
+        if ( pt->m_pRightBranch != 0 ) sStack.push_back( pt->m_pRightBranch );
+    }
+    return ( true );
+}  //  end AllCoincide
+
+//=======================================================================
+//  NearTreeNode* FindScapegoat ( const long n, const double factor, size_t& level,
+//                                const std::vector<TNode>& objectStore )
+//
+//  The subtree to rebuild after object n, just inserted below this node,
+//  landed too deep. The way down to n is found again, taking the same
+//  branches as the insert did. Then, going back up, the objects below each
+//  node are counted until one is reached whose subtree holds n more than
+//  factor*log2(count) levels down, a count under 2 being taken as 2 so a
+//  lone new leaf is never chosen. That node is returned, with level the
+//  number of levels above it. If there is no smaller one, it is this node.
+//
+//=======================================================================
+NearTreeNode* FindScapegoat ( const long n, const double factor, size_t& level,
+                              const std::vector<TNode>& objectStore )
+{
+    const size_t index = (size_t)n;
+    SearchScratch<NearTreeNode*> sPath;
+    NearTreeNode* pt = this;
+    while ( pt->m_ptLeft != index && pt->m_ptRight != index )
+    {
+        sPath.push_back( pt );
+        const DistanceTypeNode dTempRight = DistanceBetween( objectStore[index], objectStore[pt->m_ptRight] );
+        const DistanceTypeNode dTempLeft  = DistanceBetween( objectStore[index], objectStore[pt->m_ptLeft]  );
+        pt = ( dTempLeft > dTempRight ) ? pt->m_pRightBranch : pt->m_pLeftBranch;
+    }
+
+    size_t count  = pt->CountObjects( );
+    size_t height = 1;
+    while ( !sPath.empty( ) && (double)height <= factor*::log( (double)std::max( count, (size_t)2 ) )/::log( 2.0 ) )
+    {
+        NearTreeNode* const parent = sPath.back( );
+        sPath.pop_back( );
+        const NearTreeNode* const other =
+            ( parent->m_pLeftBranch == pt ) ? parent->m_pRightBranch : parent->m_pLeftBranch;
+        count += 2 + ( other != 0 ? other->CountObjects( ) : 0 );
+        ++height;
+        pt = parent;
+    }
+    level = sPath.size( );
+    return ( pt );
+}  //  end FindScapegoat
+
+//=======================================================================
+//  size_t Rebuild ( const size_t level, std::vector<TNode>& objectStore,
+//                   NodeArena& arena, RHrand& rng )
+//
+//  Reinsert the objects of this node and all of the nodes below it, in an
+//  order shuffled with rng, so that the subtree is about as shallow as a
+//  randomly built one. The nodes below are handed back to arena and taken
+//  again as needed. The objects stay in the subtree, so the bounds of the
+//  nodes above it (m_dMaxLeft and m_dMaxRight) stay right. The spacing
+//  sums are not changed; they were counted when the objects came in.
+//
+//  level is the number of levels above this node; the deepest level of the
+//  rebuilt subtree, counted from the root, is returned
+//
+//=======================================================================
+size_t Rebuild ( const size_t level, std::vector<TNode>& objectStore, NodeArena& arena, RHrand& rng )
 {
+    SearchScratch<long> sIndices;
+    SearchScratch<NearTreeNode*> sStack;
+    sStack.push_back( this );
+    while ( !sStack.empty( ) )
+    {
+        NearTreeNode* const pt = sStack.back( );
+        sStack.pop_back( );
+        if ( pt->m_ptLeft  != ULONG_MAX ) sIndices.push_back( (long)pt->m_ptLeft );
+        if ( pt->m_ptRight != ULONG_MAX ) sIndices.push_back( (long)pt->m_ptRight );
+        if ( pt->m_pLeftBranch  != 0 ) sStack.push_back( pt->m_pLeftBranch );
+        if ( pt->m_pRightBranch != 0 ) sStack.push_back( pt->m_pRightBranch );
+        if ( pt != this ) arena.Release( pt );
+    }
     clear( );
-};  //  end NearTreeNode destructor
 
-//=======================================================================
-void clear( void )
-{
-    if ( m_pLeftBranch  ) m_pLeftBranch ->clear( );
-    if ( m_pRightBranch ) m_pRightBranch->clear( );
-    delete m_pLeftBranch  ;  m_pLeftBranch  =0;
-    delete m_pRightBranch ;  m_pRightBranch =0;
+    // Fisher-Yates
+    for ( size_t i=sIndices.size( ); i>1; --i )
+    {
+        const size_t j = std::min( (size_t)( (double)i*rng.urand( ) ), i-1 );
+        std::swap( sIndices[i-1], sIndices[j] );
+    }
+
+    DistanceTypeNode SumSpacings   = DistanceTypeNode( 0 );
+    DistanceTypeNode SumSpacingsSq = DistanceTypeNode( 0 );
+    size_t deepestDepth = 0;
+    for ( size_t i=0; i<sIndices.size( ); ++i )
+    {
+        size_t localDepth = level;
+        InserterDelayed( sIndices[i], localDepth, objectStore, SumSpacings, SumSpacingsSq, arena );
+        if ( localDepth > deepestDepth ) deepestDepth = localDepth;
+    }
+    return ( deepestDepth );
+}  //  end Rebuild
+
+//=======================================================================
+//  void InserterParallel ( const std::vector<long>& indices, size_t& deepestDepth,
+//                          std::vector<TNode>& objectStore, DistanceTypeNode& SumSpacings,
+//                          DistanceTypeNode& SumSpacingsSq, NodeArena& arena, const unsigned int threads )
+//
+//  Insert the objects indices on up to threads threads, building the same tree
+//  as calling InserterDelayed for each of them in turn. The full nodes at the top
+//  of the tree are the routing levels: every object is first sent down them
+//  (which also raises their m_dMax bounds), and then the branches hanging off
+//  them are filled concurrently, each from its own objects in their original
+//  order. The nodes come from one NodeArena per thread, which arena then adopts.
+//  deepestDepth is raised to the depth of the deepest object inserted.
+//
+//=======================================================================
+void InserterParallel ( const std::vector<long>& indices, size_t& deepestDepth, std::vector<TNode>& objectStore,
+                        DistanceTypeNode& SumSpacings, DistanceTypeNode& SumSpacingsSq, NodeArena& arena,
+                        const unsigned int threads )
+{
+    // a branch hanging off a routing node, and the objects that go into it
+    struct Slot
+    {
+        NearTreeNode* m_pParent;
+        bool          m_bRight;
+        size_t        m_Depth;
+    };
+    // a full node near the top of the tree, with where each of its sides leads:
+    // the position of another routing node, or -1 minus the position of a slot
+    struct Route
+    {
+        NearTreeNode* m_pNode;
+        size_t        m_Depth;
+        long          m_Next[2];
+    };
+
+    static const size_t MinPerThread = 4096;  // below this, threads cost more than they save
+    const unsigned int nThreads = (unsigned int)std::min( (size_t)threads, indices.size( )/MinPerThread );
+    if ( nThreads <= 1 || m_ptLeft == ULONG_MAX || m_ptRight == ULONG_MAX )
+    {
+        for ( size_t i=0; i<indices.size( ); ++i )
+        {
+            size_t localDepth = 0;
+            InserterDelayed( indices[i], localDepth, objectStore, SumSpacings, SumSpacingsSq, arena );
+            if ( localDepth > deepestDepth ) deepestDepth = localDepth;
+        }
+        return;
+    }
+
+    // find the routing nodes, breadth first, deep enough for about 16 slots per thread
+    size_t routeDepth = 1;
+    while ( ((size_t)1 << routeDepth) < 16*(size_t)nThreads ) ++routeDepth;
+    std::vector<Route> route;
+    std::vector<Slot>  slots;
+    const Route root = { this, 1, { 0, 0 } };
+    route.push_back( root );
+    for ( size_t r=0; r<route.size( ); ++r )
+    {
+        for ( int side=0; side<2; ++side )
+        {
+            NearTreeNode* const pNode  = route[r].m_pNode;
+            NearTreeNode* const pChild = side ? pNode->m_pRightBranch : pNode->m_pLeftBranch;
+            if ( pChild != 0 && pChild->m_ptRight != ULONG_MAX && route[r].m_Depth < routeDepth )
+            {
+                const Route next = { pChild, route[r].m_Depth+1, { 0, 0 } };
+                route[r].m_Next[side] = (long)route.size( );
+                route.push_back( next );
+            }
+            else
+            {
+                const Slot slot = { pNode, side != 0, route[r].m_Depth };
+                route[r].m_Next[side] = -1 - (long)slots.size( );
+                slots.push_back( slot );
+            }
+        }
+    }
+
+    // route every object to its slot, each thread keeping its own m_dMax bounds
+    std::vector<unsigned int> slotOf( indices.size( ) );
+    std::vector<std::vector<DistanceTypeNode> > dMax( nThreads,
+        std::vector<DistanceTypeNode>( 2*route.size( ), DistanceTypeNode( distMinValueNode ) ) );
+    std::vector<std::thread> pool;
+    for ( unsigned int t=0; t<nThreads; ++t )
+    {
+        pool.push_back( std::thread( [&, t]( )
+        {
+            std::vector<DistanceTypeNode>& localMax = dMax[t];
+            const size_t last = indices.size( )*(t+1)/nThreads;
+            for ( size_t i=indices.size( )*t/nThreads; i<last; ++i )
+            {
+                const TNode& object = objectStore[indices[i]];
+                long r = 0;
+                while ( r >= 0 )
+                {
+                    const NearTreeNode* const pNode = route[r].m_pNode;
+                    const DistanceTypeNode dTempRight = DistanceBetween( object, objectStore[pNode->m_ptRight] );
+                    const DistanceTypeNode dTempLeft  = DistanceBetween( object, objectStore[pNode->m_ptLeft]  );
+                    const int side = ( dTempLeft > dTempRight ) ? 1 : 0;
+                    const DistanceTypeNode d = side ? dTempRight : dTempLeft;
+                    if ( localMax[2*r+side] < d ) localMax[2*r+side] = d;
+                    const long next = route[r].m_Next[side];
+                    if ( next < 0 ) slotOf[i] = (unsigned int)(-1 - next);
+                    r = next;
+                }
+            }
+        } ) );
+    }
+    for ( unsigned int t=0; t<nThreads; ++t ) pool[t].join( );
+    pool.clear( );
+    for ( size_t r=0; r<route.size( ); ++r )
+    {
+        for ( unsigned int t=0; t<nThreads; ++t )
+        {
+            // note that this assumes that m_dMax is negative for a new branch
+            if ( route[r].m_pNode->m_dMaxLeft  < dMax[t][2*r]   ) route[r].m_pNode->m_dMaxLeft  = dMax[t][2*r];
+            if ( route[r].m_pNode->m_dMaxRight < dMax[t][2*r+1] ) route[r].m_pNode->m_dMaxRight = dMax[t][2*r+1];
+        }
+    }
 
-    m_ptLeft     = ULONG_MAX;
-    m_ptRight    = ULONG_MAX;
-    m_dMaxLeft   = DistanceTypeNode( distMinValueNode );
-    m_dMaxRight  = DistanceTypeNode( distMinValueNode );
-};  //  end clear
+    // gather each slot's objects together, keeping them in their original order
+    std::vector<size_t> first( slots.size( )+1, 0 );
+    for ( size_t i=0; i<indices.size( ); ++i ) ++first[slotOf[i]+1];
+    for ( size_t k=0; k<slots.size( ); ++k ) first[k+1] += first[k];
+    std::vector<long> bySlot( indices.size( ) );
+    {
+        std::vector<size_t> fill( first.begin( ), first.end( )-1 );
+        for ( size_t i=0; i<indices.size( ); ++i ) bySlot[fill[slotOf[i]]++] = indices[i];
+    }
 
-//=======================================================================
-DistanceTypeNode GetDiamEstimate( void ) const
-{
-    DistanceTypeNode temp = m_dMaxLeft;
-    if ( m_dMaxRight > temp ) temp = m_dMaxRight;
-    if ( DistanceTypeNode(0) > temp ) temp = DistanceTypeNode(0);
-    return temp;
-}
+    // build the slots concurrently, largest first, each thread with its own arena
+    std::vector<size_t> order( slots.size( ) );
+    for ( size_t k=0; k<slots.size( ); ++k ) order[k] = k;
+    std::sort( order.begin( ), order.end( ), [&]( const size_t a, const size_t b )
+        { return ( first[a+1]-first[a] > first[b+1]-first[b] ); } );
+    std::vector<DistanceTypeNode> slotSum( slots.size( ), DistanceTypeNode( 0 ) );
+    std::vector<DistanceTypeNode> slotSumSq( slots.size( ), DistanceTypeNode( 0 ) );
+    std::vector<size_t> slotDepth( slots.size( ), 0 );
+    NodeArena* const arenas = new NodeArena[nThreads];
+    std::atomic<size_t> nextSlot( 0 );
+    for ( unsigned int t=0; t<nThreads; ++t )
+    {
+        pool.push_back( std::thread( [&, t]( )
+        {
+            for ( size_t j=nextSlot++; j<order.size( ); j=nextSlot++ )
+            {
+                const size_t k = order[j];
+                NearTreeNode*& pBranch = slots[k].m_bRight ? slots[k].m_pParent->m_pRightBranch : slots[k].m_pParent->m_pLeftBranch;
+                const size_t ptParent  = slots[k].m_bRight ? slots[k].m_pParent->m_ptRight      : slots[k].m_pParent->m_ptLeft;
+                for ( size_t i=first[k]; i<first[k+1]; ++i )
+                {
+                    if ( pBranch == 0 ) pBranch = arenas[t].Allocate( );
+                    if ( pBranch->m_ptLeft == ULONG_MAX )
+                    {
+                        const DistanceTypeNode d = DistanceBetween( objectStore[bySlot[i]], objectStore[ptParent] );
+                        slotSum[k]   += d;
+                        slotSumSq[k] += d*d;
+                    }
+                    size_t localDepth = slots[k].m_Depth;
+                    pBranch->InserterDelayed( bySlot[i], localDepth, objectStore, slotSum[k], slotSumSq[k], arenas[t] );
+                    if ( localDepth > slotDepth[k] ) slotDepth[k] = localDepth;
+                }
+            }
+        } ) );
+    }
+    for ( unsigned int t=0; t<nThreads; ++t ) pool[t].join( );
+
+    for ( unsigned int t=0; t<nThreads; ++t ) arena.Adopt( arenas[t] );
+    delete [] arenas;
+    for ( size_t k=0; k<slots.size( ); ++k )
+    {
+        SumSpacings   += slotSum[k];
+        SumSpacingsSq += slotSumSq[k];
+        if ( slotDepth[k] > deepestDepth ) deepestDepth = slotDepth[k];
+    }
+}  //   end InserterParallel
 
 //=======================================================================
-//  void Inserter ( const TNode& t, size_t& localDepth, std::vector<TNode>& objectStore,
-//                  DistanceTypeNode& SumSpacings,  DistanceTypeNode& SumSpacingsSq  )
-//
-//  Function to insert some "point" as an object into a CNearTree for
-//  later searching
-//
-//     t is an object of the templated type which is to be inserted into a
-//     NearTree
-//
-//     localDepth is the returned deepest tree level reached for the current insert
+//  void BulkBuild ( std::vector<long>& indices, size_t& deepestDepth,
+//                   const std::vector<TNode>& objectStore, DistanceTypeNode& SumSpacings,
+//                   DistanceTypeNode& SumSpacingsSq, NodeArena& arena, const unsigned int threads )
 //
-//  Three possibilities exist: put the datum into the left
-//  position (first test),into the right position, or else
-//  into a node descending from the nearer of those positions
-//  when they are both already used.
+//  Build the tree below this empty node top down from the objects indices,
+//  on up to threads threads. Each node takes an approximate farthest pair
+//  of the objects that reach it: the one farthest from its parent's object
+//  (at the root, from the first object), and the one farthest from that.
+//  The rest go to the branch of the nearer of the two, ties to the left,
+//  as InserterDelayed would send them, and each m_dMax is the farthest
+//  that went its way. indices is partitioned in place, each subtree's
+//  objects becoming one run of it, so no more memory is needed than two
+//  distances per object. Near the top, the distances of one run are
+//  measured by all the threads together; once the runs are small enough
+//  to share out, the threads build whole subtrees concurrently, each with
+//  its own arena, which arena then adopts. deepestDepth is raised to the
+//  depth of the deepest object.
 //
 //=======================================================================
-void Inserter ( const TNode& t, size_t& localDepth, std::vector<TNode>& objectStore,
-               DistanceTypeNode& SumSpacings,  DistanceTypeNode& SumSpacingsSq)
-{
-    // do a bit of precomputing if it is possible so that we can
-    // reduce the number of calls to operator 'DistanceTypeNode' as much as possible;
-    // 'DistanceTypeNode' might use square roots in some cases
-    DistanceTypeNode dTempRight =  DistanceTypeNode(0);
-    DistanceTypeNode dTempLeft  =  DistanceTypeNode(0);
-    ++localDepth;
-    
-    if ( m_ptRight  != ULONG_MAX )
+void BulkBuild ( std::vector<long>& indices, size_t& deepestDepth, const std::vector<TNode>& objectStore,
+                 DistanceTypeNode& SumSpacings, DistanceTypeNode& SumSpacingsSq, NodeArena& arena,
+                 const unsigned int threads )
+{
+    if ( indices.empty( ) )
     {
-        dTempRight  = DistanceBetween( t, objectStore[m_ptRight] );
-        dTempLeft   = DistanceBetween( t, objectStore[m_ptLeft]  );
+        return;
     }
+    std::vector<DistanceTypeNode> dLeft ( indices.size( ) );
+    std::vector<DistanceTypeNode> dRight( indices.size( ) );
+    const unsigned int nThreads =
+        (unsigned int)std::max( (size_t)1, std::min( (size_t)threads, indices.size( )/BulkMinPerThread ) );
 
-    if ( m_ptLeft == ULONG_MAX )
+    // split the top of the tree, the distances measured in parallel,
+    // until every run is small enough to be one thread's share
+    const BulkRun root = { this, 0, indices.size( ), 1, false };
+    std::vector<BulkRun> runs;
+    if ( nThreads <= 1 )
     {
-        m_ptLeft = objectStore.size( );
-        objectStore.push_back( t );
+        runs.push_back( root );
     }
-    else if ( m_ptRight == ULONG_MAX )
+    else
     {
-        m_ptRight = objectStore.size( );
-        objectStore.push_back( t );
+        const size_t share = std::max( (size_t)BulkMinPerThread, indices.size( )/( 16*(size_t)nThreads ) );
+        std::vector<BulkRun> sTop( 1, root );
+        while ( !sTop.empty( ) )
+        {
+            const BulkRun run = sTop.back( );
+            sTop.pop_back( );
+            if ( run.m_Last-run.m_First <= share )
+            {
+                runs.push_back( run );
+                continue;
+            }
+            if ( run.m_Depth > deepestDepth ) deepestDepth = run.m_Depth;
+            BulkRun below[2];
+            const int nBelow = SplitRun( run, indices, objectStore, dLeft, dRight, SumSpacings, SumSpacingsSq,
+                                         arena, nThreads, below );
+            for ( int k=0; k<nBelow; ++k ) sTop.push_back( below[k] );
+        }
     }
-    else if ( dTempLeft > dTempRight )
+
+    // then build the subtrees of the runs, largest first, each on one thread
+    std::sort( runs.begin( ), runs.end( ), []( const BulkRun& a, const BulkRun& b )
+        { return ( a.m_Last-a.m_First > b.m_Last-b.m_First ); } );
+    std::vector<DistanceTypeNode> runSum( runs.size( ), DistanceTypeNode( 0 ) );
+    std::vector<DistanceTypeNode> runSumSq( runs.size( ), DistanceTypeNode( 0 ) );
+    std::vector<size_t> runDepth( runs.size( ), 0 );
+    const auto buildRun = [&]( const size_t k, NodeArena& runArena )
     {
-        if ( m_pRightBranch == 0 ) m_pRightBranch = new NearTreeNode;
-        // note that the next line assumes that m_dMaxRight is negative for a new node
-        if ( m_dMaxRight < dTempRight ) m_dMaxRight = dTempRight;
-        if ( m_pRightBranch->m_ptLeft == ULONG_MAX || m_pRightBranch->m_ptLeft == ULONG_MAX)
+        std::vector<BulkRun> sStack( 1, runs[k] );
+        while ( !sStack.empty( ) )
         {
-            SumSpacings += dTempRight;
-            SumSpacingsSq += dTempRight*dTempRight;
+            const BulkRun run = sStack.back( );
+            sStack.pop_back( );
+            if ( run.m_Depth > runDepth[k] ) runDepth[k] = run.m_Depth;
+            BulkRun below[2];
+            const int nBelow = SplitRun( run, indices, objectStore, dLeft, dRight, runSum[k], runSumSq[k],
+                                         runArena, 1, below );
+            for ( int j=0; j<nBelow; ++j ) sStack.push_back( below[j] );
         }
-        m_pRightBranch->Inserter( t, localDepth, objectStore, SumSpacings, SumSpacingsSq );
+    };
+    if ( nThreads <= 1 )
+    {
+        buildRun( 0, arena );
     }
-    else  // ((DistanceTypeNode)(t - *m_tLeft) <= (DistanceTypeNode)(t - *m_tRight) )
+    else
     {
-        if ( m_pLeftBranch  == 0 ) m_pLeftBranch  = new NearTreeNode;
-        // note that the next line assumes that m_dMaxLeft is negative for a new node
-        if ( m_dMaxLeft < dTempLeft ) m_dMaxLeft  = dTempLeft;
-        if ( m_pLeftBranch->m_ptLeft == ULONG_MAX || m_pLeftBranch->m_ptLeft == ULONG_MAX)
+        NodeArena* const arenas = new NodeArena[nThreads];
+        std::atomic<size_t> nextRun( 0 );
+        std::vector<std::thread> pool;
+        for ( unsigned int t=0; t<nThreads; ++t )
         {
-            SumSpacings += dTempLeft;
-            SumSpacingsSq += dTempLeft*dTempLeft;
+            pool.push_back( std::thread( [&, t]( )
+            {
+                for ( size_t k=nextRun++; k<runs.size( ); k=nextRun++ )
+                {
+                    buildRun( k, arenas[t] );
+                }
+            } ) );
         }
-        m_pLeftBranch->Inserter( t, localDepth, objectStore, SumSpacings, SumSpacingsSq );
+        for ( unsigned int t=0; t<nThreads; ++t ) pool[t].join( );
+        for ( unsigned int t=0; t<nThreads; ++t ) arena.Adopt( arenas[t] );
+        delete [] arenas;
     }
-}  //  end Inserter
+    for ( size_t k=0; k<runs.size( ); ++k )
+    {
+        SumSpacings   += runSum[k];
+        SumSpacingsSq += runSumSq[k];
+        if ( runDepth[k] > deepestDepth ) deepestDepth = runDepth[k];
+    }
+}  //   end BulkBuild
 
 //=======================================================================
-void InserterDelayed ( const long n, size_t& localDepth, std::vector<TNode>& objectStore,
-                       DistanceTypeNode& SumSpacings,  DistanceTypeNode& SumSpacingsSq )
+//  int SplitRun ( const BulkRun& run, std::vector<long>& indices,
+//                 const std::vector<TNode>& objectStore, std::vector<DistanceTypeNode>& dLeft,
+//                 std::vector<DistanceTypeNode>& dRight, DistanceTypeNode& SumSpacings,
+//                 DistanceTypeNode& SumSpacingsSq, NodeArena& arena, const unsigned int threads,
+//                 BulkRun below[2] )
+//
+//  One step of BulkBuild: fill run's node from its objects and split the
+//  others between its branches, which are taken from arena. The runs of
+//  the branches that have objects are put in below, and their number is
+//  returned. The first object of each is the one farthest from the object
+//  above it, so it has been measured already; it is the branch's left
+//  object, and its distance goes into the spacing sums, as it would for
+//  the first object inserted into a branch.
+//
+//=======================================================================
+static int SplitRun ( const BulkRun& run, std::vector<long>& indices, const std::vector<TNode>& objectStore,
+                      std::vector<DistanceTypeNode>& dLeft, std::vector<DistanceTypeNode>& dRight,
+                      DistanceTypeNode& SumSpacings, DistanceTypeNode& SumSpacingsSq, NodeArena& arena,
+                      const unsigned int threads, BulkRun below[2] )
 {
-    // do a bit of precomputing if it is possible so that we can
-    // reduce the number of calls to operator 'DistanceTypeNode' as much as possible;
-    // 'DistanceTypeNode' might use square roots in some cases
-    DistanceTypeNode dTempRight =  DistanceTypeNode(0);
-    DistanceTypeNode dTempLeft  =  DistanceTypeNode(0);
-    ++localDepth;
-
-    if ( m_ptRight  != ULONG_MAX )
+    NearTreeNode* const pt = run.m_pNode;
+    const size_t first = run.m_First;
+    const size_t last  = run.m_Last;
+    if ( last-first <= 2 )
     {
-        dTempRight  = DistanceBetween( objectStore[n], objectStore[m_ptRight] );
-        dTempLeft   = DistanceBetween( objectStore[n], objectStore[m_ptLeft]  );
+        pt->m_ptLeft = (size_t)indices[first];
+        if ( last-first == 2 ) pt->m_ptRight = (size_t)indices[first+1];
+        return ( 0 );
     }
 
-    if ( m_ptLeft == ULONG_MAX )
+    // the pair: the farthest from the first object, if that is not already
+    // first, and the farthest from it
+    if ( ! run.m_FarFirst )
     {
-        m_ptLeft = n;
+        const size_t far = MeasureRun( objectStore[indices[first]], indices, first+1, last, objectStore, dLeft, threads );
+        std::swap( indices[first], indices[far] );
     }
-    else if ( m_ptRight == ULONG_MAX )
+    const size_t far = MeasureRun( objectStore[indices[first]], indices, first+1, last, objectStore, dLeft, threads );
+    std::swap( indices[first+1], indices[far] );
+    std::swap( dLeft[first+1], dLeft[far] );
+    MeasureRun( objectStore[indices[first+1]], indices, first+2, last, objectStore, dRight, threads );
+    pt->m_ptLeft  = (size_t)indices[first];
+    pt->m_ptRight = (size_t)indices[first+1];
+
+    // split the others in place, those nearer the left object to the front
+    size_t middle = first+2;
+    size_t back   = last;
+    while ( middle < back )
     {
-        m_ptRight = n;
+        if ( dLeft[middle] > dRight[middle] )
+        {
+            --back;
+            std::swap( indices[middle], indices[back] );
+            std::swap( dLeft[middle],   dLeft[back]   );
+            std::swap( dRight[middle],  dRight[back]  );
+        }
+        else
+        {
+            ++middle;
+        }
     }
-    else if ( dTempLeft > dTempRight )
+
+    int nBelow = 0;
+    for ( int side=0; side<2; ++side )
     {
-        if ( m_pRightBranch == 0 ) m_pRightBranch = new NearTreeNode;
-        // note that the next line assumes that m_dMaxRight is negative for a new node
-        if ( m_dMaxRight < dTempRight ) m_dMaxRight = dTempRight;
-        if ( m_pRightBranch->m_ptLeft == ULONG_MAX || m_pRightBranch->m_ptLeft == ULONG_MAX)
+        const size_t begin = side ? middle : first+2;
+        const size_t end   = side ? last   : middle;
+        if ( begin == end ) continue;
+        std::vector<DistanceTypeNode>& d = side ? dRight : dLeft;
+        size_t far = begin;
+        for ( size_t i=begin+1; i<end; ++i )
         {
-            SumSpacings += dTempRight;
-            SumSpacingsSq += dTempRight*dTempRight;
+            if ( d[i] > d[far] ) far = i;
         }
-        m_pRightBranch->InserterDelayed( n, localDepth, objectStore, SumSpacings, SumSpacingsSq );
+        std::swap( indices[begin], indices[far] );
+        std::swap( d[begin], d[far] );
+
+        NearTreeNode* const pBranch = arena.Allocate( );
+        ( side ? pt->m_pRightBranch : pt->m_pLeftBranch ) = pBranch;
+        ( side ? pt->m_dMaxRight    : pt->m_dMaxLeft    ) = d[begin];
+        SumSpacings   += d[begin];
+        SumSpacingsSq += d[begin]*d[begin];
+        const BulkRun branch = { pBranch, begin, end, run.m_Depth+1, true };
+        below[nBelow++] = branch;
     }
-    else  // ((DistanceTypeNode)(t - *m_tLeft) <= (DistanceTypeNode)(t - *m_tRight) )
-    {
-        if ( m_pLeftBranch  == 0 ) m_pLeftBranch  = new NearTreeNode;
-        // note that the next line assumes that m_dMaxLeft is negative for a new node
-        if ( m_dMaxLeft < dTempLeft ) m_dMaxLeft  = dTempLeft;
-        if ( m_pLeftBranch->m_ptLeft == ULONG_MAX || m_pLeftBranch->m_ptLeft == ULONG_MAX)
+    return ( nBelow );
+}  //  end SplitRun
+
+//=======================================================================
+//  size_t MeasureRun ( const TNode& t, const std::vector<long>& indices,
+//                      const size_t first, const size_t last,
+//                      const std::vector<TNode>& objectStore,
+//                      std::vector<DistanceTypeNode>& d, const unsigned int threads )
+//
+//  d[i] = the distance from t to object indices[i], for i from first to
+//  last-1 (at least one), on up to threads threads. Returns the i of the
+//  farthest, the first of them if there are several.
+//
+//=======================================================================
+static size_t MeasureRun ( const TNode& t, const std::vector<long>& indices, const size_t first, const size_t last,
+                           const std::vector<TNode>& objectStore, std::vector<DistanceTypeNode>& d,
+                           const unsigned int threads )
+{
+    const unsigned int nThreads =
+        (unsigned int)std::max( (size_t)1, std::min( (size_t)threads, ( last-first )/BulkMinPerThread ) );
+    std::vector<size_t> farthest( nThreads, first );
+    const auto measure = [&]( const unsigned int k )
+    {
+        const size_t begin = first + ( last-first )*k/nThreads;
+        const size_t end   = first + ( last-first )*(k+1)/nThreads;
+        size_t far = begin;
+        for ( size_t i=begin; i<end; ++i )
         {
-            SumSpacings += dTempLeft;
-            SumSpacingsSq += dTempLeft*dTempLeft;
-        }        
-        m_pLeftBranch->InserterDelayed( n, localDepth, objectStore, SumSpacings, SumSpacingsSq );
+            d[i] = DistanceBetween( t, objectStore[indices[i]] );
+            if ( d[i] > d[far] ) far = i;
+        }
+        farthest[k] = far;
+    };
+    std::vector<std::thread> pool;
+    for ( unsigned int k=1; k<nThreads; ++k ) pool.push_back( std::thread( measure, k ) );
+    measure( 0 );
+    for ( size_t k=0; k<pool.size( ); ++k ) pool[k].join( );
+
+    size_t far = farthest[0];
+    for ( unsigned int k=1; k<nThreads; ++k )
+    {
+        if ( d[farthest[k]] > d[far] ) far = farthest[k];
     }
-}  //   end InserterDelayed
+    return ( far );
+}  //  end MeasureRun
 
 //=======================================================================
-//  bool Nearest ( DistanceTypeNode& dRadius,  TNode& tClosest,   const TNode& t,
+//  bool Nearest ( DistanceTypeNode& dRadius,  TNode* tClosest,   const TNode& t,
 //                 const std::vector<TNode>& objectStore) const
 //
 //  Private function to search a NearTree for the object closest to some probe point, t.
 //  This function is only called by NearestNeighbor.
 //
 //    dRadius is the smallest currently known distance of an object from the probe point.
-//    tClosest is an object of the templated type and is the returned closest point
-//             to the probe point that can be found in the NearTree
+//    tClosest points to an object of the templated type and is the returned closest point
+//             to the probe point that can be found in the NearTree, or is 0 if only
+//             its index, pClosest, is wanted
 //    t  is the probe point
 //    objectStore is the complete object store of the NearTree
+//    erased marks the erased objects (see erase), or is 0 if none are
+//    epsilon: the branches are pruned at dRadius/(1+epsilon), so the object found may be
+//             up to (1+epsilon) times as far as the nearest; 0 for the exact search
 //
 //    the return value is true only if a point was found within dRadius
 //
 //=======================================================================
 bool Nearest (
               DistanceTypeNode& dRadius,
-              TNode& tClosest,
+              TNode* const tClosest,
               const TNode& t,
               size_t& pClosest,
-              const std::vector<TNode>& objectStore
+              const std::vector<TNode>& objectStore,
+              const char* const erased,
+              const DistanceTypeNode epsilon
 #ifdef CNEARTREE_INSTRUMENTED
               , size_t& VisitCount
 #endif
               ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
+    const DistanceTypeNode onePlusEpsilon = DistanceTypeNode( 1 ) + epsilon;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
     pClosest = ULONG_MAX;
@@ -3064,7 +6501,7 @@ bool Nearest (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
                 dRadius = dDL;
                 pClosest = pt->m_ptLeft;
@@ -3075,13 +6512,16 @@ bool Nearest (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
                 dRadius = dDR;
                 pClosest = pt->m_ptRight;
             }            
         }
         
+        // the branches are pruned at dRadius/(1+epsilon) (see SetApproximation)
+        const DistanceTypeNode dPrune = dRadius/onePlusEpsilon;
+
         /*
          See if both branches are populated.  In that case, save one branch
          on the stack, and process the other one based on which one seems
@@ -3089,8 +6529,8 @@ bool Nearest (
          */
         if (pt->m_pLeftBranch != 0 && pt->m_pRightBranch != 0 ) {
             if (dDL+pt->m_dMaxLeft < dDR+pt->m_dMaxRight || pt->m_pRightBranch == 0) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-                    if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
+                if ( TRIANG(dDL,pt->m_dMaxLeft,dPrune)) {
+                    if ( TRIANG(dDR,pt->m_dMaxRight,dPrune)) {
                         sStack.push_back(pt->m_pRightBranch);
                     }
                     pt = pt->m_pLeftBranch;
@@ -3107,8 +6547,8 @@ bool Nearest (
             /* We come here either because pursuing the left branch was not useful
                of the right branch look shorter
              */
-            if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
+            if ( TRIANG(dDR,pt->m_dMaxRight,dPrune)) {
+                if ( TRIANG(dDL,pt->m_dMaxLeft,dPrune)) {
                     sStack.push_back(pt->m_pLeftBranch);
                 }
                 pt = pt->m_pRightBranch;
@@ -3121,7 +6561,7 @@ bool Nearest (
         
         /* Only one branch is viable, try them one at a time
          */
-        if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
+        if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dPrune)) {
             pt = pt->m_pLeftBranch;
 #ifdef CNEARTREE_INSTRUMENTED
             ++VisitCount;
@@ -3129,7 +6569,7 @@ bool Nearest (
             continue;
         }
         
-        if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
+        if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dPrune)) {
             pt = pt->m_pRightBranch;
 #ifdef CNEARTREE_INSTRUMENTED
             ++VisitCount;
@@ -3149,29 +6589,28 @@ bool Nearest (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
-    if ( pClosest != ULONG_MAX )
-        tClosest = objectStore[pClosest];
+    if ( pClosest != ULONG_MAX && tClosest != 0 )
+        *tClosest = objectStore[pClosest];
     return ( pClosest != ULONG_MAX );
 };   // end Nearest
 
 
 //=======================================================================
-//  bool LeftNearest ( DistanceTypeNode& dRadius,  TNode& tClosest,   const TNode& t,
+//  bool LeftNearest ( DistanceTypeNode& dRadius,  TNode* tClosest,   const TNode& t,
 //                 const std::vector<TNode>& objectStore) const
 //
 //  Private function to search a NearTree for the object closest to some probe point, t.
 //  This function is only called by NearestNeighbor.
 //
 //    dRadius is the smallest currently known distance of an object from the probe point.
-//    tClosest is an object of the templated type and is the returned closest point
-//             to the probe point that can be found in the NearTree
+//    tClosest points to an object of the templated type and is the returned closest point
+//             to the probe point that can be found in the NearTree, or is 0 if only
+//             its index, pClosest, is wanted
 //    t  is the probe point
 //    objectStore is the complete object store of the NearTree
+//    erased marks the erased objects (see erase), or is 0 if none are
+//    epsilon: the branches are pruned at dRadius/(1+epsilon), so the object found may be
+//             up to (1+epsilon) times as far as the nearest; 0 for the exact search
 //
 //    the return value is true only if a point was found within dRadius
 //
@@ -3180,16 +6619,19 @@ bool Nearest (
 //=======================================================================
 bool LeftNearest (
               DistanceTypeNode& dRadius,
-              TNode& tClosest,
+              TNode* const tClosest,
               const TNode& t,
               size_t& pClosest,
-              const std::vector<TNode>& objectStore
+              const std::vector<TNode>& objectStore,
+              const char* const erased,
+              const DistanceTypeNode epsilon
 #ifdef CNEARTREE_INSTRUMENTED
               , size_t& VisitCount
 #endif
               ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
+    const DistanceTypeNode onePlusEpsilon = DistanceTypeNode( 1 ) + epsilon;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -3203,12 +6645,12 @@ bool LeftNearest (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR = DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
                 dRadius = dDR;
                 pClosest = pt->m_ptRight;
             }
-            if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius))
+            if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius/onePlusEpsilon))
             { // we did the left and now we finished the right, go down
                 pt = pt->m_pRightBranch;
                 eDir = left;
@@ -3224,7 +6666,7 @@ bool LeftNearest (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
                 dRadius = dDL;
                 pClosest = pt->m_ptLeft;
@@ -3233,7 +6675,7 @@ bool LeftNearest (
             {
                 sStack.push_back( pt );
             }
-            if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius))
+            if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius/onePlusEpsilon))
             { // we did the left, go down
 #ifdef CNEARTREE_INSTRUMENTED
                 ++VisitCount;
@@ -3256,13 +6698,8 @@ bool LeftNearest (
             eDir = right;
         }
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
-    if ( pClosest != ULONG_MAX )
-        tClosest = objectStore[pClosest];
+    if ( pClosest != ULONG_MAX && tClosest != 0 )
+        *tClosest = objectStore[pClosest];
     return ( pClosest != ULONG_MAX );
 };   // end LeftNearest
 
@@ -3285,13 +6722,14 @@ bool Farthest (
                DistanceTypeNode& dRadius,
                TNode& tFarthest,
                const TNode& t, size_t& pFarthest,
-               const std::vector<TNode>& objectStore
+               const std::vector<TNode>& objectStore,
+               const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                , size_t& VisitCount
 #endif
                ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
     pFarthest = ULONG_MAX;
@@ -3316,7 +6754,7 @@ bool Farthest (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 dRadius = dDL;
                 pFarthest = pt->m_ptLeft;
@@ -3327,7 +6765,7 @@ bool Farthest (
             ++VisitCount;
 #endif                                                        
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 dRadius = dDR;
                 pFarthest = pt->m_ptRight;
@@ -3401,11 +6839,6 @@ bool Farthest (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
     if ( pFarthest != ULONG_MAX )
         tFarthest = objectStore[pFarthest];
     return ( pFarthest != ULONG_MAX );
@@ -3432,13 +6865,14 @@ bool LeftFarthest (
                DistanceTypeNode& dRadius,
                TNode& tFarthest,
                const TNode& t, size_t& pFarthest,
-               const std::vector<TNode>& objectStore
+               const std::vector<TNode>& objectStore,
+               const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                , size_t& VisitCount
 #endif
                ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -3452,7 +6886,7 @@ bool LeftFarthest (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR = DistanceBetween( t , objectStore[pt->m_ptRight] );
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 dRadius = dDR;
                 pFarthest = pt->m_ptRight;
@@ -3473,7 +6907,7 @@ bool LeftFarthest (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t , objectStore[pt->m_ptLeft] );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 dRadius = dDL;
                 pFarthest = pt->m_ptLeft;
@@ -3486,179 +6920,94 @@ bool LeftFarthest (
             { // we did the left, go down
                 pt = pt->m_pLeftBranch;
 #ifdef CNEARTREE_INSTRUMENTED
-                ++VisitCount;
-#endif                            
-            }
-            else
-            {
-                eDir = end;
-            }
-        }
-        
-        if ( eDir == end && !sStack.empty( ) )
-        {
-            pt = sStack.back( );
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
-#endif                            
-            sStack.pop_back( );
-            eDir = right;
-        }
-    }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
-    if ( pFarthest != ULONG_MAX )
-        tFarthest = objectStore[pFarthest];
-    return ( pFarthest != ULONG_MAX );
-};   //  end LeftFarthest
-
-
-//=======================================================================
-//  long InSphere (
-//                const DistanceTypeNode& dRadius,
-//                ContainerType& tClosest,
-//                const TNode& t,
-//                const std::vector<TNode>& objectStore
-//                ) const
-//
-//  Private function to search a NearTree for the objects inside of the specified radius
-//     from the probe point
-//  This function is only called by FindInSphere.
-//
-//    dRadius is the search radius
-//    tClosest is a CNearTree of objects of the templated type found within dRadius of the
-//         probe point
-//    t  is the probe point
-//
-// returns the number of objects returned in the container (for sets, that may not equal the number found)
-//
-//=======================================================================
-template<typename ContainerType>
-long InSphere (
-               const DistanceTypeNode& dRadius,
-               ContainerType& tClosest,
-               const TNode& t,
-               const std::vector<TNode>& objectStore
-#ifdef CNEARTREE_INSTRUMENTED
-               , size_t& VisitCount
-#endif
-               ) const
-{
-    std::vector <NearTreeNode* > sStack;
-    DistanceTypeNode dDL=0., dDR=0.;
-    NearTreeNode* pt = const_cast<NearTreeNode*>(this);
-#ifdef CNEARTREE_INSTRUMENTED
-    ++VisitCount;
-#endif                            
-    if ( pt->m_ptLeft == ULONG_MAX &&  pt->m_ptRight == ULONG_MAX) return false; // test for empty
-    while ( pt->m_ptLeft != ULONG_MAX ||
-           pt->m_ptRight != ULONG_MAX ||
-           !sStack.empty( ) ) 
-    {
-        if (pt->m_ptLeft == ULONG_MAX && pt->m_ptRight == ULONG_MAX) {
-            if (!sStack.empty( )) {
-                pt = sStack.back();
-                sStack.pop_back();
-#ifdef CNEARTREE_INSTRUMENTED
-                ++VisitCount;
-#endif                
-                continue;
-            }
-            break;
-        }
-        if (pt->m_ptLeft != ULONG_MAX) {
-            dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL <= dRadius )
-            {
-                tClosest.insert( tClosest.end(), objectStore[pt->m_ptLeft] );
-            }            
-        }
-        if (pt->m_ptRight != ULONG_MAX) {
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
-#endif                                            
-            dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR <= dRadius )
-            {
-                tClosest.insert( tClosest.end(), objectStore[pt->m_ptRight] );
-            }            
-        }
-        
-        /*
-         See if both branches are populated.  In that case, save one branch
-         on the stack, and process the other one based on which one seems
-         smaller, but useful first]
-         */
-        if (pt->m_pLeftBranch != 0 && pt->m_pRightBranch != 0 ) {
-            if (dDL+pt->m_dMaxLeft < dDR+pt->m_dMaxRight || pt->m_pRightBranch == 0) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-                    if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-                        sStack.push_back(pt->m_pRightBranch);
-                    }
-                    pt = pt->m_pLeftBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-                    ++VisitCount;
-#endif                                
-                    continue;
-                }
-                /* If we are here, the left branch was not useful
-                 Fall through to use the right
-                 */
-            }
-            
-            /* We come here either because pursuing the left branch was not useful
-             of the right branch look shorter
-             */
-            if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-                    sStack.push_back(pt->m_pLeftBranch);
-                }
-                pt = pt->m_pRightBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-                ++VisitCount;
-#endif                
-                continue;
-            } 
-        }
-        
-        /* Only one branch is viable, try them one at a time
-         */
-        if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-            pt = pt->m_pLeftBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
-#endif                            
-            continue;
-        }
-        
-        if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-            pt = pt->m_pRightBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
+                ++VisitCount;
 #endif                            
-            continue;
+            }
+            else
+            {
+                eDir = end;
+            }
         }
         
-        /* We have procesed both sides, we need to go to the stack */
-        
-        if (!sStack.empty( )) {
-            pt = sStack.back();
-            sStack.pop_back();
+        if ( eDir == end && !sStack.empty( ) )
+        {
+            pt = sStack.back( );
 #ifdef CNEARTREE_INSTRUMENTED
             ++VisitCount;
 #endif                            
-            continue;
+            sStack.pop_back( );
+            eDir = right;
         }
-        break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
+    if ( pFarthest != ULONG_MAX )
+        tFarthest = objectStore[pFarthest];
+    return ( pFarthest != ULONG_MAX );
+};   //  end LeftFarthest
+
+
+//=======================================================================
+//  CopyFound
+//
+//  The visitor by which InSphere collects what VisitInSphere finds: a
+//  copy of each object, and its index if the indices are wanted.
+//
+//=======================================================================
+template<typename ContainerType>
+struct CopyFound
+{
+    ContainerType&            tClosest;
+    std::vector<size_t>*      pIndices;    // 0 if the indices are not wanted
+    const std::vector<TNode>& objectStore;
+
+    CopyFound( ContainerType& c, std::vector<size_t>* p, const std::vector<TNode>& o )
+        : tClosest( c ), pIndices( p ), objectStore( o ) { }
+    void operator() ( const size_t n, const DistanceTypeNode )
     {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
+        tClosest.insert( tClosest.end(), objectStore[n] );
+        if ( pIndices != 0 ) pIndices->insert( pIndices->end(), n );
     }
+};
+
+//=======================================================================
+//  long InSphere (
+//                const DistanceTypeNode& dRadius,
+//                ContainerType& tClosest,
+//                const TNode& t,
+//                const std::vector<TNode>& objectStore
+//                ) const
+//
+//  Private function to search a NearTree for the objects inside of the specified radius
+//     from the probe point
+//  This function is only called by FindInSphere. The search is VisitInSphere's,
+//     with a visitor that copies each object found into tClosest (and its index into
+//     tIndices).
+//
+//    dRadius is the search radius
+//    tClosest is a CNearTree of objects of the templated type found within dRadius of the
+//         probe point
+//    t  is the probe point
+//
+// returns the number of objects returned in the container (for sets, that may not equal the number found)
+//
+//=======================================================================
+template<typename ContainerType>
+long InSphere (
+               const DistanceTypeNode& dRadius,
+               ContainerType& tClosest,
+               const TNode& t,
+               const std::vector<TNode>& objectStore,
+               const char* const erased
+#ifdef CNEARTREE_INSTRUMENTED
+               , size_t& VisitCount
+#endif
+               ) const
+{
+    CopyFound<ContainerType> fn( tClosest, 0, objectStore );
+    VisitInSphere( dRadius, fn, t, objectStore, erased
+#ifdef CNEARTREE_INSTRUMENTED
+                  , VisitCount
+#endif
+                  );
     return ( (long)tClosest.size() );
     
 }   // end InSphere
@@ -3670,14 +7019,61 @@ long InSphere (
                ContainerType& tClosest,
                std::vector<size_t>& tIndices,
                const TNode& t,
-               const std::vector<TNode>& objectStore
+               const std::vector<TNode>& objectStore,
+               const char* const erased
+#ifdef CNEARTREE_INSTRUMENTED
+               , size_t& VisitCount
+#endif
+               ) const
+{
+    CopyFound<ContainerType> fn( tClosest, &tIndices, objectStore );
+    VisitInSphere( dRadius, fn, t, objectStore, erased
+#ifdef CNEARTREE_INSTRUMENTED
+                  , VisitCount
+#endif
+                  );
+    return ( (long)tClosest.size() );
+    
+}   // end InSphere
+
+
+//=======================================================================
+//  long VisitInSphere (
+//                const DistanceTypeNode& dRadius,
+//                Visitor& fn,
+//                const TNode& t,
+//                const std::vector<TNode>& objectStore
+//                ) const
+//
+//  Private function to search a NearTree for the objects inside of the specified radius
+//     from the probe point
+//  This function is called by CNearTree::SearchForEachInSphere (for ForEachInSphere and
+//     CountInSphere) and by InSphere (for FindInSphere): it is the only search of the
+//     linked nodes for the objects inside a sphere.
+//
+//    dRadius is the search radius
+//    fn is called as fn( n, d ) for each object found, with its index n in
+//         objectStore and its distance d from the probe point; nothing is copied
+//    t  is the probe point
+//
+// returns the number of objects found
+//
+//=======================================================================
+template<typename Visitor>
+long VisitInSphere (
+               const DistanceTypeNode& dRadius,
+               Visitor& fn,
+               const TNode& t,
+               const std::vector<TNode>& objectStore,
+               const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                , size_t& VisitCount
 #endif
                ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
+    long lFound = 0;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
     ++VisitCount;
@@ -3700,10 +7096,10 @@ long InSphere (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
-                tClosest.insert( tClosest.end(), objectStore[pt->m_ptLeft] );
-                tIndices.insert( tIndices.end(), pt->m_ptLeft);
+                fn( pt->m_ptLeft, dDL );
+                ++lFound;
             }            
         }
         if (pt->m_ptRight != ULONG_MAX) {
@@ -3711,10 +7107,10 @@ long InSphere (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
-                tClosest.insert( tClosest.end(), objectStore[pt->m_ptRight] );
-                tIndices.insert( tIndices.end(), pt->m_ptRight);
+                fn( pt->m_ptRight, dDR );
+                ++lFound;
             }            
         }
         
@@ -3785,14 +7181,9 @@ long InSphere (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
-    return ( (long)tClosest.size() );
+    return ( lFound );
     
-}   // end InSphere
+}   // end VisitInSphere
 
 
 //=======================================================================
@@ -3822,13 +7213,14 @@ long LeftInSphere (
                const DistanceTypeNode& dRadius,
                ContainerType& tClosest,
                const TNode& t,
-               const std::vector<TNode>& objectStore
+               const std::vector<TNode>& objectStore,
+               const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                , size_t& VisitCount
 #endif
                ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -3841,7 +7233,7 @@ long LeftInSphere (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR =  DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
                 tClosest.insert( tClosest.end(), objectStore[pt->m_ptRight] );
             }
@@ -3861,7 +7253,7 @@ long LeftInSphere (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
                 tClosest.insert( tClosest.end(), objectStore[pt->m_ptLeft] );
             }
@@ -3902,13 +7294,14 @@ long LeftInSphere (
                ContainerType& tClosest,
                std::vector<size_t>& tIndices,
                const TNode& t,
-               const std::vector<TNode>& objectStore
+               const std::vector<TNode>& objectStore,
+               const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                , size_t& VisitCount
 #endif
                ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -3921,7 +7314,7 @@ long LeftInSphere (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR =  DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
                 tClosest.insert( tClosest.end(), objectStore[pt->m_ptRight] );
                 tIndices.insert( tIndices.end(), pt->m_ptRight);
@@ -3942,7 +7335,7 @@ long LeftInSphere (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
                 tClosest.insert( tClosest.end(), objectStore[pt->m_ptLeft] );
                 tIndices.insert( tIndices.end(), pt->m_ptLeft);
@@ -4004,13 +7397,14 @@ long OutSphere (
                 const DistanceTypeNode& dRadius,
                 ContainerType& tFarthest,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
@@ -4034,7 +7428,7 @@ long OutSphere (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptLeft] );
             }            
@@ -4044,7 +7438,7 @@ long OutSphere (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptRight] );
             }            
@@ -4117,11 +7511,6 @@ long OutSphere (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
     return ( (long)tFarthest.size() );
 }   // end OutSphere
 
@@ -4132,13 +7521,14 @@ long OutSphere (
                 ContainerType& tFarthest,
                 std::vector<size_t>& tIndices,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
@@ -4162,7 +7552,7 @@ long OutSphere (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptLeft] );
                 tIndices.insert( tIndices.end(), pt->m_ptLeft);
@@ -4173,7 +7563,7 @@ long OutSphere (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptRight] );
                 tIndices.insert( tIndices.end(), pt->m_ptRight);
@@ -4247,11 +7637,6 @@ long OutSphere (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
     return ( (long)tFarthest.size() );
 }   // end OutSphere
 
@@ -4281,13 +7666,14 @@ long LeftOutSphere (
                 const DistanceTypeNode& dRadius,
                 ContainerType& tFarthest,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -4300,7 +7686,7 @@ long LeftOutSphere (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR = DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptRight] );
             }
@@ -4320,7 +7706,7 @@ long LeftOutSphere (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptLeft] );
             }
@@ -4361,13 +7747,14 @@ long LeftOutSphere (
                 ContainerType& tFarthest,
                 std::vector<size_t>& tIndices,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -4380,7 +7767,7 @@ long LeftOutSphere (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR = DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptRight] );
                 tIndices.insert( tIndices.end(), pt->m_ptRight );
@@ -4401,7 +7788,7 @@ long LeftOutSphere (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), objectStore[pt->m_ptLeft] );
                 tIndices.insert( tIndices.end(), pt->m_ptLeft );
@@ -4456,13 +7843,14 @@ long InAnnulus (
                 const DistanceTypeNode& dRadius2,
                 ContainerType& tAnnular,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
@@ -4486,7 +7874,7 @@ long InAnnulus (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL <= dRadius2 && dDL >= dRadius1 )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius2 && dDL >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end(), objectStore[pt->m_ptLeft] );
             }            
@@ -4496,7 +7884,7 @@ long InAnnulus (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR <= dRadius2 && dDR >= dRadius1 )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius2 && dDR >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end(), objectStore[pt->m_ptRight] );
             }            
@@ -4569,11 +7957,6 @@ long InAnnulus (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
     return ( (long)tAnnular.size() );
 }   // end InAnnulus
 
@@ -4585,13 +7968,14 @@ long InAnnulus (
                 ContainerType& tAnnular,
                 std::vector<size_t>& tIndices,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
@@ -4615,7 +7999,7 @@ long InAnnulus (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL <= dRadius2 && dDL >= dRadius1 )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius2 && dDL >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end(), objectStore[pt->m_ptLeft] );
                 tIndices.insert( tIndices.end(), pt->m_ptLeft);
@@ -4626,7 +8010,7 @@ long InAnnulus (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR <= dRadius2 && dDR >= dRadius1 )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius2 && dDR >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end(), objectStore[pt->m_ptRight] );
                 tIndices.insert( tIndices.end(), pt->m_ptRight);
@@ -4700,11 +8084,6 @@ long InAnnulus (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
     return ( (long)tAnnular.size() );
 }   // end InAnnulus
 
@@ -4728,13 +8107,14 @@ long LeftInAnnulus (
                 const DistanceTypeNode& dRadius2,
                 ContainerType& tAnnular,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -4747,7 +8127,7 @@ long LeftInAnnulus (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR = DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR <= dRadius2 && dDR >= dRadius1 )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius2 && dDR >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end( ), objectStore[pt->m_ptRight] );
             }
@@ -4767,7 +8147,7 @@ long LeftInAnnulus (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL <= dRadius2 && dDL >= dRadius1 )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius2 && dDL >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end(), objectStore[pt->m_ptLeft] );
             }
@@ -4809,13 +8189,14 @@ long LeftInAnnulus (
                 ContainerType& tAnnular,
                 std::vector<size_t>& tIndices,
                 const TNode& t,
-                const std::vector<TNode> objectStore
+                const std::vector<TNode> objectStore,
+                const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
                 , size_t& VisitCount
 #endif
                 ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -4828,7 +8209,7 @@ long LeftInAnnulus (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR = DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR <= dRadius2 && dDR >= dRadius1 )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius2 && dDR >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end( ), objectStore[pt->m_ptRight] );
                 tIndices.insert( tIndices.end( ), pt->m_ptRight );
@@ -4849,7 +8230,7 @@ long LeftInAnnulus (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL <= dRadius2 && dDL >= dRadius1 )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius2 && dDL >= dRadius1 )
             {
                 tAnnular.insert( tAnnular.end(), objectStore[pt->m_ptLeft] );
                 tIndices.insert( tIndices.end( ), pt->m_ptLeft );
@@ -4888,46 +8269,48 @@ long LeftInAnnulus (
 
 
 //=======================================================================
-//  long K_Near ( const DistanceTypeNode dRadius,  
-//                std::vector<std::pair<DistanceTypeNode,T> >& tClosest,
-//                const TNode& t, const std::vector<TNode>& objectStore ) const
-//  long K_Near ( const DistanceTypeNode dRadius,  
-//                std::vector<triple<DistanceTypeNode,T,size_t> >& tClosest,
+//  long K_Near ( const size_t k, DistanceTypeNode& dRadius, K_Heap& tClosest,
 //                const TNode& t, const std::vector<TNode>& objectStore ) const
 //
-//  Private function to search a NearTree for the objects inside of the specified radius
-//     from the probe point
-//  This function is only called by FindK_Nearest.
+//  Private function to search a NearTree for the k objects nearest to the probe
+//     point, inside of the specified radius
+//  This function is only called by CNearTree::SearchK_Near.
 //
 // k:           the maximum number of object to return, giving preference to the nearest
-// dRadius:     the search radius, which will be updated when the internal store is resized
-// tClosest:    is a vector of pairs of Nodes and objects or of triples 
-//                 of Nodes, objects and ordinals of objects where the objects
-//                 are of the templated type found within dRadius of the
-//                 probe point, limited by the k-near search
+// dRadius:     the search radius, which shrinks to the k-th nearest distance as soon
+//                 as k objects have been found
+// tClosest:    a max-heap of the distances and indices in objectStore of the
+//                 nearest objects found so far (see K_Offer)
 // t:           is the probe point
 // objectStore: the internal vector storing the object in CNearTree
+// erased:      marks the erased objects (see erase), or is 0 if none are
+// epsilon:     the branches are pruned at dRadius/(1+epsilon), so the i-th object found
+//                 may be up to (1+epsilon) times as far as the true i-th; 0 for the exact search
 //
-// returns the number of objects returned in the container (for sets, that may not equal the number found)
+// returns the number of objects found
 //
 /*=======================================================================*/
 long K_Near (
              const size_t k,
              DistanceTypeNode& dRadius,
-             std::vector<std::pair<DistanceTypeNode,T> >& tClosest,
+             K_Heap& tClosest,
              const TNode& t,
-             const std::vector<TNode>& objectStore
+             const std::vector<TNode>& objectStore,
+             const char* const erased,
+             const DistanceTypeNode epsilon
 #ifdef CNEARTREE_INSTRUMENTED
              , size_t& VisitCount
 #endif
-             )
+             ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
+    const DistanceTypeNode onePlusEpsilon = DistanceTypeNode( 1 ) + epsilon;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
     ++VisitCount;
 #endif                            
+    if ( k == 0 ) return 0;
     if ( pt->m_ptLeft == ULONG_MAX &&  pt->m_ptRight == ULONG_MAX) return false; // test for empty
     while ( pt->m_ptLeft != ULONG_MAX ||
            pt->m_ptRight != ULONG_MAX ||
@@ -4946,10 +8329,9 @@ long K_Near (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
-                tClosest.insert( tClosest.end(), std::make_pair( dDL, objectStore[pt->m_ptLeft] ) );
-                if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
+                K_Offer( k, dRadius, tClosest, dDL, pt->m_ptLeft );
             }            
         }
         if (pt->m_ptRight != ULONG_MAX) {
@@ -4957,143 +8339,15 @@ long K_Near (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
-                tClosest.insert( tClosest.end(), std::make_pair( dDR, objectStore[pt->m_ptRight] ) );
-                if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
+                K_Offer( k, dRadius, tClosest, dDR, pt->m_ptRight );
             }            
         }
         
-        /*
-         See if both branches are populated.  In that case, save one branch
-         on the stack, and process the other one based on which one seems
-         smaller, but useful first]
-         */
-        if (pt->m_pLeftBranch != 0 && pt->m_pRightBranch != 0 ) {
-            if (dDL+pt->m_dMaxLeft < dDR+pt->m_dMaxRight || pt->m_pRightBranch == 0) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-                    if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-                        sStack.push_back(pt->m_pRightBranch);
-                    }
-                    pt = pt->m_pLeftBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-                    ++VisitCount;
-#endif                                
-                    continue;
-                }
-                /* If we are here, the left branch was not useful
-                 Fall through to use the right
-                 */
-            }
-            
-            /* We come here either because pursuing the left branch was not useful
-             of the right branch look shorter
-             */
-            if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-                    sStack.push_back(pt->m_pLeftBranch);
-                }
-                pt = pt->m_pRightBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-                ++VisitCount;
-#endif                
-                continue;
-            } 
-        }
-        
-        /* Only one branch is viable, try them one at a time
-         */
-        if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-            pt = pt->m_pLeftBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
-#endif                            
-            continue;
-        }
-        
-        if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-            pt = pt->m_pRightBranch;
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
-#endif                            
-            continue;
-        }
-        
-        /* We have procesed both sides, we need to go to the stack */
-        
-        if (!sStack.empty( )) {
-            pt = sStack.back();
-            sStack.pop_back();
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
-#endif                            
-            continue;
-        }
-        break;
-    }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
-    if( tClosest.size( ) > k ) K_Resize( k, t, tClosest, dRadius );
-    return ( (long)tClosest.size( ) );
-    
-}   // end KNear
+        // the branches are pruned at dRadius/(1+epsilon) (see SetApproximation)
+        const DistanceTypeNode dPrune = dRadius/onePlusEpsilon;
 
-long K_Near (
-             const size_t k,
-             DistanceTypeNode& dRadius,
-             std::vector<triple<DistanceTypeNode,T,size_t> >& tClosest,
-             const TNode& t,
-             const std::vector<TNode>& objectStore
-#ifdef CNEARTREE_INSTRUMENTED
-             , size_t& VisitCount
-#endif
-             )
-{
-    std::vector <NearTreeNode* > sStack;
-    DistanceTypeNode dDL=0., dDR=0.;
-    NearTreeNode* pt = const_cast<NearTreeNode*>(this);
-#ifdef CNEARTREE_INSTRUMENTED
-    ++VisitCount;
-#endif                            
-    if ( pt->m_ptLeft == ULONG_MAX &&  pt->m_ptRight == ULONG_MAX) return false; // test for empty
-    while ( pt->m_ptLeft != ULONG_MAX ||
-           pt->m_ptRight != ULONG_MAX ||
-           !sStack.empty( ) ) 
-    {
-        if (pt->m_ptLeft == ULONG_MAX && pt->m_ptRight == ULONG_MAX) {
-            if (!sStack.empty( )) {
-                pt = sStack.back();
-                sStack.pop_back();
-#ifdef CNEARTREE_INSTRUMENTED
-                ++VisitCount;
-#endif                
-                continue;
-            }
-            break;
-        }
-        if (pt->m_ptLeft != ULONG_MAX) {
-            dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL <= dRadius )
-            {
-                tClosest.insert( tClosest.end(), make_triple( dDL, objectStore[pt->m_ptLeft], pt->m_ptLeft ) );
-                if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
-            }            
-        }
-        if (pt->m_ptRight != ULONG_MAX) {
-#ifdef CNEARTREE_INSTRUMENTED
-            ++VisitCount;
-#endif                                            
-            dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR <= dRadius )
-            {
-                tClosest.insert( tClosest.end(), make_triple( dDR, objectStore[pt->m_ptRight], pt->m_ptRight ) );
-                if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
-            }            
-        }
-        
         /*
          See if both branches are populated.  In that case, save one branch
          on the stack, and process the other one based on which one seems
@@ -5101,8 +8355,8 @@ long K_Near (
          */
         if (pt->m_pLeftBranch != 0 && pt->m_pRightBranch != 0 ) {
             if (dDL+pt->m_dMaxLeft < dDR+pt->m_dMaxRight || pt->m_pRightBranch == 0) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
-                    if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
+                if ( TRIANG(dDL,pt->m_dMaxLeft,dPrune)) {
+                    if ( TRIANG(dDR,pt->m_dMaxRight,dPrune)) {
                         sStack.push_back(pt->m_pRightBranch);
                     }
                     pt = pt->m_pLeftBranch;
@@ -5119,8 +8373,8 @@ long K_Near (
             /* We come here either because pursuing the left branch was not useful
              of the right branch look shorter
              */
-            if ( TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
-                if ( TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
+            if ( TRIANG(dDR,pt->m_dMaxRight,dPrune)) {
+                if ( TRIANG(dDL,pt->m_dMaxLeft,dPrune)) {
                     sStack.push_back(pt->m_pLeftBranch);
                 }
                 pt = pt->m_pRightBranch;
@@ -5133,7 +8387,7 @@ long K_Near (
         
         /* Only one branch is viable, try them one at a time
          */
-        if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius)) {
+        if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dPrune)) {
             pt = pt->m_pLeftBranch;
 #ifdef CNEARTREE_INSTRUMENTED
             ++VisitCount;
@@ -5141,7 +8395,7 @@ long K_Near (
             continue;
         }
         
-        if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius)) {
+        if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dPrune)) {
             pt = pt->m_pRightBranch;
 #ifdef CNEARTREE_INSTRUMENTED
             ++VisitCount;
@@ -5161,12 +8415,6 @@ long K_Near (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
-    if( tClosest.size( ) > k ) K_Resize( k, t, tClosest, dRadius );
     return ( (long)tClosest.size( ) );
     
 }   // end KNear
@@ -5198,13 +8446,14 @@ long K_Far (
             DistanceTypeNode& dRadius,
             std::vector<std::pair<DistanceTypeNode,T> >& tFarthest,
             const TNode& t,
-            const std::vector<TNode>& objectStore
+            const std::vector<TNode>& objectStore,
+            const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
             , size_t& VisitCount
 #endif
-            )
+            ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
@@ -5228,7 +8477,7 @@ long K_Far (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), std::make_pair( -dDL, objectStore[pt->m_ptLeft] ) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5239,7 +8488,7 @@ long K_Far (
             ++VisitCount;
 #endif                                            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), std::make_pair( -dDR, objectStore[pt->m_ptRight] ) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5313,11 +8562,6 @@ long K_Far (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
     if( tFarthest.size( ) > k ) K_Resize( k, t, tFarthest, dRadius );
     return ( (long)tFarthest.size( ) );
 }   // end KFar
@@ -5327,13 +8571,14 @@ long K_Far (
             DistanceTypeNode& dRadius,
             std::vector<triple<DistanceTypeNode,T,size_t> >& tFarthest,
             const TNode& t,
-            const std::vector<TNode>& objectStore
+            const std::vector<TNode>& objectStore,
+            const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
             , size_t& VisitCount
 #endif
-            )
+            ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     DistanceTypeNode dDL=0., dDR=0.;
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
 #ifdef CNEARTREE_INSTRUMENTED
@@ -5357,7 +8602,7 @@ long K_Far (
         }
         if (pt->m_ptLeft != ULONG_MAX) {
             dDL = DistanceBetween( t, objectStore[pt->m_ptLeft] );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), make_triple( -dDL, objectStore[pt->m_ptLeft], pt->m_ptLeft) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5368,7 +8613,7 @@ long K_Far (
             ++VisitCount;
 #endif            
             dDR = DistanceBetween( t, objectStore[pt->m_ptRight]);
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), make_triple( -dDR, objectStore[pt->m_ptRight], pt->m_pt_Right ) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5442,11 +8687,6 @@ long K_Far (
         }
         break;
     }
-    if ( !sStack.empty( ) ) // for safety !!!
-    {
-        std::vector <NearTreeNode* > sTemp;
-        sTemp.swap( sStack );
-    }
     if( tFarthest.size( ) > k ) K_Resize( k, t, tFarthest, dRadius );
     return ( (long)tFarthest.size( ) );
 }   // end KFar
@@ -5472,6 +8712,8 @@ long K_Far (
 //                 probe point, limited by the k-near search
 // t:           is the probe point
 // objectStore: the internal vector storing the object in CNearTree
+// erased:      marks the erased objects (see erase), or is 0 if none are
+// epsilon:     the branches are pruned at dRadius/(1+epsilon), as in K_Near
 //
 // returns the number of objects returned in the container (for sets, that may not equal the number found)
 //
@@ -5481,13 +8723,16 @@ long LeftK_Near (
              DistanceTypeNode& dRadius,
              std::vector<std::pair<DistanceTypeNode,T> >& tClosest,
              const TNode& t,
-             const std::vector<TNode>& objectStore
+             const std::vector<TNode>& objectStore,
+             const char* const erased,
+             const DistanceTypeNode epsilon
 #ifdef CNEARTREE_INSTRUMENTED
              , size_t& VisitCount
 #endif
-             )
+             ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
+    const DistanceTypeNode onePlusEpsilon = DistanceTypeNode( 1 ) + epsilon;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -5500,12 +8745,12 @@ long LeftK_Near (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR =  DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
                 tClosest.insert( tClosest.end(), std::make_pair( dDR, objectStore[pt->m_ptRight] ) );
                 if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
             }
-            if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius) )
+            if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius/onePlusEpsilon) )
             { // we did the left and now we finished the right, go down
                 pt = pt->m_pRightBranch;
 #ifdef CNEARTREE_INSTRUMENTED
@@ -5521,7 +8766,7 @@ long LeftK_Near (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
                 tClosest.insert( tClosest.end(), std::make_pair( dDL, objectStore[pt->m_ptLeft] ) );
                 if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
@@ -5530,7 +8775,7 @@ long LeftK_Near (
             {
                 sStack.push_back( pt );
             }
-            if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius) )
+            if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius/onePlusEpsilon) )
             { // we did the left, go down
                 pt = pt->m_pLeftBranch;
 #ifdef CNEARTREE_INSTRUMENTED
@@ -5562,13 +8807,16 @@ long LeftK_Near (
              DistanceTypeNode& dRadius,
              std::vector<triple<DistanceTypeNode,T,size_t> >& tClosest,
              const TNode& t,
-             const std::vector<TNode>& objectStore
+             const std::vector<TNode>& objectStore,
+             const char* const erased,
+             const DistanceTypeNode epsilon
 #ifdef CNEARTREE_INSTRUMENTED
              , size_t& VisitCount
 #endif
-             )
+             ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
+    const DistanceTypeNode onePlusEpsilon = DistanceTypeNode( 1 ) + epsilon;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -5581,12 +8829,12 @@ long LeftK_Near (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR =  DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR <= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR <= dRadius )
             {
                 tClosest.insert( tClosest.end(), make_triple( dDR, objectStore[pt->m_ptRight], pt->m_ptRight ) );
                 if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
             }
-            if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius) )
+            if ( pt->m_pRightBranch != 0 && TRIANG(dDR,pt->m_dMaxRight,dRadius/onePlusEpsilon) )
             { // we did the left and now we finished the right, go down
                 pt = pt->m_pRightBranch;
 #ifdef CNEARTREE_INSTRUMENTED
@@ -5602,7 +8850,7 @@ long LeftK_Near (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL <= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL <= dRadius )
             {
                 tClosest.insert( tClosest.end(), make_triple( dDL, objectStore[pt->m_ptLeft], pt->m_ptLeft ) );
                 if( tClosest.size( ) > 2*k ) K_Resize( k, t, tClosest, dRadius );
@@ -5611,7 +8859,7 @@ long LeftK_Near (
             {
                 sStack.push_back( pt );
             }
-            if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius) )
+            if ( pt->m_pLeftBranch != 0 && TRIANG(dDL,pt->m_dMaxLeft,dRadius/onePlusEpsilon) )
             { // we did the left, go down
                 pt = pt->m_pLeftBranch;
 #ifdef CNEARTREE_INSTRUMENTED
@@ -5665,13 +8913,14 @@ long LeftK_Far (
             DistanceTypeNode& dRadius,
             std::vector<std::pair<DistanceTypeNode,T> >& tFarthest,
             const TNode& t,
-            const std::vector<TNode>& objectStore
+            const std::vector<TNode>& objectStore,
+            const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
             , size_t& VisitCount
 #endif
-            )
+            ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -5684,7 +8933,7 @@ long LeftK_Far (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR =  DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), std::make_pair( -dDR, objectStore[pt->m_ptRight] ) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5705,7 +8954,7 @@ long LeftK_Far (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), std::make_pair( -dDL, objectStore[pt->m_ptLeft] ) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5747,13 +8996,14 @@ long LeftK_Far (
             DistanceTypeNode& dRadius,
             std::vector<triple<DistanceTypeNode,T,size_t> >& tFarthest,
             const TNode& t,
-            const std::vector<TNode>& objectStore
+            const std::vector<TNode>& objectStore,
+            const char* const erased
 #ifdef CNEARTREE_INSTRUMENTED
             , size_t& VisitCount
 #endif
-            )
+            ) const
 {
-    std::vector <NearTreeNode* > sStack;
+    SearchScratch<NearTreeNode*> sStack;
     enum  { left, right, end } eDir;
     eDir = left; // examine the left nodes first
     NearTreeNode* pt = const_cast<NearTreeNode*>(this);
@@ -5766,7 +9016,7 @@ long LeftK_Far (
         if ( eDir == right )
         {
             const DistanceTypeNode dDR =  DistanceBetween( t, objectStore[pt->m_ptRight] );
-            if ( dDR >= dRadius )
+            if ( Live( erased, pt->m_ptRight ) && dDR >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), make_triple( -dDR, objectStore[pt->m_ptRight], pt->m_pt_Right ) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5787,7 +9037,7 @@ long LeftK_Far (
         if ( eDir == left )
         {
             const DistanceTypeNode dDL = DistanceBetween( t, objectStore[pt->m_ptLeft]  );
-            if ( dDL >= dRadius )
+            if ( Live( erased, pt->m_ptLeft ) && dDL >= dRadius )
             {
                 tFarthest.insert( tFarthest.end(), make_triple( -dDL, objectStore[pt->m_ptLeft], pt->m_ptLeft) );
                 if( tFarthest.size( ) > 2*k ) K_Resize( k, t, tFarthest, dRadius );
@@ -5844,12 +9094,44 @@ static bool K_Sorter3( const triple<DistanceTypeNode, T, size_t>& t1, const trip
     return ( t1.GetFirst() < t2.GetFirst() );
 }
 
+//=======================================================================
+//  void K_Offer ( const size_t k, DistanceTypeNode& dRadius, K_Heap& tClosest,
+//                 const DistanceTypeNode d, const size_t n )
+//
+//  Keep object n, at distance d from the probe, if it is one of the k nearest
+//  so far. tClosest is a max-heap of at most k (distance, index) pairs with
+//  the farthest on top, so a nearer object replaces that one in O(log k) and
+//  no object is copied. Once the heap is full, dRadius is the distance of its
+//  top, which is as far as anything can still be and be kept.
+//
+//=======================================================================
+static void K_Offer( const size_t k, DistanceTypeNode& dRadius, K_Heap& tClosest,
+                     const DistanceTypeNode d, const size_t n )
+{
+    if ( tClosest.size( ) < k )
+    {
+        tClosest.push_back( std::make_pair( d, n ) );
+        std::push_heap( tClosest.begin( ), tClosest.end( ) );
+    }
+    else if ( d < tClosest.front( ).first )
+    {
+        std::pop_heap( tClosest.begin( ), tClosest.end( ) );
+        tClosest.back( ) = std::make_pair( d, n );
+        std::push_heap( tClosest.begin( ), tClosest.end( ) );
+    }
+    else
+    {
+        return;
+    }
+    if ( tClosest.size( ) == k ) dRadius = tClosest.front( ).first;
+}  // end K_Offer
+
 //=======================================================================
 //  void K_Resize ( const size_t k, const TNode& t, std::vector<std::pair<DistanceTypeNode, T> >& tClosest, DistanceTypeNode& dRadius ) const
 //  void K_Resize ( const size_t k, const TNode& t, std::vector<triple<DistanceTypeNode, T, size_t> >& tClosest, DistanceTypeNode& dRadius ) const
 //
 //  Private function to limit the size of internally stored data for K-nearest/farthest-neighbor searches
-//  This function is only called by K_Near and K_Far.
+//  This function is only called by K_Far and the Left K-nearest/farthest searches.
 //
 //    dRadius is the search radius, updated to the best-known value
 //    tClosest is a vector of pairs of Nodes and objects or of triples 
@@ -5859,13 +9141,13 @@ static bool K_Sorter3( const triple<DistanceTypeNode, T, size_t>& t1, const trip
 //    t  is the probe point
 //
 //=======================================================================
-void K_Resize( const size_t k, const TNode& t, std::vector<std::pair<DistanceTypeNode, T> >& tClosest, DistanceTypeNode& dRadius )
+static void K_Resize( const size_t k, const TNode& t, std::vector<std::pair<DistanceTypeNode, T> >& tClosest, DistanceTypeNode& dRadius )
 {
     std::sort( tClosest.begin(), tClosest.end(), &K_Sorter2 );
     tClosest.resize( k );
     dRadius = DistanceBetween( t, tClosest[tClosest.size()-1].second );
 }  // end K_Resize
-void K_Resize( const size_t k, const TNode& t, std::vector<triple<DistanceTypeNode, T, size_t> >& tClosest, DistanceTypeNode& dRadius )
+static void K_Resize( const size_t k, const TNode& t, std::vector<triple<DistanceTypeNode, T, size_t> >& tClosest, DistanceTypeNode& dRadius )
 {
     std::sort( tClosest.begin(), tClosest.end(), &K_Sorter3 );
     tClosest.resize( k );
@@ -5890,6 +9172,636 @@ void K_Resize( const size_t k, const TNode& t, std::vector<triple<DistanceTypeNo
 //=======================================================================
 // end NearTreeNode nested class in CNearTree
 //=======================================================================
+
+//=======================================================================
+//
+// NODEARENA - nested class that owns the storage for the nodes of a tree
+//
+// Nodes are handed out one after another from blocks of contiguous
+// storage, so a tree of n objects costs a few dozen allocations instead
+// of n/2, and nodes created together sit together in memory. A block is
+// never moved once allocated, so node pointers stay valid until clear,
+// which releases every block at once instead of walking the tree.
+//
+//=======================================================================
+class NodeArena
+{
+typedef NearTreeNode<T, DistanceType, distMinValue> Node;
+
+std::vector<Node*> m_Blocks;           // the blocks of nodes, each usually twice the size of the one before
+size_t             m_BlockUsed;        // number of nodes handed out from the last block
+size_t             m_LastBlockSize;    // number of nodes in the last block
+size_t             m_NodeCount;        // number of nodes handed out from all blocks
+size_t             m_NodeCapacity;     // number of nodes in all blocks
+std::vector<Node*> m_Free;             // nodes handed back by Release, handed out again first
+
+// enumerators, so that std::min and the like never need a definition of them
+enum { FirstBlockSize = 64, MaxBlockSize = 65536 };
+
+NodeArena( const NodeArena& );             // not copyable, see CNearTree( const CNearTree& )
+NodeArena& operator= ( const NodeArena& );
+
+public:
+
+NodeArena( void ) :
+m_Blocks       (   ),
+m_BlockUsed    ( 0 ),
+m_LastBlockSize( 0 ),
+m_NodeCount    ( 0 ),
+m_NodeCapacity ( 0 ),
+m_Free         (   )
+{
+};  //  NodeArena constructor
+
+~NodeArena( void )
+{
+    clear( );
+};  //  end NodeArena destructor
+
+//=======================================================================
+void clear( void )
+{
+    for ( size_t i=0; i<m_Blocks.size( ); ++i )
+    {
+        delete [] m_Blocks[i];
+    }
+    std::vector<Node*> vtemp;
+    m_Blocks.swap( vtemp );
+    std::vector<Node*> vfree;
+    m_Free.swap( vfree );
+    m_BlockUsed     = 0;
+    m_LastBlockSize = 0;
+    m_NodeCount     = 0;
+    m_NodeCapacity  = 0;
+};  //  end clear
+
+//=======================================================================
+Node* Allocate( void )
+{
+    if ( !m_Free.empty( ) )
+    {
+        Node* const p = m_Free.back( );
+        m_Free.pop_back( );
+        ++m_NodeCount;
+        return ( p );
+    }
+    if ( m_BlockUsed == m_LastBlockSize )
+    {
+        const size_t newSize = BlockSize( m_Blocks.size( ) );
+        m_Blocks.push_back( new Node[newSize] );
+        m_NodeCapacity += newSize;
+        m_LastBlockSize = newSize;
+        m_BlockUsed = 0;
+    }
+    ++m_NodeCount;
+    return ( &(m_Blocks.back( )[m_BlockUsed++]) );
+};  //  end Allocate
+
+//=======================================================================
+// Hand back a node that is no longer in the tree (see NearTreeNode::Rebuild),
+// for Allocate to hand out again. Its storage is released with its block.
+void Release( Node* const p )
+{
+    p->clear( );
+    m_Free.push_back( p );
+    --m_NodeCount;
+};  //  end Release
+
+//=======================================================================
+// Take over all of the nodes of other, which is left empty. The blocks
+// are not moved, so pointers to their nodes stay valid. Nodes are still
+// handed out from the end of this arena's own last block.
+void Adopt( NodeArena& other )
+{
+    if ( other.m_Blocks.empty( ) )
+    {
+        return;
+    }
+    if ( m_Blocks.empty( ) )
+    {
+        m_Blocks.swap( other.m_Blocks );
+        m_BlockUsed     = other.m_BlockUsed;
+        m_LastBlockSize = other.m_LastBlockSize;
+    }
+    else
+    {
+        m_Blocks.insert( m_Blocks.end( )-1, other.m_Blocks.begin( ), other.m_Blocks.end( ) );
+        other.m_Blocks.clear( );
+    }
+    m_Free.insert( m_Free.end( ), other.m_Free.begin( ), other.m_Free.end( ) );
+    other.m_Free.clear( );
+    m_NodeCount    += other.m_NodeCount;
+    m_NodeCapacity += other.m_NodeCapacity;
+    other.m_BlockUsed     = 0;
+    other.m_LastBlockSize = 0;
+    other.m_NodeCount     = 0;
+    other.m_NodeCapacity  = 0;
+};  //  end Adopt
+
+//=======================================================================
+size_t GetNodeCount( void ) const
+{
+    return ( m_NodeCount );
+}
+
+//=======================================================================
+size_t GetBytes( void ) const
+{
+    return ( m_NodeCapacity*sizeof( Node ) + ( m_Blocks.capacity( )+m_Free.capacity( ) )*sizeof( Node* ) );
+}
+
+private:
+//=======================================================================
+static size_t BlockSize( const size_t nBlock )
+{
+    const size_t shift = std::min( nBlock, (size_t)16 );
+    return ( std::min( size_t( FirstBlockSize )<<shift, size_t( MaxBlockSize ) ) );
+}
+
+}; // end NodeArena
+//=======================================================================
+// end NodeArena nested class in CNearTree
+//=======================================================================
+
+//=======================================================================
+//
+// FROZENNODE - nested struct for one node of the frozen copy of a tree
+//
+// The same as a NearTreeNode, except that the objects and the branches
+// are 32-bit positions in m_ObjectStore and m_FrozenNodes, with FrozenNone
+// for an empty one. A leaf bucket is marked by FrozenBucket as its left
+// branch (see MakeLeafBuckets). See Freeze.
+//
+//=======================================================================
+struct FrozenNode
+{
+unsigned int      m_ptLeft;            // index of left object stored in this node
+unsigned int      m_ptRight;           // index of right object stored in this node
+DistanceType      m_dMaxLeft;          // longest distance from the left object to anything below it
+DistanceType      m_dMaxRight;         // longest distance from the right object to anything below it
+unsigned int      m_pLeftBranch;       // position of the tree descending from the left object
+unsigned int      m_pRightBranch;      // position of the tree descending from the right object
+}; // end FrozenNode
+
+static const unsigned int FrozenNone = UINT_MAX; // no object or branch in a FrozenNode
+static const unsigned int FrozenBucket = UINT_MAX-1; // the left branch of a leaf bucket
+
+//=======================================================================
+//
+// SNAPSHOTHEADER - nested struct for the start of a file written by Save
+//
+// The file is this header followed by the arrays it points to, each
+// starting on a multiple of Alignment bytes from the start of the file:
+// the objects, as in m_ObjectStore; the nodes of the whole tree, as
+// Flatten lays them out; and, if the tree was frozen with leaf buckets,
+// the frozen copy with them (see MakeLeafBuckets), the objects of the
+// buckets and their indices. Otherwise the search nodes are the nodes of
+// the whole tree and there are no buckets. Everything is in the byte
+// order and sizes of the machine that wrote it, which Open checks.
+//
+//=======================================================================
+struct SnapshotHeader
+{
+char               m_Magic[8];          // "CNTSNAP1"
+unsigned int       m_ByteOrder;         // ByteOrder, as the writer stored it
+unsigned int       m_ObjectBytes;       // sizeof( T )
+unsigned int       m_DistanceBytes;     // sizeof( DistanceType )
+unsigned int       m_NodeBytes;         // sizeof( FrozenNode )
+unsigned long long m_ObjectCount;       // objects in the tree
+unsigned long long m_NodeCount;         // nodes of the whole tree, see GetNodeCount
+unsigned long long m_SearchNodeCount;   // nodes of the frozen copy the searches walk
+unsigned long long m_BucketCount;       // objects in the leaf buckets
+unsigned long long m_ObjectOffset;      // where each array starts, in bytes from the start of the file
+unsigned long long m_NodeOffset;
+unsigned long long m_SearchNodeOffset;
+unsigned long long m_BucketObjectOffset;
+unsigned long long m_BucketIndexOffset;
+unsigned long long m_FileBytes;         // the length of the file
+unsigned long long m_DeepestDepth;      // see GetDepth
+unsigned long long m_LeafBucketSize;    // see GetLeafBucketSize
+double             m_DiamEstimate;      // the estimates that go with the tree, see Open
+double             m_SumSpacings;
+double             m_SumSpacingsSq;
+double             m_DimEstimate;
+double             m_DimEstimateEsd;
+unsigned long long m_DimEstimateReady;  // 1 if the short searches' dimension estimate was made
+
+static const unsigned int ByteOrder = 0x01020304u;
+static const size_t       Alignment = 64;
+
+static const char* Magic( void ) { return ( "CNTSNAP1" ); }
+static unsigned long long Align( const unsigned long long n )
+{
+    return ( ( n + Alignment-1 ) / Alignment * Alignment );
+}
+}; // end SnapshotHeader
+
+//=======================================================================
+//
+// SNAPSHOT - nested class for a file written by Save, mapped into memory
+//
+// Map maps the whole file read-only and checks its header and nodes;
+// after that the arrays are used where they lie in the mapping, which is
+// released when the Snapshot is destroyed. The trees that use a Snapshot
+// share it (see m_Snapshot), so the last of them to let go unmaps it.
+//
+//=======================================================================
+class Snapshot
+{
+const char*       m_pData;             // the start of the mapped file
+size_t            m_Bytes;             // the length of the mapping
+
+Snapshot( const Snapshot& );           // not copyable
+Snapshot& operator= ( const Snapshot& );
+
+public:
+
+Snapshot( void ) :
+m_pData ( 0 ),
+m_Bytes ( 0 )
+{
+};  //  Snapshot constructor
+
+~Snapshot( void )
+{
+    if ( m_pData != 0 )
+    {
+#if defined( _WIN32 )
+        UnmapViewOfFile( m_pData );
+#else
+        ::munmap( (void*)m_pData, m_Bytes );
+#endif
+    }
+};  //  end Snapshot destructor
+
+//=======================================================================
+// Map the file at path. Returns false, and maps nothing, if it cannot
+// be mapped or is not a snapshot of this kind of tree.
+bool Map( const std::string& path )
+{
+#if defined( _WIN32 )
+    const HANDLE file = CreateFileA( path.c_str( ), GENERIC_READ, FILE_SHARE_READ, 0,
+                                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+    if ( file == INVALID_HANDLE_VALUE ) return ( false );
+    LARGE_INTEGER length;
+    if ( !GetFileSizeEx( file, &length ) || length.QuadPart < (LONGLONG)sizeof( SnapshotHeader ) )
+    {
+        CloseHandle( file );
+        return ( false );
+    }
+    const HANDLE mapping = CreateFileMappingA( file, 0, PAGE_READONLY, 0, 0, 0 );
+    CloseHandle( file );
+    if ( mapping == 0 ) return ( false );
+    const void* const p = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+    CloseHandle( mapping );  // the view keeps the mapping
+    if ( p == 0 ) return ( false );
+    m_pData = (const char*)p;
+    m_Bytes = (size_t)length.QuadPart;
+#else
+    const int file = ::open( path.c_str( ), O_RDONLY );
+    if ( file < 0 ) return ( false );
+    struct stat status;
+    if ( ::fstat( file, &status ) != 0 || status.st_size < (off_t)sizeof( SnapshotHeader ) )
+    {
+        ::close( file );
+        return ( false );
+    }
+    void* const p = ::mmap( 0, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0 );
+    ::close( file );  // the mapping keeps the file
+    if ( p == MAP_FAILED ) return ( false );
+    m_pData = (const char*)p;
+    m_Bytes = (size_t)status.st_size;
+#endif
+    if ( ! Check( ) )
+    {
+#if defined( _WIN32 )
+        UnmapViewOfFile( m_pData );
+#else
+        ::munmap( (void*)m_pData, m_Bytes );
+#endif
+        m_pData = 0;
+        m_Bytes = 0;
+        return ( false );
+    }
+    return ( true );
+};  //  end Map
+
+//=======================================================================
+const SnapshotHeader& GetHeader( void ) const
+{
+    return ( *reinterpret_cast<const SnapshotHeader*>( m_pData ) );
+}
+
+const T* Objects( void ) const
+{
+    return ( reinterpret_cast<const T*>( m_pData + GetHeader( ).m_ObjectOffset ) );
+}
+
+const FrozenNode* Nodes( void ) const
+{
+    return ( reinterpret_cast<const FrozenNode*>( m_pData + GetHeader( ).m_NodeOffset ) );
+}
+
+const FrozenNode* SearchNodes( void ) const
+{
+    return ( reinterpret_cast<const FrozenNode*>( m_pData + GetHeader( ).m_SearchNodeOffset ) );
+}
+
+const T* BucketObjects( void ) const
+{
+    return ( reinterpret_cast<const T*>( m_pData + GetHeader( ).m_BucketObjectOffset ) );
+}
+
+const unsigned int* BucketIndices( void ) const
+{
+    return ( reinterpret_cast<const unsigned int*>( m_pData + GetHeader( ).m_BucketIndexOffset ) );
+}
+
+private:
+//=======================================================================
+// The header is one that Save wrote for the same T and DistanceType on a
+// machine of the same byte order, every array lies inside the file, and
+// everything the nodes and buckets point to lies inside its array.
+bool Check( void ) const
+{
+    const SnapshotHeader& h = GetHeader( );
+    return ( memcmp( h.m_Magic, SnapshotHeader::Magic( ), sizeof( h.m_Magic ) ) == 0
+          && h.m_ByteOrder     == SnapshotHeader::ByteOrder
+          && h.m_ObjectBytes   == sizeof( T )
+          && h.m_DistanceBytes == sizeof( DistanceType )
+          && h.m_NodeBytes     == sizeof( FrozenNode )
+          && h.m_FileBytes     == m_Bytes
+          && h.m_NodeCount > 0 && h.m_SearchNodeCount > 0
+          && h.m_LeafBucketSize <= (unsigned long long)MaxLeafBucket
+          && Holds( h.m_ObjectOffset,       h.m_ObjectCount,     sizeof( T ) )
+          && Holds( h.m_NodeOffset,         h.m_NodeCount,       sizeof( FrozenNode ) )
+          && Holds( h.m_SearchNodeOffset,   h.m_SearchNodeCount, sizeof( FrozenNode ) )
+          && Holds( h.m_BucketObjectOffset, h.m_BucketCount,     sizeof( T ) )
+          && Holds( h.m_BucketIndexOffset,  h.m_BucketCount,     sizeof( unsigned int ) )
+          && CheckNodes( Nodes( ), h.m_NodeCount, false )
+          && ( ( h.m_SearchNodeOffset == h.m_NodeOffset && h.m_SearchNodeCount == h.m_NodeCount )
+               || CheckNodes( SearchNodes( ), h.m_SearchNodeCount, true ) )
+          && CheckBucketIndices( ) );
+}
+
+//=======================================================================
+// The count nodes are one tree as Flatten lays it out: each branch comes
+// after its node and is the branch of no other node, so that the searches
+// and Unflatten, which follow them without looking, reach every node once.
+// Every object is inside the objects, and, if buckets is true, every leaf
+// bucket (see MakeLeafBuckets) is a run of at most MaxLeafBucket objects
+// inside the buckets. Only the base node of an empty tree has no object.
+bool CheckNodes( const FrozenNode* const nodes, const unsigned long long count, const bool buckets ) const
+{
+    const SnapshotHeader& h = GetHeader( );
+    std::vector<char> reached( (size_t)count, 0 );
+    reached[0] = 1;
+    for ( size_t i=0; i<count; ++i )
+    {
+        const FrozenNode& node = nodes[i];
+        if ( ! reached[i] ) return ( false );
+        if ( buckets && node.m_pLeftBranch == FrozenBucket )
+        {
+            if ( node.m_ptRight == 0 || node.m_ptRight > (unsigned int)MaxLeafBucket
+                 || node.m_ptRight > h.m_BucketCount || node.m_ptLeft > h.m_BucketCount - node.m_ptRight
+                 || node.m_pRightBranch != FrozenNone ) return ( false );
+            continue;
+        }
+        if ( node.m_ptLeft == FrozenNone )
+        {
+            if ( i != 0 || count != 1 || node.m_ptRight != FrozenNone
+                 || node.m_pLeftBranch != FrozenNone || node.m_pRightBranch != FrozenNone ) return ( false );
+            continue;
+        }
+        if ( node.m_ptLeft >= h.m_ObjectCount ) return ( false );
+        if ( node.m_ptRight == FrozenNone ? node.m_pRightBranch != FrozenNone
+                                          : node.m_ptRight >= h.m_ObjectCount ) return ( false );
+        const unsigned int branches[2] = { node.m_pLeftBranch, node.m_pRightBranch };
+        for ( int k=0; k<2; ++k )
+        {
+            if ( branches[k] == FrozenNone ) continue;
+            if ( branches[k] <= i || branches[k] >= count || reached[branches[k]] ) return ( false );
+            reached[branches[k]] = 1;
+        }
+    }
+    return ( true );
+}
+
+//=======================================================================
+// Every object of the buckets stands for one inside the objects.
+bool CheckBucketIndices( void ) const
+{
+    const SnapshotHeader& h = GetHeader( );
+    const unsigned int* const indices = BucketIndices( );
+    for ( size_t i=0; i<h.m_BucketCount; ++i )
+    {
+        if ( indices[i] >= h.m_ObjectCount ) return ( false );
+    }
+    return ( true );
+}
+
+bool Holds( const unsigned long long offset, const unsigned long long count, const size_t bytes ) const
+{
+    return ( offset % SnapshotHeader::Alignment == 0 && offset <= m_Bytes && count <= ( m_Bytes-offset )/bytes );
+}
+
+}; // end Snapshot
+
+//=======================================================================
+//
+// SEARCHSCRATCH - nested class for the work vectors of one search
+//
+// A search needs a stack of the branches it has still to look at, and a
+// K-nearest search a heap of the objects found so far. Instead of a new
+// vector for each search, each thread keeps a pool of them, and a
+// SearchScratch borrows one from the pool for as long as it lives. The
+// vector is handed back empty but with its storage, so once a thread's
+// vectors have grown to the depth of the trees it searches, searching
+// allocates nothing. Scratches are borrowed and handed back in the order
+// of a stack, so a search started from inside another one (by the
+// visitor of ForEachInSphere, say) simply takes the next vector.
+//
+//=======================================================================
+template <typename Elem>
+class SearchScratch
+{
+std::vector<Elem>* m_pVector;          // the vector borrowed from the pool
+
+SearchScratch( const SearchScratch& );     // not copyable
+SearchScratch& operator= ( const SearchScratch& );
+
+struct Pool
+{
+    std::vector<std::vector<Elem>*> m_Vectors;  // every vector the thread has used
+    size_t                          m_Used;     // number of them borrowed now
+
+    Pool( void ) : m_Vectors( ), m_Used( 0 ) { }
+    ~Pool( void )
+    {
+        for ( size_t i=0; i<m_Vectors.size( ); ++i ) delete m_Vectors[i];
+    }
+};
+
+static Pool& ThreadPool( void )
+{
+    static thread_local Pool pool;
+    return ( pool );
+}
+
+public:
+
+// capacity is a hint of how many elements the search will need at once
+explicit SearchScratch( const size_t capacity = 0 )
+{
+    Pool& pool = ThreadPool( );
+    if ( pool.m_Used == pool.m_Vectors.size( ) )
+    {
+        pool.m_Vectors.push_back( new std::vector<Elem>( ) );
+    }
+    m_pVector = pool.m_Vectors[pool.m_Used++];
+    if ( capacity > m_pVector->capacity( ) ) m_pVector->reserve( capacity );
+};  //  SearchScratch constructor
+
+~SearchScratch( void )
+{
+    m_pVector->clear( );
+    --ThreadPool( ).m_Used;
+};  //  end SearchScratch destructor
+
+std::vector<Elem>& Get         ( void )               { return ( *m_pVector ); }
+bool               empty       ( void ) const         { return ( m_pVector->empty( ) ); }
+size_t             size        ( void ) const         { return ( m_pVector->size( ) ); }
+Elem&              back        ( void )               { return ( m_pVector->back( ) ); }
+void               push_back   ( const Elem& e )      { m_pVector->push_back( e ); }
+void               pop_back    ( void )               { m_pVector->pop_back( ); }
+Elem&              operator[]  ( const size_t i )     { return ( (*m_pVector)[i] ); }
+
+}; // end SearchScratch
+//=======================================================================
+// end SearchScratch nested class in CNearTree
+//=======================================================================
+
+//=======================================================================
+//  NearestSearch, InSphereSearch, InAnnulusSearch, K_NearSearch, ForEachInSphereSearch
+//
+//  What FrozenSearch collects for each of the balanced searches, and
+//  which branches it still has to look at. Found and Useful follow the
+//  tests of NearTreeNode::Nearest, InSphere, InAnnulus and K_Near.
+//
+//=======================================================================
+struct NearestSearch
+{
+    DistanceType& dRadius;             // distance of the closest object so far
+    size_t&       index;               // index of the closest object so far
+    const DistanceType onePlusEpsilon; // the branches are pruned at dRadius/onePlusEpsilon
+
+    NearestSearch( DistanceType& r, size_t& n, const DistanceType epsilon )
+        : dRadius( r ), index( n ), onePlusEpsilon( DistanceType( 1 ) + epsilon ) { index = ULONG_MAX; }
+    void Found( const DistanceType d, const size_t n )
+    {
+        if ( d <= dRadius )
+        {
+            dRadius = d;
+            index   = n;
+        }
+    }
+    bool Useful( const DistanceType d, const DistanceType dMax ) const
+    {
+        return ( TRIANG( d, dMax, dRadius/onePlusEpsilon ) );
+    }
+    DistanceType Cutoff( void ) const { return ( dRadius ); }
+};
+
+template<typename OutputContainerType>
+struct InSphereSearch
+{
+    const DistanceType        dRadius;
+    OutputContainerType&      tClosest;
+    std::vector<size_t>*      pIndices;    // 0 if the indices are not wanted
+    const T* const            objects;
+
+    InSphereSearch( const DistanceType r, OutputContainerType& c, std::vector<size_t>* p, const T* const o )
+        : dRadius( r ), tClosest( c ), pIndices( p ), objects( o ) { }
+    void Found( const DistanceType d, const size_t n )
+    {
+        if ( d <= dRadius )
+        {
+            tClosest.insert( tClosest.end(), objects[n] );
+            if ( pIndices != 0 ) pIndices->insert( pIndices->end(), n );
+        }
+    }
+    bool Useful( const DistanceType d, const DistanceType dMax ) const { return ( TRIANG( d, dMax, dRadius ) ); }
+    DistanceType Cutoff( void ) const { return ( dRadius ); }
+};
+
+template<typename OutputContainerType>
+struct InAnnulusSearch
+{
+    const DistanceType        dRadius1;
+    const DistanceType        dRadius2;
+    OutputContainerType&      tAnnular;
+    std::vector<size_t>*      pIndices;    // 0 if the indices are not wanted
+    const T* const            objects;
+
+    InAnnulusSearch( const DistanceType r1, const DistanceType r2, OutputContainerType& c,
+                     std::vector<size_t>* p, const T* const o )
+        : dRadius1( r1 ), dRadius2( r2 ), tAnnular( c ), pIndices( p ), objects( o ) { }
+    void Found( const DistanceType d, const size_t n )
+    {
+        if ( d <= dRadius2 && d >= dRadius1 )
+        {
+            tAnnular.insert( tAnnular.end(), objects[n] );
+            if ( pIndices != 0 ) pIndices->insert( pIndices->end(), n );
+        }
+    }
+    bool Useful( const DistanceType d, const DistanceType dMax ) const
+    {
+        return ( (TRIANG(dRadius1,d,dMax)) && (TRIANG(d,dMax,dRadius2)) );
+    }
+    DistanceType Cutoff( void ) const { return ( dRadius2 ); }
+};
+
+struct K_NearSearch
+{
+    const size_t              k;
+    DistanceType&             dRadius;     // shrinks as closer objects are found
+    K_Heap&                   tClosest;
+    const DistanceType        onePlusEpsilon;  // the branches are pruned at dRadius/onePlusEpsilon
+
+    K_NearSearch( const size_t kk, DistanceType& r, K_Heap& c, const DistanceType epsilon )
+        : k( kk ), dRadius( r ), tClosest( c ), onePlusEpsilon( DistanceType( 1 ) + epsilon ) { }
+    void Found( const DistanceType d, const size_t n )
+    {
+        if ( d <= dRadius ) NearTreeNode<T, DistanceType, distMinValue>::K_Offer( k, dRadius, tClosest, d, n );
+    }
+    bool Useful( const DistanceType d, const DistanceType dMax ) const
+    {
+        return ( TRIANG( d, dMax, dRadius/onePlusEpsilon ) );
+    }
+    DistanceType Cutoff( void ) const { return ( dRadius ); }
+};
+template<typename Visitor>
+struct ForEachInSphereSearch
+{
+    const DistanceType        dRadius;
+    Visitor&                  fn;
+    long                      lFound;
+
+    ForEachInSphereSearch( const DistanceType r, Visitor& f ) : dRadius( r ), fn( f ), lFound( 0 ) { }
+    void Found( const DistanceType d, const size_t n )
+    {
+        if ( d <= dRadius )
+        {
+            fn( n, d );
+            ++lFound;
+        }
+    }
+    bool Useful( const DistanceType d, const DistanceType dMax ) const { return ( TRIANG( d, dMax, dRadius ) ); }
+    DistanceType Cutoff( void ) const { return ( dRadius ); }
+};
+//=======================================================================
+// end FrozenNode and its searches
+//=======================================================================
 // start of iterator, a nested class in CNearTree
 //=======================================================================
 //=======================================================================
@@ -5928,26 +9840,26 @@ public:
 
         iterator& operator=  ( const iterator& s )       { position = s.position; parent = s.parent; return ( *this ); };
         iterator& operator=  ( const const_iterator& s ) { position = ((const_iterator&)s).get_position(); parent = ((const_iterator&)s).get_parent(); return ( *this ); };
-        iterator  operator++ ( const int n )             { iterator it(*this); position+=1+n; return ( it ); };
-        iterator  operator-- ( const int n )             { iterator it(*this); position-=1+n; return ( it ); };
-        iterator& operator++ ( void )                    { ++position; return ( *this ); };
-        iterator& operator-- ( void )                    { --position; return ( *this ); };
+        iterator  operator++ ( const int n )             { iterator it(*this); position=parent->NextLive( position+1+n ); return ( it ); };
+        iterator  operator-- ( const int n )             { iterator it(*this); position=parent->PreviousLive( position-1-n ); return ( it ); };
+        iterator& operator++ ( void )                    { position=parent->NextLive( position+1 ); return ( *this ); };
+        iterator& operator-- ( void )                    { position=parent->PreviousLive( position-1 ); return ( *this ); };
         iterator  operator+  ( const long n ) const      { iterator it( position+n, parent); return ( it ); };
         iterator  operator-  ( const long n ) const      { iterator it( position-n, parent); return ( it ); };
         iterator& operator+= ( const long n )            { position += n; return ( *this ); };
         iterator& operator-= ( const long n )            { position -= n; return ( *this ); };
-        T         operator*  ( void )         const      { return ( parent->m_ObjectStore[position] ); };
+        T         operator*  ( void )         const      { return ( parent->ObjectData( )[position] ); };
 
-        bool      operator== ( const iterator& t ) const { return ( t.position==(parent->m_ObjectStore.empty( )?1:position) && t.parent==parent ); };
+        bool      operator== ( const iterator& t ) const { return ( t.position==(parent->empty( )?1:position) && t.parent==parent ); };
         bool      operator!= ( const iterator& t ) const { return ( ! (*this==t )); };
-        bool      operator== ( const const_iterator& t ) const { return ( ((const_iterator&)t).get_position()==(parent->m_ObjectStore.empty( )?1:position) &&  ((const_iterator&)t).get_parent()==parent ); };
+        bool      operator== ( const const_iterator& t ) const { return ( ((const_iterator&)t).get_position()==(parent->empty( )?1:position) &&  ((const_iterator&)t).get_parent()==parent ); };
         bool      operator!= ( const const_iterator& t ) const { return ( ! (*this==t )); };
         bool      operator>  ( const iterator& t       ) const { return ( (*this).get_position()>t.get_position() ); };
         bool      operator>  ( const const_iterator& t ) const { return ( (*this).get_position()>t.get_position() ); };
         bool      operator<  ( const iterator& t       ) const { return ( (*this).get_position()<t.get_position() ); };
         bool      operator<  ( const const_iterator& t ) const { return ( (*this).get_position()<t.get_position() ); };
 
-        const T * const operator-> ( void )   const      { return ( &(const_cast<CNearTree*>(parent)->m_ObjectStore[position]) ); };
+        const T * const operator-> ( void )   const      { return ( parent->ObjectData( )+position ); };
         long get_position( void ) const {return position;};
         const CNearTree< T, DistanceType, distMinValue >* get_parent( void ) {return parent;};
 
@@ -5974,26 +9886,26 @@ class const_iterator
 
         const_iterator& operator=  ( const const_iterator& s ) { position = s.position; parent = s.parent; return ( *this ); };
         const_iterator& operator=  ( const       iterator& s ) { position = ((iterator &)s).get_position(); parent = ((iterator &)s).get_parent(); return ( *this ); };
-        const_iterator  operator++ ( const int n )             { const_iterator it(*this); position+=1+n; return ( it ); };
-        const_iterator  operator-- ( const int n )             { const_iterator it(*this); position-=1+n; return ( it ); };
-        const_iterator& operator++ ( void )                    { ++position; return ( *this ); };
-        const_iterator& operator-- ( void )                    { --position; return ( *this ); };
+        const_iterator  operator++ ( const int n )             { const_iterator it(*this); position=parent->NextLive( position+1+n ); return ( it ); };
+        const_iterator  operator-- ( const int n )             { const_iterator it(*this); position=parent->PreviousLive( position-1-n ); return ( it ); };
+        const_iterator& operator++ ( void )                    { position=parent->NextLive( position+1 ); return ( *this ); };
+        const_iterator& operator-- ( void )                    { position=parent->PreviousLive( position-1 ); return ( *this ); };
         const_iterator  operator+  ( const long n ) const      { const_iterator it( position+n, parent); return ( it ); };
         const_iterator  operator-  ( const long n ) const      { const_iterator it( position-n, parent); return ( it ); };
         const_iterator& operator+= ( const long n )            { position += n; return ( *this ); };
         const_iterator& operator-= ( const long n )            { position -= n; return ( *this ); };
-        T               operator*  ( void )         const      { return ( parent->m_ObjectStore[position] ); };
+        T               operator*  ( void )         const      { return ( parent->ObjectData( )[position] ); };
 
-        bool            operator== ( const const_iterator& t ) const { return ( t.position==(parent->m_ObjectStore.empty( )?1:position) && t.parent==parent ); };
+        bool            operator== ( const const_iterator& t ) const { return ( t.position==(parent->empty( )?1:position) && t.parent==parent ); };
         bool            operator!= ( const const_iterator& t ) const { return ( ! (*this==t )); };
-        bool            operator== ( const iterator& t ) const { return ( ((iterator &)t).get_position()==(parent->m_ObjectStore.empty( )?1:position) && ((iterator &)t).get_parent()==parent ); };
+        bool            operator== ( const iterator& t ) const { return ( ((iterator &)t).get_position()==(parent->empty( )?1:position) && ((iterator &)t).get_parent()==parent ); };
         bool            operator!= ( const iterator& t ) const { return ( ! (*this==t )); };
         bool      operator>  ( const iterator& t       ) const { return ( (*this).get_position()>t.get_position() ); };
         bool      operator>  ( const const_iterator& t ) const { return ( (*this).get_position()>t.get_position() ); };
         bool      operator<  ( const iterator& t       ) const { return ( (*this).get_position()<t.get_position() ); };
         bool      operator<  ( const const_iterator& t ) const { return ( (*this).get_position()<t.get_position() ); };
 
-        const T * const operator-> ( void )   const      { return ( &(const_cast<CNearTree*>(parent)->m_ObjectStore[position]) ); };
+        const T * const operator-> ( void )   const      { return ( parent->ObjectData( )+position ); };
         long get_position          ( void ) const  {return position;};
         const CNearTree< T, DistanceType, distMinValue >* get_parent( void ) {return parent;};
 
@@ -25,14 +25,15 @@ int main(int argc, char* argv[])
     const SQR<double> q = SQR<double>( atof( argv[1] ), atof( argv[2] ), atof( argv[3] ), atof( argv[4] ) );
     Matrix_3x3 m = q.Quaternion2Matrix( );
 
-    const std::vector<Vector_3> v = ReadVector_3File( std::cin );
+    std::vector<Vector_3> v = ReadVector_3File( std::cin );
 
     for ( unsigned int i=0; i<v.size( ); ++i )
     {
-        const Vector_3 vr = m.MV( v[i] );
-        fprintf( stdout, "%f,%f,%f\n", vr[0], vr[1], vr[2] );
+        v[i] = m.MV( v[i] );
     }
 
+    WriteVector_3File( v );
+
     return 0;
 }
 
@@ -23,13 +23,15 @@ int main(int argc, char* argv[])
 
     const double scale = atof( argv[1] );
 
-    const std::vector<Vector_3> v = ReadVector_3File( std::cin );
+    std::vector<Vector_3> v = ReadVector_3File( std::cin );
 
     for ( unsigned int i=0; i<v.size( ); ++i )
     {
-        fprintf( stdout, "%f,%f,%f\n", scale*v[i][0], scale*v[i][1], scale*v[i][2] );
+        v[i] = Vector_3( scale*v[i][0], scale*v[i][1], scale*v[i][2] );
     }
 
+    WriteVector_3File( v );
+
     return 0;
 }
 
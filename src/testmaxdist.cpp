@@ -7,9 +7,14 @@
 // designed to connect to DataGen and a few related programs. However, it
 // still contains functions such as testHamm that generate their own data.
 
+#include <algorithm>
+#include <atomic>
 #include <cfloat>
+#include <chrono>
 #include <climits>
+#include <cstdlib>
 #include <ctime>
+#include <new>
 
 #include "hammersley.h"
 #include "vector_3d.h"
@@ -18,6 +23,42 @@
 #include "TNear.h"
 #include "rhrand.h"
 
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// operator new, operator delete
+//
+// Every allocation the program makes is counted in g_allocations, so
+// that the allocation test can show how many a search makes. The array
+// and sized forms that are not here come to these by default, so new[]
+// is counted as well.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+std::atomic<long> g_allocations( 0 );
+
+void* operator new( size_t n )
+//---------------------------------------------------------------------
+{
+    ++g_allocations;
+    void* const p = malloc( n>0 ? n : 1 );
+    if ( p == 0 ) throw std::bad_alloc( );
+    return( p );
+}
+
+void operator delete( void* p ) noexcept
+//---------------------------------------------------------------------
+{
+    free( p );
+}
+
+// kept out of line, or gcc inlines free into std::allocator and takes it
+// for a mismatch with the operator new the allocator calls
+#if defined( __GNUC__ ) && ! defined( __clang__ )
+__attribute__(( noinline ))
+#endif
+void operator delete( void* p, size_t ) noexcept
+//---------------------------------------------------------------------
+{
+    free( p );
+}
+
 #ifdef _MSC_VER
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -29,17 +70,114 @@ void testBigVector(  );
 void testDouble(  );
 int g_errorCount;
 
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// RandomPoint
+//
+// A random point of the type and dimension of t. Both types draw the
+// same random numbers, so the probes are the same whichever is used.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+vecN RandomPoint( const vecN& t )
+//---------------------------------------------------------------------
+{
+    return( vecN( t.dim ) );
+}
+
+template <int N, typename Scalar>
+VecD<N, Scalar> RandomPoint( const VecD<N, Scalar>& )
+//---------------------------------------------------------------------
+{
+    return( VecD<N, Scalar>::Random( ) );
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// NearestRun
+//
+// A nearest neighbor search of each of a FeatureTest's probes, as
+// FeatureTest::NearestOf measures it.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+struct NearestRun
+{
+    std::vector<double> distances;     // to the nearest neighbor of each probe, DBL_MAX if none
+    double              visits;        // node visits per probe
+    double              seconds;       // wall clock, for all of the probes
+};
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// FeatureTest
+//
+// What the CSV-<FEATURE> tests of testGeneral share: random probes of
+// the type and dimension of the input, a stopwatch for the steps each
+// test times, and a timed nearest neighbor search of the probes, whose
+// distances a test compares between trees that must agree. A result
+// that is wrong is counted in g_errorCount.
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+template <typename P>
+class FeatureTest
+{
+    const P                               m_point;    // of the type and dimension of the input
+    std::chrono::steady_clock::time_point m_lap;      // when Lap was last called
+
+public:
+    std::vector<P> probes;
+
+    FeatureTest( const P& t, const size_t nProbes )
+        : m_point( t )
+    {
+        probes.reserve( nProbes );
+        for ( size_t i=0; i<nProbes; ++i )
+        {
+            probes.push_back( RandomPoint( t ) );
+        }
+        m_lap = std::chrono::steady_clock::now( );
+    }
+
+    // the wall-clock seconds since the FeatureTest was made or Lap was last called
+    double Lap( void )
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now( );
+        const double seconds = std::chrono::duration<double>( now-m_lap ).count( );
+        m_lap = now;
+        return( seconds );
+    }
+
+    // searches tree for the nearest neighbor of each probe; the search is a lap of its own
+    NearestRun NearestOf( const CNearTree<P>& tree )
+    {
+        NearestRun run;
+        run.distances.assign( probes.size( ), DBL_MAX );
+        P closest = m_point;
+        const long nodevisits = (long)tree.GetNodeVisits( );
+        Lap( );
+        for ( size_t i=0; i<probes.size( ); ++i )
+        {
+            if ( tree.NearestNeighbor( DBL_MAX, closest, probes[i] ) )
+                run.distances[i] = CNearTreeDistance<P, double>::Between( closest, probes[i] );
+        }
+        run.seconds = Lap( );
+        run.visits  = (double)((long)tree.GetNodeVisits( )-nodevisits)/(double)std::max( probes.size( ), (size_t)1 );
+        return( run );
+    }
+
+    // counts a wrong result
+    static void Expect( const bool ok )
+    {
+        if ( ! ok ) ++g_errorCount;
+    }
+};
+
 /*=======================================================================*/
 // testGeneral
 //
 // Designed to test input data sets of arbitrary size and dimension.
 // The input can come from any source, but the main in testMaxDist
-// gets its input from standard input.
+// gets its input from standard input. P is vecN, or VecD for the
+// dimensions DispatchDim covers.
 /*=======================================================================*/
-void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
+template <typename P>
+void testGeneral( const bool Do_Random_Insertion, const std::vector<P>& v )
 //---------------------------------------------------------------------
 {
-    CNearTree<vecN> nt( v );
+    CNearTree<P> nt( v );
 
     if ( Do_Random_Insertion )
     {
@@ -57,26 +195,26 @@ void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
     }
 
     const int nTests = 10000;
-    nt.SetFlags( CNearTree<vecN>::NTF_NoPrePrune );
+    nt.SetFlags( CNearTree<P>::NTF_NoPrePrune );
 
     long nodevisits1 = (long)nt.GetNodeVisits( );
     const clock_t tc1 = std::clock();
     for ( int i=0; i<nTests; ++i )
     {
-        vecN newPoint(v[0].dim);
-        const vecN probe = vecN(v[0].dim);
+        P newPoint = RandomPoint( v[0] );
+        const P probe = RandomPoint( v[0] );
         nt.NearestNeighbor( DBL_MAX, newPoint, probe );
     }
     {
 
-        nt.SetFlags( CNearTree<vecN>::NTF_ForcePrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_ForcePrePrune );
         const clock_t tc2 = std::clock();
         long nodevisits2 = (long)nt.GetNodeVisits( );
 
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe = vecN(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.NearestNeighbor( DBL_MAX, newPoint, probe );
         }
 
@@ -86,8 +224,8 @@ void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
 
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.NearestNeighbor( DBL_MAX, newPoint, probe );
         }
 
@@ -119,26 +257,26 @@ void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
     /*----------------------------end balanced tree test--------------------------------------------*/
     /*----------------------------end left branch first test--------------------------------------------*/
     {
-        nt.SetFlags( CNearTree<vecN>::NTF_NoPrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_NoPrePrune );
 
 
         const long nodevisits1 = (long)nt.GetNodeVisits( );
         const clock_t tc1 = std::clock();
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe = vecN(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.LeftNearestNeighbor( DBL_MAX, newPoint, probe );
         }
 
-        nt.SetFlags( CNearTree<vecN>::NTF_ForcePrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_ForcePrePrune );
         const long nodevisits2 = (long)nt.GetNodeVisits( );
         const clock_t tc2 = std::clock();
 
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe = vecN(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.LeftNearestNeighbor( DBL_MAX, newPoint, probe );
         }
 
@@ -148,8 +286,8 @@ void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
 
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.LeftNearestNeighbor( DBL_MAX, newPoint, probe );
         }
 
@@ -181,26 +319,26 @@ void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
     /*----------------------------end left branch first test--------------------------------------------*/
     /*----------------------------start short radius test--------------------------------------------*/
     {
-        nt.SetFlags( CNearTree<vecN>::NTF_NoPrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_NoPrePrune );
 
         const clock_t tc1 = std::clock();
         const long nodevisits1 = (long)nt.GetNodeVisits( );
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe = vecN(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.ShortNearestNeighbor( DBL_MAX, newPoint, probe );
         }
 
 
-        nt.SetFlags( CNearTree<vecN>::NTF_ForcePrePrune );
+        nt.SetFlags( CNearTree<P>::NTF_ForcePrePrune );
         const long nodevisits2 = (long)nt.GetNodeVisits( );
         const clock_t tc2 = std::clock();
 
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe = vecN(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.ShortNearestNeighbor( DBL_MAX, newPoint, probe );
         }
 
@@ -210,8 +348,8 @@ void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
 
         for ( int i=0; i<nTests; ++i )
         {
-            vecN newPoint(v[0].dim);
-            const vecN probe(v[0].dim);
+            P newPoint = RandomPoint( v[0] );
+            const P probe = RandomPoint( v[0] );
             nt.ShortNearestNeighbor( DBL_MAX, newPoint, probe );
         }
         const long nodevisits4 = (long)nt.GetNodeVisits( );
@@ -240,6 +378,518 @@ void testGeneral( const bool Do_Random_Insertion, const std::vector<vecN>& v )
             (double)nt.GetVarSpacing());
     }
     /*----------------------------end short radius test--------------------------------------------*/
+    /*----------------------------start frozen balanced test--------------------------------------------*/
+    {
+        // the balanced search again, on the contiguous copy made by Freeze, without
+        // and with pre-pruning and by default; the node visits should match
+        // CSV-balanced, the time should not, and the three must find the same neighbors
+        if ( nt.Freeze( ) )
+        {
+            FeatureTest<P> test( v[0], nTests );
+            nt.SetFlags( CNearTree<P>::NTF_NoPrePrune );
+            const NearestRun noPrePrune = test.NearestOf( nt );
+            nt.SetFlags( CNearTree<P>::NTF_ForcePrePrune );
+            const NearestRun prePrune = test.NearestOf( nt );
+            nt.SetFlags( 0 );
+            const NearestRun byDefault = test.NearestOf( nt );
+            test.Expect( prePrune.distances == noPrePrune.distances && byDefault.distances == noPrePrune.distances );
+
+            fprintf( stdout, "CSV-FROZEN,%ld,%d,%.3f,%.3f,%.3f,%.3f,%.2f,%.4f,%.4f,%.4f,%.4f\n",
+                (long)nt.size( ),
+                nTests,
+                noPrePrune.seconds,
+                noPrePrune.visits,
+                prePrune.visits,
+                byDefault.visits,
+                noPrePrune.visits/byDefault.visits,
+                nt.GetDimEstimate(),
+                (double)nt.GetDiamEstimate(),
+                (double)nt.GetMeanSpacing(),
+                (double)nt.GetVarSpacing());
+        }
+    }
+    /*----------------------------end frozen balanced test--------------------------------------------*/
+    /*----------------------------start leaf bucket test--------------------------------------------*/
+    {
+        // the balanced search on frozen copies with leaf buckets of several sizes (0 for
+        // none), for the same probes; a bucket counts a visit for each object in it, so
+        // the visits rise with the bucket size while fewer nodes are walked. The last
+        // column is the time with NTF_SquaredDistances. All of them must find the same
+        // neighbors
+        static const size_t bucketSizes[] = { 0, 8, 16, 32, 64 };
+        FeatureTest<P> test( v[0], nTests );
+        std::vector<double> dNearest;
+
+        nt.SetFlags( 0 );
+        for ( size_t b=0; b<sizeof( bucketSizes )/sizeof( bucketSizes[0] ); ++b )
+        {
+            if ( ! nt.Freeze( bucketSizes[b] ) ) break;
+            const NearestRun plain = test.NearestOf( nt );
+
+            // the same with the squared distances of NTF_SquaredDistances
+            nt.SetFlags( CNearTree<P>::NTF_SquaredDistances );
+            const NearestRun squared = test.NearestOf( nt );
+            nt.SetFlags( 0 );
+
+            if ( b == 0 ) dNearest = plain.distances;
+            test.Expect( plain.distances == dNearest && squared.distances == dNearest );
+
+            fprintf( stdout, "CSV-BUCKET,%ld,%d,%d,%.3f,%.3f,%ld,%.3f\n",
+                (long)nt.size( ),
+                nTests,
+                (int)bucketSizes[b],
+                plain.seconds,
+                plain.visits,
+                (long)nt.GetNodeBytes( ),
+                squared.seconds );
+        }
+        nt.Thaw( );
+    }
+    /*----------------------------end leaf bucket test--------------------------------------------*/
+    /*----------------------------start separate by radius test--------------------------------------------*/
+    {
+        // SeparateByRadius, which measures the whole store, without and with
+        // NTF_SquaredDistances, at twice the mean spacing; the counts inside must agree
+        const int nSeparate = 100;
+        const double radius = 2.0*(double)nt.GetMeanSpacing( );
+        FeatureTest<P> test( v[0], nSeparate );
+        std::vector<P> vInside;
+        std::vector<P> vOutside;
+        long nInside1 = 0;
+        long nInside2 = 0;
+
+        nt.SetFlags( 0 );
+        test.Lap( );
+        for ( int i=0; i<nSeparate; ++i )
+        {
+            nt.SeparateByRadius( radius, test.probes[i], vInside, vOutside );
+            nInside1 += (long)vInside.size( );
+        }
+        const double plainSeconds = test.Lap( );
+        nt.SetFlags( CNearTree<P>::NTF_SquaredDistances );
+        for ( int i=0; i<nSeparate; ++i )
+        {
+            nt.SeparateByRadius( radius, test.probes[i], vInside, vOutside );
+            nInside2 += (long)vInside.size( );
+        }
+        const double squaredSeconds = test.Lap( );
+        nt.SetFlags( 0 );
+
+        test.Expect( nInside1 == nInside2 );
+        fprintf( stdout, "CSV-SEPARATE,%ld,%d,%.3f,%.3f,%ld,%ld\n",
+            (long)nt.size( ),
+            nSeparate,
+            plainSeconds,
+            squaredSeconds,
+            nInside1,
+            nInside2 );
+    }
+    /*----------------------------end separate by radius test--------------------------------------------*/
+    /*----------------------------start allocation test--------------------------------------------*/
+    {
+        // allocations per search, on the linked nodes and then on the frozen copy.
+        // The same probes are searched twice and only the second time is counted,
+        // so the scratch vectors of the thread and the result containers have
+        // already grown; what is left is what a search itself allocates (none,
+        // except the copies of the found objects when P is vecN)
+        const int nAlloc = 1000;
+        const size_t k = 8;
+        const double radius = 2.0*(double)nt.GetMeanSpacing( );
+        FeatureTest<P> test( v[0], nAlloc );
+        const std::vector<P>& vProbe = test.probes;
+        P closest = v[0];
+        std::vector<P> vFound;
+        std::vector<size_t> vIndices;
+
+        for ( int frozen=0; frozen<2; ++frozen )
+        {
+            if ( frozen == 1 && ! nt.Freeze( ) ) break;
+            long allocations[4] = { 0, 0, 0, 0 };
+            for ( int pass=0; pass<2; ++pass )
+            {
+                const long a1 = g_allocations;
+                for ( int i=0; i<nAlloc; ++i )
+                {
+                    nt.NearestNeighbor( DBL_MAX, closest, vProbe[i] );
+                }
+                const long a2 = g_allocations;
+                for ( int i=0; i<nAlloc; ++i )
+                {
+                    nt.NearestNeighbor( DBL_MAX, vProbe[i] );
+                }
+                const long a3 = g_allocations;
+                for ( int i=0; i<nAlloc; ++i )
+                {
+                    nt.FindK_NearestNeighbors( k, DBL_MAX, vFound, vIndices, vProbe[i] );
+                }
+                const long a4 = g_allocations;
+                for ( int i=0; i<nAlloc; ++i )
+                {
+                    nt.FindInSphere( radius, vFound, vIndices, vProbe[i] );
+                }
+                const long a5 = g_allocations;
+                allocations[0] = a2-a1;
+                allocations[1] = a3-a2;
+                allocations[2] = a4-a3;
+                allocations[3] = a5-a4;
+            }
+
+            fprintf( stdout, "CSV-ALLOC,%ld,%d,%d,%.3f,%.3f,%.3f,%.3f\n",
+                (long)nt.size( ),
+                nAlloc,
+                frozen,
+                (double)allocations[0]/(double)nAlloc,
+                (double)allocations[1]/(double)nAlloc,
+                (double)allocations[2]/(double)nAlloc,
+                (double)allocations[3]/(double)nAlloc );
+        }
+        nt.Thaw( );
+    }
+    /*----------------------------end allocation test--------------------------------------------*/
+    /*----------------------------start sorted stream test--------------------------------------------*/
+    {
+        // ImmediateInsert of the objects sorted on their first coordinate, the worst
+        // order for a neartree, without and with the depth watchdog; the columns are
+        // the time and depth of each, and the number of subtrees the watchdog rebuilt.
+        // The two trees must find the same nearest neighbors
+        const size_t nStream = std::min( v.size( ), (size_t)20000 );
+        std::vector<P> vSorted( v.begin( ), v.begin( )+nStream );
+        std::sort( vSorted.begin( ), vSorted.end( ),
+            []( const P& a, const P& b ) { return( a[0] < b[0] ); } );
+        FeatureTest<P> test( v[0], 100 );
+
+        CNearTree<P> ntPlain;
+        ntPlain.SetDepthLimitFactor( 0.0 );
+        CNearTree<P> ntWatched;
+        test.Lap( );
+        for ( size_t i=0; i<nStream; ++i )
+        {
+            ntPlain.ImmediateInsert( vSorted[i] );
+        }
+        const double plainSeconds = test.Lap( );
+        for ( size_t i=0; i<nStream; ++i )
+        {
+            ntWatched.ImmediateInsert( vSorted[i] );
+        }
+        const double watchedSeconds = test.Lap( );
+
+        test.Expect( test.NearestOf( ntPlain ).distances == test.NearestOf( ntWatched ).distances );
+
+        fprintf( stdout, "CSV-STREAM,%ld,%.3f,%ld,%.3f,%ld,%ld\n",
+            (long)nStream,
+            plainSeconds,
+            (long)ntPlain.GetDepth( ),
+            watchedSeconds,
+            (long)ntWatched.GetDepth( ),
+            (long)ntWatched.GetRebuildCount( ) );
+    }
+    /*----------------------------end sorted stream test--------------------------------------------*/
+
+    /*----------------------------start duplicate stream test--------------------------------------------*/
+    {
+        // ImmediateInsert of one object over and over, and of two objects in turn,
+        // without and with the depth watchdog; the columns are the time and depth
+        // of each, and the number of subtrees the watchdog rebuilt. No rebuild can
+        // make such a tree shallower, so the watchdog should cost next to nothing
+        const size_t nDup = 8000;
+        FeatureTest<P> test( v[0], 2 );
+        const P pFirst  = test.probes[0];
+        const P pSecond = test.probes[1];
+        for ( int kinds=1; kinds<=2; ++kinds )
+        {
+            CNearTree<P> ntPlain;
+            ntPlain.SetDepthLimitFactor( 0.0 );
+            CNearTree<P> ntWatched;
+            test.Lap( );
+            for ( size_t i=0; i<nDup; ++i )
+            {
+                ntPlain.ImmediateInsert( ( kinds == 2 && i%2 != 0 ) ? pSecond : pFirst );
+            }
+            const double plainSeconds = test.Lap( );
+            for ( size_t i=0; i<nDup; ++i )
+            {
+                ntWatched.ImmediateInsert( ( kinds == 2 && i%2 != 0 ) ? pSecond : pFirst );
+            }
+            const double watchedSeconds = test.Lap( );
+
+            fprintf( stdout, "CSV-DUPLICATE,%d,%ld,%.3f,%ld,%.3f,%ld,%ld\n",
+                kinds,
+                (long)nDup,
+                plainSeconds,
+                (long)ntPlain.GetDepth( ),
+                watchedSeconds,
+                (long)ntWatched.GetDepth( ),
+                (long)ntWatched.GetRebuildCount( ) );
+        }
+    }
+    /*----------------------------end duplicate stream test--------------------------------------------*/
+    /*----------------------------start insertion order test--------------------------------------------*/
+    {
+        // the same objects built in each of the insertion orders, with seed 1; the
+        // columns are the order, the build time and depth, and the node visits and
+        // time of nearest neighbor searches, which must find the same neighbors in
+        // every order
+        static const char* const orderNames[5] = { "sqrtprefix", "shuffle", "morton", "hilbert", "farthestfirst" };
+        FeatureTest<P> test( v[0], nTests );
+        std::vector<double> dNearest;
+        for ( int order=CNearTree<P>::NTO_SqrtPrefix; order<=CNearTree<P>::NTO_FarthestFirst; ++order )
+        {
+            CNearTree<P> ntOrder( v );
+            test.Lap( );
+            ntOrder.CompleteDelayedInsert( (typename CNearTree<P>::InsertionOrder)order, 1 );
+            const double buildSeconds = test.Lap( );
+            const NearestRun run = test.NearestOf( ntOrder );
+
+            if ( order == CNearTree<P>::NTO_SqrtPrefix ) dNearest = run.distances;
+            test.Expect( run.distances == dNearest );
+
+            fprintf( stdout, "CSV-ORDER,%ld,%s,%.3f,%ld,%.2f,%.3f\n",
+                (long)ntOrder.size( ),
+                orderNames[order],
+                buildSeconds,
+                (long)ntOrder.GetDepth( ),
+                run.visits,
+                run.seconds );
+        }
+    }
+    /*----------------------------end insertion order test--------------------------------------------*/
+    /*----------------------------start bulk build test--------------------------------------------*/
+    {
+        // the same objects inserted by CompleteDelayedInsert and built top down by
+        // BulkBuild, on one thread and on all of them; the columns are the builder,
+        // the build time (wall clock) and depth, and the node visits and time of
+        // nearest neighbor searches. The bulk built trees must find neighbors as
+        // near as the inserted one does
+        static const char* const builderNames[3] = { "insert", "bulk", "bulkparallel" };
+        FeatureTest<P> test( v[0], nTests );
+        std::vector<double> dNearest;
+        for ( int builder=0; builder<3; ++builder )
+        {
+            CNearTree<P> ntBuilt( v );
+            test.Lap( );
+            if ( builder == 0 )
+            {
+                ntBuilt.CompleteDelayedInsert( );
+            }
+            else
+            {
+                ntBuilt.BulkBuild( builder == 1 ? 1 : 0 );
+            }
+            const double buildSeconds = test.Lap( );
+            const NearestRun run = test.NearestOf( ntBuilt );
+
+            if ( builder == 0 ) dNearest = run.distances;
+            test.Expect( run.distances == dNearest );
+
+            fprintf( stdout, "CSV-BULK,%ld,%s,%.3f,%ld,%.2f,%.3f\n",
+                (long)ntBuilt.size( ),
+                builderNames[builder],
+                buildSeconds,
+                (long)ntBuilt.GetDepth( ),
+                run.visits,
+                run.seconds );
+        }
+    }
+    /*----------------------------end bulk build test--------------------------------------------*/
+    /*----------------------------start approximate search test--------------------------------------------*/
+    {
+        // nearest neighbor and k nearest neighbor searches with SetApproximation( epsilon ),
+        // against the exact searches (epsilon 0, the first row). The columns are epsilon,
+        // then for each search the recall (the fraction of the exact neighbors that were
+        // found) and the mean node visits per probe. No neighbor may be more than (1+epsilon)
+        // times as far as the exact one
+        static const double epsilons[4] = { 0.0, 0.1, 0.5, 1.0 };
+        const size_t kNear = 10;
+        FeatureTest<P> test( v[0], nTests );
+        const std::vector<P>& probes = test.probes;
+        CNearTree<P> ntApprox( v );
+        ntApprox.CompleteDelayedInsert( );
+        std::vector<double> exactDistance;
+        std::vector<std::vector<size_t> > exactK( probes.size( ) );
+        for ( int e=0; e<4; ++e )
+        {
+            ntApprox.SetApproximation( epsilons[e] );
+            const NearestRun run = test.NearestOf( ntApprox );
+            if ( e == 0 ) exactDistance = run.distances;
+            long nearestFound = 0;
+            for ( size_t i=0; i<probes.size( ); ++i )
+            {
+                if ( run.distances[i] == exactDistance[i] ) ++nearestFound;
+                test.Expect( run.distances[i] <= ( 1.0+epsilons[e] )*exactDistance[i] );
+            }
+
+            long kFound = 0;
+            const long nodevisits1 = (long)ntApprox.GetNodeVisits( );
+            for ( size_t i=0; i<probes.size( ); ++i )
+            {
+                std::vector<P> kClosest;
+                std::vector<size_t> kIndices;
+                ntApprox.FindK_NearestNeighbors( kNear, DBL_MAX, kClosest, kIndices, probes[i] );
+                std::sort( kIndices.begin( ), kIndices.end( ) );
+                if ( e == 0 )
+                {
+                    exactK[i] = kIndices;
+                }
+                for ( size_t j=0; j<kIndices.size( ); ++j )
+                {
+                    if ( std::binary_search( exactK[i].begin( ), exactK[i].end( ), kIndices[j] ) ) ++kFound;
+                }
+            }
+            const long nodevisits2 = (long)ntApprox.GetNodeVisits( );
+
+            fprintf( stdout, "CSV-APPROX,%ld,%.2f,%.4f,%.2f,%.4f,%.2f\n",
+                (long)ntApprox.size( ),
+                epsilons[e],
+                (double)nearestFound/(double)probes.size( ),
+                run.visits,
+                (double)kFound/(double)( kNear*probes.size( ) ),
+                (double)(nodevisits2-nodevisits1)/(double)probes.size( ) );
+        }
+    }
+    /*----------------------------end approximate search test--------------------------------------------*/
+    /*----------------------------start snapshot test--------------------------------------------*/
+    {
+        // the tree frozen with leaf buckets, saved and opened again; the columns
+        // are the size, the times to build and freeze, to save and to open, the
+        // file's size in MB, and the times of nearest neighbor searches of the
+        // built and of the opened tree, which must find the same neighbors. Only
+        // for objects that can be saved (see CNearTree::Save)
+        const char* const snapshotPath = "testmaxdist.snap";
+        FeatureTest<P> test( v[0], nTests );
+        CNearTree<P> ntBuilt( v );
+        ntBuilt.Freeze( 16 );
+        const double buildSeconds = test.Lap( );
+        if ( ntBuilt.Save( snapshotPath ) )
+        {
+            const double saveSeconds = test.Lap( );
+            CNearTree<P> ntOpened;
+            const bool opened = ntOpened.Open( snapshotPath );
+            const double openSeconds = test.Lap( );
+
+            const NearestRun built = test.NearestOf( ntBuilt );
+            const NearestRun reopened = test.NearestOf( ntOpened );
+            test.Expect( opened && reopened.distances == built.distances );
+
+            FILE* const file = fopen( snapshotPath, "rb" );
+            long fileBytes = 0;
+            if ( file != 0 )
+            {
+                fseek( file, 0, SEEK_END );
+                fileBytes = ftell( file );
+                fclose( file );
+            }
+            ntOpened.clear( );
+            remove( snapshotPath );
+
+            fprintf( stdout, "CSV-SNAPSHOT,%ld,%.3f,%.3f,%.3f,%.1f,%.3f,%.3f\n",
+                (long)ntBuilt.size( ),
+                buildSeconds,
+                saveSeconds,
+                openSeconds,
+                (double)fileBytes/1048576.,
+                built.seconds,
+                reopened.seconds );
+        }
+    }
+    /*----------------------------end snapshot test--------------------------------------------*/
+    /*----------------------------start rolling update test--------------------------------------------*/
+    {
+        // ten rolling updates of a tree of 90% of the objects, each erasing 1% of
+        // them at random and inserting the next 1%: in place with erase and insert,
+        // and by building a new tree of the objects that remain, as operator-= does.
+        // The columns are the size, the times of the ten updates both ways, the
+        // objects still erased, and the node visits per nearest neighbor search of
+        // each tree, which must find neighbors at the same distances
+        const size_t nChange = std::max( v.size( )/100, (size_t)1 );
+        const size_t nFirst = v.size( ) - std::min( v.size( ), 10*nChange );
+        FeatureTest<P> test( v[0], nTests );
+        CNearTree<P> ntRolling( std::vector<P>( v.begin( ), v.begin( )+nFirst ) );
+        ntRolling.CompleteDelayedInsert( );
+        CNearTree<P> ntRebuilt;
+        double rollingSeconds = 0.0;
+        double rebuiltSeconds = 0.0;
+        for ( int update=0; update<10; ++update )
+        {
+            const std::vector<P> added( v.begin( )+std::min( v.size( ), nFirst+update*nChange ),
+                                        v.begin( )+std::min( v.size( ), nFirst+(update+1)*nChange ) );
+            test.Lap( );
+            for ( size_t erased=0; erased<nChange; )
+            {
+                const size_t stored = ntRolling.size( ) + ntRolling.GetErasedCount( );
+                if ( ntRolling.erase( (size_t)( rhr.urand( )*(double)stored ) % stored ) ) ++erased;
+            }
+            ntRolling.insert( added );
+            ntRolling.CompleteDelayedInsert( );
+            rollingSeconds += test.Lap( );
+            const std::vector<P> remaining( ntRolling.GetObjectStore( ) );
+            test.Lap( );
+            ntRebuilt.clear( );
+            ntRebuilt.insert( remaining );
+            ntRebuilt.CompleteDelayedInsert( );
+            rebuiltSeconds += test.Lap( );
+        }
+
+        const NearestRun rolling = test.NearestOf( ntRolling );
+        const NearestRun rebuilt = test.NearestOf( ntRebuilt );
+        test.Expect( rolling.distances == rebuilt.distances );
+
+        fprintf( stdout, "CSV-ERASE,%ld,%.3f,%.3f,%ld,%.2f,%.2f\n",
+            (long)ntRolling.size( ),
+            rollingSeconds,
+            rebuiltSeconds,
+            (long)ntRolling.GetErasedCount( ),
+            rolling.visits,
+            rebuilt.visits );
+    }
+    /*----------------------------end rolling update test--------------------------------------------*/
+    /*----------------------------start set operation test--------------------------------------------*/
+    {
+        // a delta of 1% of the objects, already in the tree, and as many random
+        // points, not in it, merged into the tree with +=, taken out again with -=,
+        // and swapped with set_symmetric_difference, which puts the objects back and
+        // takes the points out. The columns are the size of the tree and of the
+        // delta, the time to build the tree, and the times of the three operations.
+        // Last, += of the delta and of the points again into a tree that holds each
+        // object of the delta twice: the duplicates already in the tree stay, and
+        // each point comes in once
+        const size_t nDelta = std::max( v.size( )/100, (size_t)1 );
+        FeatureTest<P> test( v[0], nDelta );
+        const std::vector<P> present( v.begin( ), v.begin( )+nDelta );
+        const std::vector<P>& absent = test.probes;
+        std::vector<P> delta( present );
+        delta.insert( delta.end( ), absent.begin( ), absent.end( ) );
+
+        test.Lap( );
+        CNearTree<P> ntSet( v );
+        ntSet.CompleteDelayedInsert( );
+        const double buildSeconds = test.Lap( );
+        ntSet += delta;
+        const double unionSeconds = test.Lap( );
+        ntSet -= present;
+        const double differenceSeconds = test.Lap( );
+        ntSet.set_symmetric_difference( delta );
+        const double symmetricSeconds = test.Lap( );
+
+        for ( size_t i=0; i<nDelta; ++i )
+        {
+            test.Expect( ntSet.Contains( present[i] ) && ! ntSet.Contains( absent[i] ) );
+        }
+
+        CNearTree<P> ntDuplicates( present );
+        ntDuplicates.insert( present );
+        ntDuplicates += delta;
+        ntDuplicates += absent;
+        test.Expect( ntDuplicates.size( ) == 3*nDelta );
+
+        fprintf( stdout, "CSV-SETOPS,%ld,%ld,%.3f,%.3f,%.3f,%.3f\n",
+            (long)v.size( ),
+            (long)delta.size( ),
+            buildSeconds,
+            unionSeconds,
+            differenceSeconds,
+            symmetricSeconds );
+    }
+    /*----------------------------end set operation test--------------------------------------------*/
 
 }
 
@@ -290,12 +940,14 @@ int main( int argc, char* argv[] )
     {
         fprintf( stdout, "Inconsistent csv input\n" );
     }
-    else
+    else if ( ! DispatchDim( v[0].dim, [&]( auto n ) { testGeneral( Do_Random_Insertion, ToVecD<decltype( n )::value, double>( v ) ); } ) )
     {
         testGeneral( Do_Random_Insertion, v );
     }
 
-    return 0;
+    // the checks of the tests above that found a wrong result
+    fprintf( stdout, "CSV-ERRORS,%d\n", g_errorCount );
+    return ( g_errorCount > 0 ) ? 1 : 0;
 }
 
 
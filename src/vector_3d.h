@@ -9,6 +9,7 @@
 #include <iostream>
 #include "cqrlib.h"
 #include "TNear.h"
+#include "L2Kernels.h"
 #include "triple.h"
 #include <utility>
 #include <vector>
@@ -441,6 +442,17 @@ static Vector_3 GetCenterOfMass( const ContainerType& lv )
         return (v[n]);
     }
 
+    //-----------------------------------------------------------------------------
+    // Name: data()
+    // Description: the three components, in order
+    //
+    /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+    inline const double* data ( void ) const
+    //-------------------------------------------------------------------------------------
+    {
+        return (v);
+    }
+
     // constants
     static const double    MINNORM;
     
@@ -448,6 +460,43 @@ static Vector_3 GetCenterOfMass( const ContainerType& lv )
                                            const Vector_3& t1, const Vector_3& t2, const Vector_3& t3);
 }; // end of class vector
 
+#ifndef L1NORM
+//-----------------------------------------------------------------------------
+// Name: CNearTreeBlockDistance<Vector_3>
+// Description: measures a block of stored Vector_3's with the SIMD kernels.
+// The kernels sum the squares in the same order as Norm, so the distances
+// are the same.
+//
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+template <>
+struct CNearTreeBlockDistance<Vector_3, double>
+{
+    enum { Available = 1 };
+    static inline void Between( const Vector_3& probe, const Vector_3* const objects, const size_t n, double* const out )
+    {
+        static_assert( sizeof( Vector_3 ) == 3*sizeof( double ), "Vector_3 must be three packed doubles" );
+        if ( n > 0 ) L2DistanceBlock( probe.data( ), objects[0].data( ), n, 3, 3, out );
+    }
+    static inline void BetweenSquared( const Vector_3& probe, const Vector_3* const objects, const size_t n, double* const out )
+    {
+        if ( n > 0 ) L2SquaredDistanceBlock( probe.data( ), objects[0].data( ), n, 3, 3, out );
+    }
+};
+#endif
+
+//-----------------------------------------------------------------------------
+// Name: CNearTreeCoordinates<Vector_3>
+// Description: the coordinates, for the space-filling-curve insertion orders
+//
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+template <>
+struct CNearTreeCoordinates<Vector_3>
+{
+    enum { Available = 1 };
+    static inline int    Dim       ( const Vector_3& ) { return( 3 ); }
+    static inline double Coordinate( const Vector_3& t, const int k ) { return( t[k] ); }
+};
+
 /*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
 class Matrix_3x3
 {